@@ -0,0 +1,150 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A micro-benchmark of fmthttpdate() and parsehttpdate(). It first
+ * checks both against gmtime(3) over a range of dates, and then
+ * prints the time per call for the cases that matter when serving
+ * static files, along with the gmtime(3) and regex(3) based
+ * equivalents that they replaced, for comparison.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <regex.h>
+
+#include <utils.h>
+#include <resp.h>
+
+static char *days[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static regex_t spec;
+static volatile unsigned long sink;
+
+static char *reffmt(time_t t)
+{
+    static char buf[64];
+    struct tm *tm;
+    
+    tm = gmtime(&t);
+    snprintf(buf, sizeof(buf), "%s, %i %s %i %02i:%02i:%02i GMT", days[(tm->tm_wday + 6) % 7], tm->tm_mday, months[tm->tm_mon], tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec);
+    return(buf);
+}
+
+static time_t refparse(char *date)
+{
+    regmatch_t g[11];
+    struct tm tm;
+    
+    if(regexec(&spec, date, 11, g, 0))
+	return(0);
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mday = atoi(date + g[1].rm_so);
+    tm.tm_year = atoi(date + g[3].rm_so) - 1900;
+    tm.tm_hour = atoi(date + g[4].rm_so);
+    tm.tm_min = atoi(date + g[5].rm_so);
+    tm.tm_sec = atoi(date + g[6].rm_so);
+    for(tm.tm_mon = 0; (tm.tm_mon < 12) && strncasecmp(date + g[2].rm_so, months[tm.tm_mon], 3); tm.tm_mon++);
+    return(timegm(&tm));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + (ts.tv_nsec / 1e9));
+}
+
+static int check(void)
+{
+    time_t t;
+    struct tm *tm;
+    char buf[64], *s;
+    int errs;
+    
+    errs = 0;
+    for(t = -86400 * 366; t < 4102444800; t += 86400 * 7 + 3607) {
+	s = fmthttpdate(t);
+	if(strcmp(s, reffmt(t))) {
+	    fprintf(stderr, "datebench: %jd formatted as `%s', expected `%s'\n", (intmax_t)t, s, reffmt(t));
+	    errs++;
+	}
+	if((t > 0) && (parsehttpdate(s) != t)) {
+	    fprintf(stderr, "datebench: `%s' parsed as %jd, expected %jd\n", s, (intmax_t)parsehttpdate(s), (intmax_t)t);
+	    errs++;
+	}
+	tm = gmtime(&t);
+	if((tm->tm_year >= 70) && (tm->tm_year < 170)) {
+	    strftime(buf, sizeof(buf), "%A, %d-%b-%y %H:%M:%S GMT", tm);
+	    if(parsehttpdate(buf) != t) {
+		fprintf(stderr, "datebench: `%s' parsed as %jd, expected %jd\n", buf, (intmax_t)parsehttpdate(buf), (intmax_t)t);
+		errs++;
+	    }
+	}
+	if(t > 0) {
+	    strftime(buf, sizeof(buf), "%a %b %e %H:%M:%S %Y", tm);
+	    if(parsehttpdate(buf) != t) {
+		fprintf(stderr, "datebench: `%s' parsed as %jd, expected %jd\n", buf, (intmax_t)parsehttpdate(buf), (intmax_t)t);
+		errs++;
+	    }
+	}
+    }
+    return(errs);
+}
+
+#define BENCH(name, n, expr) do {		\
+	double start;				\
+	long i;					\
+	start = now();				\
+	for(i = 0; i < (n); i++)		\
+	    sink += (unsigned long)(expr);	\
+	printf("%-24s %8.1f ns\n", name, (now() - start) * 1e9 / (n)); \
+    } while(0)
+
+int main(int argc, char **argv)
+{
+    long n;
+    time_t base, mtimes[32];
+    int i;
+    
+    n = (argc > 1) ? atol(argv[1]) : 1000000;
+    regcomp(&spec, "^[A-Z]{3}, +([0-9]+) +([A-Z]{3}) +([0-9]+) +([0-9]{2}):([0-9]{2}):([0-9]{2}) +(([A-Z]+)|[+-]([0-9]{2})([0-9]{2}))$", REG_EXTENDED | REG_ICASE);
+    if(check()) {
+	fprintf(stderr, "datebench: self-check failed\n");
+	exit(1);
+    }
+    base = time(NULL);
+    for(i = 0; i < 32; i++)
+	mtimes[i] = base - (86400 * 30 * i) - (i * 7919);
+    BENCH("fmt now", n, fmthttpdate(base + (i / 100000))[5]);
+    BENCH("fmt now (gmtime)", n, reffmt(base + (i / 100000))[5]);
+    BENCH("fmt mtimes", n, fmthttpdate(mtimes[i % 32])[5]);
+    BENCH("fmt mtimes (gmtime)", n, reffmt(mtimes[i % 32])[5]);
+    BENCH("fmt distinct", n, fmthttpdate(base - i * 3)[5]);
+    BENCH("parse IMF-fixdate", n, parsehttpdate("Sun, 06 Nov 1994 08:49:37 GMT"));
+    BENCH("parse IMF (regex)", n, refparse("Sun, 06 Nov 1994 08:49:37 GMT"));
+    BENCH("parse RFC 850", n, parsehttpdate("Sunday, 06-Nov-94 08:49:37 GMT"));
+    BENCH("parse asctime", n, parsehttpdate("Sun Nov  6 08:49:37 1994"));
+    return(0);
+}
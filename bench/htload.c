@@ -0,0 +1,410 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A simple closed-loop HTTP load generator. Each connection runs in
+ * a thread of its own, sends DEPTH pipelined requests at a time and
+ * waits for all their responses before sending more, so that the
+ * number of outstanding requests is always CONNS * DEPTH.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#endif
+
+struct conn {
+    int fd;
+#ifdef HAVE_GNUTLS
+    gnutls_session_t sess;
+#endif
+    char buf[65536];
+    size_t bh, bt;
+};
+
+struct worker {
+    pthread_t th;
+    typedbuf(uint32_t) lat;
+    uintmax_t errors;
+};
+
+static char *host, *port, *path, *request;
+static size_t reqlen;
+static int depth = 1, keepalive = 1, usetls = 0;
+static volatile int running = 1;
+static struct addrinfo *addr;
+#ifdef HAVE_GNUTLS
+static gnutls_certificate_credentials_t creds;
+#endif
+
+static uintmax_t now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((uintmax_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+static int cconnect(struct conn *c)
+{
+    int one;
+    struct timeval tv;
+    
+    if((c->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+	return(-1);
+    if(connect(c->fd, addr->ai_addr, addr->ai_addrlen)) {
+	close(c->fd);
+	return(-1);
+    }
+    one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    /* Keep a stalled server from hanging the run indefinitely. */
+    tv = (struct timeval){.tv_sec = 10};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    c->bh = c->bt = 0;
+#ifdef HAVE_GNUTLS
+    if(usetls) {
+	gnutls_init(&c->sess, GNUTLS_CLIENT);
+	gnutls_set_default_priority(c->sess);
+	gnutls_credentials_set(c->sess, GNUTLS_CRD_CERTIFICATE, creds);
+	gnutls_transport_set_int(c->sess, c->fd);
+	if(gnutls_handshake(c->sess) < 0) {
+	    gnutls_deinit(c->sess);
+	    close(c->fd);
+	    return(-1);
+	}
+    }
+#endif
+    return(0);
+}
+
+static void cclose(struct conn *c)
+{
+#ifdef HAVE_GNUTLS
+    if(usetls)
+	gnutls_deinit(c->sess);
+#endif
+    close(c->fd);
+}
+
+static int cwrite(struct conn *c, char *buf, size_t len)
+{
+    ssize_t ret;
+    
+    while(len > 0) {
+#ifdef HAVE_GNUTLS
+	if(usetls)
+	    ret = gnutls_record_send(c->sess, buf, len);
+	else
+#endif
+	    ret = write(c->fd, buf, len);
+	if(ret <= 0)
+	    return(-1);
+	buf += ret;
+	len -= ret;
+    }
+    return(0);
+}
+
+static int cfill(struct conn *c)
+{
+    ssize_t ret;
+    
+    if(c->bh > 0) {
+	memmove(c->buf, c->buf + c->bh, c->bt - c->bh);
+	c->bt -= c->bh;
+	c->bh = 0;
+    }
+    if(c->bt >= sizeof(c->buf))
+	return(-1);
+#ifdef HAVE_GNUTLS
+    if(usetls)
+	ret = gnutls_record_recv(c->sess, c->buf + c->bt, sizeof(c->buf) - c->bt);
+    else
+#endif
+	ret = read(c->fd, c->buf + c->bt, sizeof(c->buf) - c->bt);
+    if(ret <= 0)
+	return(-1);
+    c->bt += ret;
+    return(0);
+}
+
+/* Returns a line without its terminator, or NULL on error. */
+static char *cline(struct conn *c)
+{
+    char *p, *ret;
+    
+    while((p = memchr(c->buf + c->bh, '\n', c->bt - c->bh)) == NULL) {
+	if(cfill(c))
+	    return(NULL);
+    }
+    ret = c->buf + c->bh;
+    c->bh = p + 1 - c->buf;
+    if((p > ret) && (p[-1] == '\r'))
+	p--;
+    *p = 0;
+    return(ret);
+}
+
+static int cskip(struct conn *c, off_t len)
+{
+    size_t n;
+    
+    while(len > 0) {
+	if(c->bh == c->bt) {
+	    if(cfill(c))
+		return(-1);
+	}
+	n = min(len, c->bt - c->bh);
+	c->bh += n;
+	len -= n;
+    }
+    return(0);
+}
+
+/* Reads one complete response, and returns whether the connection
+ * may be kept. */
+static int readresp(struct conn *c)
+{
+    char *line, *p;
+    int code, cls, chunked;
+    off_t clen, chlen;
+    
+    if(((line = cline(c)) == NULL) || ((p = strchr(line, ' ')) == NULL))
+	return(-1);
+    code = atoi(p + 1);
+    cls = !keepalive || !strncmp(line, "HTTP/1.0", 8);
+    chunked = 0;
+    clen = -1;
+    while(1) {
+	if((line = cline(c)) == NULL)
+	    return(-1);
+	if(!*line)
+	    break;
+	if(!strncasecmp(line, "content-length:", 15))
+	    clen = strtoll(line + 15, NULL, 10);
+	else if(!strncasecmp(line, "transfer-encoding:", 18))
+	    chunked = 1;
+	else if(!strncasecmp(line, "connection:", 11) && strstr(line, "close"))
+	    cls = 1;
+    }
+    if(chunked) {
+	do {
+	    if((line = cline(c)) == NULL)
+		return(-1);
+	    chlen = strtoll(line, NULL, 16);
+	    if(cskip(c, chlen) || (cline(c) == NULL))
+		return(-1);
+	} while(chlen > 0);
+    } else if(clen >= 0) {
+	if(cskip(c, clen))
+	    return(-1);
+    } else {
+	while(cfill(c) == 0)
+	    c->bh = c->bt;
+	return(1);
+    }
+    if((code < 200) || (code >= 400))
+	return(-1);
+    return(cls);
+}
+
+static void *run(void *uwork)
+{
+    struct worker *w = uwork;
+    struct conn *c;
+    uintmax_t start[depth];
+    int i, n, ret, isopen;
+    
+    c = smalloc(sizeof(*c));
+    isopen = 0;
+    while(running) {
+	if(!isopen) {
+	    if(cconnect(c)) {
+		w->errors++;
+		usleep(10000);
+		continue;
+	    }
+	    isopen = 1;
+	}
+	n = keepalive ? depth : 1;
+	for(i = 0; i < n; i++) {
+	    start[i] = now();
+	    if(cwrite(c, request, reqlen))
+		break;
+	}
+	if(i < n) {
+	    w->errors++;
+	    cclose(c);
+	    isopen = 0;
+	    continue;
+	}
+	ret = 0;
+	for(i = 0; (i < n) && (ret == 0); i++) {
+	    if((ret = readresp(c)) < 0) {
+		w->errors++;
+	    } else {
+		bufadd(w->lat, now() - start[i]);
+	    }
+	}
+	if(ret != 0) {
+	    cclose(c);
+	    isopen = 0;
+	}
+    }
+    if(isopen)
+	cclose(c);
+    free(c);
+    return(NULL);
+}
+
+static int latcmp(const void *a, const void *b)
+{
+    uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+    
+    return((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+static uint32_t pct(uint32_t *lat, size_t n, double p)
+{
+    size_t i;
+    
+    if(n == 0)
+	return(0);
+    i = (size_t)(p * n);
+    return(lat[(i >= n) ? (n - 1) : i]);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: htload [-hCs] [-c CONNS] [-d SECONDS] [-p DEPTH] [-H HOST] HOST PORT PATH\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, conns, secs;
+    char *vhost;
+    struct worker *w;
+    struct addrinfo hint;
+    uintmax_t st, el, errors;
+    typedbuf(uint32_t) lat;
+    
+    conns = 16;
+    secs = 5;
+    vhost = NULL;
+    while((c = getopt(argc, argv, "hCsc:d:p:H:")) >= 0) {
+	switch(c) {
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	case 'C':
+	    keepalive = 0;
+	    break;
+	case 's':
+#ifdef HAVE_GNUTLS
+	    usetls = 1;
+	    break;
+#else
+	    fprintf(stderr, "htload: not built with TLS support\n");
+	    exit(1);
+#endif
+	case 'c':
+	    conns = atoi(optarg);
+	    break;
+	case 'd':
+	    secs = atoi(optarg);
+	    break;
+	case 'p':
+	    depth = atoi(optarg);
+	    break;
+	case 'H':
+	    vhost = optarg;
+	    break;
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if((argc - optind != 3) || (conns < 1) || (depth < 1) || (secs < 1)) {
+	usage(stderr);
+	exit(1);
+    }
+    host = argv[optind];
+    port = argv[optind + 1];
+    path = argv[optind + 2];
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_socktype = SOCK_STREAM;
+    if((i = getaddrinfo(host, port, &hint, &addr)) != 0) {
+	fprintf(stderr, "htload: %s: %s\n", host, gai_strerror(i));
+	exit(1);
+    }
+    request = sprintf2("GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: htload\r\n%s\r\n",
+		       path, vhost ? vhost : host, keepalive ? "" : "Connection: close\r\n");
+    reqlen = strlen(request);
+#ifdef HAVE_GNUTLS
+    if(usetls) {
+	gnutls_global_init();
+	gnutls_certificate_allocate_credentials(&creds);
+    }
+#endif
+    
+    w = szmalloc(sizeof(*w) * conns);
+    st = now();
+    for(i = 0; i < conns; i++) {
+	if(pthread_create(&w[i].th, NULL, run, &w[i])) {
+	    fprintf(stderr, "htload: could not create thread: %s\n", strerror(errno));
+	    exit(1);
+	}
+    }
+    sleep(secs);
+    running = 0;
+    bufinit(lat);
+    errors = 0;
+    for(i = 0; i < conns; i++) {
+	pthread_join(w[i].th, NULL);
+	bufcat(lat, w[i].lat.b, w[i].lat.d);
+	buffree(w[i].lat);
+	errors += w[i].errors;
+    }
+    el = now() - st;
+    qsort(lat.b, lat.d, sizeof(*lat.b), latcmp);
+    printf("requests=%zi errors=%ju seconds=%.3f rps=%.1f p50_us=%" PRIu32 " p99_us=%" PRIu32 " p999_us=%" PRIu32 " max_us=%" PRIu32 "\n",
+	   lat.d, errors, el / 1000000.0, lat.d / (el / 1000000.0),
+	   pct(lat.b, lat.d, 0.5), pct(lat.b, lat.d, 0.99), pct(lat.b, lat.d, 0.999),
+	   (lat.d > 0) ? lat.b[lat.d - 1] : 0);
+    return((lat.d > 0) ? 0 : 1);
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/python3
+
+# A micro-benchmark of reading SCGI request headers in scgi-wsgi3,
+# comparing the native reader in the htlib extension with the pure
+# Python one that is used when it is not available. It first checks
+# that both decode a range of random requests alike, and then prints
+# the number of requests per second each can read from a socket.
+#
+# Run it with the ashd Python modules (including a built htlib) on
+# PYTHONPATH, optionally giving the number of requests to time.
+
+import sys, socket, random, time
+import ashd.scgi
+
+if ashd.scgi.htlib is None:
+    sys.stderr.write("scgibench: the htlib extension is not available\n")
+    sys.exit(1)
+
+def pyread(sk, bsk):
+    head = ashd.scgi.readhead(sk)
+    try:
+        env = ashd.scgi.decodehead(head, "utf-8")
+        env["wsgi.uri_encoding"] = "utf-8"
+    except UnicodeError:
+        env = ashd.scgi.decodehead(head, "latin-1")
+        env["wsgi.uri_encoding"] = "latin-1"
+    return env
+
+def nativeread(sk, bsk):
+    return ashd.scgi.readenv(bsk)
+
+def encode(head):
+    data = b"".join(k + b"\0" + v + b"\0" for k, v in head)
+    return str(len(data)).encode("ascii") + b":" + data + b","
+
+def typical(extra = []):
+    return encode(extra + [(b"CONTENT_LENGTH", b"0"), (b"SCGI", b"1"),
+                   (b"SERVER_SOFTWARE", b"ashd"), (b"GATEWAY_INTERFACE", b"CGI/1.1"),
+                   (b"REQUEST_METHOD", b"GET"), (b"SERVER_PROTOCOL", b"HTTP/1.1"),
+                   (b"REQUEST_URI", b"/app/items/42?sort=name"), (b"QUERY_STRING", b"sort=name"),
+                   (b"SCRIPT_NAME", b"/app"), (b"PATH_INFO", b"/items/42"),
+                   (b"SERVER_NAME", b"www.example.com"), (b"SERVER_PORT", b"80"),
+                   (b"REMOTE_ADDR", b"192.0.2.17"), (b"REMOTE_PORT", b"51234"),
+                   (b"HTTP_HOST", b"www.example.com"), (b"HTTP_USER_AGENT", b"Mozilla/5.0 (X11; Linux x86_64)"),
+                   (b"HTTP_ACCEPT", b"text/html,application/xhtml+xml,*/*;q=0.8"),
+                   (b"HTTP_ACCEPT_ENCODING", b"gzip, deflate"), (b"HTTP_ACCEPT_LANGUAGE", b"en-US,en;q=0.5"),
+                   (b"HTTP_COOKIE", b"session=0123456789abcdef0123456789abcdef"),
+                   (b"HTTP_X_ASH_PROTOCOL", b"http"), (b"HTTP_X_ASH_ADDRESS", b"192.0.2.17")])
+
+def randbytes(rnd, n):
+    return bytes(rnd.choice(b"abcXYZ_-/%=\xc3\xa5\xff") for i in range(n))
+
+def randreq(rnd):
+    head = [(randbytes(rnd, rnd.randrange(1, 12)), randbytes(rnd, rnd.randrange(0, 40))) for i in range(rnd.randrange(0, 20))]
+    if rnd.random() < 0.05:
+        head.append((b"BIG", b"x" * rnd.randrange(8000, 70000)))
+    return encode(head)
+
+def runreq(read, data):
+    a, b = socket.socketpair()
+    try:
+        a.sendall(data + b"BODY")
+        a.shutdown(socket.SHUT_WR)
+        sk = b.makefile("rb")
+        try:
+            return read(sk, b), sk.read()
+        except ashd.scgi.protoerr:
+            return "error", None
+        finally:
+            sk.close()
+    finally:
+        a.close()
+        b.close()
+
+def check():
+    rnd = random.Random(1)
+    errs = 0
+    cases = [randreq(rnd) for i in range(2000)]
+    cases += [b"", b"12", b"x:", b"3:a\0b,", b"4:a\0b\0;", b"5:a\0b\0c,", b"10:a\0b\0",
+              b"0:,", b"3:ab\0,", b"4:\xff\0\xff\0,"]
+    for data in cases:
+        if runreq(pyread, data) != runreq(nativeread, data):
+            sys.stderr.write("scgibench: mismatch for %r\n" % data[:80])
+            errs += 1
+    return errs
+
+def bench(name, read, data, n):
+    a, b = socket.socketpair()
+    sk = b.makefile("rb")
+    start = time.perf_counter()
+    for i in range(n):
+        a.sendall(data)
+        read(sk, b)
+    el = time.perf_counter() - start
+    print("%-24s %10.0f req/s %8.2f us" % (name, n / el, el * 1e6 / n))
+    sk.close()
+    a.close()
+    b.close()
+
+n = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+if check():
+    sys.stderr.write("scgibench: self-check failed\n")
+    sys.exit(1)
+bench("typical (python)", pyread, typical(), n)
+bench("typical (native)", nativeread, typical(), n)
+bench("latin-1 (python)", pyread, typical([(b"HTTP_REFERER", b"http://example.com/r\xe4ksm\xf6rg\xe5s")]), n)
+bench("latin-1 (native)", nativeread, typical([(b"HTTP_REFERER", b"http://example.com/r\xe4ksm\xf6rg\xe5s")]), n)
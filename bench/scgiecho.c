@@ -0,0 +1,85 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A minimal SCGI server for benchmarking, meant to be started by
+ * callscgi(1), which passes it a listening socket on standard
+ * input. It answers every request with a short fixed response, so
+ * that what is measured is ashd rather than the application.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+static const char resp[] =
+    "Status: 200 OK\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 6\r\n"
+    "\r\n"
+    "hello\n";
+
+static int serve(int fd)
+{
+    char buf[65536];
+    size_t len, hlen, off;
+    ssize_t ret;
+    char *p;
+    
+    /* Read the netstring header block and discard it. */
+    len = 0;
+    while(((p = memchr(buf, ':', len)) == NULL) && (len < 16)) {
+	if((ret = read(fd, buf + len, sizeof(buf) - len)) <= 0)
+	    return(-1);
+	len += ret;
+    }
+    if(p == NULL)
+	return(-1);
+    hlen = atoi(buf) + (p - buf) + 2;
+    if(hlen > sizeof(buf))
+	return(-1);
+    while(len < hlen) {
+	if((ret = read(fd, buf + len, sizeof(buf) - len)) <= 0)
+	    return(-1);
+	len += ret;
+    }
+    for(off = 0; off < sizeof(resp) - 1; off += ret) {
+	if((ret = write(fd, resp + off, sizeof(resp) - 1 - off)) <= 0)
+	    return(-1);
+    }
+    return(0);
+}
+
+int main(int argc, char **argv)
+{
+    int fd;
+    
+    while(1) {
+	if((fd = accept(0, NULL, NULL)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    fprintf(stderr, "scgiecho: accept: %s\n", strerror(errno));
+	    exit(1);
+	}
+	serve(fd);
+	close(fd);
+    }
+}
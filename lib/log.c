@@ -19,6 +19,12 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <syslog.h>
 
 #ifdef HAVE_CONFIG_H
@@ -26,31 +32,318 @@
 #endif
 #include <utils.h>
 #include <log.h>
+#include <mt.h>
+#include <mtio.h>
+
+/*
+ * While the mtio loop runs, messages are not written out as they are
+ * logged, but put in a ring of fixed-size slots that the loop drains
+ * in one go once per iteration, so that a flood of messages costs one
+ * write per iteration rather than one per message. What standard
+ * error will not take at once is kept, up to LOGPENDING bytes, and
+ * written by a coroutine as it becomes writable, so that a stalled
+ * reader never holds up the loop. When the ring or the pending output
+ * is full, messages are dropped rather than waited for. Regardless of
+ * that, repeats of the last message are only counted, and messages
+ * beyond a burst of LOGBURST, refilled at LOGRATE per second, are
+ * dropped; both are summarized once logging resumes. The ring has a
+ * single producer and a single consumer, which in practice are the
+ * same thread, and is indexed by free-running counters so that they
+ * never need to take a lock.
+ */
+
+#define LOGSLOTS 256
+#define LOGLEN 1024
+#define LOGRATE 50
+#define LOGBURST 200
+#define LOGREPEAT 5
+#define LOGPENDING 65536
+#define LOGSTALL 10
+
+struct logmsg {
+    int level;
+    char text[LOGLEN];
+};
 
 static int inited = 0;
 static int tostderr = 1, tosyslog = 0;
+static int async = 0;
+static pid_t owner;
+static struct logmsg ring[LOGSLOTS];
+static unsigned int rhead = 0, rtail = 0;
+static unsigned int ringdrops = 0, ratedrops = 0;
+static uintmax_t dropped = 0;
+static char last[LOGLEN];
+static int lastlevel = -1;
+static unsigned int repeats = 0;
+static time_t firstrep;
+static double tokens = LOGBURST, lastfill = 0;
+static struct charbuf pending;
+static int writing = 0;
+
+static void emit(int level, char *text, struct charbuf *buf)
+{
+    if(tostderr) {
+	if(buf != NULL) {
+	    bufcatstr(*buf, text);
+	    bufadd(*buf, '\n');
+	} else {
+	    fprintf(stderr, "%s\n", text);
+	}
+    } else if(tosyslog) {
+	syslog(level, "%s", text);
+    }
+}
+
+static void enqueue(int level, char *text)
+{
+    struct logmsg *msg;
+    unsigned int head;
+    
+    if(!async) {
+	emit(level, text, NULL);
+	return;
+    }
+    head = __atomic_load_n(&rhead, __ATOMIC_RELAXED);
+    if(head - __atomic_load_n(&rtail, __ATOMIC_ACQUIRE) >= LOGSLOTS) {
+	ringdrops++;
+	dropped++;
+	return;
+    }
+    msg = &ring[head % LOGSLOTS];
+    msg->level = level;
+    strcpy(msg->text, text);
+    __atomic_store_n(&rhead, head + 1, __ATOMIC_RELEASE);
+}
+
+static void flushrepeats(void)
+{
+    char buf[64];
+    
+    if(repeats > 0) {
+	snprintf(buf, sizeof(buf), "last message repeated %u times", repeats);
+	repeats = 0;
+	enqueue(lastlevel, buf);
+    }
+}
+
+static int ratecheck(void)
+{
+    struct timespec ts;
+    double now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+    tokens += (now - lastfill) * LOGRATE;
+    if(tokens > LOGBURST)
+	tokens = LOGBURST;
+    lastfill = now;
+    if(tokens < 1)
+	return(0);
+    tokens -= 1;
+    return(1);
+}
+
+static void submit(int level, char *text)
+{
+    char buf[64];
+    
+    if((level == lastlevel) && !strcmp(text, last)) {
+	if(repeats++ == 0)
+	    firstrep = time(NULL);
+	return;
+    }
+    flushrepeats();
+    strcpy(last, text);
+    lastlevel = level;
+    if(!ratecheck()) {
+	ratedrops++;
+	dropped++;
+	return;
+    }
+    if(ratedrops > 0) {
+	snprintf(buf, sizeof(buf), "%u log messages dropped", ratedrops);
+	ratedrops = 0;
+	enqueue(LOG_WARNING, buf);
+    }
+    enqueue(level, text);
+}
+
+/* A child process must neither write nor discard its parent's
+ * pending messages, but should start over with its own. */
+static void checkowner(void)
+{
+    if(owner == getpid())
+	return;
+    owner = getpid();
+    async = 0;
+    rhead = rtail = 0;
+    repeats = ringdrops = ratedrops = 0;
+    lastlevel = -1;
+    pending.d = 0;
+    writing = 0;
+}
+
+/* Standard error is shared with other processes, so it is only made
+ * non-blocking for as long as it takes to write to it. */
+static int writesome(void)
+{
+    int fl;
+    ssize_t ret;
+    
+    fl = fcntl(2, F_GETFL);
+    if(!(fl & O_NONBLOCK))
+	fcntl(2, F_SETFL, fl | O_NONBLOCK);
+    ret = write(2, pending.b, pending.d);
+    if(!(fl & O_NONBLOCK))
+	fcntl(2, F_SETFL, fl);
+    if(ret < 0)
+	return(((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1);
+    memmove(pending.b, pending.b + ret, pending.d -= ret);
+    return(0);
+}
+
+static void writeall(void)
+{
+    ssize_t ret;
+    
+    while(pending.d > 0) {
+	if((ret = write(2, pending.b, pending.d)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    break;
+	}
+	memmove(pending.b, pending.b + ret, pending.d -= ret);
+    }
+    pending.d = 0;
+}
+
+static void droppending(void)
+{
+    size_t i;
+    
+    for(i = 0; i < pending.d; i++) {
+	if(pending.b[i] == '\n') {
+	    ringdrops++;
+	    dropped++;
+	}
+    }
+    pending.d = 0;
+}
+
+static void logwriter(struct muth *muth, va_list args)
+{
+    int ev;
+    
+    while(pending.d > 0) {
+	if((ev = block(2, EV_WRITE, LOGSTALL)) < 0) {
+	    /* Not something that can be waited for, such as a
+	     * regular file, which does not stall anyway. */
+	    writeall();
+	    break;
+	}
+	if((ev == 0) || writesome())
+	    droppending();
+    }
+    writing = 0;
+}
+
+/*
+ * Writes out all queued messages, or as many of them as can be
+ * written without blocking while the mtio loop runs. Called by the
+ * mtio loop once per iteration, and at exit.
+ */
+void logflush(void)
+{
+    struct logmsg *msg;
+    unsigned int tail, head;
+    char sbuf[64];
+    
+    if(!inited || (owner != getpid()))
+	return;
+    if((repeats > 0) && (time(NULL) - firstrep >= LOGREPEAT))
+	flushrepeats();
+    tail = __atomic_load_n(&rtail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&rhead, __ATOMIC_ACQUIRE);
+    for(; tail != head; tail++) {
+	msg = &ring[tail % LOGSLOTS];
+	if(tostderr && (pending.d + strlen(msg->text) >= LOGPENDING)) {
+	    ringdrops++;
+	    dropped++;
+	    continue;
+	}
+	emit(msg->level, msg->text, &pending);
+    }
+    __atomic_store_n(&rtail, tail, __ATOMIC_RELEASE);
+    if((ringdrops > 0) && (pending.d + sizeof(sbuf) < LOGPENDING)) {
+	snprintf(sbuf, sizeof(sbuf), "%u log messages dropped", ringdrops);
+	ringdrops = 0;
+	emit(LOG_WARNING, sbuf, &pending);
+    }
+    if(pending.d == 0)
+	return;
+    if(!async) {
+	writeall();
+    } else if(!writing) {
+	if(writesome())
+	    droppending();
+	if(pending.d > 0) {
+	    writing = 1;
+	    mustart(logwriter);
+	}
+    }
+}
+
+/* Returns the number of messages dropped so far. */
+uintmax_t logdropped(void)
+{
+    return(dropped);
+}
+
+static void logexit(void)
+{
+    if(owner != getpid())
+	return;
+    async = 0;
+    flushrepeats();
+    logflush();
+}
 
 static void initlog(void)
 {
     inited = 1;
+    owner = getpid();
+    atexit(logexit);
     if(getenv("ASHD_USESYSLOG") != NULL)
 	opensyslog();
 }
 
+/* Called by the mtio loop as it starts and stops. */
+void logasync(int on)
+{
+    if(!inited)
+	initlog();
+    checkowner();
+    if(!on) {
+	async = 0;
+	logflush();
+    } else {
+	async = 1;
+    }
+}
+
 void flog(int level, char *format, ...)
 {
     va_list args;
+    char buf[LOGLEN];
     
     if(!inited)
 	initlog();
+    checkowner();
     va_start(args, format);
-    if(tostderr) {
-	vfprintf(stderr, format, args);
-	fprintf(stderr, "\n");
-    } else if(tosyslog) {
-	vsyslog(level, format, args);
-    }
+    vsnprintf(buf, sizeof(buf), format, args);
     va_end(args);
+    submit(level, buf);
 }
 
 void opensyslog(void)
@@ -2,8 +2,12 @@
 #define _LOG_H
 
 #include <syslog.h>
+#include <stdint.h>
 
 void flog(int level, char *format, ...);
 void opensyslog(void);
+void logflush(void);
+void logasync(int on);
+uintmax_t logdropped(void);
 
 #endif
@@ -39,7 +39,7 @@ struct blocker {
     int fd, reg;
     int ev, rev, id;
     int thpos;
-    time_t to;
+    double to;
     struct muth *th;
 };
 
@@ -169,7 +169,7 @@ static void thlower(struct blocker *bl, int n)
     bl->thpos = n;
 }
 
-static void addtimeout(struct blocker *bl, time_t to)
+static void addtimeout(struct blocker *bl, double to)
 {
     sizebuf(timeheap, ++timeheap.d);
     thraise(bl, timeheap.d - 1);
@@ -217,18 +217,27 @@ static void remblock(struct blocker *bl)
     remfd(bl);
 }
 
+static double mtnow(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + (ts.tv_nsec / 1000000000.0));
+}
+
 struct selected mblock(time_t to, int n, struct selected *spec)
 {
     int i, id;
     struct blocker bls[n];
+    double tm;
     
-    to = (to > 0)?(time(NULL) + to):0;
+    tm = (to > 0)?(mtnow() + to):0;
     for(i = 0; i < n; i++) {
 	bls[i] = (struct blocker) {
 	    .fd = spec[i].fd,
 	    .ev = spec[i].ev,
 	    .id = i,
-	    .to = to,
+	    .to = tm,
 	    .th = current,
 	};
 	if(addblock(&bls[i])) {
@@ -245,7 +254,8 @@ struct selected mblock(time_t to, int n, struct selected *spec)
     return((struct selected){.fd = bls[id].fd, .ev = bls[id].rev});
 }
 
-int block(int fd, int ev, time_t to)
+/* As block(), but with a timeout given in fractional seconds. */
+int block2(int fd, int ev, double to)
 {
     struct blocker bl;
     int rv;
@@ -254,7 +264,7 @@ int block(int fd, int ev, time_t to)
 	.fd = fd,
 	.ev = ev,
 	.id = -1,
-	.to = (to > 0)?(time(NULL) + to):0,
+	.to = (to > 0)?(mtnow() + to):0,
 	.th = current,
     };
     if(addblock(&bl))
@@ -264,14 +274,20 @@ int block(int fd, int ev, time_t to)
     return(rv);
 }
 
+int block(int fd, int ev, time_t to)
+{
+    return(block2(fd, ev, to));
+}
+
 int ioloop(void)
 {
     struct blocker *bl, *nbl;
     struct epoll_event evr[16];
     int i, fd, nev, ev, toval;
-    time_t now;
+    double now;
     
     exitstatus = 0;
+    logasync(1);
     epfd = epoll_create(128);
     fcntl(epfd, F_SETFD, FD_CLOEXEC);
     for(bl = blockers; bl; bl = nbl) {
@@ -280,13 +296,14 @@ int ioloop(void)
 	    resume(bl->th, -1);
     }
     while(blockers != NULL) {
-	now = time(NULL);
+	logflush();
+	now = mtnow();
 	if(timeheap.d == 0)
 	    toval = -1;
 	else if(timeheap.b[0]->to > now)
-	    toval = (timeheap.b[0]->to - now) * 1000;
+	    toval = (int)((timeheap.b[0]->to - now) * 1000) + 1;
 	else
-	    toval = 1000;
+	    toval = 0;
 	if(exitstatus)
 	    break;
 	nev = epoll_wait(epfd, evr, sizeof(evr) / sizeof(*evr), toval);
@@ -320,7 +337,7 @@ int ioloop(void)
 		}
 	    }
 	}
-	now = time(NULL);
+	now = mtnow();
 	while((timeheap.d > 0) && ((bl = timeheap.b[0])->to <= now)) {
 	    if(bl->id < 0) {
 		resume(bl->th, 0);
@@ -334,6 +351,7 @@ int ioloop(void)
 	remfd(bl);
     close(epfd);
     epfd = -1;
+    logasync(0);
     return(exitstatus);
 }
 
@@ -39,7 +39,7 @@ struct blocker {
     int fd, reg;
     int ev, rev, id;
     int thpos;
-    time_t to;
+    double to;
     struct muth *th;
 };
 
@@ -177,7 +177,7 @@ static void thlower(struct blocker *bl, int n)
     bl->thpos = n;
 }
 
-static void addtimeout(struct blocker *bl, time_t to)
+static void addtimeout(struct blocker *bl, double to)
 {
     sizebuf(timeheap, ++timeheap.d);
     thraise(bl, timeheap.d - 1);
@@ -225,18 +225,27 @@ static void remblock(struct blocker *bl)
     remfd(bl);
 }
 
+static double mtnow(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + (ts.tv_nsec / 1000000000.0));
+}
+
 struct selected mblock(time_t to, int n, struct selected *spec)
 {
     int i, id;
     struct blocker bls[n];
+    double tm;
     
-    to = (to > 0)?(time(NULL) + to):0;
+    tm = (to > 0)?(mtnow() + to):0;
     for(i = 0; i < n; i++) {
 	bls[i] = (struct blocker) {
 	    .fd = spec[i].fd,
 	    .ev = spec[i].ev,
 	    .id = i,
-	    .to = to,
+	    .to = tm,
 	    .th = current,
 	};
 	if(addblock(&bls[i])) {
@@ -253,7 +262,8 @@ struct selected mblock(time_t to, int n, struct selected *spec)
     return((struct selected){.fd = bls[id].fd, .ev = bls[id].rev});
 }
 
-int block(int fd, int ev, time_t to)
+/* As block(), but with a timeout given in fractional seconds. */
+int block2(int fd, int ev, double to)
 {
     struct blocker bl;
     int rv;
@@ -262,7 +272,7 @@ int block(int fd, int ev, time_t to)
 	.fd = fd,
 	.ev = ev,
 	.id = -1,
-	.to = (to > 0)?(time(NULL) + to):0,
+	.to = (to > 0)?(mtnow() + to):0,
 	.th = current,
     };
     addblock(&bl);
@@ -271,15 +281,21 @@ int block(int fd, int ev, time_t to)
     return(rv);
 }
 
+int block(int fd, int ev, time_t to)
+{
+    return(block2(fd, ev, to));
+}
+
 int ioloop(void)
 {
     struct blocker *bl, *nbl;
     struct kevent evs[16];
     int i, fd, nev, ev;
-    time_t now;
+    double now, tv;
     struct timespec *toval;
     
     exitstatus = 0;
+    logasync(1);
     qfd = kqueue();
     fcntl(qfd, F_SETFD, FD_CLOEXEC);
     for(bl = blockers; bl; bl = nbl) {
@@ -288,14 +304,13 @@ int ioloop(void)
 	    resume(bl->th, -1);
     }
     while(blockers != NULL) {
-	now = time(NULL);
+	logflush();
+	now = mtnow();
 	toval = &(struct timespec){};
 	if(timeheap.d == 0)
 	    toval  = NULL;
-	else if(timeheap.b[0]->to > now)
-	    *toval = (struct timespec){.tv_sec = timeheap.b[0]->to - now};
-	else
-	    *toval = (struct timespec){.tv_sec = 1};
+	else if((tv = timeheap.b[0]->to - now) > 0)
+	    *toval = (struct timespec){.tv_sec = (time_t)tv, .tv_nsec = (long)((tv - (time_t)tv) * 1000000000.0)};
 	if(exitstatus)
 	    break;
 	nev = kevent(qfd, NULL, 0, evs, sizeof(evs) / sizeof(*evs), toval);
@@ -323,7 +338,7 @@ int ioloop(void)
 		}
 	    }
 	}
-	now = time(NULL);
+	now = mtnow();
 	while((timeheap.d > 0) && ((bl = timeheap.b[0])->to <= now)) {
 	    if(bl->id < 0) {
 		resume(bl->th, 0);
@@ -337,6 +352,7 @@ int ioloop(void)
 	remfd(bl);
     close(qfd);
     qfd = -1;
+    logasync(0);
     return(exitstatus);
 }
 
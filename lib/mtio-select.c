@@ -39,7 +39,7 @@ struct blocker {
     struct iterator *it;
     int fd;
     int ev, rev, id;
-    time_t to;
+    double to;
     struct muth *th;
 };
 
@@ -70,18 +70,27 @@ static void remblock(struct blocker *bl)
     }
 }
 
+static double mtnow(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + (ts.tv_nsec / 1000000000.0));
+}
+
 struct selected mblock(time_t to, int n, struct selected *spec)
 {
     int i, id;
     struct blocker bls[n];
+    double tm;
     
-    to = (to > 0)?(time(NULL) + to):0;
+    tm = (to > 0)?(mtnow() + to):0;
     for(i = 0; i < n; i++) {
 	bls[i] = (struct blocker){
 	    .fd = spec[i].fd,
 	    .ev = spec[i].ev,
 	    .id = i,
-	    .to = to,
+	    .to = tm,
 	    .th = current,
 	};
 	addblock(&bls[i]);
@@ -94,7 +103,8 @@ struct selected mblock(time_t to, int n, struct selected *spec)
     return((struct selected){.fd = bls[id].fd, .ev = bls[id].rev});
 }
 
-int block(int fd, int ev, time_t to)
+/* As block(), but with a timeout given in fractional seconds. */
+int block2(int fd, int ev, double to)
 {
     struct blocker bl;
     int rv;
@@ -108,7 +118,7 @@ int block(int fd, int ev, time_t to)
 	.fd = fd,
 	.ev = ev,
 	.id = -1,
-	.to = (to > 0)?(time(NULL) + to):0,
+	.to = (to > 0)?(mtnow() + to):0,
 	.th = current,
     };
     addblock(&bl);
@@ -117,6 +127,11 @@ int block(int fd, int ev, time_t to)
     return(rv);
 }
 
+int block(int fd, int ev, time_t to)
+{
+    return(block2(fd, ev, to));
+}
+
 int ioloop(void)
 {
     int ret;
@@ -124,17 +139,20 @@ int ioloop(void)
     struct blocker *bl;
     struct iterator it;
     struct timeval toval;
-    time_t now, timeout;
+    double now, timeout;
+    long us;
     int maxfd;
     int ev;
     
     exitstatus = 0;
+    logasync(1);
     while(blockers != NULL) {
+	logflush();
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
 	FD_ZERO(&efds);
 	maxfd = 0;
-	now = time(NULL);
+	now = mtnow();
 	timeout = 0;
 	for(bl = blockers; bl; bl = bl->n) {
 	    if(bl->fd >= 0) {
@@ -149,10 +167,13 @@ int ioloop(void)
 	    if((bl->to != 0) && ((timeout == 0) || (timeout > bl->to)))
 		timeout = bl->to;
 	}
-	if(exitstatus)
+	if(exitstatus) {
+	    logasync(0);
 	    return(exitstatus);
-	toval.tv_sec = timeout - now;
-	toval.tv_usec = 0;
+	}
+	us = (timeout > now) ? ((long)((timeout - now) * 1000000.0) + 1) : 0;
+	toval.tv_sec = us / 1000000;
+	toval.tv_usec = us % 1000000;
 	ret = select(maxfd + 1, &rfds, &wfds, &efds, timeout?(&toval):NULL);
 	if(ret < 0) {
 	    if(errno != EINTR) {
@@ -162,7 +183,7 @@ int ioloop(void)
 		sleep(1);
 	    }
 	} else {
-	    now = time(NULL);
+	    now = mtnow();
 	    for(bl = it.bl = blockers; bl; bl = it.bl) {
 		if((it.bl = bl->n) != NULL)
 		    it.bl->it = &it;
@@ -195,6 +216,7 @@ int ioloop(void)
 	    }
 	}
     }
+    logasync(0);
     return(0);
 }
 
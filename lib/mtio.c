@@ -331,3 +331,78 @@ void mtiopipe(FILE **read, FILE **write)
     *read = funstdio(p, piperead, NULL, NULL, piperclose);
     *write = funstdio(p, NULL, pipewrite, NULL, pipewclose);
 }
+
+#ifdef HAVE_SPLICE
+/*
+ * Moves data from fd to ofd through a kernel pipe, without copying
+ * it through userspace, until EOF on fd or until max bytes have been
+ * moved (if max is non-negative). The number of bytes actually moved
+ * is added to *passed, also on error. If splicing is not supported
+ * for the given file descriptors, -1 is returned with errno set to
+ * EINVAL before any data has been moved, so that the caller may fall
+ * back to ordinary copying. Note that splicing to a socket does not
+ * suppress SIGPIPE.
+ */
+int mtsplice(int fd, int ofd, off_t max, int timeout, off_t *passed)
+{
+    int pfd[2], rv, serr;
+    ssize_t ret, ip;
+    off_t total;
+    size_t len;
+    
+    if(pipe2(pfd, O_NONBLOCK | O_CLOEXEC))
+	return(-1);
+    rv = -1;
+    ip = 0;
+    total = 0;
+    while(1) {
+	if(ip == 0) {
+	    len = 65536;
+	    if(max >= 0) {
+		if(total >= max) {
+		    rv = 0;
+		    break;
+		}
+		len = min(len, max - total);
+	    }
+	    ret = splice(fd, NULL, pfd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    if(ret == 0) {
+		rv = 0;
+		break;
+	    } else if(ret < 0) {
+		if(errno != EAGAIN)
+		    break;
+		if(block(fd, EV_READ, timeout) == 0) {
+		    errno = ETIMEDOUT;
+		    break;
+		}
+		continue;
+	    }
+	    ip = ret;
+	}
+	ret = splice(pfd[0], NULL, ofd, NULL, ip, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(ret < 0) {
+	    if(errno != EAGAIN)
+		break;
+	    if(block(ofd, EV_WRITE, timeout) == 0) {
+		errno = ETIMEDOUT;
+		break;
+	    }
+	    continue;
+	}
+	ip -= ret;
+	total += ret;
+    }
+    serr = errno;
+    if((rv < 0) && (serr == EINVAL) && (ip > 0)) {
+	/* Data has been consumed from fd, so falling back is no
+	 * longer possible. */
+	serr = EIO;
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+    errno = serr;
+    *passed += total;
+    return(rv);
+}
+#endif
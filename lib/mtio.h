@@ -2,6 +2,7 @@
 #define _LIB_MTIO_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #define EV_READ 1
 #define EV_WRITE 2
@@ -19,10 +20,14 @@ struct selected {
 
 struct selected mblock(time_t to, int n, struct selected *spec);
 int block(int fd, int ev, time_t to);
+int block2(int fd, int ev, double to);
 int ioloop(void);
 void exitioloop(int status);
 FILE *mtstdopen(int fd, int issock, int timeout, char *mode, struct stdiofd **infop);
 struct bufio *mtbioopen(int fd, int issock, int timeout, char *mode, struct stdiofd **infop);
 void mtiopipe(FILE **read, FILE **write);
+#ifdef HAVE_SPLICE
+int mtsplice(int fd, int ofd, off_t max, int timeout, off_t *passed);
+#endif
 
 #endif
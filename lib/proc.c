@@ -16,6 +16,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -24,9 +27,6 @@
 #include <ctype.h>
 #include <fcntl.h>
 
-#ifdef HAVE_CONFIG_H
-#include <config.h>
-#endif
 #include <utils.h>
 #include <log.h>
 #include <proc.h>
@@ -96,7 +96,7 @@ int recvfd(int sock, char **data, size_t *datalen)
     
     buf = smalloc(65536);
     memset(&msg, 0, sizeof(msg));
-
+    
     msg.msg_iov = &bufvec;
     msg.msg_iovlen = 1;
     bufvec.iov_base = buf;
@@ -129,6 +129,115 @@ int recvfd(int sock, char **data, size_t *datalen)
     return(fd);
 }
 
+/*
+ * Receives up to MAX datagrams and their file descriptors at once,
+ * blocking only until the first is available, and returns the number
+ * received. Where recvmmsg(2) is available, the datagrams are read
+ * into buffers kept between calls, so this should only be used from
+ * one thread. Errors and EOF are reported as by recvfd(), but only
+ * when no datagram could be received before them.
+ */
+int recvfdv(int sock, int *fds, char **data, size_t *lens, int max)
+{
+#ifdef HAVE_RECVMMSG
+    static char *bufs = NULL;
+    static int nbufs = 0;
+    struct mmsghdr msgs[max];
+    struct iovec vecs[max];
+    char cbufs[max][CMSG_SPACE(sizeof(int) * 4)];
+    struct cmsghdr *cmsg;
+    int i, n, ret, fd;
+    
+    if(max > nbufs) {
+	bufs = srealloc(bufs, 65536 * max);
+	nbufs = max;
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < max; i++) {
+	vecs[i].iov_base = bufs + (65536 * i);
+	vecs[i].iov_len = 65536;
+	msgs[i].msg_hdr.msg_iov = &vecs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_control = cbufs[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+    }
+    if((ret = recvmmsg(sock, msgs, max, MSG_WAITFORONE, NULL)) < 0)
+	return(-1);
+    for(i = n = 0; i < ret; i++) {
+	fd = -1;
+	for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+	    if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+		fd = *((int *)CMSG_DATA(cmsg));
+	}
+	if(msgs[i].msg_len == 0) {
+	    /* EOF, which will be seen again on the next call. */
+	    if(fd >= 0)
+		close(fd);
+	    break;
+	}
+	if(fd < 0) {
+	    if(n > 0)
+		continue;
+	    errno = EPROTO;
+	    return(-1);
+	}
+	fds[n] = fd;
+	data[n] = memcpy(smalloc(msgs[i].msg_len), vecs[i].iov_base, msgs[i].msg_len);
+	lens[n] = msgs[i].msg_len;
+	n++;
+    }
+    if(n == 0) {
+	errno = 0;
+	return(-1);
+    }
+    return(n);
+#else
+    if((fds[0] = recvfd(sock, &data[0], &lens[0])) < 0)
+	return(-1);
+    return(1);
+#endif
+}
+
+/*
+ * Sends N datagrams, each with a file descriptor, and returns the
+ * number sent, or -1 if not even the first could be.
+ */
+int sendfdv(int sock, int *fds, char **data, size_t *lens, int n, int flags)
+{
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[n];
+    struct iovec vecs[n];
+    char cbufs[n][CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    int i;
+    
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < n; i++) {
+	vecs[i].iov_base = data[i];
+	vecs[i].iov_len = lens[i];
+	msgs[i].msg_hdr.msg_iov = &vecs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_control = cbufs[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+	cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	*((int *)CMSG_DATA(cmsg)) = fds[i];
+	msgs[i].msg_hdr.msg_controllen = cmsg->cmsg_len;
+    }
+    return(sendmmsg(sock, msgs, n, flags));
+#else
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if(sendfd2(sock, fds[i], data[i], lens[i], flags) < 0)
+	    return((i > 0) ? i : -1);
+    }
+    return(n);
+#endif
+}
+
 pid_t stdforkserve(char **argv, struct hthead *req, int fd, void (*chinit)(void *), void *idata)
 {
     int i;
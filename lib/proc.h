@@ -7,6 +7,8 @@ int stdmkchild(char **argv, void (*chinit)(void *), void *idata);
 int sendfd2(int sock, int fd, char *data, size_t datalen, int flags);
 int sendfd(int sock, int fd, char *data, size_t datalen);
 int recvfd(int sock, char **data, size_t *datalen);
+int recvfdv(int sock, int *fds, char **data, size_t *lens, int max);
+int sendfdv(int sock, int *fds, char **data, size_t *lens, int n, int flags);
 pid_t stdforkserve(char **argv, struct hthead *req, int fd, void (*chinit)(void *), void *idata);
 
 #endif
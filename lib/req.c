@@ -33,6 +33,7 @@
 #include <req.h>
 #include <proc.h>
 #include <bufio.h>
+#include <stats.h>
 
 struct hthead *mkreq(char *method, char *url, char *ver)
 {
@@ -71,6 +72,8 @@ void freehthead(struct hthead *head)
 	free(head->ver);
     if(head->rest != NULL)
 	free(head->rest);
+    if(head->raw != NULL)
+	free(head->raw);
     if(head->headers) {
 	for(i = 0; i < head->noheaders; i++) {
 	    free(head->headers[i][0]);
@@ -82,10 +85,52 @@ void freehthead(struct hthead *head)
     free(head);
 }
 
+static void appheader(struct hthead *head, const char *name, const char *val)
+{
+    int i;
+    
+    i = head->noheaders++;
+    head->headers = srealloc(head->headers, sizeof(*head->headers) * head->noheaders);
+    head->headers[i] = smalloc(sizeof(*head->headers[i]) * 2);
+    head->headers[i][0] = sstrdup(name);
+    head->headers[i][1] = sstrdup(val);
+}
+
+/* Parses the headers of a request received with RECVREQ_LAZY, if
+ * that has not already been done. */
+static void parsehdrs(struct hthead *head)
+{
+    char *p, *name, *val;
+    size_t l;
+    
+    if(head->rawhdrs == 0)
+	return;
+    p = head->raw + head->rawhdrs;
+    l = head->rawlen - head->rawhdrs;
+    head->rawhdrs = 0;
+    while(((name = decstr(&p, &l)) != NULL) && *name) {
+	if((val = decstr(&p, &l)) == NULL)
+	    break;
+	appheader(head, name, val);
+    }
+}
+
+/* Called before a head is changed, since it can then no longer be
+ * passed on as it was received. */
+static void headdirty(struct hthead *head)
+{
+    if(head->raw == NULL)
+	return;
+    parsehdrs(head);
+    free(head->raw);
+    head->raw = NULL;
+}
+
 char *getheader(struct hthead *head, char *name)
 {
     int i;
     
+    parsehdrs(head);
     for(i = 0; i < head->noheaders; i++) {
 	if(!strcasecmp(head->headers[i][0], name))
 	    return(head->headers[i][1]);
@@ -363,6 +408,7 @@ void replrest(struct hthead *head, char *rest)
 {
     char *tmp;
     
+    headdirty(head);
     /* Do not free the current rest string yet, so that the new one
      * can be taken from a subpart of the old one. */
     tmp = head->rest;
@@ -372,6 +418,7 @@ void replrest(struct hthead *head, char *rest)
 
 void headpreheader(struct hthead *head, const char *name, const char *val)
 {
+    headdirty(head);
     head->headers = srealloc(head->headers, sizeof(*head->headers) * (head->noheaders + 1));
     memmove(head->headers + 1, head->headers, sizeof(*head->headers) * head->noheaders);
     head->noheaders++;
@@ -382,19 +429,15 @@ void headpreheader(struct hthead *head, const char *name, const char *val)
 
 void headappheader(struct hthead *head, const char *name, const char *val)
 {
-    int i;
-
-    i = head->noheaders++;
-    head->headers = srealloc(head->headers, sizeof(*head->headers) * head->noheaders);
-    head->headers[i] = smalloc(sizeof(*head->headers[i]) * 2);
-    head->headers[i][0] = sstrdup(name);
-    head->headers[i][1] = sstrdup(val);
+    headdirty(head);
+    appheader(head, name, val);
 }
 
 void headrmheader(struct hthead *head, const char *name)
 {
     int i;
     
+    headdirty(head);
     for(i = 0; i < head->noheaders; i++) {
 	if(!strcasecmp(head->headers[i][0], name)) {
 	    free(head->headers[i][0]);
@@ -432,21 +475,115 @@ int writerespb(struct bufio *out, struct hthead *resp)
     return(0);
 }
 
+/*
+ * Request tracing: when htparser is run with tracing enabled, it
+ * gives each request an X-Ash-Trace header of the form `ID HOP...',
+ * and every program passing the request through recvreq() and
+ * sendreq() appends a hop of its own, on the form
+ * PROG/PID<RECEIVED>SENT, with timestamps in microseconds of the
+ * monotonic clock. Each updated trace is also sent as a datagram to
+ * the socket named by ASHD_TRACEFD, if set, so that htparser can
+ * collect the trace of the last hop when the response is complete.
+ */
+static char *traceprog(void)
+{
+    static char *prog = NULL;
+    char buf[64];
+    FILE *fp;
+    
+    if(prog == NULL) {
+	prog = "unknown";
+	if((fp = fopen("/proc/self/comm", "r")) != NULL) {
+	    if(fgets(buf, sizeof(buf), fp) != NULL) {
+		buf[strcspn(buf, "\n")] = 0;
+		if(*buf && !strpbrk(buf, " <>"))
+		    prog = sstrdup(buf);
+	    }
+	    fclose(fp);
+	}
+    }
+    return(prog);
+}
+
+static int tracefd(void)
+{
+    static int tfd = -2;
+    char *p;
+    
+    if(tfd == -2)
+	tfd = ((p = getenv("ASHD_TRACEFD")) != NULL) ? atoi(p) : -1;
+    return(tfd);
+}
+
+static void tracerecv(struct hthead *req, int lazy)
+{
+    int i;
+    char *n;
+    
+    /* A lazily received request is not parsed just to look for a
+     * trace that could not be reported anyway. */
+    if(lazy && (tracefd() < 0))
+	return;
+    parsehdrs(req);
+    for(i = 0; i < req->noheaders; i++) {
+	if(!strcasecmp(req->headers[i][0], "X-Ash-Trace"))
+	    break;
+    }
+    if(i == req->noheaders)
+	return;
+    headdirty(req);
+    n = sprintf2("%s %s/%i<%ju", req->headers[i][1], traceprog(), (int)getpid(), statnow());
+    free(req->headers[i][1]);
+    req->headers[i][1] = n;
+    if(tracefd() >= 0)
+	send(tracefd(), n, strlen(n), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static char *tracesend(char *trace)
+{
+    char *p, *me;
+    
+    me = sprintf2("%s/%i<", traceprog(), (int)getpid());
+    p = strrchr(trace, ' ');
+    if((p != NULL) && !strncmp(p + 1, me, strlen(me)) && !strchr(p, '>'))
+	p = sprintf3("%s>%ju", trace, statnow());
+    else
+	p = sprintf3("%s %s/%i>%ju", trace, traceprog(), (int)getpid(), statnow());
+    free(me);
+    return(p);
+}
+
+static void encodereq(struct hthead *req, struct charbuf *buf)
+{
+    int i;
+    
+    bufcatstr2(*buf, req->method);
+    bufcatstr2(*buf, req->url);
+    bufcatstr2(*buf, req->ver);
+    bufcatstr2(*buf, req->rest);
+    for(i = 0; i < req->noheaders; i++) {
+	bufcatstr2(*buf, req->headers[i][0]);
+	if(!strcasecmp(req->headers[i][0], "X-Ash-Trace"))
+	    bufcatstr2(*buf, tracesend(req->headers[i][1]));
+	else
+	    bufcatstr2(*buf, req->headers[i][1]);
+    }
+    bufcatstr2(*buf, "");
+}
+
 int sendreq2(int sock, struct hthead *req, int fd, int flags)
 {
-    int ret, i;
+    int ret;
     struct charbuf buf;
     
-    bufinit(buf);
-    bufcatstr2(buf, req->method);
-    bufcatstr2(buf, req->url);
-    bufcatstr2(buf, req->ver);
-    bufcatstr2(buf, req->rest);
-    for(i = 0; i < req->noheaders; i++) {
-	bufcatstr2(buf, req->headers[i][0]);
-	bufcatstr2(buf, req->headers[i][1]);
+    /* An unmodified request is passed on exactly as it came. */
+    if(req->raw != NULL) {
+	if(sendfd2(sock, fd, req->raw, req->rawlen, flags) < 0)
+	    return(-1);
+	return(0);
     }
-    bufcatstr2(buf, "");
+    bufinit(buf);
+    encodereq(req, &buf);
     ret = sendfd2(sock, fd, buf.b, buf.d, flags);
     buffree(buf);
     if(ret < 0)
@@ -455,29 +592,52 @@ int sendreq2(int sock, struct hthead *req, int fd, int flags)
 	return(0);
 }
 
+/*
+ * Sends N requests at once, returning the number sent, or -1 if none
+ * could be.
+ */
+int sendreqs(int sock, struct hthead **reqs, int *fds, int n, int flags)
+{
+    char *data[n];
+    size_t lens[n];
+    struct charbuf buf;
+    int i, ret;
+    
+    for(i = 0; i < n; i++) {
+	if(reqs[i]->raw != NULL) {
+	    data[i] = reqs[i]->raw;
+	    lens[i] = reqs[i]->rawlen;
+	} else {
+	    bufinit(buf);
+	    encodereq(reqs[i], &buf);
+	    data[i] = buf.b;
+	    lens[i] = buf.d;
+	}
+    }
+    ret = sendfdv(sock, fds, data, lens, n, flags);
+    for(i = 0; i < n; i++) {
+	if(reqs[i]->raw == NULL)
+	    free(data[i]);
+    }
+    return(ret);
+}
+
 int sendreq(int sock, struct hthead *req, int fd)
 {
     return(sendreq2(sock, req, fd, MSG_NOSIGNAL));
 }
 
-int recvreq(int sock, struct hthead **reqp)
+static struct hthead *decodereq(char *buf, size_t len, int flags)
 {
-    int fd;
-    struct charbuf buf;
     char *p;
     size_t l;
-    char *name, *val;
     struct hthead *req;
     
-    if((fd = recvfd(sock, &buf.b, &buf.d)) < 0) {
-	return(-1);
-    }
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
-    buf.s = buf.d;
-    p = buf.b;
-    l = buf.d;
-    
-    *reqp = omalloc(req);
+    p = buf;
+    l = len;
+    omalloc(req);
+    req->raw = buf;
+    req->rawlen = len;
     if((req->method = sstrdup(decstr(&p, &l))) == NULL)
 	goto fail;
     if((req->url = sstrdup(decstr(&p, &l))) == NULL)
@@ -486,22 +646,71 @@ int recvreq(int sock, struct hthead **reqp)
 	goto fail;
     if((req->rest = sstrdup(decstr(&p, &l))) == NULL)
 	goto fail;
+    req->rawhdrs = p - buf;
+    if(!(flags & RECVREQ_LAZY))
+	parsehdrs(req);
+    tracerecv(req, flags & RECVREQ_LAZY);
+    return(req);
     
-    while(1) {
-	if(!*(name = decstr(&p, &l)))
-	    break;
-	val = decstr(&p, &l);
-	headappheader(req, name, val);
-    }
+fail:
+    freehthead(req);
+    return(NULL);
+}
+
+/*
+ * Receives a request. With RECVREQ_LAZY, its headers are only parsed
+ * once they are first looked at, which a handler that merely passes
+ * requests on may then never do.
+ */
+int recvreq2(int sock, struct hthead **reqp, int flags)
+{
+    int fd;
+    char *buf;
+    size_t len;
     
-    buffree(buf);
+    if((fd = recvfd(sock, &buf, &len)) < 0) {
+	return(-1);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if((*reqp = decodereq(buf, len, flags)) == NULL) {
+	close(fd);
+	errno = EPROTO;
+	return(-1);
+    }
     return(fd);
+}
+
+int recvreq(int sock, struct hthead **reqp)
+{
+    return(recvreq2(sock, reqp, 0));
+}
+
+/*
+ * Receives as many as MAX requests that are already queued, or waits
+ * for one if there are none, and returns the number received. Errors
+ * are reported as by recvreq().
+ */
+int recvreqs(int sock, struct hthead **reqs, int *fds, int max, int flags)
+{
+    char *data[max];
+    size_t lens[max];
+    int i, n, o;
     
-fail:
-    close(fd);
-    freehthead(req);
-    errno = EPROTO;
-    return(-1);
+    if((n = recvfdv(sock, fds, data, lens, max)) < 0)
+	return(-1);
+    for(i = o = 0; i < n; i++) {
+	fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	if((reqs[o] = decodereq(data[i], lens[i], flags)) == NULL) {
+	    close(fds[i]);
+	    continue;
+	}
+	fds[o++] = fds[i];
+    }
+    if(o == 0) {
+	errno = EPROTO;
+	return(-1);
+    }
+    return(o);
 }
 
 char *unquoteurl(char *in)
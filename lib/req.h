@@ -5,12 +5,19 @@
 
 struct bufio;
 
+#define RECVREQ_LAZY 1
+#define REQBATCH 16
+
 struct hthead {
     char *method, *url, *ver, *msg;
     int code;
     char *rest;
     char ***headers;
     int noheaders;
+    /* The request as received by recvreq(), for as long as it is
+     * unmodified, and the offset in it of headers not yet parsed. */
+    char *raw;
+    size_t rawlen, rawhdrs;
 };
 
 struct hthead *mkreq(char *method, char *url, char *ver);
@@ -23,6 +30,9 @@ void headrmheader(struct hthead *head, const char *name);
 int sendreq2(int sock, struct hthead *req, int fd, int flags);
 int sendreq(int sock, struct hthead *req, int fd);
 int recvreq(int sock, struct hthead **reqp);
+int recvreq2(int sock, struct hthead **reqp, int flags);
+int recvreqs(int sock, struct hthead **reqs, int *fds, int max, int flags);
+int sendreqs(int sock, struct hthead **reqs, int *fds, int n, int flags);
 void replrest(struct hthead *head, char *rest);
 int parseheaders(struct hthead *head, FILE *in);
 int parseheadersb(struct hthead *head, struct bufio *in);
@@ -22,7 +22,6 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
-#include <regex.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -116,7 +115,7 @@ static void simpleerror2v(FILE *out, int code, char *msg, char *fmt, va_list arg
 void simpleerror2(FILE *out, int code, char *msg, char *fmt, ...)
 {
     va_list args;
-
+    
     va_start(args, fmt);
     simpleerror2v(out, code, msg, fmt, args);
     va_end(args);
@@ -126,7 +125,7 @@ void simpleerror(int fd, int code, char *msg, char *fmt, ...)
 {
     va_list args;
     FILE *out;
-
+    
     va_start(args, fmt);
     out = fdopen(dup(fd), "w");
     simpleerror2v(out, code, msg, fmt, args);
@@ -178,84 +177,236 @@ void stdredir(struct hthead *req, int fd, int code, char *dst)
     free(adst);
 }
 
-char *fmthttpdate(time_t time)
+/* I avoid using strftime, since it depends on locale settings. */
+static char *days[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/* Days since the epoch of a date in the proleptic Gregorian
+ * calendar, with MON counted from zero. */
+static long daynum(long year, int mon, int mday)
 {
-    /* I avoid using strftime, since it depends on locale settings. */
-    static char *days[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
-    static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-			     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-    struct tm *tm;
+    long era;
+    int yoe, doy;
     
-    tm = gmtime(&time);
-    return(sprintf3("%s, %i %s %i %02i:%02i:%02i GMT", days[(tm->tm_wday + 6) % 7], tm->tm_mday, months[tm->tm_mon], tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec));
+    if(mon < 2)
+	year--;
+    era = ((year >= 0) ? year : (year - 399)) / 400;
+    yoe = year - (era * 400);
+    doy = ((153 * ((mon > 1) ? (mon - 2) : (mon + 10)) + 2) / 5) + mday - 1;
+    return((era * 146097) + (yoe * 365) + (yoe / 4) - (yoe / 100) + doy - 719468);
 }
 
-static int gtoi(char *bstr, regmatch_t g)
+/* The inverse of daynum(). */
+static void civil(long day, long *year, int *mon, int *mday)
 {
-    int i, n;
+    long era;
+    int doe, yoe, doy, mp;
+    
+    day += 719468;
+    era = ((day >= 0) ? day : (day - 146096)) / 146097;
+    doe = day - (era * 146097);
+    yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+    doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+    mp = ((5 * doy) + 2) / 153;
+    *mday = doy - (((153 * mp) + 2) / 5) + 1;
+    *mon = (mp < 10) ? (mp + 2) : (mp - 10);
+    *year = yoe + (era * 400) + (*mon < 2);
+}
 
-    for(i = g.rm_so, n = 0; i < g.rm_eo; i++)
-	n = (n * 10) + (bstr[i] - '0');
-    return(n);
+static char *fmtnum(char *p, long n, int w)
+{
+    char buf[24];
+    int i;
+    
+    for(i = 0; (n > 0) || (i < w); n /= 10)
+	buf[i++] = '0' + (n % 10);
+    while(i > 0)
+	*(p++) = buf[--i];
+    return(p);
 }
 
-static int gstrcmp(char *bstr, regmatch_t g, char *str)
+static void fmtdate(char *buf, time_t time)
 {
-    if(g.rm_eo - g.rm_so != strlen(str))
-	return(1);
-    return(strncasecmp(bstr + g.rm_so, str, g.rm_eo - g.rm_so));
+    long day, year;
+    int sec, mon, mday;
+    char *p;
+    
+    day = time / 86400;
+    sec = time % 86400;
+    if(sec < 0) {
+	sec += 86400;
+	day--;
+    }
+    civil(day, &year, &mon, &mday);
+    if((year < 0) || (year > 999999999)) {
+	sprintf(buf, "%s, %i %s %li %02i:%02i:%02i GMT", days[(((day + 3) % 7) + 7) % 7], mday, months[mon], year, sec / 3600, (sec / 60) % 60, sec % 60);
+	return;
+    }
+    /* 1970-01-01 was a Thursday. */
+    memcpy(buf, days[(((day + 3) % 7) + 7) % 7], 3);
+    p = buf + 3;
+    *(p++) = ',';
+    *(p++) = ' ';
+    p = fmtnum(p, mday, 1);
+    *(p++) = ' ';
+    memcpy(p, months[mon], 3);
+    p += 3;
+    *(p++) = ' ';
+    p = fmtnum(p, year, 1);
+    *(p++) = ' ';
+    p = fmtnum(p, sec / 3600, 2);
+    *(p++) = ':';
+    p = fmtnum(p, (sec / 60) % 60, 2);
+    *(p++) = ':';
+    p = fmtnum(p, sec % 60, 2);
+    memcpy(p, " GMT", 5);
 }
 
-time_t parsehttpdate(char *date)
+/*
+ * Formats a time as an HTTP date. Since nearly all dates formatted
+ * are either the current time, for the Date header, or the
+ * modification time of some file that is served over and over again,
+ * the current second is kept formatted, and other dates are memoized
+ * in a small direct-mapped table. The returned string remains valid
+ * at least until the next call.
+ */
+char *fmthttpdate(time_t time)
 {
-    static regex_t *spec = NULL;
-    static char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-			     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    static struct {
+	time_t t;
+	char buf[40];
+    } memo[64], cur = {-1};
     int i;
-    regmatch_t g[11];
-    struct tm tm;
-    int tz;
     
-    if(spec == NULL) {
-	omalloc(spec);
-	if(regcomp(spec, "^[A-Z]{3}, +([0-9]+) +([A-Z]{3}) +([0-9]+) +([0-9]{2}):([0-9]{2}):([0-9]{2}) +(([A-Z]+)|[+-]([0-9]{2})([0-9]{2}))$", REG_EXTENDED | REG_ICASE)) {
-	    free(spec);
-	    spec = NULL;
-	    return(0);
-	}
+    if(time == cur.t)
+	return(cur.buf);
+    if(time >= cur.t) {
+	/* A time at least as late as anything seen so far is most
+	 * likely the current time. */
+	fmtdate(cur.buf, cur.t = time);
+	return(cur.buf);
     }
-    if(regexec(spec, date, 11, g, 0))
-	return(0);
-    tm.tm_mday = gtoi(date, g[1]);
-    tm.tm_year = gtoi(date, g[3]) - 1900;
-    tm.tm_hour = gtoi(date, g[4]);
-    tm.tm_min = gtoi(date, g[5]);
-    tm.tm_sec = gtoi(date, g[6]);
+    i = (unsigned int)time % (sizeof(memo) / sizeof(*memo));
+    if((memo[i].t != time) || (memo[i].buf[0] == 0)) {
+	memo[i].t = time;
+	fmtdate(memo[i].buf, time);
+    }
+    return(memo[i].buf);
+}
+
+static char *skipsp(char *p)
+{
+    while(*p == ' ')
+	p++;
+    return(p);
+}
+
+static char *pnum(char *p, int min, int max, int *n)
+{
+    int i;
     
-    tm.tm_mon = -1;
-    for(i = 0; i < 12; i++) {
-	if(!gstrcmp(date, g[2], months[i])) {
-	    tm.tm_mon = i;
-	    break;
-	}
+    for(i = *n = 0; (*p >= '0') && (*p <= '9'); i++, p++) {
+	if(i >= 9)
+	    return(NULL);
+	*n = (*n * 10) + (*p - '0');
     }
-    if(tm.tm_mon < 0)
-	return(0);
+    if((i < min) || (i > max))
+	return(NULL);
+    return(p);
+}
+
+static char *pmonth(char *p, int *mon)
+{
+    for(*mon = 0; *mon < 12; (*mon)++) {
+	if(!strncasecmp(p, months[*mon], 3))
+	    return(p + 3);
+    }
+    return(NULL);
+}
+
+static char *ptime(char *p, int *h, int *m, int *s)
+{
+    if(((p = pnum(p, 2, 2, h)) == NULL) || (*(p++) != ':'))
+	return(NULL);
+    if(((p = pnum(p, 2, 2, m)) == NULL) || (*(p++) != ':'))
+	return(NULL);
+    if((p = pnum(p, 2, 2, s)) == NULL)
+	return(NULL);
+    if((*h > 23) || (*m > 59) || (*s > 60))
+	return(NULL);
+    return(p);
+}
+
+/*
+ * Parses an HTTP date in any of the three formats that RFC 7231
+ * requires recipients to accept, namely IMF-fixdate (`Sun, 06 Nov
+ * 1994 08:49:37 GMT'), the obsolete RFC 850 format (`Sunday,
+ * 06-Nov-94 08:49:37 GMT') and that of asctime(3) (`Sun Nov  6
+ * 08:49:37 1994'). Numeric zone offsets are accepted in place of GMT
+ * in the former two, as they were by the regex-based parser that
+ * preceded this one. Returns zero if the date cannot be parsed.
+ */
+time_t parsehttpdate(char *date)
+{
+    char *p;
+    int mon, mday, year, h, m, s, tz, n;
     
-    if(g[8].rm_so > 0) {
-	if(!gstrcmp(date, g[8], "GMT"))
+    for(p = date, n = 0; ((*p >= 'A') && (*p <= 'Z')) || ((*p >= 'a') && (*p <= 'z')); p++, n++);
+    if(n < 3)
+	return(0);
+    if(*p == ',') {
+	p = skipsp(p + 1);
+	if((p = pnum(p, 1, 2, &mday)) == NULL)
+	    return(0);
+	if(*p == '-') {
+	    /* RFC 850 */
+	    if(((p = pmonth(p + 1, &mon)) == NULL) || (*(p++) != '-'))
+		return(0);
+	    if((p = pnum(p, 2, 4, &year)) == NULL)
+		return(0);
+	    /* As per RFC 7231, two-digit years that would be more than
+	     * 50 years into the future are taken to be in the past. */
+	    if(year < 100)
+		year += (year < 70) ? 2000 : 1900;
+	} else {
+	    /* IMF-fixdate */
+	    if((p = pmonth(skipsp(p), &mon)) == NULL)
+		return(0);
+	    if((p = pnum(skipsp(p), 1, 9, &year)) == NULL)
+		return(0);
+	}
+	if((*p != ' ') || ((p = ptime(skipsp(p), &h, &m, &s)) == NULL) || (*p != ' '))
+	    return(0);
+	p = skipsp(p);
+	if((*p == '+') || (*p == '-')) {
+	    if((pnum(p + 1, 4, 4, &tz) == NULL) || (p[5] != 0))
+		return(0);
+	    tz = ((tz / 100) * 3600) + ((tz % 100) * 60);
+	    if(*p == '-')
+		tz = -tz;
+	} else if(!strcasecmp(p, "GMT")) {
 	    tz = 0;
-	else
+	} else {
 	    return(0);
-    } else if((g[9].rm_so > 0) && (g[10].rm_so > 0)) {
-	tz = gtoi(date, g[9]) * 3600 + gtoi(date, g[10]) * 60;
-	if(date[g[7].rm_so] == '-')
-	    tz = -tz;
+	}
+    } else if((n == 3) && (*p == ' ')) {
+	/* asctime */
+	if((p = pmonth(skipsp(p), &mon)) == NULL)
+	    return(0);
+	if((*p != ' ') || ((p = pnum(skipsp(p), 1, 2, &mday)) == NULL))
+	    return(0);
+	if((*p != ' ') || ((p = ptime(skipsp(p), &h, &m, &s)) == NULL))
+	    return(0);
+	if((*p != ' ') || ((p = pnum(skipsp(p), 1, 9, &year)) == NULL) || (*p != 0))
+	    return(0);
+	tz = 0;
     } else {
 	return(0);
     }
-    
-    return(timegm(&tm) - tz);
+    if((mday < 1) || (mday > 31))
+	return(0);
+    return((daynum(year, mon, mday) * 86400) + (h * 3600) + (m * 60) + s - tz);
 }
 
 char *httpdefstatus(int code)
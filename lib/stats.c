@@ -0,0 +1,229 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <mt.h>
+#include <mtio.h>
+#include <stats.h>
+
+/*
+ * Every ashd program is single-threaded, so plain increments are all
+ * the counters need. Histogram buckets are logarithmic: a value v is
+ * counted in bucket n such that 2^(n-1) <= v < 2^n, with 0 going in
+ * bucket 0 and everything too large in the last bucket.
+ */
+
+static struct statcnt *counters = NULL, **lastcnt = &counters;
+static struct stathist *hists = NULL, **lasthist = &hists;
+static char *sockpath = NULL;
+static pid_t sockowner;
+
+struct statcnt *statcnt(char *name)
+{
+    struct statcnt *cnt;
+    
+    omalloc(cnt);
+    cnt->name = sstrdup(name);
+    *lastcnt = cnt;
+    lastcnt = &cnt->next;
+    return(cnt);
+}
+
+struct stathist *stathist(char *name)
+{
+    struct stathist *hist;
+    
+    omalloc(hist);
+    hist->name = sstrdup(name);
+    *lasthist = hist;
+    lasthist = &hist->next;
+    return(hist);
+}
+
+void stathadd(struct stathist *hist, uintmax_t val)
+{
+    int b;
+    uintmax_t v;
+    
+    for(b = 0, v = val; (v > 0) && (b < STATBUCKETS - 1); b++, v >>= 1);
+    hist->b[b]++;
+    hist->n++;
+    hist->sum += val;
+}
+
+/* Returns a monotonic timestamp in microseconds. */
+uintmax_t statnow(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(((uintmax_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+static void formatstats(struct charbuf *buf)
+{
+    struct statcnt *cnt;
+    struct stathist *hist;
+    int i, l;
+    uintmax_t acc;
+    
+    for(cnt = counters; cnt != NULL; cnt = cnt->next)
+	bufcatstr(*buf, sprintf3("%s %" PRIuMAX "\n", cnt->name, cnt->val));
+    for(hist = hists; hist != NULL; hist = hist->next) {
+	bufcatstr(*buf, sprintf3("%s.count %" PRIuMAX "\n", hist->name, hist->n));
+	bufcatstr(*buf, sprintf3("%s.sum %" PRIuMAX "\n", hist->name, hist->sum));
+	for(l = STATBUCKETS - 1; (l > 0) && (hist->b[l] == 0); l--);
+	for(i = 0, acc = 0; i <= l; i++) {
+	    acc += hist->b[i];
+	    if(i < STATBUCKETS - 1)
+		bufcatstr(*buf, sprintf3("%s.le.%" PRIuMAX " %" PRIuMAX "\n", hist->name, ((uintmax_t)1 << i) - 1, acc));
+	}
+	bufcatstr(*buf, sprintf3("%s.le.inf %" PRIuMAX "\n", hist->name, hist->n));
+    }
+    bufcatstr(*buf, sprintf3("logdropped %" PRIuMAX "\n", logdropped()));
+}
+
+/*
+ * Accepts all pending connections on a socket from statinit() and
+ * writes a snapshot to each. The snapshot is small enough to fit in
+ * the socket buffer, so that a slow reader cannot block the caller.
+ */
+void statserve(int fd)
+{
+    struct charbuf buf;
+    int cfd;
+    
+    if(fd < 0)
+	return;
+    bufinit(buf);
+    while((cfd = accept(fd, NULL, NULL)) >= 0) {
+	if(buf.d == 0)
+	    formatstats(&buf);
+	send(cfd, buf.b, buf.d, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(cfd);
+    }
+    buffree(buf);
+}
+
+static void statloop(struct muth *muth, va_list args)
+{
+    vavar(int, fd);
+    
+    while(block(fd, EV_READ, 0) > 0)
+	statserve(fd);
+    close(fd);
+}
+
+/*
+ * Serves snapshots from a coroutine. Since it would otherwise keep
+ * the ioloop running forever, the caller should resume the returned
+ * thread with a zero argument to stop it when shutting down.
+ */
+struct muth *mtstatserve(int fd)
+{
+    if(fd < 0)
+	return(NULL);
+    return(mustart(statloop, fd));
+}
+
+/*
+ * For programs not using the mtio loop: waits until fd is readable,
+ * meanwhile serving any snapshot requests on sfd.
+ */
+int statpoll(int fd, int sfd)
+{
+    struct pollfd pfd[2];
+    
+    if(sfd < 0)
+	return(0);
+    while(1) {
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sfd;
+	pfd[1].events = POLLIN;
+	if(poll(pfd, 2, -1) < 0)
+	    return(-1);
+	if(pfd[1].revents)
+	    statserve(sfd);
+	if(pfd[0].revents)
+	    return(0);
+    }
+}
+
+static void rmsock(void)
+{
+    if((sockpath != NULL) && (getpid() == sockowner))
+	unlink(sockpath);
+}
+
+/*
+ * If the ASHD_STATS environment variable names a directory, creates a
+ * listening socket named PROG.PID in it and returns it. Otherwise,
+ * -1 is returned, and all statistics are merely kept internally.
+ */
+int statinit(char *prog)
+{
+    char *dir;
+    int fd;
+    struct sockaddr_un name;
+    
+    if(((dir = getenv("ASHD_STATS")) == NULL) || !*dir)
+	return(-1);
+    if(sockpath != NULL) {
+	flog(LOG_WARNING, "%s: stats socket already created", prog);
+	return(-1);
+    }
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    if(snprintf(name.sun_path, sizeof(name.sun_path), "%s/%s.%i", dir, prog, (int)getpid()) >= sizeof(name.sun_path)) {
+	flog(LOG_WARNING, "%s: stats socket path too long", prog);
+	return(-1);
+    }
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	flog(LOG_WARNING, "%s: could not create stats socket: %s", prog, strerror(errno));
+	return(-1);
+    }
+    unlink(name.sun_path);
+    if(bind(fd, (struct sockaddr *)&name, sizeof(name)) || listen(fd, 16)) {
+	flog(LOG_WARNING, "%s: could not bind stats socket %s: %s", prog, name.sun_path, strerror(errno));
+	close(fd);
+	return(-1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    sockpath = sstrdup(name.sun_path);
+    sockowner = getpid();
+    atexit(rmsock);
+    return(fd);
+}
@@ -0,0 +1,33 @@
+#ifndef _LIB_STATS_H
+#define _LIB_STATS_H
+
+#include <stdint.h>
+
+struct muth;
+
+#define STATBUCKETS 32
+
+struct statcnt {
+    struct statcnt *next;
+    char *name;
+    uintmax_t val;
+};
+
+struct stathist {
+    struct stathist *next;
+    char *name;
+    uintmax_t n, sum, b[STATBUCKETS];
+};
+
+#define statinc(cnt, n) ((cnt)->val += (n))
+
+struct statcnt *statcnt(char *name);
+struct stathist *stathist(char *name);
+void stathadd(struct stathist *hist, uintmax_t val);
+uintmax_t statnow(void);
+int statinit(char *prog);
+void statserve(int fd);
+struct muth *mtstatserve(int fd);
+int statpoll(int fd, int sfd);
+
+#endif
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <utils.h>
 
@@ -316,6 +318,19 @@ int hexdigit(char c)
     return(-1);
 }
 
+/* Returns the modification time of a file with as fine a resolution
+ * as the system keeps, which may be whole seconds only. */
+struct timespec stmtime(struct stat *sb)
+{
+#if defined(HAVE_STAT_MTIM)
+    return(sb->st_mtim);
+#elif defined(HAVE_STAT_MTIMESPEC)
+    return(sb->st_mtimespec);
+#else
+    return((struct timespec){.tv_sec = sb->st_mtime});
+#endif
+}
+
 static int btheight(struct btree *tree)
 {
     if(tree == NULL)
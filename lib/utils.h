@@ -3,7 +3,9 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #define max(a, b) (((b) > (a))?(b):(a))
 #define min(a, b) (((b) < (a))?(b):(a))
@@ -83,6 +85,7 @@ void replstr(char **p, char *n);
 char *base64encode(char *data, size_t datalen);
 char *base64decode(char *data, size_t *datalen);
 int hexdigit(char c);
+struct timespec stmtime(struct stat *sb);
 int bbtreedel(struct btree **tree, void *item, int (*cmp)(void *, void *));
 void freebtree(struct btree **tree, void (*ffunc)(void *));
 int bbtreeput(struct btree **tree, void *item, int (*cmp)(void *, void *));
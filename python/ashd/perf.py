@@ -77,3 +77,21 @@ class request(object):
     def __exit__(self, *excinfo):
         self.finish(bool(excinfo[0]))
         return False
+
+def snapshot():
+    """Return the request statistics of this process in a form that
+    can be passed to another process, for it to aggregate with
+    merge()."""
+    return list(reqstat.items())
+
+def merge(snapshots):
+    """Replace the request statistics of this process with the sum of
+    the given snapshots, as returned by snapshot(). This is used by
+    a supervising process to report the statistics of its workers as
+    its own."""
+    total = {}
+    for snap in snapshots:
+        for key, val in snap:
+            total[key] = total.get(key, 0) + val
+    reqstat.clear()
+    reqstat.update(total)
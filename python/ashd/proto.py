@@ -142,25 +142,13 @@ def recvreq(sock = 0):
     the socket, or an ashd.proto.protoerr if the incoming request is
     invalidly encoded.
     """
-    data, fd = htlib.recvfd(sock)
-    if fd is None:
-        return None
     try:
-        parts = data.split(b'\0')[:-1]
-        if len(parts) < 5:
-            raise protoerr("Truncated request")
-        method, url, ver, rest = parts[:4]
-        headers = []
-        i = 4
-        while True:
-            if parts[i] == b"": break
-            if len(parts) - i < 3:
-                raise protoerr("Truncated request")
-            headers.append((parts[i], parts[i + 1]))
-            i += 2
-        return req(method, url, ver, rest, headers, os.dup(fd))
-    finally:
-        os.close(fd)
+        ret = htlib.recvreq(sock)
+    except ValueError as exc:
+        raise protoerr(str(exc))
+    if ret is None:
+        return None
+    return req(*ret)
 
 def sendreq(sock, req):
     """Encode and send a single request to the specified socket file
@@ -1,3 +1,8 @@
+try:
+    from . import htlib
+except ImportError:
+    htlib = None
+
 class protoerr(Exception):
     pass
 
@@ -7,10 +12,12 @@ def readns(sk):
         c = sk.read(1)
         if c == b':':
             break
-        elif c >= b'0' or c <= b'9':
+        elif c == b'':
+            raise protoerr("Unexpected EOF")
+        elif b'0' <= c <= b'9':
             hln = (hln * 10) + (ord(c) - ord(b'0'))
         else:
-            raise protoerr("Invalid netstring length byte: " + c)
+            raise protoerr("Invalid netstring length byte: " + repr(c))
     ret = sk.read(hln)
     if sk.read(1) != b',':
         raise protoerr("Non-terminated netstring")
@@ -29,3 +36,15 @@ def readhead(sk):
 
 def decodehead(head, coding):
     return {k.decode(coding): v.decode(coding) for k, v in head.items()}
+
+def readenv(sk):
+    """Read the headers of an SCGI request from the socket `sk' and
+    return them decoded as UTF-8 if possible and as Latin-1
+    otherwise, with `wsgi.uri_encoding' set to the encoding used. Only
+    the headers are read from the socket, leaving the request body to
+    be read by the caller. Requires the htlib extension module; see
+    readhead() for a pure Python alternative."""
+    try:
+        return htlib.readscgi(sk.fileno())
+    except ValueError as exc:
+        raise protoerr(str(exc))
@@ -1,4 +1,5 @@
-import sys, os, threading, time, logging, select, queue, collections
+import sys, os, threading, time, logging, select, queue, collections, socket, inspect, http, urllib.parse
+import asyncio, concurrent.futures
 from . import perf
 
 log = logging.getLogger("ashd.serve")
@@ -470,6 +471,188 @@ class resplex(handler):
         os.close(self.cnpipe[1])
         self.rthread.join()
 
+def isasgi(app):
+    """Returns whether the given application object appears to be an
+    ASGI application rather than a WSGI one."""
+    if inspect.iscoroutinefunction(app):
+        return True
+    call = getattr(app, "__call__", None)
+    return inspect.iscoroutinefunction(call)
+
+def asgiscope(env):
+    """Constructs an ASGI HTTP connection scope from a WSGI
+    environment, as made by the request's mkenv method."""
+    enc = env.get("wsgi.uri_encoding", "utf-8")
+    root = urllib.parse.unquote(env.get("SCRIPT_NAME", ""), encoding=enc, errors="surrogateescape")
+    headers = []
+    for key, val in env.items():
+        if key.startswith("HTTP_"):
+            headers.append((key[5:].lower().replace("_", "-").encode("latin-1"), val.encode("latin-1")))
+    for key, name in [("CONTENT_TYPE", b"content-type"), ("CONTENT_LENGTH", b"content-length")]:
+        if key in env:
+            headers.append((name, env[key].encode("latin-1")))
+    ret = {"type": "http",
+           "asgi": {"version": "3.0", "spec_version": "2.3"},
+           "http_version": env.get("SERVER_PROTOCOL", "HTTP/1.1").partition("/")[2] or "1.1",
+           "method": env["REQUEST_METHOD"],
+           "scheme": env.get("wsgi.url_scheme", "http"),
+           "path": root + env.get("PATH_INFO", ""),
+           "raw_path": env.get("REQUEST_URI", "").partition("?")[0].encode(enc, errors="surrogateescape"),
+           "query_string": env.get("QUERY_STRING", "").encode(enc, errors="surrogateescape"),
+           "root_path": root,
+           "headers": headers,
+           "state": {}}
+    for host, port, key in [("REMOTE_ADDR", "REMOTE_PORT", "client"), ("SERVER_ADDR", "SERVER_PORT", "server")]:
+        if host in env and env.get(port, "").isdigit():
+            ret[key] = (env[host], int(env[port]))
+    return ret
+
+class asyncloop(handler):
+    """Serves all requests from a single asyncio event loop, so that
+    requests that are merely waiting, for the application or for the
+    client, do not tie up a thread each. ASGI applications run in the
+    loop itself. WSGI applications, which may block, run on a pool of
+    at most `max' threads, but their responses are sent from the loop.
+    """
+    cname = "async"
+
+    def __init__(self, *, max=25, **kw):
+        super().__init__(**kw)
+        self.pool = concurrent.futures.ThreadPoolExecutor(max_workers=max, thread_name_prefix="WSGI handler")
+        self.loop = asyncio.new_event_loop()
+        self.tasks = set()
+        self.th = threading.Thread(target=self.run, name="Async request loop")
+        self.th.start()
+
+    @classmethod
+    def parseargs(cls, *, max=None, **args):
+        ret = super().parseargs(**args)
+        if max:
+            ret["max"] = int(max)
+        return ret
+
+    def run(self):
+        asyncio.set_event_loop(self.loop)
+        self.loop.run_forever()
+
+    def handle(self, req):
+        def start():
+            task = self.loop.create_task(self.serve(req))
+            self.tasks.add(task)
+            task.add_done_callback(self.tasks.discard)
+        self.loop.call_soon_threadsafe(start)
+
+    async def writable(self, req):
+        fut = self.loop.create_future()
+        fd = req.fileno()
+        self.loop.add_writer(fd, lambda: fut.done() or fut.set_result(None))
+        try:
+            await fut
+        finally:
+            self.loop.remove_writer(fd)
+
+    async def aflush(self, req):
+        while len(req.buffer) > 0:
+            await self.writable(req)
+            req.flush()
+
+    async def serve(self, req):
+        try:
+            env = req.mkenv()
+            with perf.request(env) as reqevent:
+                if getattr(req, "isasgi", False):
+                    await self.serveasgi(req, env)
+                else:
+                    await self.servewsgi(req, env)
+                if req.status:
+                    reqevent.response([req.status, req.headers])
+        except closed:
+            pass
+        except:
+            log.error("exception occurred when handling request", exc_info=True)
+        finally:
+            req.close()
+
+    async def servewsgi(self, req, env):
+        respiter = await self.loop.run_in_executor(self.pool, req.handlewsgi, env, req.startreq)
+        try:
+            end = object()
+            it = iter(respiter)
+            while True:
+                data = await self.loop.run_in_executor(self.pool, next, it, end)
+                if data is end:
+                    break
+                if data:
+                    req.flushreq()
+                    req.writedata(data)
+                    await self.aflush(req)
+            if req.status:
+                req.flushreq()
+                await self.aflush(req)
+        finally:
+            if hasattr(respiter, "close"):
+                await self.loop.run_in_executor(self.pool, respiter.close)
+
+    async def serveasgi(self, req, env):
+        sk = socket.socket(fileno=os.dup(req.fileno()))
+        done = asyncio.Event()
+        try:
+            sk.setblocking(False)
+            if "CONTENT_LENGTH" in env:
+                left = int(env["CONTENT_LENGTH"] or "0")
+            elif "HTTP_TRANSFER_ENCODING" in env:
+                left = None
+            else:
+                left = 0
+            bodydone = False
+            async def receive():
+                nonlocal left, bodydone
+                if bodydone:
+                    # Nothing is known of the client until the
+                    # response has been sent.
+                    await done.wait()
+                    return {"type": "http.disconnect"}
+                if left == 0:
+                    data = b""
+                else:
+                    data = await self.loop.sock_recv(sk, 65536 if left is None else min(left, 65536))
+                if left is not None:
+                    left -= len(data)
+                if (data == b"") or (left == 0):
+                    bodydone = True
+                return {"type": "http.request", "body": data, "more_body": not bodydone}
+            async def send(msg):
+                if msg["type"] == "http.response.start":
+                    status = msg["status"]
+                    try:
+                        phrase = http.HTTPStatus(status).phrase
+                    except ValueError:
+                        phrase = "Unknown"
+                    req.startreq("%i %s" % (status, phrase), [(k, v) for k, v in msg.get("headers", [])])
+                elif msg["type"] == "http.response.body":
+                    req.flushreq()
+                    req.writedata(msg.get("body", b""))
+                    await self.aflush(req)
+                    if not msg.get("more_body", False):
+                        done.set()
+            await req.handleasgi(asgiscope(env), receive, send)
+            if req.status:
+                req.flushreq()
+                await self.aflush(req)
+        finally:
+            done.set()
+            sk.close()
+
+    def close(self):
+        async def drain():
+            while self.tasks:
+                await asyncio.gather(*list(self.tasks), return_exceptions=True)
+        asyncio.run_coroutine_threadsafe(drain(), self.loop).result()
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self.th.join()
+        self.loop.close()
+        self.pool.shutdown()
+
 names = {cls.cname: cls for cls in globals().values() if
          isinstance(cls, type) and
          issubclass(cls, handler) and
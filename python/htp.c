@@ -16,8 +16,13 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #include <ashd/utils.h>
 #include <ashd/proc.h>
@@ -78,9 +83,517 @@ static PyObject *p_sendfd(PyObject *self, PyObject *args)
     }
 }
 
+/*
+ * Receives a request and decodes it from the ashd wire format,
+ * returning (METHOD, URL, VER, REST, HEADERS, FD) for ashd.proto to
+ * wrap in a req object, or None on EOF.
+ */
+static PyObject *p_recvreq(PyObject *self, PyObject *args)
+{
+    int fd, ret, i;
+    char *data, *p, *e, *parts[4];
+    size_t dlen, l;
+    PyObject *hl, *ho, *ro;
+    
+    fd = 0;
+    if(!PyArg_ParseTuple(args, "|i", &fd))
+	return(NULL);
+    while(1) {
+	Py_BEGIN_ALLOW_THREADS;
+	ret = recvfd(fd, &data, &dlen);
+	Py_END_ALLOW_THREADS;
+	if(ret >= 0)
+	    break;
+	if(errno == 0)
+	    Py_RETURN_NONE;
+	if(errno == EINTR) {
+	    if(PyErr_CheckSignals())
+		return(NULL);
+	    continue;
+	}
+	PyErr_SetFromErrno(PyExc_OSError);
+	return(NULL);
+    }
+    p = data;
+    e = data + dlen;
+    for(i = 0; i < 4; i++) {
+	if((parts[i] = p) >= e)
+	    goto trunc;
+	if((p = memchr(p, 0, e - p)) == NULL)
+	    goto trunc;
+	p++;
+    }
+    if((hl = PyList_New(0)) == NULL)
+	goto err;
+    while(1) {
+	if((p >= e) || (memchr(p, 0, e - p) == NULL)) {
+	    Py_DECREF(hl);
+	    goto trunc;
+	}
+	if(!*p)
+	    break;
+	l = strlen(p);
+	if((p + l + 1 >= e) || (memchr(p + l + 1, 0, e - (p + l + 1)) == NULL)) {
+	    Py_DECREF(hl);
+	    goto trunc;
+	}
+	ho = Py_BuildValue("y#y", p, (Py_ssize_t)l, p + l + 1);
+	if((ho == NULL) || PyList_Append(hl, ho)) {
+	    Py_XDECREF(ho);
+	    Py_DECREF(hl);
+	    goto err;
+	}
+	Py_DECREF(ho);
+	p += l + 1;
+	p += strlen(p) + 1;
+    }
+    ro = Py_BuildValue("yyyyNi", parts[0], parts[1], parts[2], parts[3], hl, ret);
+    if(ro == NULL)
+	goto err;
+    free(data);
+    return(ro);
+    
+trunc:
+    PyErr_SetString(PyExc_ValueError, "Truncated request");
+err:
+    close(ret);
+    free(data);
+    return(NULL);
+}
+
+static PyObject *k_sname, *k_urlscheme, *k_saddr, *k_sport, *k_raddr,
+    *k_rport, *k_ctype, *k_clen, *k_hhost, *k_hproto, *k_hsaddr, *k_hsport,
+    *k_haddr, *k_hport, *k_hctype, *k_hclen, *k_proto, *k_method, *k_uri,
+    *k_qs, *k_script, *k_pi, *k_uenc, *k_https, *k_sfname, *v_utf8,
+    *v_latin1, *v_on, *hkeys;
+
+static int internkeys(void)
+{
+    struct {
+	PyObject **var;
+	char *name;
+    } *k, keys[] = {
+	{&k_sname, "SERVER_NAME"}, {&k_urlscheme, "wsgi.url_scheme"},
+	{&k_saddr, "SERVER_ADDR"}, {&k_sport, "SERVER_PORT"},
+	{&k_raddr, "REMOTE_ADDR"}, {&k_rport, "REMOTE_PORT"},
+	{&k_ctype, "CONTENT_TYPE"}, {&k_clen, "CONTENT_LENGTH"},
+	{&k_hhost, "HTTP_HOST"}, {&k_hproto, "HTTP_X_ASH_PROTOCOL"},
+	{&k_hsaddr, "HTTP_X_ASH_SERVER_ADDRESS"}, {&k_hsport, "HTTP_X_ASH_SERVER_PORT"},
+	{&k_haddr, "HTTP_X_ASH_ADDRESS"}, {&k_hport, "HTTP_X_ASH_PORT"},
+	{&k_hctype, "HTTP_CONTENT_TYPE"}, {&k_hclen, "HTTP_CONTENT_LENGTH"},
+	{&k_proto, "SERVER_PROTOCOL"}, {&k_method, "REQUEST_METHOD"},
+	{&k_uri, "REQUEST_URI"}, {&k_qs, "QUERY_STRING"},
+	{&k_script, "SCRIPT_NAME"}, {&k_pi, "PATH_INFO"},
+	{&k_uenc, "wsgi.uri_encoding"}, {&k_https, "HTTPS"},
+	{&k_sfname, "SCRIPT_FILENAME"},
+	{&v_utf8, "utf-8"}, {&v_latin1, "latin-1"}, {&v_on, "on"},
+	{NULL},
+    };
+    
+    for(k = keys; k->var != NULL; k++) {
+	if((*k->var = PyUnicode_InternFromString(k->name)) == NULL)
+	    return(-1);
+    }
+    if((hkeys = PyDict_New()) == NULL)
+	return(-1);
+    return(0);
+}
+
+/* Returns a new reference to the environ key for a header name,
+ * such as HTTP_CONTENT_TYPE for Content-Type. Keys are interned and
+ * remembered, so that the same few headers seen on every request
+ * need not be converted over and over. */
+static PyObject *headerkey(PyObject *name)
+{
+    PyObject *key;
+    char *buf, *s;
+    Py_ssize_t i, l;
+    
+    if((key = PyDict_GetItemWithError(hkeys, name)) != NULL) {
+	Py_INCREF(key);
+	return(key);
+    }
+    if(PyErr_Occurred())
+	return(NULL);
+    if(PyBytes_AsStringAndSize(name, &s, &l))
+	return(NULL);
+    if((buf = PyMem_Malloc(l + 5)) == NULL)
+	return(PyErr_NoMemory());
+    memcpy(buf, "HTTP_", 5);
+    for(i = 0; i < l; i++) {
+	if((s[i] >= 'a') && (s[i] <= 'z'))
+	    buf[i + 5] = s[i] - 'a' + 'A';
+	else if(s[i] == '-')
+	    buf[i + 5] = '_';
+	else
+	    buf[i + 5] = s[i];
+    }
+    key = PyUnicode_DecodeLatin1(buf, l + 5, NULL);
+    PyMem_Free(buf);
+    if(key == NULL)
+	return(NULL);
+    PyUnicode_InternInPlace(&key);
+    if(PyDict_GET_SIZE(hkeys) < 256) {
+	if(PyDict_SetItem(hkeys, name, key)) {
+	    Py_DECREF(key);
+	    return(NULL);
+	}
+    }
+    return(key);
+}
+
+/* As unquoteurl() in lib/utils.c, but for a counted string; returns
+ * non-zero on an invalid escape, as ashd-wsgi3 has always done. */
+static int unquote(char *s, Py_ssize_t l, char *d, Py_ssize_t *dl)
+{
+    Py_ssize_t i, o;
+    int c1, c2;
+    
+    for(i = o = 0; i < l; i++) {
+	if(s[i] == '%') {
+	    if(i + 2 >= l)
+		return(-1);
+	    if(((c1 = hexdigit(s[i + 1])) < 0) || ((c2 = hexdigit(s[i + 2])) < 0))
+		return(-1);
+	    d[o++] = (c1 << 4) | c2;
+	    i += 2;
+	} else {
+	    d[o++] = s[i];
+	}
+    }
+    *dl = o;
+    return(0);
+}
+
+static PyObject *decode(char *s, Py_ssize_t l, int latin1)
+{
+    if(latin1)
+	return(PyUnicode_DecodeLatin1(s, l, NULL));
+    return(PyUnicode_DecodeUTF8(s, l, NULL));
+}
+
+static int setstr(PyObject *env, PyObject *key, char *s, Py_ssize_t l, int latin1)
+{
+    PyObject *val;
+    int ret;
+    
+    if((val = decode(s, l, latin1)) == NULL)
+	return(-1);
+    ret = PyDict_SetItem(env, key, val);
+    Py_DECREF(val);
+    return(ret);
+}
+
+static int copykey(PyObject *env, PyObject *src, PyObject *tgt)
+{
+    PyObject *val;
+    
+    if((val = PyDict_GetItemWithError(env, src)) == NULL)
+	return(PyErr_Occurred() ? -1 : 0);
+    return(PyDict_SetItem(env, tgt, val));
+}
+
+static int delkey(PyObject *env, PyObject *key)
+{
+    int ret;
+    
+    if((ret = PyDict_Contains(env, key)) <= 0)
+	return(ret);
+    return(PyDict_DelItem(env, key));
+}
+
+/* Finds the first header with the given lower-case name, as
+ * ashd.proto.req.__getitem__ does. */
+static PyObject *findheader(PyObject *headers, char *name)
+{
+    PyObject *hdr, *hn;
+    Py_ssize_t i, n;
+    char *s;
+    
+    n = PyList_GET_SIZE(headers);
+    for(i = 0; i < n; i++) {
+	hdr = PyList_GET_ITEM(headers, i);
+	hn = PyTuple_GET_ITEM(hdr, 0);
+	s = PyBytes_AS_STRING(hn);
+	if((PyBytes_GET_SIZE(hn) == strlen(name)) && !strcasecmp(s, name))
+	    return(PyTuple_GET_ITEM(hdr, 1));
+    }
+    return(NULL);
+}
+
+/*
+ * Builds the WSGI environment for a request, as ashd-wsgi3 has done
+ * in Python, starting from a copy of BASE. Everything but the
+ * per-request streams is filled in. CWD is used to absolutify the
+ * X-Ash-File header into SCRIPT_FILENAME.
+ */
+static PyObject *p_mkenv(PyObject *self, PyObject *args)
+{
+    PyObject *env, *base, *headers, *hdr, *key, *val, *cwd, *fn;
+    char *method, *url, *ver, *rest, *name, *qs, *pi, *xf;
+    Py_ssize_t methodl, urll, verl, restl, namel, qsl, pil, xfl, i;
+    int latin1;
+    
+    if(!PyArg_ParseTuple(args, "y#y#y#y#O!O!U", &method, &methodl, &url, &urll, &ver, &verl, &rest, &restl, &PyList_Type, &headers, &PyDict_Type, &base, &cwd))
+	return(NULL);
+    for(i = 0; i < PyList_GET_SIZE(headers); i++) {
+	hdr = PyList_GET_ITEM(headers, i);
+	if(!PyTuple_Check(hdr) || (PyTuple_GET_SIZE(hdr) != 2) || !PyBytes_Check(PyTuple_GET_ITEM(hdr, 0)) || !PyBytes_Check(PyTuple_GET_ITEM(hdr, 1))) {
+	    PyErr_SetString(PyExc_TypeError, "headers must be (bytes, bytes) tuples");
+	    return(NULL);
+	}
+    }
+    if((env = PyDict_Copy(base)) == NULL)
+	return(NULL);
+    pi = NULL;
+    for(i = 0; i < PyList_GET_SIZE(headers); i++) {
+	hdr = PyList_GET_ITEM(headers, i);
+	if((key = headerkey(PyTuple_GET_ITEM(hdr, 0))) == NULL)
+	    goto err;
+	val = PyTuple_GET_ITEM(hdr, 1);
+	if(setstr(env, key, PyBytes_AS_STRING(val), PyBytes_GET_SIZE(val), 1)) {
+	    Py_DECREF(key);
+	    goto err;
+	}
+	Py_DECREF(key);
+    }
+    if(setstr(env, k_proto, ver, verl, 1) || setstr(env, k_method, method, methodl, 1))
+	goto err;
+    if((pi = PyMem_Malloc(restl + 2)) == NULL) {
+	PyErr_NoMemory();
+	goto err;
+    }
+    pi[0] = '/';
+    if(unquote(rest, restl, pi + 1, &pil)) {
+	memcpy(pi + 1, rest, restl);
+	pil = restl;
+    }
+    /* The URL, rest string and path info are decoded together, so
+     * that they are either all UTF-8 or all Latin-1. Since they are
+     * only ever split at ASCII characters below, checking them
+     * whole suffices. */
+    latin1 = 0;
+    for(i = 0; i < 3; i++) {
+	val = (i == 0) ? decode(url, urll, 0) : ((i == 1) ? decode(rest, restl, 0) : decode(pi + 1, pil, 0));
+	if(val == NULL) {
+	    if(!PyErr_ExceptionMatches(PyExc_UnicodeError))
+		goto err;
+	    PyErr_Clear();
+	    latin1 = 1;
+	    break;
+	}
+	Py_DECREF(val);
+    }
+    if(PyDict_SetItem(env, k_uenc, latin1 ? v_latin1 : v_utf8))
+	goto err;
+    if(setstr(env, k_uri, url, urll, latin1))
+	goto err;
+    name = url;
+    if((qs = memchr(url, '?', urll)) != NULL) {
+	namel = qs - url;
+	qs++;
+	qsl = urll - namel - 1;
+    } else {
+	namel = urll;
+	qs = "";
+	qsl = 0;
+    }
+    if(setstr(env, k_qs, qs, qsl, latin1))
+	goto err;
+    /* This is the same hack used in call*cgi. */
+    if((restl > 0) ? ((namel >= restl) && !memcmp(name + namel - restl, rest, restl)) : (namel == 0))
+	namel -= restl;
+    if((namel == 1) && (name[0] == '/')) {
+	/* This seems to be normal CGI behavior, but see callcgi.c
+	 * for details. */
+	namel = 0;
+	if(setstr(env, k_pi, pi, pil + 1, latin1))
+	    goto err;
+    } else {
+	if(setstr(env, k_pi, pi + 1, pil, latin1))
+	    goto err;
+    }
+    if(setstr(env, k_script, name, namel, latin1))
+	goto err;
+    if(copykey(env, k_hhost, k_sname) || copykey(env, k_hproto, k_urlscheme) ||
+       copykey(env, k_hsaddr, k_saddr) || copykey(env, k_hsport, k_sport) ||
+       copykey(env, k_haddr, k_raddr) || copykey(env, k_hport, k_rport) ||
+       copykey(env, k_hctype, k_ctype) || copykey(env, k_hclen, k_clen))
+	goto err;
+    /* The CGI specification does not strictly require this, but
+     * many actual programs and libraries seem to. */
+    if(delkey(env, k_hctype) || delkey(env, k_hclen))
+	goto err;
+    if(((val = findheader(headers, "x-ash-protocol")) != NULL) && (PyBytes_GET_SIZE(val) == 5) && !memcmp(PyBytes_AS_STRING(val), "https", 5)) {
+	if(PyDict_SetItem(env, k_https, v_on))
+	    goto err;
+    }
+    if((val = findheader(headers, "x-ash-file")) != NULL) {
+	xf = PyBytes_AS_STRING(val);
+	xfl = PyBytes_GET_SIZE(val);
+	if((fn = PyUnicode_DecodeLocaleAndSize(xf, xfl, NULL)) == NULL)
+	    goto err;
+	if((xfl < 1) || (xf[0] != '/')) {
+	    Py_SETREF(fn, PyUnicode_FromFormat("%U%s%U", cwd, (PyUnicode_GET_LENGTH(cwd) > 0) && (PyUnicode_READ_CHAR(cwd, PyUnicode_GET_LENGTH(cwd) - 1) != '/') ? "/" : "", fn));
+	    if(fn == NULL)
+		goto err;
+	}
+	if(PyDict_SetItem(env, k_sfname, fn)) {
+	    Py_DECREF(fn);
+	    goto err;
+	}
+	Py_DECREF(fn);
+    }
+    PyMem_Free(pi);
+    return(env);
+    
+err:
+    PyMem_Free(pi);
+    Py_DECREF(env);
+    return(NULL);
+}
+
+#define SCGIMAX (16 << 20)
+
+/* Returns -1 with an exception set on errors. */
+static ssize_t scgirecv(int fd, char *buf, size_t len, int flags)
+{
+    ssize_t ret;
+    
+    while(1) {
+	Py_BEGIN_ALLOW_THREADS;
+	ret = recv(fd, buf, len, flags);
+	Py_END_ALLOW_THREADS;
+	if(ret >= 0)
+	    return(ret);
+	if(errno != EINTR)
+	    break;
+	if(PyErr_CheckSignals())
+	    return(-1);
+    }
+    PyErr_SetFromErrno(PyExc_OSError);
+    return(-1);
+}
+
+/* Decodes the NUL-separated SCGI headers between P and E. As with
+ * ashd.scgi.readhead(), a trailing unterminated part is ignored. */
+static PyObject *scgihead(char *p, char *e, int latin1)
+{
+    PyObject *env, *key, *val;
+    char *k, *v;
+    
+    if((env = PyDict_New()) == NULL)
+	return(NULL);
+    while((p < e) && ((k = memchr(p, 0, e - p)) != NULL)) {
+	if((k + 1 >= e) || ((v = memchr(k + 1, 0, e - (k + 1))) == NULL)) {
+	    PyErr_SetString(PyExc_ValueError, "Malformed headers");
+	    goto err;
+	}
+	if((key = decode(p, k - p, latin1)) == NULL)
+	    goto err;
+	PyUnicode_InternInPlace(&key);
+	if((val = decode(k + 1, v - (k + 1), latin1)) == NULL) {
+	    Py_DECREF(key);
+	    goto err;
+	}
+	if(PyDict_SetItem(env, key, val)) {
+	    Py_DECREF(key);
+	    Py_DECREF(val);
+	    goto err;
+	}
+	Py_DECREF(key);
+	Py_DECREF(val);
+	p = v + 1;
+    }
+    if(PyDict_SetItem(env, k_uenc, latin1 ? v_latin1 : v_utf8))
+	goto err;
+    return(env);
+    
+err:
+    Py_DECREF(env);
+    return(NULL);
+}
+
+/*
+ * Reads the netstring-framed header block of an SCGI request from
+ * FD, leaving the request body unread on the socket, and returns the
+ * headers decoded into a dict, as scgi-wsgi3 has done in Python: as
+ * UTF-8 if they all are valid as such, and as Latin-1 otherwise, with
+ * wsgi.uri_encoding set accordingly. The length prefix is normally
+ * found in a single peek at the socket, after which exactly the
+ * netstring is consumed in one read.
+ */
+static PyObject *p_readscgi(PyObject *self, PyObject *args)
+{
+    int fd;
+    char sbuf[8192], *buf;
+    ssize_t ret, i;
+    size_t hln, need, off;
+    PyObject *env;
+    
+    if(!PyArg_ParseTuple(args, "i", &fd))
+	return(NULL);
+    hln = 0;
+    while(1) {
+	if((ret = scgirecv(fd, sbuf, sizeof(sbuf), MSG_PEEK)) < 0)
+	    return(NULL);
+	if(ret == 0) {
+	    PyErr_SetString(PyExc_ValueError, "Unexpected EOF");
+	    return(NULL);
+	}
+	for(i = 0; (i < ret) && (sbuf[i] >= '0') && (sbuf[i] <= '9'); i++) {
+	    if((hln = (hln * 10) + (sbuf[i] - '0')) > SCGIMAX) {
+		PyErr_SetString(PyExc_ValueError, "Oversized headers");
+		return(NULL);
+	    }
+	}
+	if(i < ret)
+	    break;
+	/* Only part of the length has arrived, so consume it and wait
+	 * for the rest. */
+	if(scgirecv(fd, sbuf, i, 0) < 0)
+	    return(NULL);
+    }
+    if(sbuf[i] != ':') {
+	PyErr_SetString(PyExc_ValueError, "Invalid netstring length byte");
+	return(NULL);
+    }
+    need = i + 1 + hln + 1;
+    if(need <= sizeof(sbuf)) {
+	buf = sbuf;
+    } else if((buf = PyMem_Malloc(need)) == NULL) {
+	return(PyErr_NoMemory());
+    }
+    env = NULL;
+    for(off = 0; off < need; off += ret) {
+	if((ret = scgirecv(fd, buf + off, need - off, MSG_WAITALL)) < 0)
+	    goto out;
+	if(ret == 0) {
+	    PyErr_SetString(PyExc_ValueError, "Unexpected EOF");
+	    goto out;
+	}
+    }
+    if(buf[need - 1] != ',') {
+	PyErr_SetString(PyExc_ValueError, "Non-terminated netstring");
+	goto out;
+    }
+    if(((env = scgihead(buf + i + 1, buf + i + 1 + hln, 0)) == NULL) && PyErr_ExceptionMatches(PyExc_UnicodeDecodeError)) {
+	PyErr_Clear();
+	env = scgihead(buf + i + 1, buf + i + 1 + hln, 1);
+    }
+    
+out:
+    if(buf != sbuf)
+	PyMem_Free(buf);
+    return(env);
+}
+
 static PyMethodDef methods[] = {
     {"recvfd", p_recvfd, METH_VARARGS, "Receive a datagram and a file descriptor"},
     {"sendfd", p_sendfd, METH_VARARGS, "Send a datagram and a file descriptor"},
+    {"recvreq", p_recvreq, METH_VARARGS, "Receive and decode a request"},
+    {"mkenv", p_mkenv, METH_VARARGS, "Build the WSGI environment for a request"},
+    {"readscgi", p_readscgi, METH_VARARGS, "Read and decode the headers of an SCGI request"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -93,5 +606,7 @@ static struct PyModuleDef module = {
 
 PyMODINIT_FUNC PyInit_htlib(void)
 {
+    if(internkeys())
+	return(NULL);
     return(PyModule_Create(&module));
 }
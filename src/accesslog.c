@@ -40,6 +40,7 @@
 #include <mt.h>
 #include <mtio.h>
 #include <bufio.h>
+#include <stats.h>
 
 #define DEFFORMAT "%{%Y-%m-%d %H:%M:%S}t %m %u %A \"%G\""
 
@@ -58,6 +59,9 @@ static FILE *out;
 static int flush = 1, locklog = 1;
 static char *format;
 static volatile int reopen = 0;
+static int sfd;
+static struct statcnt *st_reqs, *st_bytes;
+static struct stathist *st_ttfb, *st_total;
 
 static void qputs(char *sp, FILE *o)
 {
@@ -212,18 +216,24 @@ static void logreq(struct logdata *data)
 	fflush(out);
 }
 
-static void serve(struct hthead *req, int fd)
+static void serve(struct hthead **reqs, int *fds, int n)
 {
     struct logdata data;
+    struct timeval start;
+    int i;
     
-    data = defdata;
-    data.req = req;
-    gettimeofday(&data.start, NULL);
-    if(sendreq(ch, req, fd)) {
+    gettimeofday(&start, NULL);
+    statinc(st_reqs, n);
+    if(sendreqs(ch, reqs, fds, n, MSG_NOSIGNAL) != n) {
 	flog(LOG_ERR, "accesslog: could not pass request to child: %s", strerror(errno));
 	exit(1);
     }
-    logreq(&data);
+    for(i = 0; i < n; i++) {
+	data = defdata;
+	data.req = reqs[i];
+	data.start = start;
+	logreq(&data);
+    }
 }
 
 static int passdata(struct bufio *in, struct bufio *out, off_t *passed)
@@ -247,6 +257,44 @@ static int passdata(struct bufio *in, struct bufio *out, off_t *passed)
     return(0);
 }
 
+/*
+ * Like passdata, but moves everything not already buffered directly
+ * between the underlying sockets with splice(2), so that the data
+ * never has to be copied through userspace just to be counted.
+ */
+static int splicedata(struct bufio *in, struct stdiofd *ini, struct bufio *out, struct stdiofd *outi, off_t *passed)
+{
+#ifdef HAVE_SPLICE
+    ssize_t ret;
+    off_t total, rest;
+    
+    total = 0;
+    while(biordata(in) > 0) {
+	if((ret = biowrite(out, in->rbuf.b + in->rh, biordata(in))) < 0)
+	    return(-1);
+	in->rh += ret;
+	total += ret;
+    }
+    if(bioflush(out))
+	return(-1);
+    if(!in->eof) {
+	rest = 0;
+	if(mtsplice(ini->fd, outi->fd, -1, ini->timeout, &rest)) {
+	    if((errno != EINVAL) || (rest > 0))
+		return(-1);
+	    if(passdata(in, out, &rest))
+		return(-1);
+	}
+	total += rest;
+    }
+    if(passed)
+	*passed = total;
+    return(0);
+#else
+    return(passdata(in, out, passed));
+#endif
+}
+
 static void filterreq(struct muth *mt, va_list args)
 {
     vavar(struct hthead *, req);
@@ -256,7 +304,10 @@ static void filterreq(struct muth *mt, va_list args)
     struct bufio *cl, *hd;
     struct stdiofd *cli, *hdi;
     struct logdata data;
+    uintmax_t t, t2;
     
+    t = statnow();
+    statinc(st_reqs, 1);
     hd = NULL;
     resp = NULL;
     data = defdata;
@@ -272,23 +323,27 @@ static void filterreq(struct muth *mt, va_list args)
     }
     close(pfds[0]);
     
-    if(passdata(cl, hd, &data.bytesin))
+    if(splicedata(cl, cli, hd, hdi, &data.bytesin))
 	goto out;
     if(bioflush(hd))
 	goto out;
     shutdown(pfds[1], SHUT_WR);
+    t2 = statnow();
     if((resp = parseresponseb(hd)) == NULL)
 	goto out;
+    stathadd(st_ttfb, statnow() - t2);
     cli->sendrights = hdi->rights;
     hdi->rights = -1;
     data.resp = resp;
     writerespb(cl, resp);
     bioprintf(cl, "\r\n");
-    if(passdata(hd, cl, &data.bytesout))
+    if(splicedata(hd, hdi, cl, cli, &data.bytesout))
 	goto out;
     gettimeofday(&data.end, NULL);
+    stathadd(st_total, statnow() - t);
     
 out:
+    statinc(st_bytes, data.bytesin + data.bytesout);
     logreq(&data);
     
     freehthead(req);
@@ -431,6 +486,7 @@ static void floop(void)
 {
     mustart(listenloop, 0);
     mustart(chwatch, ch);
+    mtstatserve(sfd);
     while(1) {
 	switch(ioloop()) {
 	case 0:
@@ -445,9 +501,10 @@ static void floop(void)
 
 static void sloop(void)
 {
-    int fd, ret;
-    struct hthead *req;
-    struct pollfd pfd[2];
+    int i, n, ret;
+    int fds[REQBATCH];
+    struct hthead *reqs[REQBATCH];
+    struct pollfd pfd[3];
     
     while(1) {
 	if(reopen) {
@@ -459,25 +516,31 @@ static void sloop(void)
 	pfd[0].events = POLLIN;
 	pfd[1].fd = ch;
 	pfd[1].events = POLLHUP;
-	if((ret = poll(pfd, 2, -1)) < 0) {
+	pfd[2].fd = sfd;
+	pfd[2].events = POLLIN;
+	if((ret = poll(pfd, 3, -1)) < 0) {
 	    if(errno != EINTR) {
 		flog(LOG_ERR, "accesslog: error in poll: %s", strerror(errno));
 		exit(1);
 	    }
 	}
 	if(pfd[0].revents) {
-	    if((fd = recvreq(0, &req)) < 0) {
+	    if((n = recvreqs(0, reqs, fds, REQBATCH, RECVREQ_LAZY)) < 0) {
 		if(errno == 0)
 		    return;
 		flog(LOG_ERR, "accesslog: error in recvreq: %s", strerror(errno));
 		exit(1);
 	    }
-	    serve(req, fd);
-	    freehthead(req);
-	    close(fd);
+	    serve(reqs, fds, n);
+	    for(i = 0; i < n; i++) {
+		freehthead(reqs[i]);
+		close(fds[i]);
+	    }
 	}
 	if(pfd[1].revents & POLLHUP)
 	    return;
+	if(pfd[2].revents)
+	    statserve(sfd);
     }
 }
 
@@ -560,6 +623,8 @@ int main(int argc, char **argv)
 	exit(1);
     }
     signal(SIGHUP, sighandler);
+    if(filter)
+	signal(SIGPIPE, SIG_IGN);
     if(pidfile) {
 	if(!strcmp(pidfile, "-")) {
 	    if(!outname) {
@@ -575,6 +640,11 @@ int main(int argc, char **argv)
 	fprintf(pidout, "%i\n", (int)getpid());
 	fclose(pidout);
     }
+    st_reqs = statcnt("requests");
+    st_bytes = statcnt("bytes");
+    st_ttfb = stathist("ttfb");
+    st_total = stathist("total");
+    sfd = statinit("accesslog");
     if(filter)
 	floop();
     else
@@ -0,0 +1,301 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <req.h>
+
+#include "bucket.h"
+
+/*
+ * The token-bucket bookkeeping shared by ratequeue(1) and the
+ * rate limiting in htparser(1): an open-addressed hash table of
+ * buckets by source address, and a heap of the times at which they
+ * next need attention.
+ */
+
+#define SBUCKETS 7
+
+struct btime {
+    struct bucket *bk;
+    double tm;
+};
+
+static struct bucket *sbuckets[1 << SBUCKETS];
+static struct bucket **buckets = sbuckets;
+static int hashlen = SBUCKETS, nbuckets = 0;
+static typedbuf(struct btime) timeheap;
+
+double bktime(void)
+{
+    struct timespec ts;
+    
+    /* Not relative to process start, so that times are comparable
+     * between processes sharing a bucket table. */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + (ts.tv_nsec / 1000000000.0));
+}
+
+/* Returns non-zero if the request has no usable source address, in
+ * which case RET is left as the empty source. */
+int reqsource(struct hthead *req, struct source *ret)
+{
+    int i, rv;
+    char *sa;
+    struct in_addr a4;
+    struct in6_addr a6;
+    
+    *ret = (struct source){};
+    rv = -1;
+    if((sa = getheader(req, "X-Ash-Address")) != NULL) {
+	if(inet_pton(AF_INET, sa, &a4) == 1) {
+	    ret->type = AF_INET;
+	    memcpy(ret->data, &a4, ret->len = sizeof(a4));
+	    rv = 0;
+	} else if(inet_pton(AF_INET6, sa, &a6) == 1) {
+	    ret->type = AF_INET6;
+	    memcpy(ret->data, &a6, ret->len = sizeof(a6));
+	    rv = 0;
+	}
+    }
+    for(i = 0, ret->hash = ret->type; i < ret->len; i++)
+	ret->hash = (ret->hash * 31) + ret->data[i];
+    return(rv);
+}
+
+int srccmp(const struct source *a, const struct source *b)
+{
+    int c;
+    
+    if((c = a->len - b->len) != 0)
+	return(c);
+    if((c = a->type - b->type) != 0)
+	return(c);
+    return(memcmp(a->data, b->data, a->len));
+}
+
+const char *formatsrc(const struct source *src)
+{
+    static char buf[128];
+    struct in_addr a4;
+    struct in6_addr a6;
+    
+    switch(src->type) {
+    case AF_INET:
+	memcpy(&a4, src->data, sizeof(a4));
+	if(!inet_ntop(AF_INET, &a4, buf, sizeof(buf)))
+	    return("<invalid ipv4>");
+	return(buf);
+    case AF_INET6:
+	memcpy(&a6, src->data, sizeof(a6));
+	if(!inet_ntop(AF_INET6, &a6, buf, sizeof(buf)))
+	    return("<invalid ipv6>");
+	return(buf);
+    default:
+	return("<invalid source record>");
+    }
+}
+
+static void rehash(int nlen)
+{
+    unsigned int i, o, n, m, pl, nl;
+    struct bucket **new, **old;
+    
+    old = buckets;
+    if(nlen <= SBUCKETS) {
+	nlen = SBUCKETS;
+	new = sbuckets;
+    } else {
+	new = smalloc(sizeof(*new) * (1 << nlen));
+    }
+    if(nlen == hashlen)
+	return;
+    memset(new, 0, sizeof(*new) * (1 << nlen));
+    assert(old != new);
+    pl = 1 << hashlen; nl = 1 << nlen; m = nl - 1;
+    for(i = 0; i < pl; i++) {
+	if(!old[i])
+	    continue;
+	for(o = old[i]->id.hash & m, n = 0; n < nl; o = (o + 1) & m, n++) {
+	    if(!new[o]) {
+		new[o] = old[i];
+		break;
+	    }
+	}
+    }
+    if(old != sbuckets)
+	free(old);
+    buckets = new;
+    hashlen = nlen;
+}
+
+/* Finds the bucket for SRC, creating a zeroed one of SIZE bytes if
+ * there is none. */
+struct bucket *bkget(const struct source *src, size_t size, double now)
+{
+    unsigned int i, n, N, m;
+    struct bucket *bk;
+    
+    m = (N = (1 << hashlen)) - 1;
+    for(i = src->hash & m, n = 0; n < N; i = (i + 1) & m, n++) {
+	bk = buckets[i];
+	if(bk && !srccmp(&bk->id, src))
+	    return(bk);
+    }
+    for(i = src->hash & m; buckets[i]; i = (i + 1) & m);
+    buckets[i] = bk = szmalloc(size);
+    memcpy(&bk->id, src, sizeof(*src));
+    bk->last = bk->etime = now;
+    bk->thpos = -1;
+    bk->blocked = -1;
+    if(++nbuckets > (1 << (hashlen - 1)))
+	rehash(hashlen + 1);
+    return(bk);
+}
+
+static void hashdel(struct bucket *bk)
+{
+    unsigned int i, o, p, n, N, m;
+    struct bucket *sb;
+    
+    m = (N = (1 << hashlen)) - 1;
+    for(i = bk->id.hash & m, n = 0; n < N; i = (i + 1) & m, n++) {
+	assert((sb = buckets[i]) != NULL);
+	if(!srccmp(&sb->id, &bk->id))
+	    break;
+    }
+    assert(sb == bk);
+    buckets[i] = NULL;
+    for(o = (i + 1) & m; buckets[o] != NULL; o = (o + 1) & m) {
+	sb = buckets[o];
+	p = (sb->id.hash - i) & m;
+	if((p == 0) || (p > ((o - i) & m))) {
+	    buckets[i] = sb;
+	    buckets[o] = NULL;
+	    i = o;
+	}
+    }
+    if(--nbuckets <= (1 << (hashlen - 3)))
+	rehash(hashlen - 1);
+}
+
+static void thraise(struct btime bt, int n)
+{
+    int p;
+    
+    while(n > 0) {
+	p = (n - 1) >> 1;
+	if(timeheap.b[p].tm <= bt.tm)
+	    break;
+	(timeheap.b[n] = timeheap.b[p]).bk->thpos = n;
+	n = p;
+    }
+    (timeheap.b[n] = bt).bk->thpos = n;
+}
+
+static void thlower(struct btime bt, int n)
+{
+    int c1, c2, c;
+    
+    while(1) {
+	c2 = (c1 = (n << 1) + 1) + 1;
+	if(c1 >= timeheap.d)
+	    break;
+	c = ((c2 < timeheap.d) && (timeheap.b[c2].tm < timeheap.b[c1].tm)) ? c2 : c1;
+	if(timeheap.b[c].tm > bt.tm)
+	    break;
+	(timeheap.b[n] = timeheap.b[c]).bk->thpos = n;
+	n = c;
+    }
+    (timeheap.b[n] = bt).bk->thpos = n;
+}
+
+static void thadjust(struct btime bt, int n)
+{
+    if((n > 0) && (timeheap.b[(n - 1) >> 1].tm > bt.tm))
+	thraise(bt, n);
+    else
+	thlower(bt, n);
+}
+
+/* Removes the bucket from the table and frees it. Anything the
+ * embedding structure holds must already have been released. */
+void bkfree(struct bucket *bk)
+{
+    int n;
+    struct btime r;
+    
+    hashdel(bk);
+    if((n = bk->thpos) >= 0) {
+	r = timeheap.b[--timeheap.d];
+	if(n < timeheap.d)
+	    thadjust(r, n);
+    }
+    free(bk);
+}
+
+/* Sets the time at which bkexpired() will next return the bucket. */
+void bksettime(struct bucket *bk, double tm)
+{
+    if(bk->thpos < 0) {
+	sizebuf(timeheap, ++timeheap.d);
+	thraise((struct btime){bk, tm}, timeheap.d - 1);
+    } else {
+	thadjust((struct btime){bk, tm}, bk->thpos);
+    }
+}
+
+/* Returns the earliest bucket whose time has come by NOW, if any. The
+ * caller must either free it or set a new time for it. */
+struct bucket *bkexpired(double now)
+{
+    if((timeheap.d > 0) && (now >= timeheap.b[0].tm))
+	return(timeheap.b[0].bk);
+    return(NULL);
+}
+
+/* Returns the earliest time set for any bucket, or -1 if none. */
+double bknext(void)
+{
+    return((timeheap.d > 0) ? timeheap.b[0].tm : -1);
+}
+
+/* Drains the level of the bucket at RATE up until NOW. */
+void bkdrain(struct bucket *bk, double now, double rate)
+{
+    double delta, ll;
+    
+    delta = now - bk->last;
+    bk->last = now;
+    ll = bk->level;
+    if((bk->level -= delta * rate) < 0) {
+	if(ll > 0)
+	    bk->etime = now + (bk->level / rate);
+	bk->level = 0;
+    }
+}
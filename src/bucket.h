@@ -0,0 +1,31 @@
+#ifndef _ASH_BUCKET_H
+#define _ASH_BUCKET_H
+
+struct hthead;
+
+struct source {
+    int type;
+    char data[16];
+    unsigned int len, hash;
+};
+
+/* Users of the bucket table extend this by embedding it as the first
+ * member of their own bucket structure. */
+struct bucket {
+    struct source id;
+    double level, last, etime, wtime;
+    int thpos, blocked;
+};
+
+double bktime(void);
+int reqsource(struct hthead *req, struct source *ret);
+int srccmp(const struct source *a, const struct source *b);
+const char *formatsrc(const struct source *src);
+struct bucket *bkget(const struct source *src, size_t size, double now);
+void bkfree(struct bucket *bk);
+void bksettime(struct bucket *bk, double tm);
+struct bucket *bkexpired(double now);
+double bknext(void);
+void bkdrain(struct bucket *bk, double now, double rate);
+
+#endif
@@ -16,6 +16,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -23,29 +26,54 @@
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/poll.h>
 #include <sys/wait.h>
 
-#ifdef HAVE_CONFIG_H
-#include <config.h>
-#endif
 #include <utils.h>
 #include <log.h>
 #include <req.h>
 
-static char **environ;
+extern char **environ;
 
-static int passdata(FILE *in, FILE *out)
+static int copydata(int in, int out)
 {
-    int ret;
     char buf[65536];
+    ssize_t ret, off, wr;
+    
+    if((ret = read(in, buf, sizeof(buf))) < 0) {
+	flog(LOG_ERR, "callcgi: could not read input: %s", strerror(errno));
+	return(-1);
+    }
+    for(off = 0; off < ret; off += wr) {
+	if((wr = write(out, buf + off, ret - off)) < 0) {
+	    if(errno != EPIPE)
+		flog(LOG_ERR, "callcgi: could not write output: %s", strerror(errno));
+	    return(-1);
+	}
+    }
+    return(ret);
+}
+
+/*
+ * Passes data from one file descriptor to another until EOF, giving
+ * up if the receiving end hangs up. Since one end or the other is
+ * always a pipe to the CGI program, the data can be spliced across
+ * without passing through userspace, if the system supports it.
+ */
+static int passdata(int in, int out)
+{
+    int ret;
     struct pollfd pfds[2];
+#ifdef HAVE_SPLICE
+    int dosplice = 1;
+#endif
     
-    while(!feof(in)) {
+    while(1) {
 	memset(pfds, 0, sizeof(struct pollfd) * 2);
-	pfds[0].fd = fileno(in);
+	pfds[0].fd = in;
 	pfds[0].events = POLLIN;
-	pfds[1].fd = fileno(out);
+	pfds[1].fd = out;
 	pfds[1].events = POLLHUP;
 	ret = poll(pfds, 2, -1);
 	if(ret < 0) {
@@ -56,16 +84,24 @@ static int passdata(FILE *in, FILE *out)
 	}
 	if(ret > 0) {
 	    if(pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
-		ret = fread(buf, 1, 65536, in);
-		if(ferror(in)) {
-		    flog(LOG_ERR, "callcgi: could not read input: %s", strerror(errno));
-		    return(1);
-		}
-		if(fwrite(buf, 1, ret, out) != ret) {
-		    if(errno != EPIPE)
-			flog(LOG_ERR, "callcgi: could not write output: %s", strerror(errno));
+#ifdef HAVE_SPLICE
+		if(dosplice) {
+		    if((ret = splice(in, NULL, out, NULL, 65536, SPLICE_F_MOVE)) < 0) {
+			if(errno == EINVAL) {
+			    dosplice = 0;
+			    continue;
+			}
+			if(errno != EPIPE)
+			    flog(LOG_ERR, "callcgi: could not pass data: %s", strerror(errno));
+			return(1);
+		    }
+		} else
+#endif
+		if((ret = copydata(in, out)) < 0) {
 		    return(1);
 		}
+		if(ret == 0)
+		    break;
 	    }
 	    if(pfds[1].revents & POLLHUP)
 		return(1);
@@ -85,14 +121,112 @@ static char *absolutify(char *file)
     return(sstrdup(file));
 }
 
+/* Adds a variable to an environment, replacing any previous
+ * definition of it, as putenv() would. */
+static void envput(struct charvbuf *env, char *var)
+{
+    size_t i, nl;
+    
+    nl = strcspn(var, "=");
+    for(i = 0; i < env->d; i++) {
+	if(!strncmp(env->b[i], var, nl) && (env->b[i][nl] == '=')) {
+	    env->b[i] = var;
+	    return;
+	}
+    }
+    bufadd(*env, var);
+}
+
+/*
+ * Builds the entire environment of the CGI program in the parent,
+ * so that the child has nothing left to do but exec it.
+ */
+static char **mkenv(char *file, char *method, char *url, char *rest)
+{
+    struct charvbuf env;
+    char *qp, **ep, *name, *pi, *p;
+    
+    bufinit(env);
+    for(ep = environ; *ep; ep++)
+	bufadd(env, *ep);
+    if((qp = strchr(url, '?')) != NULL)
+	*(qp++) = 0;
+    envput(&env, sprintf2("SERVER_SOFTWARE=ashd/%s", VERSION));
+    envput(&env, "GATEWAY_INTERFACE=CGI/1.1");
+    if((p = getenv("HTTP_VERSION")) != NULL)
+	envput(&env, sprintf2("SERVER_PROTOCOL=%s", p));
+    envput(&env, sprintf2("REQUEST_METHOD=%s", method));
+    name = url;
+    /* XXX: This is an ugly hack (I think), but though I can think
+     * of several alternatives, none seem to be better. */
+    if(*rest && (strlen(url) >= strlen(rest)) &&
+       !strcmp(rest, url + strlen(url) - strlen(rest))) {
+	name = sprintf2("%.*s", (int)(strlen(url) - strlen(rest)), url);
+    }
+    if((pi = unquoteurl(rest)) == NULL)
+	pi = rest;
+    if(!strcmp(name, "/")) {
+	/*
+	 * Normal CGI behavior appears to be to always let
+	 * PATH_INFO begin with a slash and never let SCRIPT_NAME
+	 * end with one. That conflicts, however, with some
+	 * behaviors, such as "mounting" CGI applications on a
+	 * directory element of the URI space -- a handler
+	 * responding to "/foo/" would not be able to tell that it
+	 * is not called "/foo", which makes a large difference,
+	 * not least in relation to URI reconstruction and
+	 * redirections. A common practical case is CGI-handled
+	 * index files in directories. Therefore, this only
+	 * handles the nonconditional case of the root directory
+	 * and leaves other decisions to the previous handler
+	 * handing over the request to callcgi. It is unclear if
+	 * there is a better way to handle the problem.
+	 */
+	name[0] = 0;
+	pi = sprintf2("/%s", pi);
+    }
+    envput(&env, sprintf2("PATH_INFO=%s", pi));
+    envput(&env, sprintf2("SCRIPT_NAME=%s", name));
+    envput(&env, sprintf2("QUERY_STRING=%s", qp?qp:""));
+    if((p = getenv("REQ_HOST")) != NULL)
+	envput(&env, sprintf2("SERVER_NAME=%s", p));
+    if((p = getenv("REQ_X_ASH_SERVER_ADDRESS")) != NULL)
+	envput(&env, sprintf2("SERVER_ADDR=%s", p));
+    if((p = getenv("REQ_X_ASH_SERVER_PORT")) != NULL)
+	envput(&env, sprintf2("SERVER_PORT=%s", p));
+    if(((p = getenv("REQ_X_ASH_PROTOCOL")) != NULL) && !strcmp(p, "https"))
+	envput(&env, "HTTPS=on");
+    if((p = getenv("REQ_X_ASH_ADDRESS")) != NULL)
+	envput(&env, sprintf2("REMOTE_ADDR=%s", p));
+    if((p = getenv("REQ_X_ASH_PORT")) != NULL)
+	envput(&env, sprintf2("REMOTE_PORT=%s", p));
+    if((p = getenv("REQ_X_ASH_REMOTE_USER")) != NULL)
+	envput(&env, sprintf2("REMOTE_USER=%s", p));
+    if((p = getenv("REQ_CONTENT_TYPE")) != NULL)
+	envput(&env, sprintf2("CONTENT_TYPE=%s", p));
+    if((p = getenv("REQ_CONTENT_LENGTH")) != NULL)
+	envput(&env, sprintf2("CONTENT_LENGTH=%s", p));
+    for(ep = environ; *ep; ep++) {
+	if(!strncmp(*ep, "REQ_", 4))
+	    envput(&env, sprintf2("HTTP_%s", (*ep) + 4));
+    }
+    /*
+     * This is (understandably) missing from the CGI
+     * specification, but PHP seems to require it.
+     */
+    if(file != NULL)
+	envput(&env, sprintf2("SCRIPT_FILENAME=%s", absolutify(file)));
+    bufadd(env, NULL);
+    return(env.b);
+}
+
 static pid_t forkchild(int inpath, char **prog, char *file, char *method, char *url, char *rest, int *infd, int *outfd)
 {
-    char *qp, **env, *name;
+    char **env;
     int inp[2], outp[2];
     pid_t pid;
-    char *pi;
-    int (*execfun)(const char *, char *const []);
-
+    
+    env = mkenv(file, method, url, rest);
     pipe(inp);
     pipe(outp);
     if((pid = fork()) < 0) {
@@ -106,152 +240,106 @@ static pid_t forkchild(int inpath, char **prog, char *file, char *method, char *
 	close(inp[1]);
 	close(outp[0]);
 	close(outp[1]);
-	if((qp = strchr(url, '?')) != NULL)
-	    *(qp++) = 0;
-	putenv(sprintf2("SERVER_SOFTWARE=ashd/%s", VERSION));
-	putenv("GATEWAY_INTERFACE=CGI/1.1");
-	if(getenv("HTTP_VERSION"))
-	    putenv(sprintf2("SERVER_PROTOCOL=%s", getenv("HTTP_VERSION")));
-	putenv(sprintf2("REQUEST_METHOD=%s", method));
-	name = url;
-	/* XXX: This is an ugly hack (I think), but though I can think
-	 * of several alternatives, none seem to be better. */
-	if(*rest && (strlen(url) >= strlen(rest)) &&
-	   !strcmp(rest, url + strlen(url) - strlen(rest))) {
-	    name = sprintf2("%.*s", (int)(strlen(url) - strlen(rest)), url);
-	}
-	if((pi = unquoteurl(rest)) == NULL)
-	    pi = rest;
-	if(!strcmp(name, "/")) {
-	    /*
-	     * Normal CGI behavior appears to be to always let
-	     * PATH_INFO begin with a slash and never let SCRIPT_NAME
-	     * end with one. That conflicts, however, with some
-	     * behaviors, such as "mounting" CGI applications on a
-	     * directory element of the URI space -- a handler
-	     * responding to "/foo/" would not be able to tell that it
-	     * is not called "/foo", which makes a large difference,
-	     * not least in relation to URI reconstruction and
-	     * redirections. A common practical case is CGI-handled
-	     * index files in directories. Therefore, this only
-	     * handles the nonconditional case of the root directory
-	     * and leaves other decisions to the previous handler
-	     * handing over the request to callcgi. It is unclear if
-	     * there is a better way to handle the problem.
-	     */
-	    name[0] = 0;
-	    pi = sprintf2("/%s", pi);
-	}
-	putenv(sprintf2("PATH_INFO=%s", pi));
-	putenv(sprintf2("SCRIPT_NAME=%s", name));
-	putenv(sprintf2("QUERY_STRING=%s", qp?qp:""));
-	if(getenv("REQ_HOST"))
-	    putenv(sprintf2("SERVER_NAME=%s", getenv("REQ_HOST")));
-	if(getenv("REQ_X_ASH_SERVER_ADDRESS"))
-	    putenv(sprintf2("SERVER_ADDR=%s", getenv("REQ_X_ASH_SERVER_ADDRESS")));
-	if(getenv("REQ_X_ASH_SERVER_PORT"))
-	    putenv(sprintf2("SERVER_PORT=%s", getenv("REQ_X_ASH_SERVER_PORT")));
-	if(getenv("REQ_X_ASH_PROTOCOL") && !strcmp(getenv("REQ_X_ASH_PROTOCOL"), "https"))
-	    putenv("HTTPS=on");
-	if(getenv("REQ_X_ASH_ADDRESS"))
-	    putenv(sprintf2("REMOTE_ADDR=%s", getenv("REQ_X_ASH_ADDRESS")));
-	if(getenv("REQ_X_ASH_PORT"))
-	    putenv(sprintf2("REMOTE_PORT=%s", getenv("REQ_X_ASH_PORT")));
-	if(getenv("REQ_X_ASH_REMOTE_USER"))
-	    putenv(sprintf2("REMOTE_USER=%s", getenv("REQ_X_ASH_REMOTE_USER")));
-	if(getenv("REQ_CONTENT_TYPE"))
-	    putenv(sprintf2("CONTENT_TYPE=%s", getenv("REQ_CONTENT_TYPE")));
-	if(getenv("REQ_CONTENT_LENGTH"))
-	    putenv(sprintf2("CONTENT_LENGTH=%s", getenv("REQ_CONTENT_LENGTH")));
-	for(env = environ; *env; env++) {
-	    if(!strncmp(*env, "REQ_", 4))
-		putenv(sprintf2("HTTP_%s", (*env) + 4));
-	}
-	/*
-	 * This is (understandably) missing from the CGI
-	 * specification, but PHP seems to require it.
-	 */
-	execfun = inpath?execvp:execv;
-	if(file != NULL)
-	    putenv(sprintf2("SCRIPT_FILENAME=%s", absolutify(file)));
-	execfun(prog[0], prog);
+	environ = env;
+	if(inpath)
+	    execvp(prog[0], prog);
+	else
+	    execv(prog[0], prog);
 	exit(127);
     }
     close(inp[0]);
     close(outp[1]);
     *infd = inp[1];
     *outfd = outp[0];
+    free(env);
     return(pid);
 }
 
-static void trim(struct charbuf *buf)
+/* Returns the length of the header block at the start of buf,
+ * including the terminating empty line, or zero if it is not yet
+ * complete. */
+static size_t headerlen(char *buf, size_t len)
 {
-    char *p;
+    char *p, *e;
+    int empty;
     
-    for(p = buf->b; (p - buf->b < buf->d) && isspace(*p); p++);
-    memmove(buf->b, p, buf->d -= (p - buf->b));
-    for(p = buf->b + buf->d - 1; (p > buf->b) && isspace(*p); p--, buf->d--);
+    for(p = buf, e = buf + len, empty = 1; p < e; p++) {
+	if(*p == '\n') {
+	    if(empty)
+		return(p + 1 - buf);
+	    empty = 1;
+	} else if(*p != '\r') {
+	    empty = 0;
+	}
+    }
+    return(0);
+}
+
+/* Trims whitespace and strips carriage returns from [s, e), and
+ * NUL-terminates the result in place. */
+static char *trimfield(char *s, char *e)
+{
+    char *p, *d;
+    
+    for(p = d = s; p < e; p++) {
+	if(*p != '\r')
+	    *(d++) = *p;
+    }
+    for(p = s; (p < d) && isspace(*p); p++);
+    while((d > p) && isspace(d[-1]))
+	d--;
+    *d = 0;
+    return(p);
 }
 
-static char **parsecgiheaders(FILE *s)
+/*
+ * Parses a complete header block, as found by headerlen(), in
+ * place, leaving the names and values NUL-terminated in buf.
+ */
+static char **parsecgiheaders(char *buf, size_t len)
 {
-    int c, state;
     struct charvbuf hbuf;
-    struct charbuf buf;
+    char *p, *e, *le, *c;
     
     bufinit(hbuf);
-    bufinit(buf);
-    state = 0;
-    while(1) {
-	c = fgetc(s);
-    again:
-	if(state == 0) {
-	    if(c == '\r') {
-	    } else if(c == '\n') {
-		break;
-	    } else if(c == EOF) {
-		goto fail;
-	    } else {
-		state = 1;
-		goto again;
-	    }
-	} else if(state == 1) {
-	    if(c == ':') {
-		trim(&buf);
-		bufadd(buf, 0);
-		bufadd(hbuf, buf.b);
-		bufinit(buf);
-		state = 2;
-	    } else if(c == '\r') {
-	    } else if(c == '\n') {
-		goto fail;
-	    } else if(c == EOF) {
-		goto fail;
-	    } else {
-		bufadd(buf, c);
-	    }
-	} else if(state == 2) {
-	    if(c == '\r') {
-	    } else if(c == '\n') {
-		trim(&buf);
-		bufadd(buf, 0);
-		bufadd(hbuf, buf.b);
-		bufinit(buf);
-		state = 0;
-	    } else if(c == EOF) {
-		goto fail;
-	    } else {
-		bufadd(buf, c);
-	    }
+    for(p = buf, e = buf + len; p < e; p = le + 1) {
+	le = memchr(p, '\n', e - p);
+	for(c = p; (c < le) && (*c == '\r'); c++);
+	if(c == le)
+	    break;
+	if((c = memchr(p, ':', le - p)) == NULL) {
+	    buffree(hbuf);
+	    return(NULL);
 	}
+	bufadd(hbuf, trimfield(p, c));
+	bufadd(hbuf, trimfield(c + 1, le));
     }
     bufadd(hbuf, NULL);
     return(hbuf.b);
+}
+
+/* Reads the CGI program's header block into buf, returning its
+ * length, or zero if the program closed its output or sent more
+ * than any sane header block would take. */
+static size_t readheaders(int fd, struct charbuf *buf)
+{
+    ssize_t ret;
+    size_t hlen;
     
-fail:
-    buffree(hbuf);
-    buffree(buf);
-    return(NULL);
+    while((hlen = headerlen(buf->b, buf->d)) == 0) {
+	if(buf->d >= 1 << 20)
+	    return(0);
+	sizebuf(*buf, buf->d + 65536);
+	if((ret = read(fd, buf->b + buf->d, buf->s - buf->d)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return(0);
+	}
+	if(ret == 0)
+	    return(0);
+	buf->d += ret;
+    }
+    return(hlen);
 }
 
 static char *defstatus(int code)
@@ -339,19 +427,19 @@ static void usage(void)
     flog(LOG_ERR, "usage: callcgi [-c] [-p PROGRAM] [-P PROGRAM ARGS... ;] METHOD URL REST");
 }
 
-int main(int argc, char **argv, char **envp)
+int main(int argc, char **argv)
 {
     int c;
     char *file, *sp;
     struct charvbuf prog;
     int inpath, addfile, cd;
     int infd, outfd;
-    FILE *in, *out;
+    struct charbuf hbuf;
+    size_t hlen;
     char **headers;
     pid_t child;
     int estat;
     
-    environ = envp;
     signal(SIGPIPE, SIG_IGN);
     
     bufinit(prog);
@@ -423,20 +511,21 @@ int main(int argc, char **argv, char **envp)
 	bufadd(prog, file);
     bufadd(prog, NULL);
     child = forkchild(inpath, prog.b, file, argv[optind], argv[optind + 1], argv[optind + 2], &infd, &outfd);
-    in = fdopen(infd, "w");
-    passdata(stdin, in);	/* Ignore errors, perhaps? */
-    fclose(in);
-    out = fdopen(outfd, "r");
-    if((headers = parsecgiheaders(out)) == NULL) {
+    passdata(0, infd);	/* Ignore errors, perhaps? */
+    close(infd);
+    bufinit(hbuf);
+    if(((hlen = readheaders(outfd, &hbuf)) == 0) || ((headers = parsecgiheaders(hbuf.b, hlen)) == NULL)) {
 	flog(LOG_WARNING, "CGI handler returned invalid headers");
 	exit(1);
     }
     sendstatus(headers, stdout);
     sendheaders(headers, stdout);
     printf("\n");
-    if(passdata(out, stdout))
+    fwrite(hbuf.b + hlen, 1, hbuf.d - hlen, stdout);
+    fflush(stdout);
+    if(passdata(outfd, 1))
 	kill(child, SIGINT);
-    fclose(out);
+    close(outfd);
     if(waitpid(child, &estat, 0) == child) {
 	if(WCOREDUMP(estat))
 	    flog(LOG_WARNING, "CGI handler `%s' dumped core", prog.b[0]);
@@ -49,6 +49,7 @@
 #include <log.h>
 #include <mt.h>
 #include <mtio.h>
+#include <stats.h>
 
 #define FCGI_BEGIN_REQUEST 1
 #define FCGI_ABORT_REQUEST 2
@@ -65,6 +66,9 @@ static struct sockaddr *curaddr;
 static size_t caddrlen;
 static int cafamily, isanon;
 static pid_t child;
+static struct statcnt *st_reqs, *st_errors, *st_bytes;
+static struct stathist *st_connect, *st_ttfb;
+static struct muth *statmuth;
 
 static struct addrinfo *resolv(int flags)
 {
@@ -691,6 +695,8 @@ static void serve(struct muth *muth, va_list args)
     struct hthead *resp;
     size_t read;
     char buf[8192];
+    off_t n;
+    uintmax_t t;
     
     is = mtstdopen(fd, 1, 60, "r+", NULL);
     os = mtstdopen(sfd, 1, 600, "r+", NULL);
@@ -724,13 +730,16 @@ static void serve(struct muth *muth, va_list args)
     if(fflush(os))
 	goto out;
     
+    t = statnow();
     if((resp = parseresp(outi)) == NULL)
 	goto out;
+    stathadd(st_ttfb, statnow() - t);
     writeresp(is, resp);
     freehthead(resp);
     fputc('\n', is);
-    if(passdata(outi, is) < 0)
+    if((n = passdata(outi, is)) < 0)
 	goto out;
+    statinc(st_bytes, n);
     
 out:
     freehthead(req);
@@ -747,6 +756,7 @@ static void listenloop(struct muth *muth, va_list args)
     vavar(int, lfd);
     int fd, sfd;
     struct hthead *req;
+    uintmax_t t;
     
     while(1) {
 	block(0, EV_READ, 0);
@@ -755,13 +765,19 @@ static void listenloop(struct muth *muth, va_list args)
 		flog(LOG_ERR, "recvreq: %s", strerror(errno));
 	    break;
 	}
+	statinc(st_reqs, 1);
+	t = statnow();
 	if((sfd = reconn()) < 0) {
+	    statinc(st_errors, 1);
 	    close(fd);
 	    freehthead(req);
 	    continue;
 	}
+	stathadd(st_connect, statnow() - t);
 	mustart(serve, req, fd, sfd);
     }
+    if(statmuth != NULL)
+	resume(statmuth, 0);
 }
 
 static void sigign(int sig)
@@ -813,6 +829,12 @@ int main(int argc, char **argv)
     signal(SIGPIPE, sigign);
     signal(SIGINT, sigexit);
     signal(SIGTERM, sigexit);
+    st_reqs = statcnt("requests");
+    st_errors = statcnt("errors");
+    st_bytes = statcnt("bytes");
+    st_connect = stathist("connect");
+    st_ttfb = stathist("ttfb");
+    statmuth = mtstatserve(statinit("callfcgi"));
     mustart(listenloop, 0);
     ioloop();
     killcuraddr();
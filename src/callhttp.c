@@ -0,0 +1,745 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <req.h>
+#include <resp.h>
+#include <log.h>
+#include <mt.h>
+#include <mtio.h>
+#include <bufio.h>
+#include <stats.h>
+
+#define IDLETIME 60
+
+struct backend {
+    char *spec, *host;
+    struct sockaddr_storage addr;
+    socklen_t alen;
+    int up, active, nidle;
+    struct upconn *idle;
+    struct muth *check;
+};
+
+/*
+ * A connection to a backend. While in its backend's idle list, it
+ * has a muth of its own watching it, which closes it if the backend
+ * sends anything (usually EOF) or if it stays idle for too long.
+ */
+struct upconn {
+    struct upconn *next, *prev;
+    struct backend *be;
+    int fd;
+    struct bufio *bio;
+    struct muth *watch;
+};
+
+static struct backend *backends;
+static int nbackends, rr;
+static int running = 1, bufbody = 0, userest = 0, maxidle = 16, interval = 5;
+static size_t maxbody = 16 << 20;
+static char *hpath = NULL;
+static struct statcnt *st_reqs, *st_errors, *st_bytes, *st_reused;
+static struct stathist *st_connect, *st_ttfb;
+static struct muth *statmuth;
+
+static void closeconn(struct upconn *uc)
+{
+    bioclose(uc->bio);
+    free(uc);
+}
+
+static void idleunlink(struct upconn *uc)
+{
+    if(uc->next)
+	uc->next->prev = uc->prev;
+    if(uc->prev)
+	uc->prev->next = uc->next;
+    if(uc == uc->be->idle)
+	uc->be->idle = uc->next;
+    uc->be->nidle--;
+}
+
+static void idlewatch(struct muth *muth, va_list args)
+{
+    vavar(struct upconn *, uc);
+    
+    if((block(uc->fd, EV_READ, IDLETIME) == 0) && (uc->watch == NULL))
+	return;
+    idleunlink(uc);
+    closeconn(uc);
+}
+
+static struct upconn *newconn(struct backend *be, int timeout)
+{
+    struct upconn *uc;
+    int fd, err, one;
+    socklen_t errlen;
+    uintmax_t t;
+    
+    t = statnow();
+    if((fd = socket(be->addr.ss_family, SOCK_STREAM, 0)) < 0)
+	return(NULL);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if(connect(fd, (struct sockaddr *)&be->addr, be->alen)) {
+	if(errno != EINPROGRESS)
+	    goto fail;
+	if(block(fd, EV_WRITE, timeout) == 0) {
+	    errno = ETIMEDOUT;
+	    goto fail;
+	}
+	errlen = sizeof(err);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || ((errno = err) != 0))
+	    goto fail;
+    }
+    one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    stathadd(st_connect, statnow() - t);
+    omalloc(uc);
+    uc->be = be;
+    uc->fd = fd;
+    uc->bio = mtbioopen(fd, 1, timeout, "r+", NULL);
+    return(uc);
+    
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return(NULL);
+}
+
+static struct upconn *takeconn(struct backend *be)
+{
+    struct upconn *uc;
+    struct muth *watch;
+    char c;
+    
+    while((uc = be->idle) != NULL) {
+	idleunlink(uc);
+	watch = uc->watch;
+	uc->watch = NULL;
+	resume(watch, 0);
+	/* The backend may have closed the connection without the
+	 * watcher having had a chance to notice yet. */
+	if((recv(uc->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0) && (errno == EAGAIN)) {
+	    statinc(st_reused, 1);
+	    return(uc);
+	}
+	closeconn(uc);
+    }
+    return(NULL);
+}
+
+static void putconn(struct upconn *uc)
+{
+    struct backend *be;
+    
+    be = uc->be;
+    if(!running || (be->nidle >= maxidle) || (biordata(uc->bio) > 0)) {
+	closeconn(uc);
+	return;
+    }
+    uc->prev = NULL;
+    uc->next = be->idle;
+    if(be->idle != NULL)
+	be->idle->prev = uc;
+    be->idle = uc;
+    be->nidle++;
+    uc->watch = mustart(idlewatch, uc);
+}
+
+/* Picks the available backend with the fewest requests in progress,
+ * rotating among those that are equally loaded. */
+static struct backend *pickbe(void)
+{
+    struct backend *be, *best;
+    int i;
+    
+    best = NULL;
+    rr = (rr + 1) % nbackends;
+    for(i = 0; i < nbackends; i++) {
+	be = &backends[(rr + i) % nbackends];
+	if(be->up && ((best == NULL) || (be->active < best->active)))
+	    best = be;
+    }
+    return(best);
+}
+
+static void markdown(struct backend *be, char *why)
+{
+    if(be->up)
+	flog(LOG_WARNING, "callhttp: backend %s is down: %s", be->spec, why);
+    be->up = 0;
+}
+
+static int probe(struct backend *be)
+{
+    struct upconn *uc;
+    struct hthead *resp;
+    int ret;
+    
+    if((uc = newconn(be, interval * 2)) == NULL)
+	return(0);
+    if(hpath == NULL) {
+	closeconn(uc);
+	return(1);
+    }
+    bioprintf(uc->bio, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", hpath, be->host);
+    ret = 0;
+    if(!bioflush(uc->bio) && ((resp = parseresponseb(uc->bio)) != NULL)) {
+	ret = (resp->code >= 200) && (resp->code < 400);
+	freehthead(resp);
+    }
+    closeconn(uc);
+    return(ret);
+}
+
+static void healthcheck(struct muth *muth, va_list args)
+{
+    vavar(struct backend *, be);
+    int up;
+    
+    while(running) {
+	block(-1, 0, interval);
+	if(!running)
+	    break;
+	up = probe(be);
+	if(!running)
+	    break;
+	if(up && !be->up)
+	    flog(LOG_INFO, "callhttp: backend %s is up", be->spec);
+	else if(!up && be->up)
+	    flog(LOG_WARNING, "callhttp: backend %s failed health check", be->spec);
+	be->up = up;
+    }
+}
+
+static off_t passdata(struct bufio *in, struct bufio *out, off_t max)
+{
+    ssize_t read;
+    off_t total;
+    
+    total = 0;
+    while(!bioeof(in) && ((max < 0) || (total < max))) {
+	if((read = biordata(in)) > 0) {
+	    if(max >= 0)
+		read = min(max - total, read);
+	    if((read = biowritesome(out, in->rbuf.b + in->rh, read)) < 0)
+		return(-1);
+	    in->rh += read;
+	    total += read;
+	}
+	if(biorspace(in) && ((max < 0) || (biordata(in) < max - total)) && (biofillsome(in) < 0))
+	    return(-1);
+    }
+    return(total);
+}
+
+static off_t recvchunks(struct bufio *in, struct bufio *out)
+{
+    ssize_t read, chlen;
+    off_t total;
+    int c, r;
+    
+    total = 0;
+    while(1) {
+	chlen = 0;
+	r = 0;
+	while(1) {
+	    c = biogetc(in);
+	    if(c == 10) {
+		if(!r)
+		    return(-1);
+		break;
+	    } else if(c == 13) {
+	    } else if((c >= '0') && (c <= '9')) {
+		chlen = (chlen << 4) + (c - '0');
+		r = 1;
+	    } else if((c >= 'A') && (c <= 'F')) {
+		chlen = (chlen << 4) + (c + 10 - 'A');
+		r = 1;
+	    } else if((c >= 'a') && (c <= 'f')) {
+		chlen = (chlen << 4) + (c + 10 - 'a');
+		r = 1;
+	    } else {
+		/* As in htparser, chunk extensions are not supported. */
+		return(-1);
+	    }
+	}
+	if(chlen == 0)
+	    break;
+	while(chlen > 0) {
+	    if((read = biordata(in)) > 0) {
+		if((read = biowritesome(out, in->rbuf.b + in->rh, min(read, chlen))) < 0)
+		    return(-1);
+		in->rh += read;
+		chlen -= read;
+		total += read;
+	    }
+	    if(biorspace(in) && (biordata(in) < chlen) && (biofillsome(in) <= 0))
+		return(-1);
+	}
+	if((biogetc(in) != 13) || (biogetc(in) != 10))
+	    return(-1);
+    }
+    /* Neither are trailers, so the connection will simply not be
+     * reused if there are any. */
+    if((biogetc(in) != 13) || (biogetc(in) != 10))
+	return(-1);
+    return(total);
+}
+
+static int passchunks(struct bufio *in, struct bufio *out)
+{
+    size_t read;
+    
+    while(!bioeof(in)) {
+	if((read = biordata(in)) > 0) {
+	    bioprintf(out, "%zx\r\n", read);
+	    if(biowrite(out, in->rbuf.b + in->rh, read) != read)
+		return(-1);
+	    in->rh += read;
+	    bioprintf(out, "\r\n");
+	    if(bioflush(out) < 0)
+		return(-1);
+	}
+	if(biorspace(in) && (biofillsome(in) < 0))
+	    return(-1);
+    }
+    bioprintf(out, "0\r\n\r\n");
+    return(0);
+}
+
+/* Returns 1 if the body is larger than the configured maximum. */
+static int readbody(struct bufio *in, struct charbuf *buf)
+{
+    while(!bioeof(in)) {
+	bufcat(*buf, in->rbuf.b + in->rh, biordata(in));
+	in->rh = in->rbuf.d;
+	if(buf->d > maxbody)
+	    return(1);
+	if(biofillsome(in) < 0)
+	    return(-1);
+    }
+    return(0);
+}
+
+static int hopheader(char *name)
+{
+    static char *hop[] = {
+	"connection", "keep-alive", "proxy-connection", "te", "trailer",
+	"transfer-encoding", "upgrade", "expect", "content-length",
+	"x-forwarded-for", "x-forwarded-proto", NULL,
+    };
+    int i;
+    
+    if(!strncasecmp(name, "x-ash-", 6))
+	return(1);
+    for(i = 0; hop[i] != NULL; i++) {
+	if(!strcasecmp(name, hop[i]))
+	    return(1);
+    }
+    return(0);
+}
+
+static void mkhead(struct hthead *req, struct charbuf *dst)
+{
+    int i;
+    char *url, *p, *addr, *xff, *proto;
+    
+    if(userest) {
+	p = strchr(req->url, '?');
+	url = sprintf3("/%s%s", req->rest, (p == NULL) ? "" : p);
+    } else {
+	url = req->url;
+    }
+    bprintf(dst, "%s %s HTTP/1.1\r\n", req->method, url);
+    for(i = 0; i < req->noheaders; i++) {
+	if(!hopheader(req->headers[i][0]))
+	    bprintf(dst, "%s: %s\r\n", req->headers[i][0], req->headers[i][1]);
+    }
+    if((addr = getheader(req, "X-Ash-Address")) != NULL) {
+	if((xff = getheader(req, "X-Forwarded-For")) != NULL)
+	    bprintf(dst, "X-Forwarded-For: %s, %s\r\n", xff, addr);
+	else
+	    bprintf(dst, "X-Forwarded-For: %s\r\n", addr);
+    }
+    if((proto = getheader(req, "X-Ash-Protocol")) != NULL)
+	bprintf(dst, "X-Forwarded-Proto: %s\r\n", proto);
+}
+
+/*
+ * Sends a request over a backend connection and returns the response
+ * head. If BODY is NULL, the request body, if any, is streamed from
+ * the client instead.
+ */
+static struct hthead *exchange(struct upconn *uc, struct charbuf *head, struct bufio *cl, struct charbuf *body, off_t dlen, int chunked)
+{
+    struct hthead *resp;
+    
+    if(biowrite(uc->bio, head->b, head->d) != head->d)
+	return(NULL);
+    if(body != NULL) {
+	if(biowrite(uc->bio, body->b, body->d) != body->d)
+	    return(NULL);
+    } else if(dlen > 0) {
+	if(passdata(cl, uc->bio, dlen) != dlen)
+	    return(NULL);
+    } else if(chunked) {
+	if(passchunks(cl, uc->bio))
+	    return(NULL);
+    }
+    if(bioflush(uc->bio))
+	return(NULL);
+    while(1) {
+	if((resp = parseresponseb(uc->bio)) == NULL)
+	    return(NULL);
+	if(resp->code >= 200)
+	    return(resp);
+	/* Interim responses have no use for the client. */
+	freehthead(resp);
+    }
+}
+
+/* RFC 9110, section 9.2.2 */
+static int idempotent(char *method)
+{
+    static char *methods[] = {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE", NULL};
+    int i;
+    
+    for(i = 0; methods[i] != NULL; i++) {
+	if(!strcasecmp(method, methods[i]))
+	    return(1);
+    }
+    return(0);
+}
+
+static int keepalive(struct hthead *resp)
+{
+    char *hd;
+    
+    hd = getheader(resp, "connection");
+    if(!strcasecmp(resp->ver, "HTTP/1.1"))
+	return((hd == NULL) || strcasecmp(hd, "close"));
+    if(!strcasecmp(resp->ver, "HTTP/1.0"))
+	return((hd != NULL) && !strcasecmp(hd, "keep-alive"));
+    return(0);
+}
+
+static void serve(struct muth *muth, va_list args)
+{
+    vavar(struct hthead *, req);
+    vavar(int, fd);
+    struct bufio *cl;
+    struct charbuf head, body;
+    struct backend *be;
+    struct upconn *uc;
+    struct hthead *resp;
+    char *hd;
+    off_t dlen, n;
+    int tries, reused, chunked, replay, keep;
+    uintmax_t t;
+    
+    cl = mtbioopen(fd, 1, 600, "r+", NULL);
+    bufinit(head);
+    bufinit(body);
+    uc = NULL;
+    resp = NULL;
+    /* Request bodies are passed by htparser under the same conditions
+     * as these. */
+    dlen = -1;
+    chunked = 0;
+    if(getheader(req, "content-type") != NULL) {
+	if((hd = getheader(req, "content-length")) != NULL)
+	    dlen = atoo(hd);
+	else if(((hd = getheader(req, "transfer-encoding")) != NULL) && !strcasecmp(hd, "chunked"))
+	    chunked = 1;
+    }
+    replay = (dlen <= 0) && !chunked;
+    if(bufbody && !replay) {
+	if((n = readbody(cl, &body)) != 0) {
+	    if(n > 0)
+		simpleerror(fd, 413, "Request Entity Too Large", "The request body is larger than the server is willing to accept.");
+	    goto out;
+	}
+	if((dlen >= 0) && (body.d != dlen))
+	    goto out;
+	dlen = body.d;
+	chunked = 0;
+	replay = 1;
+    }
+    replay = replay && idempotent(req->method);
+    mkhead(req, &head);
+    if(dlen >= 0)
+	bprintf(&head, "Content-Length: %ji\r\n", (intmax_t)dlen);
+    else if(chunked)
+	bufcatstr(head, "Transfer-Encoding: chunked\r\n");
+    bufcatstr(head, "\r\n");
+    
+    tries = 0;
+    while(1) {
+	if((be = pickbe()) == NULL) {
+	    statinc(st_errors, 1);
+	    simpleerror(fd, 503, "Service Unavailable", "No backend server is available to handle the request.");
+	    goto out;
+	}
+	reused = 1;
+	if((uc = takeconn(be)) == NULL) {
+	    reused = 0;
+	    if((uc = newconn(be, 600)) == NULL) {
+		markdown(be, strerror(errno));
+		if(++tries < nbackends)
+		    continue;
+		statinc(st_errors, 1);
+		simpleerror(fd, 502, "Bad Gateway", "Could not connect to any backend server.");
+		goto out;
+	    }
+	}
+	be->active++;
+	t = statnow();
+	resp = exchange(uc, &head, cl, (body.d > 0) ? &body : NULL, dlen, chunked);
+	if(resp != NULL)
+	    break;
+	be->active--;
+	closeconn(uc);
+	uc = NULL;
+	/* A pooled connection may have been closed by the backend just
+	 * as it was taken, but it may also have failed after the
+	 * backend had acted on the request, so only requests that may
+	 * safely be repeated are tried again. */
+	if(!reused || !replay) {
+	    statinc(st_errors, 1);
+	    simpleerror(fd, 502, "Bad Gateway", "The backend server did not respond properly.");
+	    goto out;
+	}
+    }
+    stathadd(st_ttfb, statnow() - t);
+    
+    keep = keepalive(resp);
+    headrmheader(resp, "connection");
+    headrmheader(resp, "keep-alive");
+    headrmheader(resp, "proxy-connection");
+    if(!strcasecmp(req->method, "head") || (resp->code == 204) || (resp->code == 304)) {
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+    } else if(((hd = getheader(resp, "transfer-encoding")) != NULL) && !strcasecmp(hd, "chunked")) {
+	/* htparser chunks the response anew as necessary. */
+	headrmheader(resp, "transfer-encoding");
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if((n = recvchunks(uc->bio, cl)) < 0)
+	    keep = 0;
+	else
+	    statinc(st_bytes, n);
+    } else if((hd = getheader(resp, "content-length")) != NULL) {
+	dlen = atoo(hd);
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if((n = passdata(uc->bio, cl, dlen)) != dlen)
+	    keep = 0;
+	else
+	    statinc(st_bytes, n);
+    } else {
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if((n = passdata(uc->bio, cl, -1)) > 0)
+	    statinc(st_bytes, n);
+	keep = 0;
+    }
+    bioflush(cl);
+    be->active--;
+    if(keep)
+	putconn(uc);
+    else
+	closeconn(uc);
+    
+out:
+    if(resp != NULL)
+	freehthead(resp);
+    buffree(head);
+    buffree(body);
+    freehthead(req);
+    bioclose(cl);
+}
+
+static void listenloop(struct muth *muth, va_list args)
+{
+    vavar(int, lfd);
+    int fd, i;
+    struct hthead *req;
+    
+    while(1) {
+	block(0, EV_READ, 0);
+	if((fd = recvreq(lfd, &req)) < 0) {
+	    if(errno != 0)
+		flog(LOG_ERR, "recvreq: %s", strerror(errno));
+	    break;
+	}
+	statinc(st_reqs, 1);
+	mustart(serve, req, fd);
+    }
+    running = 0;
+    for(i = 0; i < nbackends; i++) {
+	if(backends[i].check != NULL)
+	    resume(backends[i].check, 0);
+	while(backends[i].idle != NULL)
+	    resume(backends[i].idle->watch, 0);
+    }
+    if(statmuth != NULL)
+	resume(statmuth, 0);
+}
+
+static void addbackend(char *spec)
+{
+    struct backend *be;
+    struct addrinfo *ai, h;
+    char *name, *srv, *p;
+    int ret;
+    
+    if((p = strrchr(spec, ':')) != NULL) {
+	name = smalloc(p - spec + 1);
+	memcpy(name, spec, p - spec);
+	name[p - spec] = 0;
+	srv = p + 1;
+    } else {
+	name = sstrdup("localhost");
+	srv = spec;
+    }
+    if((name[0] == '[') && (name[strlen(name) - 1] == ']')) {
+	memmove(name, name + 1, strlen(name) - 2);
+	name[strlen(name) - 2] = 0;
+    }
+    memset(&h, 0, sizeof(h));
+    h.ai_family = AF_UNSPEC;
+    h.ai_socktype = SOCK_STREAM;
+    if((ret = getaddrinfo(name, srv, &h, &ai)) != 0) {
+	flog(LOG_ERR, "callhttp: could not resolve backend `%s': %s", spec, gai_strerror(ret));
+	exit(1);
+    }
+    be = &backends[nbackends++];
+    memset(be, 0, sizeof(*be));
+    be->spec = spec;
+    be->host = (p == NULL) ? sprintf2("localhost:%s", srv) : spec;
+    memcpy(&be->addr, ai->ai_addr, be->alen = ai->ai_addrlen);
+    be->up = 1;
+    freeaddrinfo(ai);
+    free(name);
+}
+
+static size_t parsesize(char *arg)
+{
+    char *p;
+    size_t ret;
+    
+    ret = strtoul(arg, &p, 10);
+    switch(*p) {
+    case 'g': case 'G':
+	ret <<= 10;
+    case 'm': case 'M':
+	ret <<= 10;
+    case 'k': case 'K':
+	ret <<= 10;
+    }
+    return(ret);
+}
+
+static void sigexit(int sig)
+{
+    shutdown(0, SHUT_RDWR);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: callhttp [-hbr] [-B MAXBODY] [-n MAXIDLE] [-H HEALTH-PATH] [-i INTERVAL] [HOST:]PORT...\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i;
+    
+    while((c = getopt(argc, argv, "+hbrB:n:H:i:")) >= 0) {
+	switch(c) {
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	case 'b':
+	    bufbody = 1;
+	    break;
+	case 'r':
+	    userest = 1;
+	    break;
+	case 'B':
+	    bufbody = 1;
+	    maxbody = parsesize(optarg);
+	    break;
+	case 'n':
+	    maxidle = atoi(optarg);
+	    break;
+	case 'H':
+	    hpath = optarg;
+	    break;
+	case 'i':
+	    if((interval = atoi(optarg)) < 1) {
+		usage(stderr);
+		exit(1);
+	    }
+	    break;
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    backends = szmalloc(sizeof(*backends) * (argc - optind));
+    for(i = optind; i < argc; i++)
+	addbackend(argv[i]);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sigexit);
+    signal(SIGTERM, sigexit);
+    st_reqs = statcnt("requests");
+    st_errors = statcnt("errors");
+    st_bytes = statcnt("bytes");
+    st_reused = statcnt("reused");
+    st_connect = stathist("connect");
+    st_ttfb = stathist("ttfb");
+    statmuth = mtstatserve(statinit("callhttp"));
+    for(i = 0; i < nbackends; i++)
+	backends[i].check = mustart(healthcheck, &backends[i]);
+    mustart(listenloop, 0);
+    ioloop();
+    return(0);
+}
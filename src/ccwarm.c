@@ -0,0 +1,99 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+
+#include "compress.h"
+
+static int verbose = 0;
+
+static void warm(char *path)
+{
+    struct stat sb;
+    DIR *dp;
+    struct dirent *ent;
+    char *sub;
+    
+    if(stat(path, &sb)) {
+	flog(LOG_WARNING, "ccwarm: %s: %s", path, strerror(errno));
+	return;
+    }
+    if(S_ISDIR(sb.st_mode)) {
+	if((dp = opendir(path)) == NULL) {
+	    flog(LOG_WARNING, "ccwarm: %s: %s", path, strerror(errno));
+	    return;
+	}
+	while((ent = readdir(dp)) != NULL) {
+	    if(ent->d_name[0] == '.')
+		continue;
+	    sub = sprintf2("%s/%s", path, ent->d_name);
+	    warm(sub);
+	    free(sub);
+	}
+	closedir(dp);
+    } else if(S_ISREG(sb.st_mode)) {
+	if(verbose)
+	    printf("%s\n", path);
+	if(ccwarm(path))
+	    flog(LOG_WARNING, "ccwarm: %s: could not compress: %s", path, strerror(errno));
+    }
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: ccwarm [-hv] PATH...\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i;
+    
+    while((c = getopt(argc, argv, "hv")) >= 0) {
+	switch(c) {
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    for(i = optind; i < argc; i++)
+	warm(argv[i]);
+    ccclean();
+    return(0);
+}
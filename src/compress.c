@@ -17,6 +17,7 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -24,9 +25,9 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
-#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -36,11 +37,40 @@
 
 #include "compress.h"
 
+/*
+ * Compressed variants of files are kept in a per-user cache
+ * directory, named by the device, inode, modification time and size
+ * of the source file, so that a cache entry never needs to be
+ * checked for staleness. Every entry created is recorded in an
+ * index file, which is what the periodic cleaning goes through
+ * instead of scanning the whole directory.
+ *
+ * Missing entries are created by a detached background process, so
+ * that the client asking for them is not kept waiting; it is served
+ * the uncompressed file in the meantime.
+ */
+
 struct etype {
-    char *name;
+    char *name, *alias;
     int (*compress)(int, int);
 };
 
+struct accept {
+    char *name;
+    double q;
+};
+
+struct acceptbuf {
+    struct accept *b;
+    size_t s, d;
+};
+
+struct ccent {
+    uintmax_t dev, ino, mtime, size;
+    int n;
+    char *name;
+};
+
 static char *cachedir(void)
 {
     static char *ret = NULL;
@@ -50,22 +80,34 @@ static char *cachedir(void)
     return(ret);
 }
 
+static int writeall(int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+    size_t w;
+    
+    for(w = 0; w < len; w += ret) {
+	if((ret = write(fd, buf + w, len - w)) < 0)
+	    return(-1);
+    }
+    return(0);
+}
+
 #ifdef HAVE_ZLIB
 
 #include <zlib.h>
 
-static int deflatefile(int dfd, int sfd)
+static int zcompress(int dfd, int sfd, int wbits)
 {
-    int rv, zr, b, w;
+    int rv, zr;
     char *ib, *ob;
     z_stream zs;
     
     ib = smalloc(65536);
     ob = smalloc(65536);
     memset(&zs, 0, sizeof(zs));
-    deflateInit(&zs, 9);
+    deflateInit2(&zs, 9, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY);
     while(1) {
-	rv = read(sfd, ib, 6553);
+	rv = read(sfd, ib, 65536);
 	if(rv < 0)
 	    goto out;
 	if(rv == 0)
@@ -79,11 +121,8 @@ static int deflatefile(int dfd, int sfd)
 		rv = -1;
 		goto out;
 	    }
-	    for(w = 0, b = (char *)zs.next_out - ob; w < b; w += rv) {
-		rv = write(dfd, ob + w, b - w);
-		if(rv < 0)
-		    goto out;
-	    }
+	    if((rv = writeall(dfd, ob, (char *)zs.next_out - ob)) < 0)
+		goto out;
 	}
     }
     zs.next_in = (Bytef *)ib;
@@ -96,11 +135,8 @@ static int deflatefile(int dfd, int sfd)
 	    rv = -1;
 	    goto out;
 	}
-	for(w = 0, b = (char *)zs.next_out - ob; w < b; w += rv) {
-	    rv = write(dfd, ob + w, b - w);
-	    if(rv < 0)
-		goto out;
-	}
+	if((rv = writeall(dfd, ob, (char *)zs.next_out - ob)) < 0)
+	    goto out;
     } while(zr != Z_STREAM_END);
     rv = 0;
 out:
@@ -111,29 +147,244 @@ out:
     return(rv);
 }
 
+static int deflatefile(int dfd, int sfd)
+{
+    return(zcompress(dfd, sfd, 15));
+}
+
+static int gzipfile(int dfd, int sfd)
+{
+    return(zcompress(dfd, sfd, 15 + 16));
+}
+
 static struct etype t_gz = {
+    .name = "gzip", .alias = "x-gzip",
+    .compress = gzipfile,
+};
+
+static struct etype t_zl = {
     .name = "deflate",
     .compress = deflatefile,
 };
 
 #endif
 
+#ifdef HAVE_BROTLI
+
+#include <brotli/encode.h>
+
+static int brotlifile(int dfd, int sfd)
+{
+    int rv, eof;
+    uint8_t *ib, *ob;
+    const uint8_t *ip;
+    uint8_t *op;
+    size_t ia, oa;
+    BrotliEncoderState *bs;
+    
+    if((bs = BrotliEncoderCreateInstance(NULL, NULL, NULL)) == NULL)
+	return(-1);
+    BrotliEncoderSetParameter(bs, BROTLI_PARAM_QUALITY, BROTLI_MAX_QUALITY);
+    ib = smalloc(65536);
+    ob = smalloc(65536);
+    ip = ib;
+    ia = 0;
+    eof = 0;
+    while(!BrotliEncoderIsFinished(bs)) {
+	if((ia == 0) && !eof) {
+	    if((rv = read(sfd, ib, 65536)) < 0)
+		goto out;
+	    ip = ib;
+	    ia = rv;
+	    eof = (rv == 0);
+	}
+	op = ob;
+	oa = 65536;
+	if(!BrotliEncoderCompressStream(bs, eof ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS, &ia, &ip, &oa, &op, NULL)) {
+	    rv = -1;
+	    goto out;
+	}
+	if((rv = writeall(dfd, ob, op - ob)) < 0)
+	    goto out;
+    }
+    rv = 0;
+out:
+    free(ib);
+    free(ob);
+    BrotliEncoderDestroyInstance(bs);
+    lseek(sfd, 0, SEEK_SET);
+    return(rv);
+}
+
+static struct etype t_br = {
+    .name = "br",
+    .compress = brotlifile,
+};
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+static int zstdfile(int dfd, int sfd)
+{
+    int rv;
+    size_t zr;
+    char *ib, *ob;
+    ZSTD_CCtx *zc;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    
+    if((zc = ZSTD_createCCtx()) == NULL)
+	return(-1);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel, 19);
+    ib = smalloc(65536);
+    ob = smalloc(65536);
+    while(1) {
+	if((rv = read(sfd, ib, 65536)) < 0)
+	    goto out;
+	in = (ZSTD_inBuffer){.src = ib, .size = rv, .pos = 0};
+	do {
+	    out = (ZSTD_outBuffer){.dst = ob, .size = 65536, .pos = 0};
+	    zr = ZSTD_compressStream2(zc, &out, &in, (rv == 0) ? ZSTD_e_end : ZSTD_e_continue);
+	    if(ZSTD_isError(zr)) {
+		rv = -1;
+		goto out;
+	    }
+	    if(writeall(dfd, ob, out.pos) < 0) {
+		rv = -1;
+		goto out;
+	    }
+	} while((rv == 0) ? (zr != 0) : (in.pos < in.size));
+	if(rv == 0)
+	    break;
+    }
+    rv = 0;
+out:
+    free(ib);
+    free(ob);
+    ZSTD_freeCCtx(zc);
+    lseek(sfd, 0, SEEK_SET);
+    return(rv);
+}
+
+static struct etype t_zs = {
+    .name = "zstd",
+    .compress = zstdfile,
+};
+
+#endif
+
 static struct etype *types[] = {
+#ifdef HAVE_BROTLI
+    &t_br,
+#endif
+#ifdef HAVE_ZSTD
+    &t_zs,
+#endif
 #ifdef HAVE_ZLIB
     &t_gz,
+    &t_zl,
 #endif
     NULL,
 };
 
-static struct etype *findtype(char *name)
+static char *entryname(struct etype *type, struct stat *info)
 {
-    int i;
+    return(sprintf3("%jx:%jx:%jx:%jx:%s", (uintmax_t)info->st_dev, (uintmax_t)info->st_ino,
+		    (uintmax_t)info->st_mtime, (uintmax_t)info->st_size, type->name));
+}
+
+static int entcmp(const void *ap, const void *bp)
+{
+    const struct ccent *a = ap, *b = bp;
     
-    for(i = 0; types[i] != NULL; i++) {
-	if(!strcmp(name, types[i]->name))
-	    return(types[i]);
+    if(a->dev != b->dev)
+	return((a->dev < b->dev) ? -1 : 1);
+    if(a->ino != b->ino)
+	return((a->ino < b->ino) ? -1 : 1);
+    if(a->mtime != b->mtime)
+	return((a->mtime < b->mtime) ? -1 : 1);
+    return(a->n - b->n);
+}
+
+/*
+ * Goes through the index, removing entries that have either been
+ * superseded by entries for a newer version of the same file, or
+ * that have not been used in two days.
+ */
+static void cleanindex(time_t now)
+{
+    char *ipath, *opath, *path;
+    char line[1024];
+    FILE *in;
+    int i, j, fd;
+    struct stat sb;
+    typedbuf(struct ccent) ents;
+    struct ccent ent;
+    size_t len;
+    
+    ipath = sprintf2("%s/index", cachedir());
+    opath = sprintf2("%s/index.old", cachedir());
+    bufinit(ents);
+    in = NULL;
+    fd = -1;
+    /* New entries will be appended to a new index while the old
+     * one is being cleaned. */
+    if(rename(ipath, opath))
+	goto out;
+    if((in = fopen(opath, "r")) == NULL)
+	goto out;
+    while(fgets(line, sizeof(line), in) != NULL) {
+	if(((len = strlen(line)) < 1) || (line[len - 1] != '\n'))
+	    continue;
+	line[len - 1] = 0;
+	if(strchr(line, '/') || (sscanf(line, "%jx:%jx:%jx:%jx:", &ent.dev, &ent.ino, &ent.mtime, &ent.size) != 4))
+	    continue;
+	ent.n = ents.d;
+	ent.name = sstrdup(line);
+	bufadd(ents, ent);
+    }
+    qsort(ents.b, ents.d, sizeof(*ents.b), entcmp);
+    if((fd = open(ipath, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0)
+	goto out;
+    for(i = 0; i < ents.d; i++) {
+	for(j = i + 1; j < ents.d; j++) {
+	    if(!strcmp(ents.b[i].name, ents.b[j].name))
+		break;
+	    if((ents.b[j].dev != ents.b[i].dev) || (ents.b[j].ino != ents.b[i].ino))
+		break;
+	    if(ents.b[j].mtime > ents.b[i].mtime)
+		break;
+	}
+	path = sprintf3("%s/%s", cachedir(), ents.b[i].name);
+	if((j < ents.d) && !strcmp(ents.b[i].name, ents.b[j].name))
+	    continue;
+	if((j < ents.d) && (ents.b[j].dev == ents.b[i].dev) && (ents.b[j].ino == ents.b[i].ino)) {
+	    unlink(path);
+	    continue;
+	}
+	if(stat(path, &sb))
+	    continue;
+	if(now - sb.st_atime > 3600 * 48) {
+	    unlink(path);
+	    continue;
+	}
+	writeall(fd, sprintf3("%s\n", ents.b[i].name), strlen(ents.b[i].name) + 1);
     }
-    return(NULL);
+    unlink(opath);
+    
+out:
+    if(fd >= 0)
+	close(fd);
+    if(in != NULL)
+	fclose(in);
+    for(i = 0; i < ents.d; i++)
+	free(ents.b[i].name);
+    buffree(ents);
+    free(ipath);
+    free(opath);
 }
 
 static void checkclean(void)
@@ -141,8 +392,6 @@ static void checkclean(void)
     char *path;
     int fd;
     struct stat sb;
-    DIR *dp;
-    struct dirent *ent;
     time_t now;
     
     if(stat(sprintf3("%s/lastclean", cachedir()), &sb))
@@ -162,133 +411,292 @@ static void checkclean(void)
     }
     close(fd);
     if((fd = open(sprintf3("%s/lastclean", cachedir()), O_WRONLY | O_CREAT, 0600)) >= 0) {
-	futimes(fd, NULL);;
+	futimes(fd, NULL);
 	close(fd);
     }
-    if((dp = opendir(cachedir())) == NULL)
-	return;
-    while((ent = readdir(dp)) != NULL) {
-	if((ent->d_name[0] == '.') || !strcmp(ent->d_name, "cleaning") || !strcmp(ent->d_name, "lastclean"))
-	    continue;
-	path = sprintf3("%s/%s", cachedir(), ent->d_name);
-	if(stat(path, &sb))
-	    continue;
-	if(now - sb.st_atime > 3600 * 48)
-	    unlink(path);
-    }
-    closedir(dp);
+    cleanindex(now);
     unlink(sprintf3("%s/cleaning", cachedir()));
 }
 
-static int openbytype(struct etype *type, int ofd, struct stat *info, struct stat *oinfo)
+static int openbytype(struct etype *type, struct stat *info, struct stat *oinfo)
 {
-    char *epath, *npath;
     int fd;
+    char *path;
     
-    npath = NULL;
-    epath = sprintf2("%s/%jx:%jx:%s", cachedir(), (uintmax_t)info->st_dev, (uintmax_t)info->st_ino, type->name);
-    if((fd = open(epath, O_RDONLY)) >= 0) {
-	if(fstat(fd, oinfo))
-	    goto error;
-	if(oinfo->st_mtime >= info->st_mtime)
-	    goto out;
+    path = sprintf2("%s/%s", cachedir(), entryname(type, info));
+    fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+	return(-1);
+    if(fstat(fd, oinfo)) {
 	close(fd);
-	fd = -1;
+	return(-1);
     }
-    npath = sprintf2("%s/tmp-%ji", cachedir(), (intmax_t)getpid());
-    if((fd = open(npath, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
-	if(errno != ENOENT)
-	    goto error;
-	if(!mkdir(cachedir(), 0700)) {
-	    if((fd = open(sprintf3("%s/lastclean", cachedir()), O_WRONLY, O_CREAT, O_TRUNC, 0600)) < 0)
-		goto error;
-	    close(fd);
+    return(fd);
+}
+
+/*
+ * Claims the creation of the cache entry for the given type, by
+ * exclusively creating the temporary file it is written to, which
+ * also tells other processes that it is in progress. Returns the
+ * file descriptor of the temporary file, -2 if the entry already
+ * exists or is being created by someone else, or -1 on errors.
+ */
+static int claimentry(struct etype *type, struct stat *info)
+{
+    char *name, *epath, *npath;
+    int fd, rv;
+    struct stat sb;
+    
+    name = sstrdup(entryname(type, info));
+    epath = sprintf2("%s/%s", cachedir(), name);
+    npath = sprintf2("%s/tmp-%s", cachedir(), name);
+    rv = -1;
+    if(!access(epath, F_OK)) {
+	rv = -2;
+	goto out;
+    }
+    if((fd = open(npath, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+	if(errno == ENOENT) {
+	    if(!mkdir(cachedir(), 0700)) {
+		if((fd = open(sprintf3("%s/lastclean", cachedir()), O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		    goto out;
+		close(fd);
+	    }
+	} else if(errno == EEXIST) {
+	    /* Someone else is already compressing it, unless that
+	     * someone has died doing so. */
+	    if(stat(npath, &sb) || (time(NULL) - sb.st_mtime < 3600)) {
+		rv = -2;
+		goto out;
+	    }
+	    unlink(npath);
+	} else {
+	    goto out;
 	}
-	if((fd = open(npath, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
-	    goto error;
+	if((fd = open(npath, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+	    goto out;
     }
-    if(type->compress(fd, ofd)) {
+    rv = fd;
+    
+out:
+    free(name);
+    free(epath);
+    free(npath);
+    return(rv);
+}
+
+/* Gives up a claim made by claimentry() without creating the entry. */
+static void dropentry(struct etype *type, int fd, struct stat *info)
+{
+    char *npath;
+    
+    close(fd);
+    npath = sprintf2("%s/tmp-%s", cachedir(), entryname(type, info));
+    unlink(npath);
+    free(npath);
+}
+
+/* Compresses the source file into a temporary file claimed by
+ * claimentry(), and moves it into place. */
+static int fillentry(struct etype *type, int fd, int sfd, struct stat *info)
+{
+    char *name, *epath, *npath;
+    int rv;
+    
+    name = sstrdup(entryname(type, info));
+    epath = sprintf2("%s/%s", cachedir(), name);
+    npath = sprintf2("%s/tmp-%s", cachedir(), name);
+    rv = -1;
+    if(type->compress(fd, sfd)) {
+	close(fd);
 	unlink(npath);
-	goto error;
+	goto out;
     }
+    close(fd);
     if(rename(npath, epath)) {
 	unlink(npath);
-	goto error;
+	goto out;
     }
-    fstat(fd, oinfo);
-    lseek(fd, 0, SEEK_SET);
-    checkclean();
-    goto out;
-    
-error:
-    if(fd >= 0) {
+    if((fd = open(sprintf3("%s/index", cachedir()), O_WRONLY | O_APPEND | O_CREAT, 0600)) >= 0) {
+	writeall(fd, sprintf3("%s\n", name), strlen(name) + 1);
 	close(fd);
-	fd = -1;
     }
+    rv = 0;
+    
 out:
+    free(name);
     free(epath);
-    if(npath)
-	free(npath);
-    return(fd);
+    free(npath);
+    return(rv);
 }
 
-static void parsetypes(struct charvbuf *dst, char *head)
+/*
+ * Creates the cache entry for the given type synchronously. Returns
+ * zero if the entry exists afterwards, or is being created by
+ * another process.
+ */
+static int mkentry(struct etype *type, int sfd, struct stat *info)
 {
-    char *p;
+    int fd;
+    
+    if((fd = claimentry(type, info)) < 0)
+	return((fd == -2) ? 0 : -1);
+    return(fillentry(type, fd, sfd, info));
+}
+
+/*
+ * Starts a detached process to create the missing entries. Entries
+ * are claimed before forking, so that a file requested by many
+ * clients at once is only compressed by one process, and no process
+ * is started at all when all of them are already in progress.
+ */
+static void bgcompress(char *path, struct stat *info, struct etype **missing, int n)
+{
+    pid_t pid;
+    int i, o, fd, status;
+    int fds[n];
+    struct etype *claimed[n];
+    struct stat sb;
+    
+    for(i = o = 0; i < n; i++) {
+	if((fds[o] = claimentry(missing[i], info)) >= 0)
+	    claimed[o++] = missing[i];
+    }
+    if((n = o) == 0)
+	return;
+    if((pid = fork()) < 0) {
+	for(i = 0; i < n; i++)
+	    dropentry(claimed[i], fds[i], info);
+	return;
+    }
+    if(pid != 0) {
+	for(i = 0; i < n; i++)
+	    close(fds[i]);
+	waitpid(pid, &status, 0);
+	return;
+    }
+    /* Detach fully, so that the requesting handler is neither kept
+     * waiting nor left with a child to reap, and so that no client
+     * connections are kept open by the compressor. */
+    if(fork() != 0)
+	_exit(0);
+    setsid();
+    for(i = getdtablesize() - 1; i >= 0; i--) {
+	for(o = 0; (o < n) && (fds[o] != i); o++);
+	if((i != 2) && (o == n))
+	    close(i);
+    }
+    if((fd = open("/dev/null", O_RDWR)) >= 0) {
+	dup2(fd, 0);
+	dup2(fd, 1);
+	if(fd > 2)
+	    close(fd);
+    }
+    if(((fd = open(path, O_RDONLY)) < 0) ||
+       fstat(fd, &sb) || (sb.st_dev != info->st_dev) || (sb.st_ino != info->st_ino) ||
+       (sb.st_mtime != info->st_mtime) || (sb.st_size != info->st_size)) {
+	for(i = 0; i < n; i++)
+	    dropentry(claimed[i], fds[i], info);
+	_exit(1);
+    }
+    for(i = 0; i < n; i++)
+	fillentry(claimed[i], fds[i], fd, &sb);
+    checkclean();
+    _exit(0);
+}
+
+static void parsetypes(struct acceptbuf *dst, char *head)
+{
+    char *p, *e;
     struct charbuf type;
+    double q;
     
     p = head;
     while(*p) {
 	for(; *p && isspace(*p); p++);
 	for(bufinit(type); *p && (*p != ',') && (*p != ';') && !isspace(*p); p++)
 	    bufadd(type, *p);
+	q = 1;
+	while(*p && (*p != ',')) {
+	    for(; *p && ((*p == ';') || isspace(*p)); p++);
+	    if(((p[0] == 'q') || (p[0] == 'Q')) && (p[1] == '=')) {
+		q = strtod(p + 2, &e);
+		p = (e == p + 2) ? (p + 2) : e;
+	    }
+	    for(; *p && (*p != ',') && (*p != ';'); p++);
+	}
 	if(type.b) {
 	    bufadd(type, 0);
-	    bufadd(*dst, type.b);
+	    bufadd(*dst, ((struct accept){.name = type.b, .q = q}));
 	}
-	for(; *p && (*p != ','); p++);
 	if(*p)
 	    p++;
     }
 }
 
+static double typeq(struct acceptbuf *acc, struct etype *type)
+{
+    int i;
+    double wq;
+    
+    wq = 0;
+    for(i = 0; i < acc->d; i++) {
+	if(!strcasecmp(acc->b[i].name, type->name) || (type->alias && !strcasecmp(acc->b[i].name, type->alias)))
+	    return(acc->b[i].q);
+	if(!strcmp(acc->b[i].name, "*"))
+	    wq = acc->b[i].q;
+    }
+    return(wq);
+}
+
 int ccopen(char *path, struct stat *sb, char *accept, const char **encoding)
 {
-    int i, fd, efd, mfd;
+    int i, n, fd, efd, mfd;
     off_t minsz;
-    struct charvbuf types;
-    struct etype *type, *mtype;
+    double q, mq;
+    struct acceptbuf acc;
+    struct etype *mtype, *missing[sizeof(types) / sizeof(*types)];
     struct stat esb, msb;
     
     *encoding = NULL;
-    bufinit(types);
+    bufinit(acc);
     mfd = -1;
+    mq = 0;
+    minsz = 0;
+    mtype = NULL;
+    n = 0;
     if((fd = open(path, O_RDONLY)) < 0)
 	return(-1);
     if(fstat(fd, sb))
 	goto error;
     if(accept == NULL)
 	goto out;
-    parsetypes(&types, accept);
-    for(i = 0; i < types.d; i++) {
-	if((type = findtype(types.b[i])) != NULL) {
-	    if((efd = openbytype(type, fd, sb, &esb)) >= 0) {
-		if((esb.st_size < sb->st_size) && ((mfd < 0) || (esb.st_size < minsz))) {
-		    if(mfd >= 0)
-			close(mfd);
-		    mfd = efd;
-		    minsz = esb.st_size;
-		    msb = esb;
-		    msb.st_atime = sb->st_atime;
-		    msb.st_mtime = sb->st_mtime;
-		    msb.st_ctime = sb->st_ctime;
-		    mtype = type;
-		} else {
-		    close(efd);
-		}
-	    }
+    parsetypes(&acc, accept);
+    for(i = 0; types[i] != NULL; i++) {
+	if((q = typeq(&acc, types[i])) <= 0)
+	    continue;
+	if((efd = openbytype(types[i], sb, &esb)) < 0) {
+	    missing[n++] = types[i];
+	    continue;
+	}
+	if((esb.st_size < sb->st_size) && ((mfd < 0) || (q > mq) || ((q == mq) && (esb.st_size < minsz)))) {
+	    if(mfd >= 0)
+		close(mfd);
+	    mfd = efd;
+	    mq = q;
+	    minsz = esb.st_size;
+	    msb = esb;
+	    msb.st_atime = sb->st_atime;
+	    msb.st_mtime = sb->st_mtime;
+	    msb.st_ctime = sb->st_ctime;
+	    mtype = types[i];
+	} else {
+	    close(efd);
 	}
     }
+    if(n > 0)
+	bgcompress(path, sb, missing, n);
     if(mfd < 0)
 	goto out;
     close(fd);
@@ -303,8 +711,33 @@ error:
 out:
     if(mfd >= 0)
 	close(mfd);
-    for(i = 0; i < types.d; i++)
-	free(types.b[i]);
-    buffree(types);
+    for(i = 0; i < acc.d; i++)
+	free(acc.b[i].name);
+    buffree(acc);
     return(fd);
 }
+
+int ccwarm(char *path)
+{
+    int i, fd, rv;
+    struct stat sb;
+    
+    if((fd = open(path, O_RDONLY)) < 0)
+	return(-1);
+    rv = 0;
+    if(fstat(fd, &sb)) {
+	rv = -1;
+    } else {
+	for(i = 0; types[i] != NULL; i++) {
+	    if(mkentry(types[i], fd, &sb))
+		rv = -1;
+	}
+    }
+    close(fd);
+    return(rv);
+}
+
+void ccclean(void)
+{
+    checkclean();
+}
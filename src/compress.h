@@ -2,5 +2,7 @@
 #define SENDFILE_COMPRESS_H
 
 int ccopen(char *path, struct stat *sb, char *accept, const char **encoding);
+int ccwarm(char *path);
+void ccclean(void);
 
 #endif
@@ -34,8 +34,154 @@
 
 #include "dirplex.h"
 
+/*
+ * Each configuration's match declarations are indexed when it is
+ * read: a declaration with a `filename' rule whose patterns are all
+ * either of the form `*.EXT' or literal file names is filed under each
+ * of those extensions or names, and all others are kept in a residual
+ * list for their type. Matching a file then only has to consider the
+ * declarations filed under the extensions and name of the file, and
+ * the residual ones.
+ *
+ * Furthermore, a declaration whose only name-dependent rules are
+ * `filename' rules of extension patterns matches the same way for
+ * every file with the same extensions in the same directory, so the
+ * best such match is cached per directory, type and extension, until
+ * any configuration file is reloaded.
+ */
+
+struct strent {
+    struct strent *next;
+    char *key;
+    unsigned int hash;
+    void *val;
+};
+
+struct patlist {
+    struct pattern **b;
+    size_t s, d;
+};
+
+struct match {
+    struct pattern *pat;
+    int level;
+};
+
+struct extmatch {
+    struct match nd, d;
+    typedbuf(struct match) dyn;
+};
+
+struct dircache {
+    struct config **cfs;
+    int ncfs, gen;
+    time_t lastck;
+    struct strtab ext;
+};
+
 static struct config *cflist;
 struct config *gconfig, *lconfig;
+static struct strtab dircaches;
+static int cfgen = 0;
+
+static unsigned int strhash(char *key)
+{
+    unsigned int hash;
+    
+    for(hash = 0; *key; key++)
+	hash = (hash * 31) + (unsigned char)*key;
+    return(hash);
+}
+
+void **stslot(struct strtab *t, char *key, int create)
+{
+    struct strent *e, *n, **nb;
+    unsigned int hash, m;
+    int i, nl;
+    
+    hash = strhash(key);
+    if(t->b != NULL) {
+	for(e = t->b[hash & ((1 << t->hlen) - 1)]; e != NULL; e = e->next) {
+	    if((e->hash == hash) && !strcmp(e->key, key))
+		return(&e->val);
+	}
+    }
+    if(!create)
+	return(NULL);
+    if(t->b == NULL) {
+	t->hlen = 4;
+	t->b = szmalloc(sizeof(*t->b) * (1 << t->hlen));
+    } else if(t->n >= (1 << t->hlen)) {
+	nl = t->hlen + 1;
+	nb = szmalloc(sizeof(*nb) * (1 << nl));
+	m = (1 << nl) - 1;
+	for(i = 0; i < (1 << t->hlen); i++) {
+	    for(e = t->b[i]; e != NULL; e = n) {
+		n = e->next;
+		e->next = nb[e->hash & m];
+		nb[e->hash & m] = e;
+	    }
+	}
+	free(t->b);
+	t->b = nb;
+	t->hlen = nl;
+    }
+    omalloc(e);
+    e->key = sstrdup(key);
+    e->hash = hash;
+    m = (1 << t->hlen) - 1;
+    e->next = t->b[hash & m];
+    t->b[hash & m] = e;
+    t->n++;
+    return(&e->val);
+}
+
+void *stget(struct strtab *t, char *key)
+{
+    void **v;
+    
+    if((v = stslot(t, key, 0)) == NULL)
+	return(NULL);
+    return(*v);
+}
+
+void stfree(struct strtab *t, void (*ffunc)(void *))
+{
+    struct strent *e;
+    int i;
+    
+    if(t->b == NULL)
+	return;
+    for(i = 0; i < (1 << t->hlen); i++) {
+	while((e = t->b[i]) != NULL) {
+	    t->b[i] = e->next;
+	    ffunc(e->val);
+	    free(e->key);
+	    free(e);
+	}
+    }
+    free(t->b);
+    memset(t, 0, sizeof(*t));
+}
+
+static void freepatlist(void *pl)
+{
+    buffree(*(struct patlist *)pl);
+    free(pl);
+}
+
+static void freeextmatch(void *em)
+{
+    buffree(((struct extmatch *)em)->dyn);
+    free(em);
+}
+
+static void freedircache(void *dc)
+{
+    free(((struct dircache *)dc)->cfs);
+    stfree(&((struct dircache *)dc)->ext, freeextmatch);
+    free(dc);
+}
 
 static void freerule(struct rule *rule)
 {
@@ -66,6 +212,7 @@ static void freeconfig(struct config *cf)
 {
     struct child *ch, *nch;
     struct pattern *pat, *npat;
+    int i;
     
     if(cf->prev != NULL)
 	cf->prev->next = cf->next;
@@ -83,6 +230,11 @@ static void freeconfig(struct config *cf)
 	npat = pat->next;
 	freepattern(pat);
     }
+    for(i = 0; i < PT_NUM; i++) {
+	stfree(&cf->pidx[i].exts, freepatlist);
+	stfree(&cf->pidx[i].names, freepatlist);
+	buffree(cf->pidx[i].rest);
+    }
     freeca(cf->index);
     freeca(cf->dotallow);
     if(cf->capture != NULL)
@@ -143,7 +295,7 @@ static struct pattern *parsepattern(struct cfstate *s)
     struct rule *rule;
     struct headmod *head;
     int sl;
-
+    
     if(!strcmp(s->argv[0], "match")) {
 	s->expstart = 1;
 	pat = newpattern();
@@ -225,6 +377,64 @@ static struct pattern *parsepattern(struct cfstate *s)
     return(pat);
 }
 
+static int isext(char *glob)
+{
+    return((glob[0] == '*') && (glob[1] == '.') && glob[2] && !strpbrk(glob + 2, "*?[\\"));
+}
+
+static int isliteral(char *glob)
+{
+    return(!strpbrk(glob, "*?[\\"));
+}
+
+static void fileunder(struct strtab *t, char *key, struct pattern *pat)
+{
+    void **v;
+    struct patlist *pl;
+    
+    v = stslot(t, key, 1);
+    if(*v == NULL)
+	*v = szmalloc(sizeof(*pl));
+    pl = *v;
+    if((pl->d == 0) || (pl->b[pl->d - 1] != pat))
+	bufadd(*pl, pat);
+}
+
+static void indexpattern(struct config *cf, struct pattern *pat)
+{
+    struct patindex *ix;
+    struct rule *rule, *key;
+    int i, o;
+    
+    ix = &cf->pidx[pat->type];
+    key = NULL;
+    pat->dyn = 0;
+    for(i = 0; (rule = pat->rules[i]) != NULL; i++) {
+	if(rule->type == PAT_BASENAME) {
+	    for(o = 0; rule->patterns[o] != NULL; o++) {
+		if(!isext(rule->patterns[o]))
+		    pat->dyn = 1;
+		if(!isext(rule->patterns[o]) && !isliteral(rule->patterns[o]))
+		    break;
+	    }
+	    if((key == NULL) && (rule->patterns[o] == NULL))
+		key = rule;
+	} else if(rule->type == PAT_PATHNAME) {
+	    pat->dyn = 1;
+	}
+    }
+    if(key == NULL) {
+	bufadd(ix->rest, pat);
+	return;
+    }
+    for(o = 0; key->patterns[o] != NULL; o++) {
+	if(isext(key->patterns[o]))
+	    fileunder(&ix->exts, key->patterns[o] + 2, pat);
+	else
+	    fileunder(&ix->names, key->patterns[o], pat);
+    }
+}
+
 static struct config *emptyconfig(void)
 {
     struct config *cf;
@@ -240,6 +450,7 @@ struct config *readconfig(char *file)
     struct config *cf;
     struct child *child;
     struct pattern *pat;
+    int i;
     
     if((in = fopen(file, "r")) == NULL) {
 	flog(LOG_WARNING, "%s: %s", file, strerror(errno));
@@ -293,6 +504,10 @@ struct config *readconfig(char *file)
     
     freecfparser(s);
     fclose(in);
+    for(pat = cf->patterns, i = 0; pat != NULL; pat = pat->next, i++) {
+	pat->prio = i;
+	indexpattern(cf, pat);
+    }
     return(cf);
 }
 
@@ -308,7 +523,7 @@ struct config *getconfig(char *path)
 	if(!strcmp(cf->path, path)) {
 	    if(now - cf->lastck > 5) {
 		cf->lastck = now;
-		if(stat(fn, &sb) || (sb.st_mtime != cf->mtime))
+		if(stat(fn, &sb) ? (cf->mtime != 0) : (sb.st_mtime != cf->mtime))
 		    break;
 	    }
 	    return(cf);
@@ -326,6 +541,7 @@ struct config *getconfig(char *path)
     if(ocf != NULL) {
 	mergechildren(cf->children, ocf->children);
 	freeconfig(ocf);
+	cfgen++;
     }
     cf->path = sstrdup(path);
     cf->mtime = mtime;
@@ -393,64 +609,190 @@ struct child *findchild(char *file, char *name, struct config **cf)
     return(NULL);
 }
 
-struct pattern *findmatch(char *file, int trydefault, int type)
+static char *localname(struct config *cf, char *file)
 {
-    int i, o, c;
-    char *bn, *ln;
-    struct config **cfs;
-    struct pattern *pat;
-    struct rule *rule;
     size_t pl;
     
-    if((bn = strrchr(file, '/')) != NULL)
-	bn++;
-    else
-	bn = file;
-    cfs = getconfigs(file);
-    for(c = 0; cfs[c] != NULL; c++) {
-	if(cfs[c]->path == NULL) {
-	    ln = file;
-	} else {
-	    pl = strlen(cfs[c]->path);
-	    if((strlen(file) > pl) && !strncmp(file, cfs[c]->path, pl) && (file[pl] == '/'))
-		ln = file + pl + 1;
-	    else
-		ln = file;	/* This should only happen in the base directory. */
+    if(cf->path == NULL)
+	return(file);
+    pl = strlen(cf->path);
+    if((strlen(file) > pl) && !strncmp(file, cf->path, pl) && (file[pl] == '/'))
+	return(file + pl + 1);
+    return(file);	/* This should only happen in the base directory. */
+}
+
+/*
+ * Returns zero if PAT does not match, one if it does, and two if it
+ * only matches when default rules are allowed to.
+ */
+static int matchpat(struct pattern *pat, char *bn, char *ln)
+{
+    int i, o, ret;
+    struct rule *rule;
+    
+    ret = 1;
+    for(i = 0; (rule = pat->rules[i]) != NULL; i++) {
+	if(rule->type == PAT_BASENAME) {
+	    for(o = 0; rule->patterns[o] != NULL; o++) {
+		if(!fnmatch(rule->patterns[o], bn, 0))
+		    break;
+	    }
+	    if(rule->patterns[o] == NULL)
+		return(0);
+	} else if(rule->type == PAT_PATHNAME) {
+	    for(o = 0; rule->patterns[o] != NULL; o++) {
+		if(!fnmatch(rule->patterns[o], ln, FNM_PATHNAME))
+		    break;
+	    }
+	    if(rule->patterns[o] == NULL)
+		return(0);
+	} else if(rule->type == PAT_ALL) {
+	} else if(rule->type == PAT_DEFAULT) {
+	    ret = 2;
+	} else if(rule->type == PAT_LOCAL) {
+	    if(strchr(ln, '/'))
+		return(0);
+	}
+    }
+    return(ret);
+}
+
+/* Earlier configurations, and earlier patterns in them, take
+ * precedence. */
+static int better(struct match *cur, struct pattern *pat, int level)
+{
+    return((cur->pat == NULL) || (level < cur->level) || ((level == cur->level) && (pat->prio < cur->pat->prio)));
+}
+
+static void consider(struct match *nd, struct match *d, struct pattern *pat, int level, char *bn, char *ln)
+{
+    int m;
+    
+    if(!better(nd, pat, level) && !better(d, pat, level))
+	return;
+    if((m = matchpat(pat, bn, ln)) == 0)
+	return;
+    if((m == 1) && better(nd, pat, level))
+	*nd = (struct match){.pat = pat, .level = level};
+    if(better(d, pat, level))
+	*d = (struct match){.pat = pat, .level = level};
+}
+
+static struct dircache *getdircache(char *file)
+{
+    struct dircache *dc;
+    struct config **cfs;
+    void **v;
+    char *p;
+    int n;
+    
+    p = strrchr(file, '/');
+    char dir[(p == NULL) ? 1 : (p - file + 2)];
+    if(p == NULL) {
+	dir[0] = 0;
+    } else {
+	memcpy(dir, file, p - file + 1);
+	dir[p - file + 1] = 0;
+    }
+    if((v = stslot(&dircaches, dir, 0)) == NULL) {
+	if(dircaches.n >= 4096)
+	    stfree(&dircaches, freedircache);
+	v = stslot(&dircaches, dir, 1);
+	*v = szmalloc(sizeof(*dc));
+    }
+    dc = *v;
+    if((dc->cfs == NULL) || (dc->gen != cfgen) || (now - dc->lastck > 5)) {
+	cfs = getconfigs(file);
+	for(n = 0; cfs[n] != NULL; n++);
+	if((dc->cfs == NULL) || (dc->gen != cfgen) || (n != dc->ncfs) || memcmp(cfs, dc->cfs, sizeof(*cfs) * n)) {
+	    stfree(&dc->ext, freeextmatch);
+	    free(dc->cfs);
+	    dc->cfs = memcpy(smalloc(sizeof(*cfs) * (n + 1)), cfs, sizeof(*cfs) * (n + 1));
+	    dc->ncfs = n;
+	    dc->gen = cfgen;
 	}
-	for(pat = cfs[c]->patterns; pat != NULL; pat = pat->next) {
-	    if(pat->type != type)
+	dc->lastck = now;
+    }
+    return(dc);
+}
+
+static struct extmatch *getextmatch(struct dircache *dc, char *file, char *bn, char *ext, int type)
+{
+    struct extmatch *em;
+    struct patlist *pl;
+    struct pattern *pat;
+    char *key, *p, *ln;
+    int c, i, o;
+    
+    key = sprintf3("%i%s", type, ext);
+    if((em = stget(&dc->ext, key)) != NULL)
+	return(em);
+    if(dc->ext.n >= 256)
+	stfree(&dc->ext, freeextmatch);
+    omalloc(em);
+    for(c = 0; c < dc->ncfs; c++) {
+	ln = localname(dc->cfs[c], file);
+	for(p = ext; (p = strchr(p, '.')) != NULL; ) {
+	    if((pl = stget(&dc->cfs[c]->pidx[type].exts, ++p)) == NULL)
 		continue;
-	    for(i = 0; (rule = pat->rules[i]) != NULL; i++) {
-		if(rule->type == PAT_BASENAME) {
-		    for(o = 0; rule->patterns[o] != NULL; o++) {
-			if(!fnmatch(rule->patterns[o], bn, 0))
-			    break;
-		    }
-		    if(rule->patterns[o] == NULL)
-			break;
-		} else if(rule->type == PAT_PATHNAME) {
-		    for(o = 0; rule->patterns[o] != NULL; o++) {
-			if(!fnmatch(rule->patterns[o], ln, FNM_PATHNAME))
+	    for(i = 0; i < pl->d; i++) {
+		pat = pl->b[i];
+		if(pat->dyn) {
+		    for(o = 0; o < em->dyn.d; o++) {
+			if(em->dyn.b[o].pat == pat)
 			    break;
 		    }
-		    if(rule->patterns[o] == NULL)
-			break;
-		} else if(rule->type == PAT_ALL) {
-		} else if(rule->type == PAT_DEFAULT) {
-		    if(!trydefault)
-			break;
-		} else if(rule->type == PAT_LOCAL) {
-		    if(strchr(ln, '/'))
-			break;
+		    if(o == em->dyn.d)
+			bufadd(em->dyn, ((struct match){.pat = pat, .level = c}));
+		} else {
+		    consider(&em->nd, &em->d, pat, c, bn, ln);
 		}
 	    }
-	    if(!rule)
-		return(pat);
 	}
     }
-    if(!trydefault)
-	return(findmatch(file, 1, type));
-    return(NULL);
+    *stslot(&dc->ext, key, 1) = em;
+    return(em);
+}
+
+struct pattern *findmatch(char *file, int trydefault, int type)
+{
+    int i, c;
+    char *bn, *ext;
+    struct dircache *dc;
+    struct extmatch *em;
+    struct match nd, d, *best;
+    struct patindex *ix;
+    struct patlist *pl;
+    struct config *cf;
+    
+    if((bn = strrchr(file, '/')) != NULL)
+	bn++;
+    else
+	bn = file;
+    if((ext = strchr(bn, '.')) == NULL)
+	ext = "";
+    dc = getdircache(file);
+    em = getextmatch(dc, file, bn, ext, type);
+    nd = em->nd;
+    d = em->d;
+    for(i = 0; i < em->dyn.d; i++)
+	consider(&nd, &d, em->dyn.b[i].pat, em->dyn.b[i].level, bn, localname(dc->cfs[em->dyn.b[i].level], file));
+    best = trydefault?&d:&nd;
+    for(c = 0; c < dc->ncfs; c++) {
+	if((best->pat != NULL) && (best->level < c))
+	    break;
+	cf = dc->cfs[c];
+	ix = &cf->pidx[type];
+	if((pl = stget(&ix->names, bn)) != NULL) {
+	    for(i = 0; i < pl->d; i++)
+		consider(&nd, &d, pl->b[i], c, bn, localname(cf, file));
+	}
+	for(i = 0; i < ix->rest.d; i++)
+	    consider(&nd, &d, ix->rest.b[i], c, bn, localname(cf, file));
+    }
+    if(!trydefault && (nd.pat != NULL))
+	return(nd.pat);
+    return(d.pat);
 }
 
 static int donotfound(struct child *ch, struct hthead *req, int fd, void (*chinit)(void *), void *idata)
@@ -38,10 +38,13 @@
 #include <proc.h>
 #include <resp.h>
 #include <cf.h>
+#include <stats.h>
 
 #include "dirplex.h"
 
 time_t now;
+static struct statcnt *st_reqs, *st_notfound;
+static struct stathist *st_dispatch;
 
 static void chinit(void *idata)
 {
@@ -70,7 +73,7 @@ static void handle(struct hthead *req, int fd, char *path, struct pattern *pat)
     struct config *ccf;
     struct headmod *head;
     char *twd;
-
+    
     for(head = pat->headers; head != NULL; head = head->next) {
 	headrmheader(req, head->name);
 	headappheader(req, head->name, head->value);
@@ -112,6 +115,7 @@ static void handle404(struct hthead *req, int fd, char *path)
     
     char tmp[strlen(path) + 1];
     strcpy(tmp, path);
+    statinc(st_notfound, 1);
     if((pat = findmatch(tmp, 0, PT_NOTFOUND)) != NULL) {
 	handle(req, fd, tmp, pat);
     } else {
@@ -124,7 +128,7 @@ static void handle404(struct hthead *req, int fd, char *path)
 static void handlefile(struct hthead *req, int fd, char *path)
 {
     struct pattern *pat;
-
+    
     if((pat = findmatch(path, 0, PT_FILE)) == NULL) {
 	handle404(req, fd, path);
 	return;
@@ -153,18 +157,82 @@ static int checkaccess(char *path, char *name)
     return(1);
 }
 
-static char *findfile(char *path, char *name, struct stat *sb)
+/*
+ * Extensionless names are resolved through an index of each
+ * directory's files by stem (the part of the name before the first
+ * dot), which is built on first use and rebuilt whenever the
+ * directory's modification time changes. Since modification times
+ * have limited granularity, an index of a directory that was modified
+ * very recently is not trusted on its next use.
+ */
+
+struct namelist {
+    char **b;
+    size_t s, d;
+};
+
+struct dirindex {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;
+    struct strtab stems;
+};
+
+static struct strtab dirindices;
+
+static void freenamelist(void *nl)
+{
+    int i;
+    
+    for(i = 0; i < ((struct namelist *)nl)->d; i++)
+	free(((struct namelist *)nl)->b[i]);
+    buffree(*(struct namelist *)nl);
+    free(nl);
+}
+
+static void freedirindex(void *di)
+{
+    stfree(&((struct dirindex *)di)->stems, freenamelist);
+    free(di);
+}
+
+static struct dirindex *getdirindex(char *path)
 {
     DIR *dir;
-    struct stat sbuf;
     struct dirent *dent;
-    char *p, *fp, *ret;
+    struct stat sb;
+    struct timespec mtime;
+    struct dirindex *di;
+    struct namelist *nl;
+    void **v;
+    char *p;
     
-    if(sb == NULL)
-	sb = &sbuf;
-    if((dir = opendir(path)) == NULL)
+    if(stat(path, &sb))
 	return(NULL);
-    ret = NULL;
+    /* stmtime() may only have whole seconds, which the racy check
+     * makes up for. */
+    mtime = stmtime(&sb);
+    if((v = stslot(&dirindices, path, 0)) != NULL) {
+	di = *v;
+	if(!di->racy && (di->dev == sb.st_dev) && (di->ino == sb.st_ino) &&
+	   (di->mtime.tv_sec == mtime.tv_sec) && (di->mtime.tv_nsec == mtime.tv_nsec))
+	    return(di);
+	stfree(&di->stems, freenamelist);
+    } else {
+	if(dirindices.n >= 1024)
+	    stfree(&dirindices, freedirindex);
+	v = stslot(&dirindices, path, 1);
+	di = *v = szmalloc(sizeof(*di));
+    }
+    di->dev = sb.st_dev;
+    di->ino = sb.st_ino;
+    di->mtime = mtime;
+    di->racy = mtime.tv_sec >= time(NULL) - 1;
+    if((dir = opendir(path)) == NULL) {
+	di->racy = 1;
+	return(di);
+    }
     while((dent = readdir(dir)) != NULL) {
 	/* Ignore backup files.
 	 * XXX: There is probably a better and more extensible way to
@@ -173,11 +241,32 @@ static char *findfile(char *path, char *name, struct stat *sb)
 	    continue;
 	if((p = strchr(dent->d_name, '.')) == NULL)
 	    continue;
-	if(p - dent->d_name != strlen(name))
-	    continue;
-	if(strncmp(dent->d_name, name, strlen(name)))
-	    continue;
-	fp = sprintf2("%s/%s", path, dent->d_name);
+	*p = 0;
+	v = stslot(&di->stems, dent->d_name, 1);
+	*p = '.';
+	if(*v == NULL)
+	    *v = szmalloc(sizeof(*nl));
+	nl = *v;
+	bufadd(*nl, sstrdup(dent->d_name));
+    }
+    closedir(dir);
+    return(di);
+}
+
+static char *findfile(char *path, char *name, struct stat *sb)
+{
+    struct stat sbuf;
+    struct dirindex *di;
+    struct namelist *nl;
+    char *fp;
+    int i;
+    
+    if(sb == NULL)
+	sb = &sbuf;
+    if(((di = getdirindex(path)) == NULL) || ((nl = stget(&di->stems, name)) == NULL))
+	return(NULL);
+    for(i = 0; i < nl->d; i++) {
+	fp = sprintf2("%s/%s", path, nl->b[i]);
 	if(stat(fp, sb)) {
 	    free(fp);
 	    continue;
@@ -186,15 +275,13 @@ static char *findfile(char *path, char *name, struct stat *sb)
 	    free(fp);
 	    continue;
 	}
-	if(!checkaccess(path, dent->d_name)) {
+	if(!checkaccess(path, nl->b[i])) {
 	    free(fp);
 	    continue;
 	}
-	ret = fp;
-	break;
+	return(fp);
     }
-    closedir(dir);
-    return(ret);
+    return(NULL);
 }
 
 static void handledir(struct hthead *req, int fd, char *path)
@@ -373,8 +460,12 @@ out:
 
 static void serve(struct hthead *req, int fd)
 {
+    uintmax_t t;
+    
+    t = statnow();
     now = time(NULL);
     checkpath(req, fd, ".", req->rest, 1);
+    stathadd(st_dispatch, statnow() - t);
 }
 
 static void chldhandler(int sig)
@@ -402,8 +493,9 @@ int main(int argc, char **argv)
     int c;
     int nodef;
     char *gcf, *lcf, *clcf;
-    struct hthead *req;
-    int fd;
+    struct hthead *reqs[REQBATCH];
+    int fds[REQBATCH];
+    int i, n, sfd;
     
     nodef = 0;
     lcf = NULL;
@@ -453,15 +545,28 @@ int main(int argc, char **argv)
     }
     signal(SIGCHLD, chldhandler);
     signal(SIGPIPE, sighandler);
+    st_reqs = statcnt("requests");
+    st_notfound = statcnt("notfound");
+    st_dispatch = stathist("dispatch");
+    sfd = statinit("dirplex");
     while(1) {
-	if((fd = recvreq(0, &req)) < 0) {
+	if(statpoll(0, sfd) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    flog(LOG_ERR, "poll: %s", strerror(errno));
+	    break;
+	}
+	if((n = recvreqs(0, reqs, fds, REQBATCH, 0)) < 0) {
 	    if(errno != 0)
 		flog(LOG_ERR, "recvreq: %s", strerror(errno));
 	    break;
 	}
-	serve(req, fd);
-	freehthead(req);
-	close(fd);
+	for(i = 0; i < n; i++) {
+	    statinc(st_reqs, 1);
+	    serve(reqs[i], fds[i]);
+	    freehthead(reqs[i]);
+	    close(fds[i]);
+	}
     }
     return(0);
 }
@@ -11,6 +11,18 @@
 #define PT_DIR 1
 #define PT_NOTFOUND 2
 
+#define PT_NUM 3
+
+struct strtab {
+    struct strent **b;
+    int hlen, n;
+};
+
+struct patindex {
+    struct strtab exts, names;
+    typedbuf(struct pattern *) rest;
+};
+
 struct config {
     struct config *next, *prev;
     char *path;
@@ -20,6 +32,7 @@ struct config {
     char **index, **dotallow;
     char *capture, *reparse;
     int caproot, parsecomb;
+    struct patindex pidx[PT_NUM];
 };
 
 struct rule {
@@ -39,8 +52,12 @@ struct pattern {
     char *childnm;
     char **fchild;
     struct rule **rules;
+    int prio, dyn;
 };
 
+void **stslot(struct strtab *t, char *key, int create);
+void *stget(struct strtab *t, char *key);
+void stfree(struct strtab *t, void (*ffunc)(void *));
 struct child *getchild(struct config *cf, char *name);
 struct config *readconfig(char *file);
 struct config *getconfig(char *path);
@@ -0,0 +1,323 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <req.h>
+#include <proc.h>
+#include <mt.h>
+#include <mtio.h>
+#include <bufio.h>
+
+#include "htparser.h"
+
+/*
+ * Handing off to a new htparser process. On SIGUSR2, htparser
+ * executes itself anew, passing the new process a socket as fd 3 and
+ * its number in ASHD_HANDOFF. The old process sends its listening
+ * sockets over it, which the new process picks up instead of binding
+ * new ones for the ports it is configured with. Once the new process
+ * has started and says so, the old one stops listening, and from
+ * then on passes every plaintext connection that is (or becomes)
+ * idle between requests to the new process, along with whatever it
+ * may already have read of the next request. Connections that cannot
+ * be passed, such as TLS connections, are served until they close,
+ * as on an ordinary shutdown. If the new process fails to start, the
+ * old one simply keeps running.
+ */
+
+struct idleconn {
+    struct idleconn *next, *prev;
+    struct muth *muth;
+    int moved;
+};
+
+static int hosk = -1, insk = -1, hobusy = 0;
+static struct idleconn *idle = NULL;
+static typedbuf(int) lfds, pool;
+static void (*hostop)(void);
+
+/* Records a listening socket as one to be handed off. */
+void holisten(int fd)
+{
+    bufadd(lfds, fd);
+}
+
+static int sockport(int fd, int *family)
+{
+    struct sockaddr_storage name;
+    socklen_t namelen;
+    
+    namelen = sizeof(name);
+    if(getsockname(fd, (struct sockaddr *)&name, &namelen))
+	return(-1);
+    *family = name.ss_family;
+    if(name.ss_family == AF_INET)
+	return(ntohs(((struct sockaddr_in *)&name)->sin_port));
+    if(name.ss_family == AF_INET6)
+	return(ntohs(((struct sockaddr_in6 *)&name)->sin6_port));
+    return(-1);
+}
+
+/* Returns a listening socket inherited from an old process for the
+ * given address family and port, or -1 if there is none. */
+int hotake(int family, int port)
+{
+    int i, fd, fam;
+    
+    for(i = 0; i < pool.d; i++) {
+	if((sockport(pool.b[i], &fam) == port) && (fam == family)) {
+	    fd = pool.b[i];
+	    bufdel(pool, i);
+	    return(fd);
+	}
+    }
+    return(-1);
+}
+
+/*
+ * Called in a new process before the port specifications are
+ * processed, to receive the listening sockets of the old one, if any.
+ */
+void hoinit(void)
+{
+    char *p, *data;
+    char buf[16];
+    size_t dlen;
+    int n, fd;
+    ssize_t ret;
+    
+    if((p = getenv("ASHD_HANDOFF")) == NULL)
+	return;
+    insk = atoi(p);
+    unsetenv("ASHD_HANDOFF");
+    fcntl(insk, F_SETFD, FD_CLOEXEC);
+    if((ret = recv(insk, buf, sizeof(buf) - 1, 0)) <= 0) {
+	flog(LOG_WARNING, "htparser: could not receive handoff header: %s", (ret < 0) ? strerror(errno) : "unexpected eof");
+	goto fail;
+    }
+    buf[ret] = 0;
+    if(buf[0] != 'L') {
+	flog(LOG_WARNING, "htparser: invalid handoff header");
+	goto fail;
+    }
+    for(n = atoi(buf + 1); n > 0; n--) {
+	if((fd = recvfd(insk, &data, &dlen)) < 0) {
+	    flog(LOG_WARNING, "htparser: could not receive handed-off listener: %s", strerror(errno));
+	    goto fail;
+	}
+	free(data);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	bufadd(pool, fd);
+    }
+    return;
+    
+fail:
+    close(insk);
+    insk = -1;
+}
+
+static void horecv(struct muth *muth, va_list args)
+{
+    char *data;
+    size_t dlen;
+    int fd;
+    
+    fcntl(insk, F_SETFL, fcntl(insk, F_GETFL) | O_NONBLOCK);
+    while(block(insk, EV_READ, 0) != 0) {
+	/* The old process may well have exited right after its last
+	 * message, so read until EOF rather than until a hangup is
+	 * seen. */
+	while((fd = recvfd(insk, &data, &dlen)) >= 0) {
+	    fcntl(fd, F_SETFD, FD_CLOEXEC);
+	    if((dlen < 1) || (data[0] != 'C'))
+		close(fd);
+	    else
+		adopttcp(fd, data + 1, dlen - 1);
+	    free(data);
+	}
+	if(errno != EAGAIN)
+	    break;
+    }
+    close(insk);
+    insk = -1;
+}
+
+/*
+ * Called in a new process once it is ready to serve, to tell the old
+ * one to stop and start receiving its connections. Any inherited
+ * listeners that were not claimed by a port specification are
+ * closed.
+ */
+struct muth *hoready(void)
+{
+    while(pool.d > 0)
+	close(pool.b[--pool.d]);
+    if(insk < 0)
+	return(NULL);
+    if(send(insk, "R", 1, MSG_NOSIGNAL) != 1) {
+	flog(LOG_WARNING, "htparser: could not signal readiness to old process: %s", strerror(errno));
+	close(insk);
+	insk = -1;
+	return(NULL);
+    }
+    return(mustart(horecv));
+}
+
+static int hosend(struct bufio *in, int fd)
+{
+    struct charbuf buf;
+    int ret;
+    
+    bufinit(buf);
+    bufadd(buf, 'C');
+    bufcat(buf, in->rbuf.b + in->rh, biordata(in));
+    ret = sendfd(hosk, fd, buf.b, buf.d);
+    buffree(buf);
+    return(ret);
+}
+
+/*
+ * Used by serve() in place of biofillsome() to wait for the next
+ * request on a plaintext connection. Returns zero instead if the
+ * connection has been handed off, in which case it should just be
+ * closed.
+ */
+ssize_t hofillsome(struct bufio *in, int fd)
+{
+    struct idleconn ic;
+    ssize_t ret;
+    
+    if(hosk < 0) {
+	memset(&ic, 0, sizeof(ic));
+	ic.muth = current;
+	ic.next = idle;
+	if(idle != NULL)
+	    idle->prev = &ic;
+	idle = &ic;
+	ret = biofillsome(in);
+	if(ic.next)
+	    ic.next->prev = ic.prev;
+	if(ic.prev)
+	    ic.prev->next = ic.next;
+	if(&ic == idle)
+	    idle = ic.next;
+	if(!ic.moved)
+	    return(ret);
+    }
+    if(hosend(in, fd) < 0)
+	flog(LOG_WARNING, "htparser: could not hand off connection: %s", strerror(errno));
+    return(0);
+}
+
+static void hosendlisteners(int sk)
+{
+    int i, fam, acc;
+    char *p;
+    socklen_t optlen;
+    typedbuf(int) fds;
+    
+    /* Listeners may have been closed since they were recorded. */
+    bufinit(fds);
+    for(i = 0; i < lfds.d; i++) {
+	acc = 0;
+	optlen = sizeof(acc);
+	if(getsockopt(lfds.b[i], SOL_SOCKET, SO_ACCEPTCONN, &acc, &optlen) || !acc || (sockport(lfds.b[i], &fam) < 0))
+	    continue;
+	bufadd(fds, lfds.b[i]);
+    }
+    p = sprintf3("L%zi", fds.d);
+    send(sk, p, strlen(p), MSG_NOSIGNAL);
+    for(i = 0; i < fds.d; i++)
+	sendfd(sk, fds.b[i], "L", 1);
+    buffree(fds);
+}
+
+static void hostartmuth(struct muth *muth, va_list args)
+{
+    vavar(char **, argv);
+    int sk[2], i, max;
+    pid_t pid;
+    char buf[16];
+    ssize_t ret;
+    
+    if(socketpair(PF_UNIX, SOCK_SEQPACKET, 0, sk)) {
+	flog(LOG_ERR, "htparser: could not create handoff socket: %s", strerror(errno));
+	goto out;
+    }
+    if((pid = fork()) < 0) {
+	flog(LOG_ERR, "htparser: could not fork for handoff: %s", strerror(errno));
+	close(sk[0]);
+	close(sk[1]);
+	goto out;
+    }
+    if(pid == 0) {
+	dup2(sk[1], 3);
+	max = sysconf(_SC_OPEN_MAX);
+	for(i = 4; i < max; i++)
+	    close(i);
+	putenv("ASHD_HANDOFF=3");
+	execvp(argv[0], argv);
+	flog(LOG_ERR, "htparser: could not exec %s for handoff: %s", argv[0], strerror(errno));
+	exit(127);
+    }
+    close(sk[1]);
+    fcntl(sk[0], F_SETFD, FD_CLOEXEC);
+    hosendlisteners(sk[0]);
+    if((block(sk[0], EV_READ, 60) <= 0) || ((ret = recv(sk[0], buf, sizeof(buf), MSG_DONTWAIT)) != 1) || (buf[0] != 'R')) {
+	flog(LOG_ERR, "htparser: new process %i failed to take over, continuing", (int)pid);
+	close(sk[0]);
+	goto out;
+    }
+    flog(LOG_INFO, "htparser: handed off to new process %i", (int)pid);
+    hosk = sk[0];
+    hostop();
+    while(idle != NULL) {
+	idle->moved = 1;
+	resume(idle->muth, 0);
+    }
+    return;
+    
+out:
+    hobusy = 0;
+}
+
+/*
+ * Starts handing off to a new process, running ARGV. STOP is called
+ * to stop listening once the new process has taken over.
+ */
+void hostart(char **argv, void (*stop)(void))
+{
+    if(hobusy || (hosk >= 0))
+	return;
+    hobusy = 1;
+    hostop = stop;
+    mustart(hostartmuth, argv);
+}
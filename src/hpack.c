@@ -0,0 +1,406 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* HPACK header compression for HTTP/2, as per RFC 7541. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <req.h>
+
+#include "htparser.h"
+
+/* The static table, RFC 7541 appendix A. */
+static const struct {
+    char *name, *val;
+} stable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/*
+ * The Huffman code of RFC 7541 appendix B is canonical, so it is
+ * described completely by the number of codes of each length and
+ * the symbols in order of their codes.
+ */
+static const unsigned char huffcount[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+static const unsigned short huffsym[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+struct hpent {
+    char *name, *val;
+    size_t size;
+};
+
+struct hpack {
+    struct hpent *ents;
+    int n, a;
+    size_t size, max, limit;
+};
+
+#define NSTATIC (sizeof(stable) / sizeof(*stable))
+
+struct hpack *mkhpack(size_t max)
+{
+    struct hpack *hp;
+    
+    omalloc(hp);
+    hp->max = hp->limit = max;
+    return(hp);
+}
+
+static void evict(struct hpack *hp, size_t max)
+{
+    struct hpent *ent;
+    
+    while((hp->n > 0) && (hp->size > max)) {
+	ent = &hp->ents[--hp->n];
+	hp->size -= ent->size;
+	free(ent->name);
+	free(ent->val);
+    }
+}
+
+void freehpack(struct hpack *hp)
+{
+    evict(hp, 0);
+    if(hp->ents != NULL)
+	free(hp->ents);
+    free(hp);
+}
+
+/* The most recently added entry is kept first. */
+static void addent(struct hpack *hp, char *name, char *val)
+{
+    size_t size;
+    
+    size = strlen(name) + strlen(val) + 32;
+    evict(hp, (size > hp->max) ? 0 : (hp->max - size));
+    if(size > hp->max)
+	return;
+    if(hp->n >= hp->a)
+	hp->ents = srealloc(hp->ents, sizeof(*hp->ents) * (hp->a = (hp->a * 2) + 16));
+    memmove(hp->ents + 1, hp->ents, sizeof(*hp->ents) * hp->n);
+    hp->ents[0].name = sstrdup(name);
+    hp->ents[0].val = sstrdup(val);
+    hp->ents[0].size = size;
+    hp->n++;
+    hp->size += size;
+}
+
+static int getent(struct hpack *hp, size_t idx, char **name, char **val)
+{
+    if(idx < 1)
+	return(-1);
+    if(idx <= NSTATIC) {
+	*name = stable[idx - 1].name;
+	*val = stable[idx - 1].val;
+	return(0);
+    }
+    idx -= NSTATIC + 1;
+    if(idx >= hp->n)
+	return(-1);
+    *name = hp->ents[idx].name;
+    *val = hp->ents[idx].val;
+    return(0);
+}
+
+static int decint(unsigned char **p, unsigned char *e, int prefix, size_t *ret)
+{
+    size_t v;
+    int sh;
+    
+    if(*p >= e)
+	return(-1);
+    v = *((*p)++) & ((1 << prefix) - 1);
+    if(v < ((1 << prefix) - 1)) {
+	*ret = v;
+	return(0);
+    }
+    for(sh = 0; sh < 28; sh += 7) {
+	if(*p >= e)
+	    return(-1);
+	v += (size_t)(**p & 0x7f) << sh;
+	if(!(*((*p)++) & 0x80)) {
+	    *ret = v;
+	    return(0);
+	}
+    }
+    return(-1);
+}
+
+static int huffdecode(struct charbuf *buf, unsigned char *p, size_t len)
+{
+    int i, bit, clen, code, first, idx, count, ones;
+    
+    code = first = idx = clen = 0;
+    ones = 1;
+    for(; len > 0; p++, len--) {
+	for(i = 7; i >= 0; i--) {
+	    bit = (*p >> i) & 1;
+	    code |= bit;
+	    ones &= bit;
+	    clen++;
+	    count = huffcount[clen];
+	    if(code - count < first) {
+		if(huffsym[idx + code - first] == 256)
+		    return(-1);
+		bufadd(*buf, huffsym[idx + code - first]);
+		code = first = idx = clen = 0;
+		ones = 1;
+		continue;
+	    }
+	    idx += count;
+	    first += count;
+	    first <<= 1;
+	    code <<= 1;
+	    if(clen >= 30)
+		return(-1);
+	}
+    }
+    /* Any trailing bits must be padding made from the EOS code. */
+    if((clen > 7) || !ones)
+	return(-1);
+    return(0);
+}
+
+static char *decstring(unsigned char **p, unsigned char *e)
+{
+    struct charbuf buf;
+    size_t len;
+    int huff;
+    
+    if(*p >= e)
+	return(NULL);
+    huff = **p & 0x80;
+    if(decint(p, e, 7, &len) || (len > e - *p))
+	return(NULL);
+    bufinit(buf);
+    if(huff) {
+	if(huffdecode(&buf, *p, len)) {
+	    buffree(buf);
+	    return(NULL);
+	}
+    } else {
+	bufcat(buf, *p, len);
+    }
+    /* Such fields could not be passed on to handlers intact. */
+    if(memchr(buf.b, 0, buf.d) || memchr(buf.b, '\r', buf.d) || memchr(buf.b, '\n', buf.d)) {
+	buffree(buf);
+	return(NULL);
+    }
+    bufadd(buf, 0);
+    *p += len;
+    return(buf.b);
+}
+
+/*
+ * Decodes a complete header block, appending all fields, including
+ * any pseudo-header fields, to the given head.
+ */
+int hpdecode(struct hpack *hp, unsigned char *buf, size_t len, struct hthead *head)
+{
+    unsigned char *p, *e;
+    size_t idx;
+    char *name, *val, *sname, *sval;
+    int inc;
+    
+    p = buf;
+    e = buf + len;
+    while(p < e) {
+	name = val = NULL;
+	if(*p & 0x80) {
+	    if(decint(&p, e, 7, &idx) || getent(hp, idx, &sname, &sval))
+		return(-1);
+	    headappheader(head, sname, sval);
+	    continue;
+	} else if((*p & 0xe0) == 0x20) {
+	    if(decint(&p, e, 5, &idx) || (idx > hp->limit))
+		return(-1);
+	    evict(hp, hp->max = idx);
+	    continue;
+	}
+	if((*p & 0xc0) == 0x40) {
+	    inc = 1;
+	    if(decint(&p, e, 6, &idx))
+		return(-1);
+	} else {
+	    inc = 0;
+	    if(decint(&p, e, 4, &idx))
+		return(-1);
+	}
+	if(idx > 0) {
+	    if(getent(hp, idx, &sname, &sval))
+		return(-1);
+	    name = sstrdup(sname);
+	} else if((name = decstring(&p, e)) == NULL) {
+	    return(-1);
+	}
+	if((val = decstring(&p, e)) == NULL) {
+	    free(name);
+	    return(-1);
+	}
+	if(inc)
+	    addent(hp, name, val);
+	headappheader(head, name, val);
+	free(name);
+	free(val);
+    }
+    return(0);
+}
+
+static void encint(struct charbuf *buf, int flags, int prefix, size_t v)
+{
+    if(v < ((1 << prefix) - 1)) {
+	bufadd(*buf, flags | v);
+	return;
+    }
+    bufadd(*buf, flags | ((1 << prefix) - 1));
+    v -= (1 << prefix) - 1;
+    for(; v >= 0x80; v >>= 7)
+	bufadd(*buf, 0x80 | (v & 0x7f));
+    bufadd(*buf, v);
+}
+
+/*
+ * Encodes a header field as a literal without indexing, so that no
+ * dynamic table state need be kept for the peer's decoder. Names
+ * found in the static table are referred to by index.
+ */
+void hpencode(struct charbuf *buf, char *name, char *val)
+{
+    int i;
+    
+    for(i = 0; i < NSTATIC; i++) {
+	if(!strcmp(stable[i].name, name))
+	    break;
+    }
+    if(i < NSTATIC) {
+	encint(buf, 0, 4, i + 1);
+    } else {
+	encint(buf, 0, 4, 0);
+	encint(buf, 0, 7, strlen(name));
+	bufcat(*buf, name, strlen(name));
+    }
+    encint(buf, 0, 7, strlen(val));
+    bufcat(*buf, val, strlen(val));
+}
+
+void hpencstatus(struct charbuf *buf, int code)
+{
+    int i;
+    char cbuf[16];
+    
+    snprintf(cbuf, sizeof(cbuf), "%i", code);
+    for(i = 0; i < NSTATIC; i++) {
+	if(!strcmp(stable[i].name, ":status") && !strcmp(stable[i].val, cbuf)) {
+	    encint(buf, 0x80, 7, i + 1);
+	    return;
+	}
+    }
+    hpencode(buf, ":status", cbuf);
+}
@@ -0,0 +1,836 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <req.h>
+#include <resp.h>
+#include <proc.h>
+#include <mt.h>
+#include <mtio.h>
+#include <bufio.h>
+
+/* How long a request waits for an identical one already underway
+ * before fetching by itself. */
+#define COLLAPSEWAIT 5
+/* How long responses for a key are assumed not to be stored, once
+ * one has not been. */
+#define PASSTIME 60
+
+struct variant {
+    struct variant *next, *prev;
+    struct variant *knext;
+    struct cacheent *ent;
+    char **vary;
+    struct hthead *head;
+    char *body;
+    size_t blen, size;
+    time_t stored, expires;
+    int refs, dead;
+};
+
+struct cacheent {
+    char *key;
+    struct variant *vars;
+    int refs;
+    struct muth *fetcher;
+    time_t passuntil;
+    typedbuf(struct muth *) waiting;
+};
+
+static int ch;
+static size_t budget = 64 << 20, maxobj = 1 << 20;
+static size_t used = 0;
+static struct btree *cache = NULL;
+static struct variant *lrulistf = NULL, *lrulistl = NULL;
+
+static int entcmp(void *ap, void *bp)
+{
+    struct cacheent *a = ap, *b = bp;
+    
+    return(strcmp(a->key, b->key));
+}
+
+static struct cacheent *getent(char *key)
+{
+    struct cacheent *ent, lkey;
+    
+    lkey.key = key;
+    if((ent = btreeget(cache, &lkey, entcmp)) == NULL) {
+	omalloc(ent);
+	ent->key = sstrdup(key);
+	bbtreeput(&cache, ent, entcmp);
+    }
+    ent->refs++;
+    return(ent);
+}
+
+static void putent(struct cacheent *ent)
+{
+    if((--ent->refs > 0) || (ent->vars != NULL))
+	return;
+    bbtreedel(&cache, ent, entcmp);
+    buffree(ent->waiting);
+    free(ent->key);
+    free(ent);
+}
+
+static void freevary(char **vary)
+{
+    char **p;
+    
+    for(p = vary; p[0] != NULL; p += 2) {
+	free(p[0]);
+	if(p[1] != NULL)
+	    free(p[1]);
+    }
+    free(vary);
+}
+
+static void freevar(struct variant *var)
+{
+    freehthead(var->head);
+    freevary(var->vary);
+    free(var->body);
+    free(var);
+}
+
+static void putvar(struct variant *var)
+{
+    if((--var->refs == 0) && var->dead)
+	freevar(var);
+}
+
+static void lruunlink(struct variant *var)
+{
+    if(var->next)
+	var->next->prev = var->prev;
+    if(var->prev)
+	var->prev->next = var->next;
+    if(var == lrulistf)
+	lrulistf = var->next;
+    if(var == lrulistl)
+	lrulistl = var->prev;
+    var->next = var->prev = NULL;
+}
+
+static void lrufront(struct variant *var)
+{
+    var->prev = NULL;
+    var->next = lrulistf;
+    if(lrulistf)
+	lrulistf->prev = var;
+    lrulistf = var;
+    if(lrulistl == NULL)
+	lrulistl = var;
+}
+
+/*
+ * Removes a variant from the cache. It is only freed once any
+ * requests currently being served from it have finished.
+ */
+static void dropvar(struct variant *var)
+{
+    struct variant **vp;
+    struct cacheent *ent;
+    
+    ent = var->ent;
+    for(vp = &ent->vars; *vp != NULL; vp = &(*vp)->knext) {
+	if(*vp == var) {
+	    *vp = var->knext;
+	    break;
+	}
+    }
+    lruunlink(var);
+    used -= var->size;
+    var->dead = 1;
+    ent->refs++;
+    putent(ent);
+    var->refs++;
+    putvar(var);
+}
+
+static void evict(void)
+{
+    while((used > budget) && (lrulistl != NULL))
+	dropvar(lrulistl);
+}
+
+static char *trim(char *s)
+{
+    char *e;
+    
+    for(; isspace(*s); s++);
+    for(e = s + strlen(s); (e > s) && isspace(e[-1]); e--);
+    *e = 0;
+    return(s);
+}
+
+/*
+ * Looks up a directive in a comma-separated header value such as
+ * Cache-Control. Returns its argument, an empty string if it has
+ * none, or NULL if it is not present at all. The result is only
+ * valid until the next call.
+ */
+static char *getdirective(char *list, char *name)
+{
+    static char *buf = NULL;
+    char *el, *p, *sp;
+    
+    if(list == NULL)
+	return(NULL);
+    if(buf != NULL)
+	free(buf);
+    buf = sstrdup(list);
+    for(el = strtok_r(buf, ",", &sp); el != NULL; el = strtok_r(NULL, ",", &sp)) {
+	if((p = strchr(el, '=')) != NULL)
+	    *(p++) = 0;
+	if(!strcasecmp(trim(el), name)) {
+	    if(p == NULL)
+		return("");
+	    p = trim(p);
+	    if((*p == '\"') && (strlen(p) > 1) && (p[strlen(p) - 1] == '\"')) {
+		p[strlen(p) - 1] = 0;
+		p++;
+	    }
+	    return(p);
+	}
+    }
+    return(NULL);
+}
+
+static int hasdirective(char *list, char *name)
+{
+    return(getdirective(list, name) != NULL);
+}
+
+static char *mkkey(struct hthead *req)
+{
+    char *host, *proto;
+    
+    if((host = getheader(req, "host")) == NULL)
+	host = "";
+    if((proto = getheader(req, "x-ash-protocol")) == NULL)
+	proto = "";
+    return(sprintf2("%s %s %s", proto, host, req->url));
+}
+
+static int reqcacheable(struct hthead *req)
+{
+    char *hd;
+    
+    if(strcasecmp(req->method, "get") && strcasecmp(req->method, "head"))
+	return(0);
+    if(((hd = getheader(req, "content-length")) != NULL) && (atoo(hd) != 0))
+	return(0);
+    if(getheader(req, "transfer-encoding"))
+	return(0);
+    if(hasdirective(getheader(req, "cache-control"), "no-store"))
+	return(0);
+    return(1);
+}
+
+static int reqnocache(struct hthead *req)
+{
+    if(hasdirective(getheader(req, "cache-control"), "no-cache"))
+	return(1);
+    if(hasdirective(getheader(req, "pragma"), "no-cache"))
+	return(1);
+    return(0);
+}
+
+/*
+ * Returns the absolute expiry time of a response, or zero if it may
+ * not be stored at all. No heuristic freshness is ever assumed;
+ * responses must carry explicit Cache-Control or Expires headers to
+ * be cached.
+ */
+static time_t freshness(struct hthead *req, struct hthead *resp, time_t now)
+{
+    char *cc, *hd, *arg;
+    time_t date, expires, age;
+    
+    switch(resp->code) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+	break;
+    default:
+	return(0);
+    }
+    if(getheader(resp, "set-cookie"))
+	return(0);
+    if(((hd = getheader(resp, "vary")) != NULL) && hasdirective(hd, "*"))
+	return(0);
+    cc = getheader(resp, "cache-control");
+    if(hasdirective(cc, "no-store") || hasdirective(cc, "no-cache") || hasdirective(cc, "private"))
+	return(0);
+    if(getheader(req, "authorization") && !hasdirective(cc, "public") && !hasdirective(cc, "s-maxage"))
+	return(0);
+    age = 0;
+    if((hd = getheader(resp, "age")) != NULL)
+	age = atoi(hd);
+    if(((arg = getdirective(cc, "s-maxage")) != NULL) || ((arg = getdirective(cc, "max-age")) != NULL)) {
+	if(atoi(arg) - age <= 0)
+	    return(0);
+	return(now + atoi(arg) - age);
+    }
+    if((hd = getheader(resp, "expires")) != NULL) {
+	if(((expires = parsehttpdate(hd)) == 0) || ((hd = getheader(resp, "date")) == NULL) || ((date = parsehttpdate(hd)) == 0))
+	    return(0);
+	if(expires - date - age <= 0)
+	    return(0);
+	return(now + expires - date - age);
+    }
+    return(0);
+}
+
+/* Collects the request headers named by the Vary header of a response. */
+static char **getvary(struct hthead *req, struct hthead *resp)
+{
+    struct charvbuf buf;
+    char *vary, *el, *sp, *hd;
+    
+    bufinit(buf);
+    if((hd = getheader(resp, "vary")) != NULL) {
+	vary = sstrdup(hd);
+	for(el = strtok_r(vary, ",", &sp); el != NULL; el = strtok_r(NULL, ",", &sp)) {
+	    el = trim(el);
+	    if(!*el)
+		continue;
+	    bufadd(buf, sstrdup(el));
+	    bufadd(buf, ((hd = getheader(req, el)) == NULL) ? NULL : sstrdup(hd));
+	}
+	free(vary);
+    }
+    bufadd(buf, NULL);
+    bufadd(buf, NULL);
+    return(buf.b);
+}
+
+static int varymatch(char **vary, struct hthead *req)
+{
+    char *hd;
+    
+    for(; vary[0] != NULL; vary += 2) {
+	hd = getheader(req, vary[0]);
+	if((hd == NULL) != (vary[1] == NULL))
+	    return(0);
+	if((hd != NULL) && strcmp(hd, vary[1]))
+	    return(0);
+    }
+    return(1);
+}
+
+static struct variant *findvar(struct cacheent *ent, struct hthead *req, time_t now)
+{
+    struct variant *var, *next;
+    
+    for(var = ent->vars; var != NULL; var = next) {
+	next = var->knext;
+	if(var->expires <= now) {
+	    dropvar(var);
+	    continue;
+	}
+	if(varymatch(var->vary, req))
+	    return(var);
+    }
+    return(NULL);
+}
+
+static struct hthead *duphead(struct hthead *head)
+{
+    struct hthead *ret;
+    int i;
+    
+    ret = mkresp(head->code, head->msg, head->ver);
+    for(i = 0; i < head->noheaders; i++)
+	headappheader(ret, head->headers[i][0], head->headers[i][1]);
+    return(ret);
+}
+
+static size_t headsize(struct hthead *head)
+{
+    size_t ret;
+    int i;
+    
+    ret = sizeof(*head) + strlen(head->msg) + strlen(head->ver);
+    for(i = 0; i < head->noheaders; i++)
+	ret += strlen(head->headers[i][0]) + strlen(head->headers[i][1]) + 2 + 3 * sizeof(char *);
+    return(ret);
+}
+
+/* Returns the new variant with a reference held for the caller. */
+static struct variant *store(struct cacheent *ent, struct hthead *req, struct hthead *resp, char *body, size_t blen, time_t expires)
+{
+    struct variant *var, *next;
+    char **vary;
+    size_t size;
+    
+    vary = getvary(req, resp);
+    for(var = ent->vars; var != NULL; var = next) {
+	next = var->knext;
+	if(varymatch(var->vary, req))
+	    dropvar(var);
+    }
+    omalloc(var);
+    var->ent = ent;
+    var->vary = vary;
+    var->head = duphead(resp);
+    headrmheader(var->head, "content-length");
+    headrmheader(var->head, "transfer-encoding");
+    headrmheader(var->head, "connection");
+    headrmheader(var->head, "keep-alive");
+    headrmheader(var->head, "age");
+    var->body = body;
+    var->blen = blen;
+    var->stored = time(NULL);
+    var->expires = expires;
+    size = sizeof(*var) + blen + headsize(var->head) + strlen(ent->key);
+    for(vary = var->vary; vary[0] != NULL; vary += 2)
+	size += strlen(vary[0]) + ((vary[1] == NULL) ? 0 : strlen(vary[1]));
+    var->size = size;
+    var->knext = ent->vars;
+    ent->vars = var;
+    lrufront(var);
+    used += size;
+    var->refs++;
+    evict();
+    return(var);
+}
+
+static int etagmatch(char *list, char *etag)
+{
+    char *buf, *el, *sp;
+    int rv;
+    
+    if(!strcmp(trim(list), "*"))
+	return(1);
+    if(!strncmp(etag, "W/", 2))
+	etag += 2;
+    rv = 0;
+    buf = sstrdup(list);
+    for(el = strtok_r(buf, ",", &sp); el != NULL; el = strtok_r(NULL, ",", &sp)) {
+	el = trim(el);
+	if(!strncmp(el, "W/", 2))
+	    el += 2;
+	if(!strcmp(el, etag)) {
+	    rv = 1;
+	    break;
+	}
+    }
+    free(buf);
+    return(rv);
+}
+
+static int notmodified(struct hthead *req, struct hthead *resp)
+{
+    char *hd, *etag, *lm;
+    time_t since, mtime;
+    
+    if(resp->code != 200)
+	return(0);
+    etag = getheader(resp, "etag");
+    if((hd = getheader(req, "if-none-match")) != NULL)
+	return((etag != NULL) && etagmatch(hd, etag));
+    if((hd = getheader(req, "if-modified-since")) != NULL) {
+	if(((lm = getheader(resp, "last-modified")) == NULL) || ((mtime = parsehttpdate(lm)) == 0))
+	    return(0);
+	if((since = parsehttpdate(hd)) == 0)
+	    return(0);
+	return(mtime <= since);
+    }
+    return(0);
+}
+
+/* Turns RESP into a 304 response and sends it without a body. */
+static void send304(struct bufio *cl, struct hthead *resp)
+{
+    static char *keep304[] = {"etag", "cache-control", "expires", "vary", "last-modified", "content-location", "date", "age", NULL};
+    int i, o;
+    
+    resp->code = 304;
+    free(resp->msg);
+    resp->msg = sstrdup("Not Modified");
+    for(i = 0; i < resp->noheaders; i++) {
+	for(o = 0; keep304[o] != NULL; o++) {
+	    if(!strcasecmp(resp->headers[i][0], keep304[o]))
+		break;
+	}
+	if(keep304[o] == NULL) {
+	    headrmheader(resp, resp->headers[i][0]);
+	    i--;
+	}
+    }
+    headappheader(resp, "Content-Length", "0");
+    writerespb(cl, resp);
+    bioprintf(cl, "\r\n");
+}
+
+static void sendcached(struct hthead *req, struct bufio *cl, struct variant *var, time_t now)
+{
+    struct hthead *resp;
+    
+    var->refs++;
+    lruunlink(var);
+    lrufront(var);
+    resp = duphead(var->head);
+    headappheader(resp, "Age", sprintf3("%ji", (intmax_t)(now - var->stored)));
+    if(notmodified(req, resp)) {
+	send304(cl, resp);
+    } else {
+	headappheader(resp, "Content-Length", sprintf3("%zi", var->blen));
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if(strcasecmp(req->method, "head"))
+	    biowrite(cl, var->body, var->blen);
+    }
+    bioflush(cl);
+    freehthead(resp);
+    putvar(var);
+}
+
+static int passdata(struct bufio *in, struct bufio *out)
+{
+    ssize_t read;
+    
+    while(!bioeof(in)) {
+	if((read = biordata(in)) > 0) {
+	    if((read = biowritesome(out, in->rbuf.b + in->rh, read)) < 0)
+		return(-1);
+	    in->rh += read;
+	}
+	if(biorspace(in) && (biofillsome(in) < 0))
+	    return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Reads the whole body of a response into memory, unless it is
+ * larger than the largest cacheable object, in which case whatever
+ * has been read is left in the buffer of the bufio.
+ */
+static char *readbody(struct bufio *hd, struct hthead *resp, size_t *lenp)
+{
+    char *hdr, *ret;
+    off_t clen;
+    size_t len;
+    
+    if((hdr = getheader(resp, "content-length")) != NULL) {
+	if((clen = atoo(hdr)) > maxobj)
+	    return(NULL);
+	if(biorensure(hd, clen) < 0)
+	    return(NULL);
+	if(biordata(hd) < clen)
+	    return(NULL);
+	len = clen;
+    } else {
+	while(!hd->eof && (biordata(hd) <= maxobj)) {
+	    if(biofillsome(hd) < 0)
+		return(NULL);
+	}
+	if(biordata(hd) > maxobj)
+	    return(NULL);
+	len = biordata(hd);
+    }
+    ret = smalloc(max(len, 1));
+    memcpy(ret, hd->rbuf.b + hd->rh, len);
+    hd->rh += len;
+    *lenp = len;
+    return(ret);
+}
+
+/* Lets requests waiting for the one fetching the entry go, if this is
+ * the one. */
+static void release(struct cacheent *ent)
+{
+    struct muth **waiting;
+    int i, n;
+    
+    if(ent->fetcher != current)
+	return;
+    ent->fetcher = NULL;
+    waiting = ent->waiting.b;
+    n = ent->waiting.d;
+    bufinit(ent->waiting);
+    for(i = 0; i < n; i++)
+	resume(waiting[i], 1);
+    free(waiting);
+}
+
+/* Records that responses for the entry are not being stored, so that
+ * requests for it do not wait for one another for a while. */
+static void passent(struct cacheent *ent)
+{
+    ent->passuntil = time(NULL) + PASSTIME;
+    release(ent);
+}
+
+/*
+ * Passes the request on to the child. If given a cache entry and the
+ * response may be stored, the stored variant is returned for the
+ * caller to serve. Otherwise, the response is relayed to the client
+ * as it is, or as a 304 if it satisfies the request's validators.
+ */
+static struct variant *fetch(struct hthead *req, struct bufio *cl, struct stdiofd *cli, struct cacheent *ent)
+{
+    int pfds[2];
+    struct hthead *resp;
+    struct bufio *hd;
+    struct stdiofd *hdi;
+    struct variant *var;
+    char *body, *inm, *ims;
+    size_t blen;
+    time_t expires;
+    int err;
+    
+    hd = NULL;
+    resp = NULL;
+    var = NULL;
+    inm = ims = NULL;
+    if(socketpair(PF_UNIX, SOCK_STREAM, 0, pfds))
+	goto out;
+    hd = mtbioopen(pfds[1], 1, 600, "r+", &hdi);
+    if(ent != NULL) {
+	/* The cache must be given a full response to store, so that
+	 * it can answer conditional requests by itself. */
+	if((inm = getheader(req, "if-none-match")) != NULL)
+	    inm = sstrdup(inm);
+	if((ims = getheader(req, "if-modified-since")) != NULL)
+	    ims = sstrdup(ims);
+	headrmheader(req, "if-none-match");
+	headrmheader(req, "if-modified-since");
+    }
+    err = sendreq(ch, req, pfds[0]);
+    close(pfds[0]);
+    if(inm != NULL) {
+	headappheader(req, "If-None-Match", inm);
+	free(inm);
+    }
+    if(ims != NULL) {
+	headappheader(req, "If-Modified-Since", ims);
+	free(ims);
+    }
+    if(err)
+	goto out;
+    
+    if(passdata(cl, hd))
+	goto out;
+    if(bioflush(hd))
+	goto out;
+    shutdown(pfds[1], SHUT_WR);
+    if((resp = parseresponseb(hd)) == NULL)
+	goto out;
+    if(hdi->rights >= 0) {
+	cli->sendrights = hdi->rights;
+	hdi->rights = -1;
+	if(ent != NULL)
+	    passent(ent);
+	ent = NULL;
+    }
+    
+    body = NULL;
+    if((ent != NULL) && ((expires = freshness(req, resp, time(NULL))) > 0))
+	body = readbody(hd, resp, &blen);
+    if(body != NULL) {
+	ent->passuntil = 0;
+	var = store(ent, req, resp, body, blen, expires);
+	goto out;
+    }
+    if(ent != NULL) {
+	/* Others need not wait for a response that may take any time
+	 * to relay. */
+	passent(ent);
+	if(notmodified(req, resp)) {
+	    send304(cl, resp);
+	    goto out;
+	}
+    }
+    writerespb(cl, resp);
+    bioprintf(cl, "\r\n");
+    passdata(hd, cl);
+    
+out:
+    if(resp != NULL)
+	freehthead(resp);
+    if(hd != NULL)
+	bioclose(hd);
+    return(var);
+}
+
+static void serve(struct muth *mt, va_list args)
+{
+    vavar(struct hthead *, req);
+    vavar(int, fd);
+    struct bufio *cl;
+    struct stdiofd *cli;
+    struct cacheent *ent;
+    struct variant *var;
+    char *key;
+    int i, collapsed, nocache;
+    time_t now;
+    
+    cl = mtbioopen(fd, 1, 600, "r+", &cli);
+    if(!reqcacheable(req)) {
+	fetch(req, cl, cli, NULL);
+	goto out;
+    }
+    key = mkkey(req);
+    ent = getent(key);
+    free(key);
+    nocache = reqnocache(req);
+    collapsed = 0;
+    while(1) {
+	now = time(NULL);
+	if(!nocache && ((var = findvar(ent, req, now)) != NULL)) {
+	    sendcached(req, cl, var, now);
+	    break;
+	}
+	if(!strcasecmp(req->method, "head")) {
+	    fetch(req, cl, cli, NULL);
+	    break;
+	}
+	if(!collapsed && (now < ent->passuntil))
+	    collapsed = 1;
+	if((ent->fetcher != NULL) && !collapsed) {
+	    /* Wait for the request already underway and look again
+	     * once it has finished, but not forever. */
+	    bufadd(ent->waiting, current);
+	    if(block(-1, 0, COLLAPSEWAIT) == 0) {
+		for(i = 0; i < ent->waiting.d; i++) {
+		    if(ent->waiting.b[i] == current) {
+			bufdel(ent->waiting, i);
+			break;
+		    }
+		}
+	    }
+	    collapsed = 1;
+	    continue;
+	}
+	if(!collapsed)
+	    ent->fetcher = current;
+	var = fetch(req, cl, cli, ent);
+	release(ent);
+	if(var != NULL) {
+	    sendcached(req, cl, var, time(NULL));
+	    putvar(var);
+	}
+	break;
+    }
+    putent(ent);
+    
+out:
+    freehthead(req);
+    bioclose(cl);
+}
+
+static void listenloop(struct muth *mt, va_list args)
+{
+    vavar(int, lfd);
+    int fd;
+    struct hthead *req;
+    
+    while(1) {
+	block(lfd, EV_READ, 0);
+	if((fd = recvreq(lfd, &req)) < 0) {
+	    if(errno != 0)
+		flog(LOG_ERR, "htcache: error in recvreq: %s", strerror(errno));
+	    exit(1);
+	}
+	mustart(serve, req, fd);
+    }
+}
+
+static void chwatch(struct muth *mt, va_list args)
+{
+    vavar(int, cfd);
+    
+    block(cfd, EV_READ, 0);
+    exitioloop(1);
+}
+
+static size_t parsesize(char *arg)
+{
+    char *p;
+    size_t ret;
+    
+    ret = strtoul(arg, &p, 10);
+    switch(*p) {
+    case 'g': case 'G':
+	ret <<= 10;
+    case 'm': case 'M':
+	ret <<= 10;
+    case 'k': case 'K':
+	ret <<= 10;
+    }
+    return(ret);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: htcache [-h] [-s SIZE] [-o MAXOBJ] CHILD [ARGS...]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    
+    while((c = getopt(argc, argv, "+hs:o:")) >= 0) {
+	switch(c) {
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	case 's':
+	    budget = parsesize(optarg);
+	    break;
+	case 'o':
+	    maxobj = parsesize(optarg);
+	    break;
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    if((ch = stdmkchild(argv + optind, NULL, NULL)) < 0) {
+	flog(LOG_ERR, "htcache: could not fork child: %s", strerror(errno));
+	exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    mustart(listenloop, 0);
+    mustart(chwatch, ch);
+    ioloop();
+    return(0);
+}
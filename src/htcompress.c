@@ -0,0 +1,624 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <req.h>
+#include <proc.h>
+#include <mt.h>
+#include <mtio.h>
+#include <bufio.h>
+
+#define CF_NONE 0
+#define CF_FLUSH 1
+#define CF_END 2
+/* How long to wait for more of a response of unknown length before
+ * deciding whether it is worth compressing. */
+#define IDLEWAIT 0.05
+
+struct encoder {
+    char *name, *alias;
+    int level;
+    void *(*init)(int level);
+    int (*write)(void *st, struct bufio *out, char *buf, size_t len, int flush);
+    void (*release)(void *st);
+};
+
+static int ch;
+static off_t minsize = 256;
+static char **types = NULL;
+static char *deftypes[] = {
+    "text/*",
+    "application/json",
+    "application/*+json",
+    "application/javascript",
+    "application/xml",
+    "application/*+xml",
+    "image/svg+xml",
+    NULL,
+};
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+struct zstdstate {
+    ZSTD_CCtx *cx;
+    char ob[65536];
+};
+
+static void *zstdinit(int level)
+{
+    struct zstdstate *st;
+    
+    omalloc(st);
+    if((st->cx = ZSTD_createCCtx()) == NULL) {
+	free(st);
+	return(NULL);
+    }
+    ZSTD_CCtx_setParameter(st->cx, ZSTD_c_compressionLevel, level);
+    return(st);
+}
+
+static int zstdwrite(void *stp, struct bufio *out, char *buf, size_t len, int flush)
+{
+    struct zstdstate *st = stp;
+    ZSTD_inBuffer ib;
+    ZSTD_outBuffer ob;
+    ZSTD_EndDirective dir;
+    size_t rem;
+    
+    ib.src = buf;
+    ib.size = len;
+    ib.pos = 0;
+    dir = (flush == CF_END) ? ZSTD_e_end : ((flush == CF_FLUSH) ? ZSTD_e_flush : ZSTD_e_continue);
+    do {
+	ob.dst = st->ob;
+	ob.size = sizeof(st->ob);
+	ob.pos = 0;
+	rem = ZSTD_compressStream2(st->cx, &ob, &ib, dir);
+	if(ZSTD_isError(rem))
+	    return(-1);
+	if((ob.pos > 0) && (biowrite(out, st->ob, ob.pos) < 0))
+	    return(-1);
+    } while((ib.pos < ib.size) || ((dir != ZSTD_e_continue) && (rem > 0)));
+    return(0);
+}
+
+static void zstdrelease(void *stp)
+{
+    struct zstdstate *st = stp;
+    
+    ZSTD_freeCCtx(st->cx);
+    free(st);
+}
+
+static struct encoder e_zstd = {
+    .name = "zstd",
+    .level = 3,
+    .init = zstdinit,
+    .write = zstdwrite,
+    .release = zstdrelease,
+};
+
+#endif
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+struct gzstate {
+    z_stream zs;
+    char ob[65536];
+};
+
+static void *gzipinit(int level)
+{
+    struct gzstate *st;
+    
+    omalloc(st);
+    if(deflateInit2(&st->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	free(st);
+	return(NULL);
+    }
+    return(st);
+}
+
+static int gzipwrite(void *stp, struct bufio *out, char *buf, size_t len, int flush)
+{
+    struct gzstate *st = stp;
+    int zr, zf;
+    
+    zf = (flush == CF_END) ? Z_FINISH : ((flush == CF_FLUSH) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    st->zs.next_in = (Bytef *)buf;
+    st->zs.avail_in = len;
+    do {
+	st->zs.next_out = (Bytef *)st->ob;
+	st->zs.avail_out = sizeof(st->ob);
+	zr = deflate(&st->zs, zf);
+	if((zr != Z_OK) && (zr != Z_STREAM_END) && (zr != Z_BUF_ERROR))
+	    return(-1);
+	if(((char *)st->zs.next_out > st->ob) && (biowrite(out, st->ob, (char *)st->zs.next_out - st->ob) < 0))
+	    return(-1);
+    } while((st->zs.avail_in > 0) || (st->zs.avail_out == 0) || ((flush == CF_END) && (zr != Z_STREAM_END)));
+    return(0);
+}
+
+static void gziprelease(void *stp)
+{
+    struct gzstate *st = stp;
+    
+    deflateEnd(&st->zs);
+    free(st);
+}
+
+static struct encoder e_gzip = {
+    .name = "gzip", .alias = "x-gzip",
+    .level = 6,
+    .init = gzipinit,
+    .write = gzipwrite,
+    .release = gziprelease,
+};
+
+#endif
+
+/* In order of preference among equally acceptable encodings. */
+static struct encoder *encoders[] = {
+#ifdef HAVE_ZSTD
+    &e_zstd,
+#endif
+#ifdef HAVE_ZLIB
+    &e_gzip,
+#endif
+    NULL,
+};
+
+static struct encoder *findenc(char *name)
+{
+    int i;
+    
+    for(i = 0; encoders[i] != NULL; i++) {
+	if(!strcmp(encoders[i]->name, name))
+	    return(encoders[i]);
+    }
+    return(NULL);
+}
+
+static char *trim(char *s)
+{
+    char *e;
+    
+    for(; isspace(*s); s++);
+    for(e = s + strlen(s); (e > s) && isspace(e[-1]); e--);
+    *e = 0;
+    return(s);
+}
+
+/* Checks for a token in a comma-separated header value. */
+static int hastoken(char *list, char *tok)
+{
+    char *buf, *el, *p, *sp;
+    int rv;
+    
+    rv = 0;
+    buf = sstrdup(list);
+    for(el = strtok_r(buf, ",", &sp); el != NULL; el = strtok_r(NULL, ",", &sp)) {
+	if((p = strchr(el, '=')) != NULL)
+	    *p = 0;
+	if(!strcasecmp(trim(el), tok)) {
+	    rv = 1;
+	    break;
+	}
+    }
+    free(buf);
+    return(rv);
+}
+
+/*
+ * Returns the q-value given to the encoding in an Accept-Encoding
+ * header, falling back on any wildcard, or zero if it is not
+ * acceptable at all.
+ */
+static double acceptq(char *accept, struct encoder *enc)
+{
+    char *buf, *el, *par, *p, *sp, *ps;
+    double q, ret, star;
+    
+    ret = star = -1;
+    buf = sstrdup(accept);
+    for(el = strtok_r(buf, ",", &sp); el != NULL; el = strtok_r(NULL, ",", &sp)) {
+	q = 1;
+	if((par = strchr(el, ';')) != NULL) {
+	    *(par++) = 0;
+	    for(p = strtok_r(par, ";", &ps); p != NULL; p = strtok_r(NULL, ";", &ps)) {
+		p = trim(p);
+		if(((p[0] == 'q') || (p[0] == 'Q')) && (p[1] == '='))
+		    q = atof(p + 2);
+	    }
+	}
+	el = trim(el);
+	if(!strcasecmp(el, enc->name) || (enc->alias && !strcasecmp(el, enc->alias)))
+	    ret = q;
+	else if(!strcmp(el, "*"))
+	    star = q;
+    }
+    free(buf);
+    if(ret < 0)
+	ret = star;
+    return((ret < 0) ? 0 : ret);
+}
+
+static struct encoder *chooseenc(char *accept)
+{
+    int i;
+    double q, mq;
+    struct encoder *ret;
+    
+    if(accept == NULL)
+	return(NULL);
+    ret = NULL;
+    mq = 0;
+    for(i = 0; encoders[i] != NULL; i++) {
+	if((q = acceptq(accept, encoders[i])) > mq) {
+	    ret = encoders[i];
+	    mq = q;
+	}
+    }
+    return(ret);
+}
+
+static int ctypeok(char *ctype)
+{
+    char *buf, *p;
+    int i, rv;
+    
+    buf = sstrdup(ctype);
+    if((p = strchr(buf, ';')) != NULL)
+	*p = 0;
+    p = trim(buf);
+    for(i = 0; p[i]; i++)
+	p[i] = tolower(p[i]);
+    rv = 0;
+    for(i = 0; types[i] != NULL; i++) {
+	if(!fnmatch(types[i], p, 0)) {
+	    rv = 1;
+	    break;
+	}
+    }
+    free(buf);
+    return(rv);
+}
+
+/*
+ * Checks whether the response is of the kind that could be
+ * compressed at all, regardless of what the client accepts.
+ */
+static int compressible(struct hthead *req, struct hthead *resp)
+{
+    char *hd;
+    
+    if(!strcasecmp(req->method, "head"))
+	return(0);
+    if((resp->code < 200) || (resp->code == 204) || (resp->code == 206) || (resp->code == 304))
+	return(0);
+    if(((hd = getheader(resp, "content-encoding")) != NULL) && strcasecmp(hd, "identity"))
+	return(0);
+    if(getheader(resp, "content-range") || getheader(resp, "transfer-encoding"))
+	return(0);
+    if(((hd = getheader(resp, "cache-control")) != NULL) && hastoken(hd, "no-transform"))
+	return(0);
+    if(((hd = getheader(resp, "content-type")) == NULL) || !ctypeok(hd))
+	return(0);
+    return(1);
+}
+
+static void addvary(struct hthead *resp)
+{
+    char *hd;
+    
+    if((hd = getheader(resp, "vary")) == NULL) {
+	headappheader(resp, "Vary", "Accept-Encoding");
+    } else if(!hastoken(hd, "accept-encoding") && !hastoken(hd, "*")) {
+	hd = sprintf2("%s, Accept-Encoding", hd);
+	headrmheader(resp, "vary");
+	headappheader(resp, "Vary", hd);
+	free(hd);
+    }
+}
+
+/*
+ * A strong ETag must change with the representation, so tag the
+ * encoding onto it in the manner of most other servers.
+ */
+static void fixetag(struct hthead *resp, struct encoder *enc)
+{
+    char *hd;
+    size_t len;
+    
+    if(((hd = getheader(resp, "etag")) == NULL) || ((len = strlen(hd)) < 2) || (hd[len - 1] != '\"'))
+	return;
+    hd = sprintf2("%.*s-%s\"", (int)(len - 1), hd, enc->name);
+    headrmheader(resp, "etag");
+    headappheader(resp, "ETag", hd);
+    free(hd);
+}
+
+static int passdata(struct bufio *in, struct bufio *out)
+{
+    ssize_t read;
+    
+    while(!bioeof(in)) {
+	if((read = biordata(in)) > 0) {
+	    if((read = biowritesome(out, in->rbuf.b + in->rh, read)) < 0)
+		return(-1);
+	    in->rh += read;
+	}
+	if(biorspace(in) && (biofillsome(in) < 0))
+	    return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Compresses everything from the handler. Whenever the handler has
+ * nothing more to offer for the moment, the compressor is flushed
+ * so that streamed responses are not held back.
+ */
+static int compressdata(struct bufio *in, struct stdiofd *ini, struct bufio *out, struct encoder *enc, void *st)
+{
+    size_t read;
+    int pending;
+    struct pollfd pfd;
+    
+    pending = 0;
+    while(!bioeof(in)) {
+	if((read = biordata(in)) > 0) {
+	    if(enc->write(st, out, in->rbuf.b + in->rh, read, CF_NONE))
+		return(-1);
+	    in->rh += read;
+	    pending = 1;
+	}
+	if(pending && !in->eof) {
+	    pfd.fd = ini->fd;
+	    pfd.events = POLLIN;
+	    if(poll(&pfd, 1, 0) == 0) {
+		if(enc->write(st, out, NULL, 0, CF_FLUSH) || bioflush(out))
+		    return(-1);
+		pending = 0;
+	    }
+	}
+	if(biorspace(in) && (biofillsome(in) < 0))
+	    return(-1);
+    }
+    if(enc->write(st, out, NULL, 0, CF_END))
+	return(-1);
+    return(0);
+}
+
+/*
+ * Reads ahead until MIN bytes of the response are buffered, or until
+ * the handler has finished it or stops sending for a moment, so that
+ * streamed responses, such as event streams, are not held back
+ * while deciding whether they are worth compressing.
+ */
+static int readahead(struct bufio *in, struct stdiofd *ini, size_t min)
+{
+    while(!in->eof && (biordata(in) < min)) {
+	if(block2(ini->fd, EV_READ, IDLEWAIT) == 0)
+	    break;
+	if(biofillsome(in) < 0)
+	    return(-1);
+    }
+    return(0);
+}
+
+static void filterreq(struct muth *mt, va_list args)
+{
+    vavar(struct hthead *, req);
+    vavar(int, fd);
+    int pfds[2];
+    char *hdr;
+    struct hthead *resp;
+    struct bufio *cl, *hd;
+    struct stdiofd *cli, *hdi;
+    struct encoder *enc;
+    void *st;
+    
+    hd = NULL;
+    resp = NULL;
+    st = NULL;
+    cl = mtbioopen(fd, 1, 600, "r+", &cli);
+    enc = chooseenc(getheader(req, "accept-encoding"));
+    if(socketpair(PF_UNIX, SOCK_STREAM, 0, pfds))
+	goto out;
+    hd = mtbioopen(pfds[1], 1, 600, "r+", &hdi);
+    if(sendreq(ch, req, pfds[0])) {
+	close(pfds[0]);
+	goto out;
+    }
+    close(pfds[0]);
+    
+    if(passdata(cl, hd))
+	goto out;
+    if(bioflush(hd))
+	goto out;
+    shutdown(pfds[1], SHUT_WR);
+    if((resp = parseresponseb(hd)) == NULL)
+	goto out;
+    cli->sendrights = hdi->rights;
+    hdi->rights = -1;
+    
+    if(compressible(req, resp)) {
+	addvary(resp);
+	if((hdr = getheader(resp, "content-length")) != NULL) {
+	    if(atoo(hdr) < minsize)
+		enc = NULL;
+	} else {
+	    /* Look far enough ahead to tell whether the response is
+	     * too small to be worth compressing. */
+	    if(readahead(hd, hdi, minsize) < 0)
+		goto out;
+	    if(hd->eof && (biordata(hd) < minsize)) {
+		headappheader(resp, "Content-Length", sprintf3("%zi", biordata(hd)));
+		enc = NULL;
+	    }
+	}
+	if((enc != NULL) && ((st = enc->init(enc->level)) == NULL)) {
+	    flog(LOG_WARNING, "htcompress: could not initialize %s compressor", enc->name);
+	    enc = NULL;
+	}
+    } else {
+	enc = NULL;
+    }
+    
+    if(enc != NULL) {
+	headrmheader(resp, "content-length");
+	headrmheader(resp, "content-encoding");
+	headrmheader(resp, "accept-ranges");
+	headappheader(resp, "Content-Encoding", enc->name);
+	fixetag(resp, enc);
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if(compressdata(hd, hdi, cl, enc, st))
+	    goto out;
+    } else {
+	writerespb(cl, resp);
+	bioprintf(cl, "\r\n");
+	if(passdata(hd, cl))
+	    goto out;
+    }
+    
+out:
+    if(st != NULL)
+	enc->release(st);
+    freehthead(req);
+    if(resp != NULL)
+	freehthead(resp);
+    bioclose(cl);
+    if(hd != NULL)
+	bioclose(hd);
+}
+
+static void listenloop(struct muth *mt, va_list args)
+{
+    vavar(int, lfd);
+    int fd;
+    struct hthead *req;
+    
+    while(1) {
+	block(lfd, EV_READ, 0);
+	if((fd = recvreq(lfd, &req)) < 0) {
+	    if(errno != 0)
+		flog(LOG_ERR, "htcompress: error in recvreq: %s", strerror(errno));
+	    exit(1);
+	}
+	mustart(filterreq, req, fd);
+    }
+}
+
+static void chwatch(struct muth *mt, va_list args)
+{
+    vavar(int, cfd);
+    
+    block(cfd, EV_READ, 0);
+    exitioloop(1);
+}
+
+static void usage(FILE *out)
+{
+    int i;
+    
+    fprintf(out, "usage: htcompress [-h] [-l ENCODING=LEVEL] [-m MINSIZE] [-t TYPE]... CHILD [ARGS...]\n");
+    fprintf(out, "supported encodings:");
+    for(i = 0; encoders[i] != NULL; i++)
+	fprintf(out, " %s", encoders[i]->name);
+    fprintf(out, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    char *p;
+    struct encoder *enc;
+    struct charvbuf tbuf;
+    
+    bufinit(tbuf);
+    while((c = getopt(argc, argv, "+hl:m:t:")) >= 0) {
+	switch(c) {
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	case 'l':
+	    if((p = strchr(optarg, '=')) == NULL) {
+		usage(stderr);
+		exit(1);
+	    }
+	    *(p++) = 0;
+	    if((enc = findenc(optarg)) == NULL) {
+		flog(LOG_ERR, "htcompress: unsupported encoding: %s", optarg);
+		exit(1);
+	    }
+	    enc->level = atoi(p);
+	    break;
+	case 'm':
+	    minsize = atoo(optarg);
+	    break;
+	case 't':
+	    bufadd(tbuf, optarg);
+	    break;
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    if(tbuf.d > 0) {
+	bufadd(tbuf, NULL);
+	types = tbuf.b;
+    } else {
+	types = deftypes;
+    }
+    if(encoders[0] == NULL)
+	flog(LOG_WARNING, "htcompress: compiled without any compression support, passing responses through as they are");
+    if((ch = stdmkchild(argv + optind, NULL, NULL)) < 0) {
+	flog(LOG_ERR, "htcompress: could not fork child: %s", strerror(errno));
+	exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    mustart(listenloop, 0);
+    mustart(chwatch, ch);
+    ioloop();
+    return(0);
+}
@@ -20,8 +20,12 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <string.h>
+#include <strings.h>
+#include <signal.h>
 #include <errno.h>
 #include <time.h>
 #include <stdint.h>
@@ -33,7 +37,23 @@
 #include <utils.h>
 #include <resp.h>
 #include <log.h>
-#include <resp.h>
+#include <req.h>
+#include <mt.h>
+#include <mtio.h>
+
+/*
+ * When run as a persistent handler, htls keeps the listings it has
+ * rendered, keyed by the directory's device, inode and modification
+ * time. Since that time does not change when the files in it are
+ * merely modified, listings including their sizes or modification
+ * times are only kept for a short while. Directories may also carry
+ * a listing rendered in advance by `htls -w', in a file named
+ * .htls-cache, which is used for as long as the directory's
+ * modification time matches the one recorded in it.
+ */
+
+#define CACHEFILE ".htls-cache"
+#define SHORTCACHE 10
 
 struct dentry {
     char *name;
@@ -41,24 +61,21 @@ struct dentry {
     int w, x;
 };
 
+struct listing {
+    struct listing *next, *prev;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t made;
+    int refs;
+    struct charbuf body;
+};
+
 static int dispmtime = 0;
 static int dispsize = 0;
 static char *stylesheet = NULL;
-
-static void checkcache(struct stat *sb)
-{
-    char *hdr;
-    
-    if((hdr = getenv("REQ_IF_MODIFIED_SINCE")) != NULL) {
-	if(parsehttpdate(hdr) < sb->st_mtime)
-	    return;
-	printf("HTTP/1.1 304 Not Modified\n");
-	printf("Date: %s\n", fmthttpdate(time(NULL)));
-	printf("Content-Length: 0\n");
-	printf("\n");
-	exit(0);
-    }
-}
+static struct listing *cache = NULL;
+static size_t cachesize = 0, maxcache = 64 << 20;
 
 static int dcmp(const void *ap, const void *bp)
 {
@@ -107,7 +124,7 @@ static void foot(struct charbuf *dst)
     bprintf(dst, "</html>\n");
 }
 
-static void mkindex(char *name, DIR *dir, struct charbuf *dst)
+static size_t readentries(DIR *dir, struct dentry **ret)
 {
     struct {
 	struct dentry *b;
@@ -115,73 +132,426 @@ static void mkindex(char *name, DIR *dir, struct charbuf *dst)
     } dirbuf;
     struct dentry f;
     struct dirent *dent;
-    char *fn;
-    int i;
+    int dfd;
     
     bufinit(dirbuf);
+    dfd = dirfd(dir);
     while((dent = readdir(dir)) != NULL) {
 	if(*dent->d_name == '.')
 	    continue;
 	memset(&f, 0, sizeof(f));
-	f.name = sstrdup(dent->d_name);
-	fn = sprintf3("%s/%s", name, dent->d_name);
-	if(access(fn, R_OK))
+	if(faccessat(dfd, dent->d_name, R_OK, 0))
 	    continue;
-	if(stat(fn, &f.sb))
+	if(fstatat(dfd, dent->d_name, &f.sb, 0))
 	    continue;
-	if(!access(fn, W_OK))
+	if(!faccessat(dfd, dent->d_name, W_OK, 0))
 	    f.w = 1;
-	if(!access(fn, X_OK))
+	if(!faccessat(dfd, dent->d_name, X_OK, 0))
 	    f.x = 1;
 	else if(S_ISDIR(f.sb.st_mode))
 	    continue;
+	f.name = sstrdup(dent->d_name);
 	bufadd(dirbuf, f);
     }
     qsort(dirbuf.b, dirbuf.d, sizeof(struct dentry), dcmp);
+    *ret = dirbuf.b;
+    return(dirbuf.d);
+}
+
+/* If OUT is given, the listing is written to it as it is rendered,
+ * whenever enough of it has accumulated in DST. */
+static void mkindex(struct dentry *ents, size_t n, struct charbuf *dst, FILE *out)
+{
+    int i;
+    
     bprintf(dst, "<div class=\"dirindex\"><table>\n");
-    for(i = 0; i < dirbuf.d; i++) {
+    for(i = 0; i < n; i++) {
 	bprintf(dst, "<tr class=\"dentry");
-	if(S_ISDIR(dirbuf.b[i].sb.st_mode)) {
+	if(S_ISDIR(ents[i].sb.st_mode)) {
 	    bprintf(dst, " dir");
 	} else {
-	    if(dirbuf.b[i].x)
+	    if(ents[i].x)
 		bprintf(dst, " exec");
 	}
-	if(dirbuf.b[i].w)
+	if(ents[i].w)
 	    bprintf(dst, " writable");
 	bprintf(dst, "\">");	
-	bprintf(dst, "<td class=\"filename\"><a href=\"%s\">", htmlquote(urlquote(dirbuf.b[i].name)));
-	bprintf(dst, "%s", htmlquote(dirbuf.b[i].name));
+	bprintf(dst, "<td class=\"filename\"><a href=\"%s\">", htmlquote(urlquote(ents[i].name)));
+	bprintf(dst, "%s", htmlquote(ents[i].name));
 	bprintf(dst, "</a></td>");
 	if(dispsize) {
 	    bprintf(dst, "<td class=\"filesize\">");
-	    if(!S_ISDIR(dirbuf.b[i].sb.st_mode))
-		bprintf(dst, "%ji", (intmax_t)dirbuf.b[i].sb.st_size);
+	    if(!S_ISDIR(ents[i].sb.st_mode))
+		bprintf(dst, "%ji", (intmax_t)ents[i].sb.st_size);
 	    bprintf(dst, "</td>");
 	}
 	if(dispmtime)
-	    bprintf(dst, "<td class=\"filemtime\">%s</td>", fmthttpdate(dirbuf.b[i].sb.st_mtime));
+	    bprintf(dst, "<td class=\"filemtime\">%s</td>", fmthttpdate(ents[i].sb.st_mtime));
 	bprintf(dst, "</tr>\n");
-	free(dirbuf.b[i].name);
+	if((out != NULL) && (dst->d >= 65536)) {
+	    fwrite(dst->b, 1, dst->d, out);
+	    dst->d = 0;
+	}
     }
     bprintf(dst, "</table></div>\n");
 }
 
+static void freeentries(struct dentry *ents, size_t n)
+{
+    size_t i;
+    
+    for(i = 0; i < n; i++)
+	free(ents[i].name);
+    free(ents);
+}
+
+static char *cacheflags(void)
+{
+    return(sprintf3("%c%c", dispmtime?'m':'-', dispsize?'s':'-'));
+}
+
+/*
+ * A precomputed listing consists of a header line of the form
+ * `htls-cache 1 FLAGS MTIME-SEC MTIME-NSEC LENGTH', followed by the
+ * listing itself. It is valid if the flags match the options htls is
+ * running with, the directory's modification time matches, and the
+ * file is complete.
+ */
+static FILE *opencachefile(int dfd, struct stat *dsb, off_t *len)
+{
+    int fd, ver;
+    FILE *in;
+    char flags[8];
+    intmax_t sec, nsec, clen;
+    struct stat sb;
+    struct timespec mtime;
+    
+    mtime = stmtime(dsb);
+    if((fd = openat(dfd, CACHEFILE, O_RDONLY)) < 0)
+	return(NULL);
+    if((in = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	return(NULL);
+    }
+    if((fscanf(in, "htls-cache %i %7s %ji %ji %ji\n", &ver, flags, &sec, &nsec, &clen) != 5) ||
+       (ver != 1) || strcmp(flags, cacheflags()) ||
+       (sec != mtime.tv_sec) || (nsec != mtime.tv_nsec) ||
+       fstat(fd, &sb) || (sb.st_size != ftello(in) + clen)) {
+	fclose(in);
+	return(NULL);
+    }
+    *len = clen;
+    return(in);
+}
+
+static int writecache(char *path)
+{
+    DIR *dir;
+    FILE *out;
+    struct stat sb, lsb;
+    struct timespec mtime;
+    struct dentry *ents;
+    struct charbuf body;
+    size_t n, i;
+    int fd, dfd, ret;
+    char *sub;
+    
+    if((dir = opendir(path)) == NULL) {
+	flog(LOG_ERR, "htls: could not open directory `%s': %s", path, strerror(errno));
+	return(-1);
+    }
+    dfd = dirfd(dir);
+    /* The cache file is created before examining the directory, and
+     * then overwritten in place, so that writing it does not change
+     * the directory's modification time. */
+    if(((fd = openat(dfd, CACHEFILE, O_WRONLY | O_CREAT, 0644)) < 0) || ((out = fdopen(fd, "w")) == NULL)) {
+	flog(LOG_ERR, "htls: could not open %s/%s for writing: %s", path, CACHEFILE, strerror(errno));
+	if(fd >= 0)
+	    close(fd);
+	closedir(dir);
+	return(-1);
+    }
+    fstat(dfd, &sb);
+    mtime = stmtime(&sb);
+    n = readentries(dir, &ents);
+    bufinit(body);
+    mkindex(ents, n, &body, NULL);
+    fprintf(out, "htls-cache 1 %s %ji %ji %zi\n", cacheflags(), (intmax_t)mtime.tv_sec, (intmax_t)mtime.tv_nsec, body.d);
+    fwrite(body.b, 1, body.d, out);
+    fflush(out);
+    if(ftruncate(fd, ftello(out)) || ferror(out)) {
+	flog(LOG_ERR, "htls: could not write %s/%s: %s", path, CACHEFILE, strerror(errno));
+	ret = -1;
+    } else {
+	ret = 0;
+    }
+    fclose(out);
+    buffree(body);
+    for(i = 0; i < n; i++) {
+	if(S_ISDIR(ents[i].sb.st_mode) && !fstatat(dfd, ents[i].name, &lsb, AT_SYMLINK_NOFOLLOW) && S_ISDIR(lsb.st_mode)) {
+	    sub = sprintf2("%s/%s", path, ents[i].name);
+	    if(writecache(sub))
+		ret = -1;
+	    free(sub);
+	}
+    }
+    freeentries(ents, n);
+    closedir(dir);
+    return(ret);
+}
+
+/*
+ * Listings are referenced both by the cache and by any request that
+ * is still sending one, since writing to the client may block and let
+ * another request evict it in the meantime.
+ */
+static void droplisting(struct listing *ls)
+{
+    if(--ls->refs > 0)
+	return;
+    buffree(ls->body);
+    free(ls);
+}
+
+static void uncache(struct listing *ls)
+{
+    if(ls->next)
+	ls->next->prev = ls->prev;
+    if(ls->prev)
+	ls->prev->next = ls->next;
+    if(ls == cache)
+	cache = ls->next;
+    cachesize -= ls->body.d;
+    droplisting(ls);
+}
+
+/* Returns a new reference to a cached listing, if it is current. */
+static struct listing *getlisting(struct stat *sb)
+{
+    struct listing *ls;
+    struct timespec mtime;
+    
+    for(ls = cache; ls != NULL; ls = ls->next) {
+	if((ls->dev == sb->st_dev) && (ls->ino == sb->st_ino))
+	    break;
+    }
+    if(ls == NULL)
+	return(NULL);
+    mtime = stmtime(sb);
+    if((ls->mtime.tv_sec != mtime.tv_sec) || (ls->mtime.tv_nsec != mtime.tv_nsec) ||
+       ((dispmtime || dispsize) && (time(NULL) - ls->made >= SHORTCACHE))) {
+	uncache(ls);
+	return(NULL);
+    }
+    if(ls != cache) {
+	ls->prev->next = ls->next;
+	if(ls->next)
+	    ls->next->prev = ls->prev;
+	ls->prev = NULL;
+	ls->next = cache;
+	cache->prev = ls;
+	cache = ls;
+    }
+    ls->refs++;
+    return(ls);
+}
+
+/* Adds a listing to the cache, which takes over its reference. */
+static void putlisting(struct listing *ls)
+{
+    struct listing *last;
+    
+    ls->prev = NULL;
+    ls->next = cache;
+    if(cache != NULL)
+	cache->prev = ls;
+    cache = ls;
+    cachesize += ls->body.d;
+    while(cachesize > maxcache) {
+	for(last = cache; last->next != NULL; last = last->next);
+	if(last == ls)
+	    break;
+	uncache(last);
+    }
+}
+
+static void passdata(FILE *in, FILE *out)
+{
+    char buf[65536];
+    size_t ret;
+    
+    while((ret = fread(buf, 1, sizeof(buf), in)) > 0) {
+	if(fwrite(buf, 1, ret, out) != ret)
+	    break;
+    }
+}
+
+static void sendhead(FILE *out, struct stat *sb, ssize_t len)
+{
+    fprintf(out, "HTTP/1.1 200 OK\n");
+    fprintf(out, "Content-Type: text/html; charset=UTF-8\n");
+    fprintf(out, "Last-Modified: %s\n", fmthttpdate(sb->st_mtime));
+    if(len >= 0)
+	fprintf(out, "Content-Length: %zi\n", len);
+    fprintf(out, "\n");
+}
+
+/* CACHING tells whether rendered listings may be kept. */
+static void serve2(FILE *out, char *dname, char *url, char *ims, int ishead, int caching)
+{
+    DIR *dir;
+    FILE *cf;
+    struct stat sb;
+    struct charbuf hbuf, fbuf, body;
+    struct dentry *ents;
+    struct listing *ls;
+    size_t n;
+    off_t clen;
+    
+    if(((dir = opendir(dname)) == NULL) || fstat(dirfd(dir), &sb)) {
+	flog(LOG_ERR, "htls: could not open directory `%s': %s", dname, strerror(errno));
+	simpleerror2(out, 500, "Server Error", "Could not produce directory index.");
+	if(dir != NULL)
+	    closedir(dir);
+	return;
+    }
+    if((ims != NULL) && (parsehttpdate(ims) >= sb.st_mtime)) {
+	fprintf(out, "HTTP/1.1 304 Not Modified\n");
+	fprintf(out, "Date: %s\n", fmthttpdate(time(NULL)));
+	fprintf(out, "Content-Length: 0\n");
+	fprintf(out, "\n");
+	closedir(dir);
+	return;
+    }
+    bufinit(hbuf);
+    bufinit(fbuf);
+    head(url, &hbuf);
+    foot(&fbuf);
+    if((cf = opencachefile(dirfd(dir), &sb, &clen)) != NULL) {
+	sendhead(out, &sb, hbuf.d + clen + fbuf.d);
+	if(!ishead) {
+	    fwrite(hbuf.b, 1, hbuf.d, out);
+	    passdata(cf, out);
+	    fwrite(fbuf.b, 1, fbuf.d, out);
+	}
+	fclose(cf);
+    } else if(caching && ((ls = getlisting(&sb)) != NULL)) {
+	sendhead(out, &sb, hbuf.d + ls->body.d + fbuf.d);
+	if(!ishead) {
+	    fwrite(hbuf.b, 1, hbuf.d, out);
+	    fwrite(ls->body.b, 1, ls->body.d, out);
+	    fwrite(fbuf.b, 1, fbuf.d, out);
+	}
+	droplisting(ls);
+    } else {
+	n = readentries(dir, &ents);
+	/* Listings that are unlikely to fit in the cache are streamed
+	 * instead. */
+	if(caching && (n < maxcache / 512)) {
+	    bufinit(body);
+	    mkindex(ents, n, &body, NULL);
+	    sendhead(out, &sb, hbuf.d + body.d + fbuf.d);
+	    if(!ishead) {
+		fwrite(hbuf.b, 1, hbuf.d, out);
+		fwrite(body.b, 1, body.d, out);
+		fwrite(fbuf.b, 1, fbuf.d, out);
+	    }
+	    omalloc(ls);
+	    ls->dev = sb.st_dev;
+	    ls->ino = sb.st_ino;
+	    ls->mtime = stmtime(&sb);
+	    ls->made = time(NULL);
+	    ls->refs = 1;
+	    ls->body = body;
+	    putlisting(ls);
+	} else {
+	    sendhead(out, &sb, -1);
+	    if(!ishead) {
+		mkindex(ents, n, &hbuf, out);
+		fwrite(hbuf.b, 1, hbuf.d, out);
+		fwrite(fbuf.b, 1, fbuf.d, out);
+	    }
+	}
+	freeentries(ents, n);
+    }
+    buffree(hbuf);
+    buffree(fbuf);
+    closedir(dir);
+}
+
+static void serve(struct muth *muth, va_list args)
+{
+    vavar(struct hthead *, req);
+    vavar(int, fd);
+    FILE *out;
+    char *dname;
+    
+    out = mtstdopen(fd, 1, 60, "r+", NULL);
+    if((dname = getheader(req, "X-Ash-File")) == NULL) {
+	flog(LOG_ERR, "htls: needs to be called with the X-Ash-File header");
+	simpleerror2(out, 500, "Internal Error", "The server is incorrectly configured.");
+    } else if(*req->rest) {
+	simpleerror2(out, 404, "Not Found", "The requested URL has no corresponding resource.");
+    } else {
+	serve2(out, dname, req->url, getheader(req, "If-Modified-Since"), !strcasecmp(req->method, "head"), 1);
+    }
+    fclose(out);
+    freehthead(req);
+}
+
+static void listenloop(struct muth *muth, va_list args)
+{
+    vavar(int, lfd);
+    int fd;
+    struct hthead *req;
+    
+    while(1) {
+	block(lfd, EV_READ, 0);
+	if((fd = recvreq(lfd, &req)) < 0) {
+	    if(errno != 0)
+		flog(LOG_ERR, "recvreq: %s", strerror(errno));
+	    break;
+	}
+	mustart(serve, req, fd);
+    }
+}
+
+static void sigterm(int sig)
+{
+    shutdown(0, SHUT_RDWR);
+}
+
+static size_t parsesize(char *arg)
+{
+    char *p;
+    size_t ret;
+    
+    ret = strtoul(arg, &p, 10);
+    switch(*p) {
+    case 'g': case 'G':
+	ret <<= 10;
+    case 'm': case 'M':
+	ret <<= 10;
+    case 'k': case 'K':
+	ret <<= 10;
+    }
+    return(ret);
+}
+
 static void usage(void)
 {
-    flog(LOG_ERR, "usage: htls [-hms] [-c STYLESHEET] METHOD URL REST");
+    flog(LOG_ERR, "usage: htls [-hms] [-c STYLESHEET] [-C CACHE-SIZE] [METHOD URL REST]");
+    flog(LOG_ERR, "       htls [-ms] -w DIR...");
 }
 
 int main(int argc, char **argv)
 {
-    int c;
+    int c, i, write, ret;
     char *dname;
-    DIR *dir;
-    struct charbuf buf;
-    struct stat sb;
     
     setlocale(LC_ALL, "");
-    while((c = getopt(argc, argv, "hmsc:")) >= 0) {
+    write = 0;
+    while((c = getopt(argc, argv, "hmswc:C:")) >= 0) {
 	switch(c) {
 	case 'h':
 	    usage();
@@ -192,14 +562,35 @@ int main(int argc, char **argv)
 	case 's':
 	    dispsize = 1;
 	    break;
+	case 'w':
+	    write = 1;
+	    break;
 	case 'c':
 	    stylesheet = optarg;
 	    break;
+	case 'C':
+	    maxcache = parsesize(optarg);
+	    break;
 	default:
 	    usage();
 	    exit(1);
 	}
     }
+    if(write) {
+	ret = 0;
+	for(i = optind; i < argc; i++) {
+	    if(writecache(argv[i]))
+		ret = 1;
+	}
+	return(ret);
+    }
+    if(argc == optind) {
+	signal(SIGINT, sigterm);
+	signal(SIGTERM, sigterm);
+	mustart(listenloop, 0);
+	ioloop();
+	return(0);
+    }
     if(argc - optind < 3) {
 	usage();
 	exit(1);
@@ -212,26 +603,6 @@ int main(int argc, char **argv)
 	simpleerror(1, 404, "Not Found", "The requested URL has no corresponding resource.");
 	exit(0);
     }
-
-    if(stat(dname, &sb) || ((dir = opendir(dname)) == NULL)) {
-	flog(LOG_ERR, "htls: could not open directory `%s': %s", dname, strerror(errno));
-	simpleerror(1, 500, "Server Error", "Could not produce directory index.");
-	exit(1);
-    }
-    checkcache(&sb);
-    
-    bufinit(buf);
-    head(argv[optind + 1], &buf);
-    mkindex(dname, dir, &buf);
-    foot(&buf);
-    closedir(dir);
-    
-    printf("HTTP/1.1 200 OK\n");
-    printf("Content-Type: text/html; charset=UTF-8\n");
-    printf("Last-Modified: %s\n", fmthttpdate(sb.st_mtime));
-    printf("Content-Length: %zi\n", buf.d);
-    printf("\n");
-    fwrite(buf.b, 1, buf.d, stdout);
-    buffree(buf);
+    serve2(stdout, dname, argv[optind + 1], getenv("REQ_IF_MODIFIED_SINCE"), !strcasecmp(argv[optind], "head"), 0);
     return(0);
 }
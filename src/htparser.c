@@ -36,14 +36,19 @@
 #include <req.h>
 #include <proc.h>
 #include <bufio.h>
+#include <stats.h>
 
 #include "htparser.h"
 
 static int plex;
 static int daemonize, usesyslog;
+static int nconns, draining;
+static struct muth *plexmuth, *statmuth, *tracemuth, *homuth;
+static FILE *pidout;
 struct mtbuf listeners;
+struct htstats stats;
 
-static void trimx(struct hthead *req)
+void trimx(struct hthead *req)
 {
     int i;
     
@@ -142,6 +147,7 @@ static off_t passdata(struct bufio *in, struct bufio *out, off_t max)
 		return(-1);
 	    in->rh += read;
 	    total += read;
+	    statinc(stats.bytes, read);
 	}
 	if(biorspace(in) && ((max < 0) || (biordata(in) < max - total)) && (biofillsome(in) < 0))
 	    return(-1);
@@ -189,6 +195,7 @@ static int recvchunks(struct bufio *in, struct bufio *out)
 		    return(-1);
 		in->rh += read;
 		chlen -= read;
+		statinc(stats.bytes, read);
 	    }
 	    if(biorspace(in) && (biordata(in) < chlen) && (biofillsome(in) <= 0))
 		return(-1);
@@ -213,6 +220,7 @@ static int passchunks(struct bufio *in, struct bufio *out)
 	    if(biowrite(out, in->rbuf.b + in->rh, read) != read)
 		return(-1);
 	    in->rh += read;
+	    statinc(stats.bytes, read);
 	    bioprintf(out, "\r\n");
 	    if(bioflush(out) < 0)
 		return(-1);
@@ -285,7 +293,7 @@ static int http10keep(struct hthead *req, struct hthead *resp)
     }
 }
 
-static char *connid(void)
+char *connid(void)
 {
     static struct charbuf cur;
     int i;
@@ -347,38 +355,95 @@ static void passduplex(struct bufio *a, int afd, struct bufio *b, int bfd)
     }
 }
 
-void serve(struct bufio *in, int infd, struct conn *conn)
+int plexreq(struct hthead *req)
 {
     int pfds[2];
+    
+    if((plex < 0) || block(plex, EV_WRITE, 60) <= 0)
+	return(-1);
+    if(socketpair(PF_UNIX, SOCK_STREAM, 0, pfds))
+	return(-1);
+    if(sendreq(plex, req, pfds[0])) {
+	close(pfds[0]);
+	close(pfds[1]);
+	return(-1);
+    }
+    close(pfds[0]);
+    return(pfds[1]);
+}
+
+static void drained(void);
+
+/*
+ * After a handoff, the old process keeps its root handler until its
+ * last connection is done, so that requests it has already begun
+ * reading can still be served.
+ */
+static void connend(void)
+{
+    if((--nconns == 0) && draining)
+	drained();
+}
+
+void serve(struct bufio *in, int infd, struct conn *conn)
+{
+    int fd;
     struct bufio *out, *dout;
     struct stdiofd *outi;
     struct hthead *req, *resp;
+    struct trace *tr;
     char *hd, *id;
     off_t dlen;
     int keep, duplex;
+    uintmax_t t;
     
+    nconns++;
     id = connid();
     out = NULL;
     req = resp = NULL;
+    tr = NULL;
     while(plex >= 0) {
 	bioflush(in);
+	/* Only start timing the parse once the request has begun
+	 * arriving, to leave out keep-alive idle time. */
+	if((biordata(in) == 0) && ((conn->handoff ? hofillsome(in, infd) : biofillsome(in)) <= 0))
+	    break;
+	t = statnow();
 	if((req = parsereq(in)) == NULL)
 	    break;
+	if(!strcmp(req->method, "PRI") && !strcmp(req->url, "*") && !strcmp(req->ver, "HTTP/2.0")) {
+	    /* An HTTP/2 connection with prior knowledge, the first
+	     * part of whose preface looks like a request. */
+	    freehthead(req);
+	    free(id);
+	    serveh2(in, infd, conn, H2PREFACE + strlen("PRI * HTTP/2.0\r\n\r\n"));
+	    connend();
+	    return;
+	}
 	if(!canonreq(req))
 	    break;
+	stathadd(stats.parse, statnow() - t);
 	
 	headappheader(req, "X-Ash-Connection-ID", id);
+	tr = tracereq(req, t);
 	if((conn->initreq != NULL) && conn->initreq(conn, req))
 	    break;
-	
-	if((plex < 0) || block(plex, EV_WRITE, 60) <= 0)
-	    break;
-	if(socketpair(PF_UNIX, SOCK_STREAM, 0, pfds))
+	if(ratelimit(req)) {
+	    bioprintf(in, "%s 429 Too many requests\r\n", req->ver);
+	    bioprintf(in, "Content-Type: text/plain\r\n");
+	    bioprintf(in, "Content-Length: 18\r\n");
+	    bioprintf(in, "Connection: close\r\n");
+	    bioprintf(in, "\r\n");
+	    bioprintf(in, "Too many requests\n");
 	    break;
-	if(sendreq(plex, req, pfds[0]))
+	}
+	
+	statinc(stats.reqs, 1);
+	t = statnow();
+	if((fd = plexreq(req)) < 0)
 	    break;
-	close(pfds[0]);
-	out = mtbioopen(pfds[1], 1, 600, "r+", &outi);
+	stathadd(stats.dispatch, statnow() - t);
+	out = mtbioopen(fd, 1, 600, "r+", &outi);
 
 	if(getheader(req, "content-type") != NULL) {
 	    if((hd = getheader(req, "content-length")) != NULL) {
@@ -398,10 +463,13 @@ void serve(struct bufio *in, int infd, struct conn *conn)
 	if(bioflush(out))
 	    break;
 	/* Make sure to send EOF */
-	shutdown(pfds[1], SHUT_WR);
+	shutdown(fd, SHUT_WR);
 	
+	t = statnow();
 	if((resp = parseresponseb(out)) == NULL)
 	    break;
+	stathadd(stats.ttfb, statnow() - t);
+	tracehead(tr);
 	replstr(&resp->ver, req->ver);
 	
 	if(!getheader(resp, "server"))
@@ -470,6 +538,8 @@ void serve(struct bufio *in, int infd, struct conn *conn)
 
 	bioclose(out);
 	out = NULL;
+	tracedone(tr, req, resp);
+	tr = NULL;
 	freehthead(req);
 	freehthead(resp);
 	req = resp = NULL;
@@ -477,12 +547,73 @@ void serve(struct bufio *in, int infd, struct conn *conn)
     
     if(out != NULL)
 	bioclose(out);
+    if(tr != NULL)
+	tracedone(tr, req, resp);
     if(req != NULL)
 	freehthead(req);
     if(resp != NULL)
 	freehthead(resp);
     bioclose(in);
     free(id);
+    connend();
+}
+
+/* Stops the coroutines that would otherwise keep the ioloop going. */
+static void stopaux(void)
+{
+    if(statmuth != NULL)
+	resume(statmuth, 0);
+    if(tracemuth != NULL)
+	resume(tracemuth, 0);
+    if(homuth != NULL)
+	resume(homuth, 0);
+    statmuth = tracemuth = homuth = NULL;
+}
+
+static void stoplistening(void)
+{
+    while(listeners.d > 0)
+	resume(listeners.b[0], 0);
+    stopaux();
+    flog(LOG_INFO, "no longer listening");
+    if(pidout != NULL) {
+	putc('\n', pidout);
+	fflush(pidout);
+    }
+}
+
+static void drained(void)
+{
+    int i;
+    
+    for(i = 0; i < listeners.d; i++) {
+	if(listeners.b[i] == plexmuth) {
+	    resume(plexmuth, 0);
+	    break;
+	}
+    }
+    stopaux();
+}
+
+/* Called once a new process has taken over in a handoff. */
+static void handedoff(void)
+{
+    int i;
+    
+    draining = 1;
+    for(i = 0; i < listeners.d;) {
+	if(listeners.b[i] == plexmuth)
+	    i++;
+	else
+	    resume(listeners.b[i], 0);
+    }
+    flog(LOG_INFO, "no longer listening");
+    if(pidout != NULL) {
+	putc('\n', pidout);
+	fflush(pidout);
+    }
+    if(nconns == 0)
+	drained();
 }
 
 static void plexwatch(struct muth *muth, va_list args)
@@ -518,6 +649,7 @@ static void plexwatch(struct muth *muth, va_list args)
 	flog(LOG_INFO, "root handler exited, so shutting down listening...");
 	while(listeners.d > 0)
 	    resume(listeners.b[0], 0);
+	stopaux();
     }
 }
 
@@ -539,13 +671,15 @@ static void initroot(void *uu)
 	putenv("ASHD_USESYSLOG=1");
     else
 	unsetenv("ASHD_USESYSLOG");
+    tracechild();
 }
 
 static void usage(FILE *out)
 {
-    fprintf(out, "usage: htparser [-hSf] [-u USER] [-r ROOT] [-p PIDFILE] PORTSPEC... -- ROOT [ARGS...]\n");
+    fprintf(out, "usage: htparser [-hSf] [-u USER] [-r ROOT] [-p PIDFILE] [-R RATESPEC] [-T TRACEFILE] PORTSPEC... -- ROOT [ARGS...]\n");
     fprintf(out, "\twhere PORTSPEC is HANDLER[:PAR[=VAL][(,PAR[=VAL])...]] (try HANDLER:help)\n");
     fprintf(out, "\tavailable handlers are `plain' and `ssl'.\n");
+    fprintf(out, "\tRATESPEC is PAR=VAL[,PAR=VAL...] (try -R help)\n");
 }
 
 static void addport(char *spec)
@@ -601,18 +735,32 @@ static void sighandler(int sig)
     exitioloop(1);
 }
 
+static void hosighandler(int sig)
+{
+    exitioloop(2);
+}
+
 int main(int argc, char **argv)
 {
     int c, d;
-    int i, s1;
-    char *root, *pidfile, *pidtmp;
-    FILE *pidout;
+    int i, s1, sfd;
+    char *root, *pidfile, *pidtmp, *tracefile;
+    char **hoargv;
     struct passwd *pwent;
     
     daemonize = usesyslog = 0;
-    root = pidfile = NULL;
+    /* The port specifications are modified as they are parsed. */
+    hoargv = szmalloc(sizeof(*hoargv) * (argc + 1));
+    for(i = 0; i < argc; i++)
+	hoargv[i] = sstrdup(argv[i]);
+    root = pidfile = tracefile = NULL;
+    stats.reqs = statcnt("requests");
+    stats.bytes = statcnt("bytes");
+    stats.parse = stathist("parse");
+    stats.dispatch = stathist("dispatch");
+    stats.ttfb = stathist("ttfb");
     pwent = NULL;
-    while((c = getopt(argc, argv, "+hSfu:r:p:")) >= 0) {
+    while((c = getopt(argc, argv, "+hSfu:r:p:R:T:")) >= 0) {
 	switch(c) {
 	case 'h':
 	    usage(stdout);
@@ -635,11 +783,18 @@ int main(int argc, char **argv)
 	case 'p':
 	    pidfile = optarg[0] ? optarg : NULL;
 	    break;
+	case 'R':
+	    handleratelimit(optarg);
+	    break;
+	case 'T':
+	    tracefile = optarg[0] ? optarg : NULL;
+	    break;
 	default:
 	    usage(stderr);
 	    exit(1);
 	}
     }
+    hoinit();
     s1 = 0;
     for(i = optind; i < argc; i++) {
 	if(!strcmp(argv[i], "--"))
@@ -651,11 +806,13 @@ int main(int argc, char **argv)
 	usage(stderr);
 	exit(1);
     }
+    if((tracefile != NULL) && traceinit(tracefile))
+	return(1);
     if((plex = stdmkchild(argv + ++i, initroot, NULL)) < 0) {
 	flog(LOG_ERR, "could not spawn root multiplexer: %s", strerror(errno));
 	return(1);
     }
-    bufadd(listeners, mustart(plexwatch, plex));
+    bufadd(listeners, plexmuth = mustart(plexwatch, plex));
     pidout = NULL;
     if(pidfile != NULL) {
 	pidtmp = sprintf3("%s.new", pidfile);
@@ -671,6 +828,8 @@ int main(int argc, char **argv)
     }
     if(usesyslog)
 	opensyslog();
+    /* The stats socket must be created before chrooting. */
+    sfd = statinit("htparser");
     if(root) {
 	if(chdir(root) || chroot(root)) {
 	    flog(LOG_ERR, "could not chroot to %s: %s", root, strerror(errno));
@@ -691,13 +850,17 @@ int main(int argc, char **argv)
     signal(SIGCHLD, SIG_IGN);
     signal(SIGINT, sighandler);
     signal(SIGTERM, sighandler);
+    signal(SIGUSR2, hosighandler);
     if(daemonize) {
 	daemon(0, 0);
     }
+    statmuth = mtstatserve(sfd);
+    tracemuth = tracestart();
     if(pidout != NULL) {
 	fprintf(pidout, "%i\n", getpid());
 	fflush(pidout);
     }
+    homuth = hoready();
     d = 0;
     while(!d) {
 	switch(ioloop()) {
@@ -705,17 +868,16 @@ int main(int argc, char **argv)
 	    d = 1;
 	    break;
 	case 1:
-	    if(listeners.d > 0) {
-		while(listeners.d > 0)
-		    resume(listeners.b[0], 0);
-		flog(LOG_INFO, "no longer listening");
-		if(pidout != NULL) {
-		    putc('\n', pidout);
-		    fflush(pidout);
-		}
-	    } else {
+	    if(listeners.d > 0)
+		stoplistening();
+	    else
 		d = 1;
-	    }
+	    break;
+	case 2:
+	    if(root != NULL)
+		flog(LOG_WARNING, "htparser: cannot hand off to a new process when chrooted");
+	    else if(listeners.d > 0)
+		hostart(hoargv, handedoff);
 	    break;
 	}
     }
@@ -1,9 +1,13 @@
 #ifndef _ASH_HTPARSER_H
 #define _ASH_HTPARSER_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 struct conn {
     int (*initreq)(struct conn *, struct hthead *);
     void *pdata;
+    int handoff;
 };
 
 struct mtbuf {
@@ -11,12 +15,50 @@ struct mtbuf {
     size_t s, d;
 };
 
+struct htstats {
+    struct statcnt *reqs, *bytes;
+    struct stathist *parse, *dispatch, *ttfb;
+};
+
+#define H2PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+struct hpack;
+struct trace;
+struct bufio;
+
 void serve(struct bufio *in, int infd, struct conn *conn);
+void serveh2(struct bufio *in, int infd, struct conn *conn, char *preface);
+int plexreq(struct hthead *req);
+void trimx(struct hthead *req);
+char *connid(void);
+
+struct hpack *mkhpack(size_t max);
+void freehpack(struct hpack *hp);
+int hpdecode(struct hpack *hp, unsigned char *buf, size_t len, struct hthead *head);
+void hpencode(struct charbuf *buf, char *name, char *val);
+void hpencstatus(struct charbuf *buf, int code);
+
+int traceinit(char *path);
+void tracechild(void);
+struct muth *tracestart(void);
+struct trace *tracereq(struct hthead *req, uintmax_t start);
+void tracehead(struct trace *tr);
+void tracedone(struct trace *tr, struct hthead *req, struct hthead *resp);
+
+void holisten(int fd);
+int hotake(int family, int port);
+void hoinit(void);
+struct muth *hoready(void);
+ssize_t hofillsome(struct bufio *in, int fd);
+void hostart(char **argv, void (*stop)(void));
 
 int listensock4(int port);
 int listensock6(int port);
 char *formathaddress(struct sockaddr *name, socklen_t namelen);
 void handleplain(int argc, char **argp, char **argv);
+void adopttcp(int fd, char *pre, size_t prelen);
+void handleratelimit(char *spec);
+int ratelimit(struct hthead *req);
 #ifdef HAVE_GNUTLS
 void handlegnussl(int argc, char **argp, char **argv);
 #endif
@@ -25,5 +67,6 @@ void handleossl(int argc, char **argp, char **argv);
 #endif
 
 extern struct mtbuf listeners;
+extern struct htstats stats;
 
 #endif
@@ -80,22 +80,25 @@ static int mklisten(char *path)
 
 static void runclient(int sk)
 {
-    int fd;
-    struct hthead *req;
+    int i, n;
+    int fds[REQBATCH];
+    struct hthead *reqs[REQBATCH];
     
     while(1) {
-	if((fd = recvreq(0, &req)) < 0) {
+	if((n = recvreqs(0, reqs, fds, REQBATCH, RECVREQ_LAZY)) < 0) {
 	    if(errno == 0)
 		break;
 	    flog(LOG_ERR, "htpipe: error in recvreq: %s", strerror(errno));
 	    exit(1);
 	}
-	if(sendreq(sk, req, fd)) {
+	if(sendreqs(sk, reqs, fds, n, MSG_NOSIGNAL) != n) {
 	    flog(LOG_ERR, "htpipe: could not pass request across pipe: %s", strerror(errno));
 	    exit(1);
 	}
-	freehthead(req);
-	close(fd);
+	for(i = 0; i < n; i++) {
+	    freehthead(reqs[i]);
+	    close(fds[i]);
+	}
     }
 }
 
@@ -122,7 +125,7 @@ static void runserver(int lsk, int ch)
 	}
 	for(i = 0; i < ncl; i++) {
 	    if(pfd[i].revents & POLLIN) {
-		if((rfd = recvreq(cl[i], &req)) < 0) {
+		if((rfd = recvreq2(cl[i], &req, RECVREQ_LAZY)) < 0) {
 		    if(errno != 0)
 			flog(LOG_ERR, "htpipe: error from client: %s", strerror(errno));
 		    close(cl[i]);
@@ -41,8 +41,9 @@ static void usage(FILE *out)
 int main(int argc, char **argv)
 {
     int c, timeout, ret;
-    int ch, fd;
-    struct hthead *req;
+    int ch, i, n;
+    int fds[REQBATCH];
+    struct hthead *reqs[REQBATCH];
     struct pollfd pfd[2];
     time_t lreq, now;
     
@@ -84,18 +85,20 @@ int main(int argc, char **argv)
 	}
 	now = time(NULL);
 	if(pfd[0].revents) {
-	    if((fd = recvreq(0, &req)) < 0) {
+	    if((n = recvreqs(0, reqs, fds, REQBATCH, RECVREQ_LAZY)) < 0) {
 		if(errno == 0)
 		    break;
 		flog(LOG_ERR, "httimed: error in recvreq: %s", strerror(errno));
 		exit(1);
 	    }
-	    if(sendreq(ch, req, fd)) {
+	    if(sendreqs(ch, reqs, fds, n, MSG_NOSIGNAL) != n) {
 		flog(LOG_ERR, "httimed: could not pass request to child: %s", strerror(errno));
 		exit(1);
 	    }
-	    freehthead(req);
-	    close(fd);
+	    for(i = 0; i < n; i++) {
+		freehthead(reqs[i]);
+		close(fds[i]);
+	    }
 	}
 	if((pfd[1].revents & POLLHUP) || (now - lreq > timeout)) {
 	    timeout = -1;
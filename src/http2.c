@@ -0,0 +1,844 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * HTTP/2 connections, as per RFC 9113. The connection's own
+ * coroutine reads and dispatches frames, a writer coroutine sends
+ * all queued frames, and each stream gets a coroutine of its own,
+ * which passes its request on to the root handler exactly as an
+ * HTTP/1 request would be.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <mt.h>
+#include <mtio.h>
+#include <log.h>
+#include <req.h>
+#include <bufio.h>
+#include <stats.h>
+
+#include "htparser.h"
+
+#define FT_DATA 0
+#define FT_HEADERS 1
+#define FT_PRIORITY 2
+#define FT_RST_STREAM 3
+#define FT_SETTINGS 4
+#define FT_PUSH_PROMISE 5
+#define FT_PING 6
+#define FT_GOAWAY 7
+#define FT_WINDOW_UPDATE 8
+#define FT_CONTINUATION 9
+
+#define FL_END_STREAM 0x1
+#define FL_ACK 0x1
+#define FL_END_HEADERS 0x4
+#define FL_PADDED 0x8
+#define FL_PRIORITY 0x20
+
+#define ER_NO_ERROR 0
+#define ER_PROTOCOL_ERROR 1
+#define ER_INTERNAL_ERROR 2
+#define ER_FLOW_CONTROL_ERROR 3
+#define ER_STREAM_CLOSED 5
+#define ER_FRAME_SIZE_ERROR 6
+#define ER_REFUSED_STREAM 7
+#define ER_CANCEL 8
+#define ER_COMPRESSION_ERROR 9
+
+#define ST_HEADER_TABLE_SIZE 1
+#define ST_MAX_CONCURRENT_STREAMS 3
+#define ST_INITIAL_WINDOW_SIZE 4
+#define ST_MAX_FRAME_SIZE 5
+
+#define MAXSTREAMS 100
+#define MAXFRAME 16384
+#define MAXHBLOCK 262144
+#define DEFWINDOW 65535
+#define MAXQUEUE 262144
+
+struct h2frame {
+    struct h2frame *next;
+    size_t len;
+    unsigned char *data;
+};
+
+struct h2conn {
+    struct bufio *io;
+    int fd;
+    struct conn *conn;
+    char *id;
+    struct hpack *dec;
+    struct h2stream *streams;
+    int nstreams, lastid, closing, werr, wgen;
+    int contid, contfl;
+    struct charbuf hblock;
+    long sendwin, initwin, rcredit;
+    size_t maxframe, qsize;
+    struct h2frame *outq, **outqt;
+    struct muth *writer, *wwait, *rwait;
+};
+
+struct h2stream {
+    struct h2stream *next, *prev;
+    struct h2conn *c;
+    int id, fd;
+    int rclosed, reset, wgen;
+    long sendwin, recvwin;
+    struct charbuf in;
+    struct hthead *req;
+    struct trace *tr;
+    struct muth *wait;
+};
+
+static unsigned int getu32(unsigned char *p)
+{
+    return(((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | (unsigned int)p[3]);
+}
+
+static void putu32(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static void queueframe(struct h2conn *c, int type, int flags, int id, const void *data, size_t len)
+{
+    struct h2frame *f;
+    
+    omalloc(f);
+    f->len = len + 9;
+    f->data = smalloc(f->len);
+    f->data[0] = (len >> 16) & 0xff;
+    f->data[1] = (len >> 8) & 0xff;
+    f->data[2] = len & 0xff;
+    f->data[3] = type;
+    f->data[4] = flags;
+    putu32(f->data + 5, id & 0x7fffffff);
+    if(len > 0)
+	memcpy(f->data + 9, data, len);
+    *c->outqt = f;
+    c->outqt = &f->next;
+    c->qsize += f->len;
+    if(c->wwait != NULL)
+	resume(c->wwait, 0);
+}
+
+static void sendrst(struct h2conn *c, int id, int code)
+{
+    unsigned char buf[4];
+    
+    putu32(buf, code);
+    queueframe(c, FT_RST_STREAM, 0, id, buf, 4);
+}
+
+static void sendgoaway(struct h2conn *c, int code)
+{
+    unsigned char buf[8];
+    
+    putu32(buf, c->lastid);
+    putu32(buf + 4, code);
+    queueframe(c, FT_GOAWAY, 0, 0, buf, 8);
+}
+
+static void sendwinupd(struct h2conn *c, int id, long inc)
+{
+    unsigned char buf[4];
+    
+    putu32(buf, inc);
+    queueframe(c, FT_WINDOW_UPDATE, 0, id, buf, 4);
+}
+
+/*
+ * Resumes every stream that is waiting for something to happen on
+ * the connection. Since resumed streams may finish or wake other
+ * streams in turn, the list is rescanned after each resumption.
+ */
+static void wakestreams(struct h2conn *c)
+{
+    struct h2stream *st;
+    int gen;
+    
+    gen = ++c->wgen;
+    while(1) {
+	for(st = c->streams; st != NULL; st = st->next) {
+	    if((st->wait != NULL) && (st->wgen < gen))
+		break;
+	}
+	if(st == NULL)
+	    break;
+	st->wgen = gen;
+	resume(st->wait, 0);
+    }
+}
+
+static void waitstream(struct h2stream *st)
+{
+    st->wait = current;
+    yield();
+    st->wait = NULL;
+}
+
+static void h2writer(struct muth *muth, va_list args)
+{
+    vavar(struct h2conn *, c);
+    struct h2frame *f;
+    size_t len;
+    
+    while(1) {
+	if((f = c->outq) == NULL) {
+	    if(!c->werr && bioflush(c->io)) {
+		c->werr = 1;
+		shutdown(c->fd, SHUT_RDWR);
+	    }
+	    if(c->outq != NULL)
+		continue;
+	    if(c->closing && (c->nstreams == 0))
+		break;
+	    c->wwait = current;
+	    yield();
+	    c->wwait = NULL;
+	    continue;
+	}
+	if((c->outq = f->next) == NULL)
+	    c->outqt = &c->outq;
+	c->qsize -= (len = f->len);
+	if(!c->werr && (biowrite(c->io, f->data, len) != len)) {
+	    c->werr = 1;
+	    shutdown(c->fd, SHUT_RDWR);
+	}
+	free(f->data);
+	free(f);
+	if((c->qsize < MAXQUEUE / 2) && (c->qsize + len >= MAXQUEUE / 2))
+	    wakestreams(c);
+    }
+    c->writer = NULL;
+    if(c->rwait != NULL)
+	resume(c->rwait, 0);
+}
+
+static struct h2stream *findstream(struct h2conn *c, int id)
+{
+    struct h2stream *st;
+    
+    for(st = c->streams; st != NULL; st = st->next) {
+	if(st->id == id)
+	    return(st);
+    }
+    return(NULL);
+}
+
+static void freestream(struct h2stream *st)
+{
+    struct h2conn *c;
+    
+    c = st->c;
+    if(st->next)
+	st->next->prev = st->prev;
+    if(st->prev)
+	st->prev->next = st->next;
+    if(st == c->streams)
+	c->streams = st->next;
+    c->nstreams--;
+    if(st->tr != NULL)
+	tracedone(st->tr, st->req, NULL);
+    if(st->req != NULL)
+	freehthead(st->req);
+    buffree(st->in);
+    free(st);
+    if(c->rwait != NULL)
+	resume(c->rwait, 0);
+}
+
+static void abortstream(struct h2stream *st)
+{
+    st->reset = 1;
+    if(st->fd >= 0)
+	shutdown(st->fd, SHUT_RDWR);
+    if(st->wait != NULL)
+	resume(st->wait, 0);
+}
+
+static void sendheaders(struct h2conn *c, struct h2stream *st, struct hthead *resp, int end)
+{
+    struct charbuf buf;
+    char *name;
+    int i, o, type, flags;
+    size_t off, len;
+    
+    bufinit(buf);
+    hpencstatus(&buf, resp->code);
+    for(i = 0; i < resp->noheaders; i++) {
+	name = sstrdup(resp->headers[i][0]);
+	for(o = 0; name[o]; o++) {
+	    if((name[o] >= 'A') && (name[o] <= 'Z'))
+		name[o] += 'a' - 'A';
+	}
+	if(strcmp(name, "connection") && strcmp(name, "keep-alive") && strcmp(name, "proxy-connection") &&
+	   strcmp(name, "transfer-encoding") && strcmp(name, "upgrade"))
+	    hpencode(&buf, name, resp->headers[i][1]);
+	free(name);
+    }
+    type = FT_HEADERS;
+    off = 0;
+    do {
+	len = min(buf.d - off, c->maxframe);
+	flags = (off + len >= buf.d) ? FL_END_HEADERS : 0;
+	if((type == FT_HEADERS) && end)
+	    flags |= FL_END_STREAM;
+	queueframe(c, type, flags, st->id, buf.b + off, len);
+	type = FT_CONTINUATION;
+	off += len;
+    } while(off < buf.d);
+    buffree(buf);
+}
+
+static void simpleresp(struct h2conn *c, struct h2stream *st, int code, char *msg, char *body)
+{
+    struct hthead *resp;
+    
+    resp = mkresp(code, msg, "HTTP/2");
+    headappheader(resp, "Content-Type", "text/plain");
+    headappheader(resp, "Content-Length", sprintf3("%zi", strlen(body)));
+    sendheaders(c, st, resp, 0);
+    queueframe(c, FT_DATA, FL_END_STREAM, st->id, body, strlen(body));
+    freehthead(resp);
+}
+
+/*
+ * Waits for enough flow-control window to send at least some data,
+ * and returns how much may be sent.
+ */
+static long sendwindow(struct h2conn *c, struct h2stream *st)
+{
+    while(!st->reset) {
+	if((st->sendwin > 0) && (c->sendwin > 0) && (c->qsize < MAXQUEUE))
+	    return(min(min(st->sendwin, c->sendwin), c->maxframe));
+	waitstream(st);
+    }
+    return(0);
+}
+
+static void h2stream(struct muth *muth, va_list args)
+{
+    vavar(struct h2stream *, st);
+    struct h2conn *c;
+    struct hthead *req, *resp;
+    struct bufio *out;
+    struct stdiofd *outi;
+    char *hd;
+    size_t n;
+    long w;
+    off_t clen, sent;
+    int end;
+    uintmax_t t;
+    
+    c = st->c;
+    req = st->req;
+    out = NULL;
+    resp = NULL;
+    headappheader(req, "X-Ash-Connection-ID", c->id);
+    if((c->conn->initreq != NULL) && c->conn->initreq(c->conn, req)) {
+	sendrst(c, st->id, ER_INTERNAL_ERROR);
+	goto out;
+    }
+    if(ratelimit(req)) {
+	simpleresp(c, st, 429, "Too many requests", "Too many requests\n");
+	goto out;
+    }
+    statinc(stats.reqs, 1);
+    t = statnow();
+    if((st->fd = plexreq(req)) < 0) {
+	sendrst(c, st->id, ER_REFUSED_STREAM);
+	goto out;
+    }
+    stathadd(stats.dispatch, statnow() - t);
+    out = mtbioopen(st->fd, 1, 600, "r+", &outi);
+    
+    while(!st->reset) {
+	if(st->in.d > 0) {
+	    n = st->in.d;
+	    if(biowrite(out, st->in.b, n) != n)
+		break;
+	    statinc(stats.bytes, n);
+	    memmove(st->in.b, st->in.b + n, st->in.d -= n);
+	    st->recvwin += n;
+	    if(!st->rclosed)
+		sendwinupd(c, st->id, n);
+	    continue;
+	}
+	if(st->rclosed)
+	    break;
+	if(bioflush(out))
+	    break;
+	waitstream(st);
+    }
+    if(st->reset || !st->rclosed || bioflush(out)) {
+	if(!st->reset)
+	    sendrst(c, st->id, ER_INTERNAL_ERROR);
+	goto out;
+    }
+    shutdown(st->fd, SHUT_WR);
+    
+    t = statnow();
+    if((resp = parseresponseb(out)) == NULL) {
+	if(!st->reset)
+	    sendrst(c, st->id, ER_INTERNAL_ERROR);
+	goto out;
+    }
+    stathadd(stats.ttfb, statnow() - t);
+    tracehead(st->tr);
+    if(((hd = getheader(resp, "x-ash-switch")) != NULL) && !strcasecmp(hd, "duplex")) {
+	/* There is no reasonable way to tunnel a connection over
+	 * an ordinary HTTP/2 stream. */
+	sendrst(c, st->id, ER_INTERNAL_ERROR);
+	goto out;
+    }
+    if(!getheader(resp, "server"))
+	headappheader(resp, "Server", sprintf3("ashd/%s", VERSION));
+    trimx(resp);
+    clen = -1;
+    if((hd = getheader(resp, "content-length")) != NULL)
+	clen = atoo(hd);
+    if(!strcasecmp(req->method, "head") || (resp->code == 204) || (resp->code == 304))
+	clen = 0;
+    if(st->reset)
+	goto out;
+    sendheaders(c, st, resp, clen == 0);
+    
+    sent = 0;
+    end = (clen == 0);
+    while(!end) {
+	if(biordata(out) == 0) {
+	    if(bioeof(out) || (biofillsome(out) < 0) || st->reset)
+		break;
+	    continue;
+	}
+	if((w = sendwindow(c, st)) <= 0)
+	    break;
+	n = min(biordata(out), w);
+	if(clen >= 0)
+	    n = min(n, clen - sent);
+	sent += n;
+	end = (clen >= 0) && (sent >= clen);
+	queueframe(c, FT_DATA, end ? FL_END_STREAM : 0, st->id, out->rbuf.b + out->rh, n);
+	out->rh += n;
+	statinc(stats.bytes, n);
+	st->sendwin -= n;
+	c->sendwin -= n;
+    }
+    if(st->reset)
+	goto out;
+    if(!end) {
+	if(clen >= 0)
+	    sendrst(c, st->id, ER_INTERNAL_ERROR);
+	else
+	    queueframe(c, FT_DATA, FL_END_STREAM, st->id, NULL, 0);
+    }
+    
+out:
+    if(out != NULL)
+	bioclose(out);
+    if(resp != NULL) {
+	tracedone(st->tr, req, resp);
+	st->tr = NULL;
+	freehthead(resp);
+    }
+    freestream(st);
+}
+
+/* Converts the fields of an HTTP/2 header block into a request. */
+static struct hthead *mkh2req(struct hthead *fields)
+{
+    struct hthead *req;
+    char *method, *path, *auth, *p;
+    struct charbuf cookie;
+    int i;
+    
+    method = getheader(fields, ":method");
+    path = getheader(fields, ":path");
+    auth = getheader(fields, ":authority");
+    if((method == NULL) || (path == NULL) || (path[0] != '/'))
+	return(NULL);
+    req = mkreq(method, path, "HTTP/2");
+    bufinit(cookie);
+    for(i = 0; i < fields->noheaders; i++) {
+	if(fields->headers[i][0][0] == ':')
+	    continue;
+	if(!strcmp(fields->headers[i][0], "cookie")) {
+	    /* HTTP/2 allows the cookie header to be split. */
+	    if(cookie.d > 0)
+		bufcatstr(cookie, "; ");
+	    bufcatstr(cookie, fields->headers[i][1]);
+	    continue;
+	}
+	if(!strcmp(fields->headers[i][0], "host"))
+	    auth = NULL;
+	headappheader(req, fields->headers[i][0], fields->headers[i][1]);
+    }
+    if(cookie.d > 0) {
+	bufadd(cookie, 0);
+	headappheader(req, "cookie", cookie.b);
+    }
+    buffree(cookie);
+    if(auth != NULL)
+	headappheader(req, "host", auth);
+    replrest(req, req->url + 1);
+    if((p = strchr(req->rest, '?')) != NULL)
+	*p = 0;
+    trimx(req);
+    return(req);
+}
+
+static int gotheaders(struct h2conn *c, int id, int flags, unsigned char *data, size_t len)
+{
+    struct hthead *fields, *req;
+    struct h2stream *st;
+    uintmax_t t;
+    
+    t = statnow();
+    omalloc(fields);
+    if(hpdecode(c->dec, data, len, fields)) {
+	freehthead(fields);
+	sendgoaway(c, ER_COMPRESSION_ERROR);
+	return(-1);
+    }
+    if((st = findstream(c, id)) != NULL) {
+	/* Trailers, which are not passed on. */
+	freehthead(fields);
+	if(st->rclosed) {
+	    sendrst(c, id, ER_STREAM_CLOSED);
+	    abortstream(st);
+	    return(0);
+	}
+	if(!(flags & FL_END_STREAM)) {
+	    sendgoaway(c, ER_PROTOCOL_ERROR);
+	    return(-1);
+	}
+	st->rclosed = 1;
+	if(st->wait != NULL)
+	    resume(st->wait, 0);
+	return(0);
+    }
+    if((id & 1) == 0) {
+	freehthead(fields);
+	sendgoaway(c, ER_PROTOCOL_ERROR);
+	return(-1);
+    }
+    if(id <= c->lastid) {
+	/* A stream that has already been closed. */
+	freehthead(fields);
+	sendrst(c, id, ER_STREAM_CLOSED);
+	return(0);
+    }
+    c->lastid = id;
+    req = mkh2req(fields);
+    freehthead(fields);
+    if(req == NULL) {
+	sendrst(c, id, ER_PROTOCOL_ERROR);
+	return(0);
+    }
+    stathadd(stats.parse, statnow() - t);
+    if(c->nstreams >= MAXSTREAMS) {
+	freehthead(req);
+	sendrst(c, id, ER_REFUSED_STREAM);
+	return(0);
+    }
+    omalloc(st);
+    st->c = c;
+    st->id = id;
+    st->fd = -1;
+    st->req = req;
+    st->tr = tracereq(req, t);
+    st->sendwin = c->initwin;
+    st->recvwin = DEFWINDOW;
+    st->rclosed = (flags & FL_END_STREAM) ? 1 : 0;
+    st->next = c->streams;
+    if(c->streams)
+	c->streams->prev = st;
+    c->streams = st;
+    c->nstreams++;
+    mustart(h2stream, st);
+    return(0);
+}
+
+static int gotsettings(struct h2conn *c, int flags, unsigned char *data, size_t len)
+{
+    struct h2stream *st;
+    unsigned int val;
+    long delta;
+    int id;
+    
+    if(flags & FL_ACK)
+	return(0);
+    if(len % 6) {
+	sendgoaway(c, ER_FRAME_SIZE_ERROR);
+	return(-1);
+    }
+    for(; len > 0; data += 6, len -= 6) {
+	id = (data[0] << 8) | data[1];
+	val = getu32(data + 2);
+	if(id == ST_INITIAL_WINDOW_SIZE) {
+	    if(val > 0x7fffffff) {
+		sendgoaway(c, ER_FLOW_CONTROL_ERROR);
+		return(-1);
+	    }
+	    delta = (long)val - c->initwin;
+	    c->initwin = val;
+	    for(st = c->streams; st != NULL; st = st->next)
+		st->sendwin += delta;
+	} else if(id == ST_MAX_FRAME_SIZE) {
+	    if((val < 16384) || (val > 16777215)) {
+		sendgoaway(c, ER_PROTOCOL_ERROR);
+		return(-1);
+	    }
+	    c->maxframe = val;
+	}
+    }
+    queueframe(c, FT_SETTINGS, FL_ACK, 0, NULL, 0);
+    wakestreams(c);
+    return(0);
+}
+
+static int gotframe(struct h2conn *c, int type, int flags, int id, unsigned char *data, size_t len)
+{
+    struct h2stream *st;
+    size_t pad, flen;
+    unsigned int inc;
+    
+    flen = len;
+    if((c->contid != 0) && (type != FT_CONTINUATION)) {
+	sendgoaway(c, ER_PROTOCOL_ERROR);
+	return(-1);
+    }
+    if((type == FT_DATA) || (type == FT_HEADERS)) {
+	if(id == 0) {
+	    sendgoaway(c, ER_PROTOCOL_ERROR);
+	    return(-1);
+	}
+	pad = 0;
+	if(flags & FL_PADDED) {
+	    if((len < 1) || ((pad = data[0]) >= len)) {
+		sendgoaway(c, ER_PROTOCOL_ERROR);
+		return(-1);
+	    }
+	    data++;
+	    len -= pad + 1;
+	}
+    }
+    switch(type) {
+    case FT_DATA:
+	/* The connection window is given back at once, since every
+	 * stream's own window limits what it may have buffered. */
+	if((c->rcredit += flen) >= DEFWINDOW / 4) {
+	    sendwinupd(c, 0, c->rcredit);
+	    c->rcredit = 0;
+	}
+	if(((st = findstream(c, id)) == NULL) || st->rclosed) {
+	    if(id > c->lastid) {
+		sendgoaway(c, ER_PROTOCOL_ERROR);
+		return(-1);
+	    }
+	    sendrst(c, id, ER_STREAM_CLOSED);
+	    return(0);
+	}
+	/* Padding counts against the window as well, but is given
+	 * back at once since it is never buffered. */
+	if((st->recvwin -= flen) < 0) {
+	    sendrst(c, id, ER_FLOW_CONTROL_ERROR);
+	    abortstream(st);
+	    return(0);
+	}
+	bufcat(st->in, data, len);
+	if(flen > len) {
+	    st->recvwin += flen - len;
+	    if(!(flags & FL_END_STREAM))
+		sendwinupd(c, id, flen - len);
+	}
+	if(flags & FL_END_STREAM)
+	    st->rclosed = 1;
+	if(st->wait != NULL)
+	    resume(st->wait, 0);
+	break;
+    case FT_HEADERS:
+	if(flags & FL_PRIORITY) {
+	    if(len < 5) {
+		sendgoaway(c, ER_PROTOCOL_ERROR);
+		return(-1);
+	    }
+	    data += 5;
+	    len -= 5;
+	}
+	if(!(flags & FL_END_HEADERS)) {
+	    c->contid = id;
+	    c->contfl = flags;
+	    c->hblock.d = 0;
+	    bufcat(c->hblock, data, len);
+	    break;
+	}
+	return(gotheaders(c, id, flags, data, len));
+    case FT_CONTINUATION:
+	if((c->contid == 0) || (id != c->contid)) {
+	    sendgoaway(c, ER_PROTOCOL_ERROR);
+	    return(-1);
+	}
+	if(c->hblock.d + len > MAXHBLOCK) {
+	    sendgoaway(c, ER_PROTOCOL_ERROR);
+	    return(-1);
+	}
+	bufcat(c->hblock, data, len);
+	if(flags & FL_END_HEADERS) {
+	    c->contid = 0;
+	    return(gotheaders(c, id, c->contfl, (unsigned char *)c->hblock.b, c->hblock.d));
+	}
+	break;
+    case FT_RST_STREAM:
+	if((id != 0) && ((st = findstream(c, id)) != NULL))
+	    abortstream(st);
+	break;
+    case FT_SETTINGS:
+	if(id != 0) {
+	    sendgoaway(c, ER_PROTOCOL_ERROR);
+	    return(-1);
+	}
+	return(gotsettings(c, flags, data, len));
+    case FT_PING:
+	if(len != 8) {
+	    sendgoaway(c, ER_FRAME_SIZE_ERROR);
+	    return(-1);
+	}
+	if(!(flags & FL_ACK))
+	    queueframe(c, FT_PING, FL_ACK, 0, data, len);
+	break;
+    case FT_GOAWAY:
+	/* Streams already underway are completed regardless, and the
+	 * client will not start any new ones. */
+	break;
+    case FT_WINDOW_UPDATE:
+	if(len != 4) {
+	    sendgoaway(c, ER_FRAME_SIZE_ERROR);
+	    return(-1);
+	}
+	inc = getu32(data) & 0x7fffffff;
+	if(id == 0) {
+	    if((c->sendwin += inc) > 0x7fffffff) {
+		sendgoaway(c, ER_FLOW_CONTROL_ERROR);
+		return(-1);
+	    }
+	} else if((st = findstream(c, id)) != NULL) {
+	    if((st->sendwin += inc) > 0x7fffffff) {
+		sendrst(c, id, ER_FLOW_CONTROL_ERROR);
+		abortstream(st);
+		return(0);
+	    }
+	}
+	wakestreams(c);
+	break;
+    case FT_PUSH_PROMISE:
+	sendgoaway(c, ER_PROTOCOL_ERROR);
+	return(-1);
+    }
+    return(0);
+}
+
+void serveh2(struct bufio *in, int infd, struct conn *conn, char *preface)
+{
+    struct h2conn *c;
+    struct h2stream *st;
+    unsigned char *hd, sbuf[6];
+    size_t len, plen;
+    ssize_t ret;
+    
+    omalloc(c);
+    c->io = in;
+    c->fd = infd;
+    c->conn = conn;
+    c->id = connid();
+    c->dec = mkhpack(4096);
+    c->initwin = c->sendwin = DEFWINDOW;
+    c->maxframe = 16384;
+    c->outqt = &c->outq;
+    plen = strlen(preface);
+    if((biorensure(in, plen) < plen) || memcmp(in->rbuf.b + in->rh, preface, plen))
+	goto done;
+    in->rh += plen;
+    c->writer = mustart(h2writer, c);
+    sbuf[0] = 0;
+    sbuf[1] = ST_MAX_CONCURRENT_STREAMS;
+    putu32(sbuf + 2, MAXSTREAMS);
+    queueframe(c, FT_SETTINGS, 0, 0, sbuf, 6);
+    
+    while(!c->werr) {
+	if((ret = biorensure(in, 9)) < 9) {
+	    /* Idle connections time out as with HTTP/1, but not while
+	     * any streams are still being handled. */
+	    if((ret < 0) && (in->err == ETIMEDOUT) && (c->nstreams > 0)) {
+		in->err = 0;
+		continue;
+	    }
+	    break;
+	}
+	hd = (unsigned char *)in->rbuf.b + in->rh;
+	len = (hd[0] << 16) | (hd[1] << 8) | hd[2];
+	if(len > MAXFRAME) {
+	    sendgoaway(c, ER_FRAME_SIZE_ERROR);
+	    break;
+	}
+	if(biorensure(in, 9 + len) < 9 + len)
+	    break;
+	hd = (unsigned char *)in->rbuf.b + in->rh;
+	in->rh += 9 + len;
+	if(gotframe(c, hd[3], hd[4], getu32(hd + 5) & 0x7fffffff, hd + 9, len))
+	    break;
+    }
+    
+    c->closing = 1;
+    for(st = c->streams; st != NULL; st = st->next) {
+	st->reset = 1;
+	if(st->fd >= 0)
+	    shutdown(st->fd, SHUT_RDWR);
+    }
+    wakestreams(c);
+    while((c->nstreams > 0) || (c->writer != NULL)) {
+	if((c->nstreams == 0) && (c->wwait != NULL)) {
+	    resume(c->wwait, 0);
+	    continue;
+	}
+	c->rwait = current;
+	yield();
+	c->rwait = NULL;
+    }
+done:
+    freehpack(c->dec);
+    buffree(c->hblock);
+    free(c->id);
+    free(c);
+    bioclose(in);
+}
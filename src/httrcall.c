@@ -84,8 +84,9 @@ static void usage(FILE *out)
 int main(int argc, char **argv)
 {
     int c;
-    struct hthead *req;
-    int fd;
+    struct hthead *reqs[REQBATCH];
+    int fds[REQBATCH];
+    int i, n;
     
     while((c = getopt(argc, argv, "+hl:")) >= 0) {
 	switch(c) {
@@ -111,16 +112,18 @@ int main(int argc, char **argv)
     while(1) {
 	if(exited)
 	    checkexit(0);
-	if((fd = recvreq(0, &req)) < 0) {
+	if((n = recvreqs(0, reqs, fds, REQBATCH, 0)) < 0) {
 	    if(errno == EINTR)
 		continue;
 	    if(errno != 0)
 		flog(LOG_ERR, "recvreq: %s", strerror(errno));
 	    break;
 	}
-	serve(req, fd);
-	freehthead(req);
-	close(fd);
+	for(i = 0; i < n; i++) {
+	    serve(reqs[i], fds[i]);
+	    freehthead(reqs[i]);
+	    close(fds[i]);
+	}
     }
     return(0);
 }
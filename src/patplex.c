@@ -36,6 +36,7 @@
 #include <proc.h>
 #include <resp.h>
 #include <cf.h>
+#include <stats.h>
 
 #define PAT_REST 0
 #define PAT_URL 1
@@ -77,6 +78,8 @@ struct pattern {
 
 static struct config *gconfig, *lconfig;
 static volatile int reload = 0;
+static struct statcnt *st_reqs, *st_notfound;
+static struct stathist *st_match, *st_dispatch;
 
 static void freepattern(struct pattern *pat)
 {
@@ -519,12 +522,16 @@ static void serve(struct hthead *req, int fd)
 {
     struct match *match;
     struct child *ch;
+    uintmax_t t;
     
+    t = statnow();
     match = NULL;
     match = findmatch(lconfig, req, match);
     if(gconfig != NULL)
 	match = findmatch(gconfig, req, match);
+    stathadd(st_match, statnow() - t);
     if(match == NULL) {
+	statinc(st_notfound, 1);
 	simpleerror(fd, 404, "Not Found", "The requested resource could not be found on this server.");
 	return;
     }
@@ -541,8 +548,10 @@ static void serve(struct hthead *req, int fd)
 	    simpleerror(fd, 500, "Configuration Error", "The server is erroneously configured. Handler %s was requested, but not declared.", match->pat->childnm);
 	    break;
 	}
+	t = statnow();
 	if(childhandle(ch, req, fd, NULL, NULL))
 	    childerror(req, fd);
+	stathadd(st_dispatch, statnow() - t);
 	break;
     case HND_REPARSE:
 	match->pat->disable = 1;
@@ -595,8 +604,9 @@ int main(int argc, char **argv)
     int c;
     int nodef;
     char *gcf, *lcf;
-    struct hthead *req;
-    int fd;
+    struct hthead *reqs[REQBATCH];
+    int fds[REQBATCH];
+    int i, n, sfd;
     
     nodef = 0;
     while((c = getopt(argc, argv, "hN")) >= 0) {
@@ -635,21 +645,35 @@ int main(int argc, char **argv)
     signal(SIGCHLD, chldhandler);
     signal(SIGHUP, sighandler);
     signal(SIGPIPE, sighandler);
+    st_reqs = statcnt("requests");
+    st_notfound = statcnt("notfound");
+    st_match = stathist("match");
+    st_dispatch = stathist("dispatch");
+    sfd = statinit("patplex");
     while(1) {
 	if(reload) {
 	    reloadconf(lcf);
 	    reload = 0;
 	}
-	if((fd = recvreq(0, &req)) < 0) {
+	if(statpoll(0, sfd) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    flog(LOG_ERR, "poll: %s", strerror(errno));
+	    break;
+	}
+	if((n = recvreqs(0, reqs, fds, REQBATCH, 0)) < 0) {
 	    if(errno == EINTR)
 		continue;
 	    if(errno != 0)
 		flog(LOG_ERR, "recvreq: %s", strerror(errno));
 	    break;
 	}
-	serve(req, fd);
-	freehthead(req);
-	close(fd);
+	for(i = 0; i < n; i++) {
+	    statinc(st_reqs, 1);
+	    serve(reqs[i], fds[i]);
+	    freehthead(reqs[i]);
+	    close(fds[i]);
+	}
     }
     return(0);
 }
@@ -33,6 +33,7 @@
 #include <req.h>
 #include <mt.h>
 #include <mtio.h>
+#include <bufio.h>
 #include <log.h>
 
 #include "htparser.h"
@@ -44,8 +45,7 @@ struct tcpport {
 
 struct tcpconn {
     struct sockaddr_storage name;
-    struct tcpport *port;
-    int fd;
+    int fd, sport;
 };
 
 int listensock4(int port)
@@ -54,6 +54,10 @@ int listensock4(int port)
     int fd;
     int valbuf;
     
+    if((fd = hotake(AF_INET, port)) >= 0) {
+	holisten(fd);
+	return(fd);
+    }
     memset(&name, 0, sizeof(name));
     name.sin_family = AF_INET;
     name.sin_port = htons(port);
@@ -70,6 +74,7 @@ int listensock4(int port)
 	return(-1);
     }
     fcntl(fd, F_SETFD, FD_CLOEXEC);
+    holisten(fd);
     return(fd);
 }
 
@@ -79,6 +84,10 @@ int listensock6(int port)
     int fd;
     int valbuf;
     
+    if((fd = hotake(AF_INET6, port)) >= 0) {
+	holisten(fd);
+	return(fd);
+    }
     memset(&name, 0, sizeof(name));
     name.sin6_family = AF_INET6;
     name.sin6_port = htons(port);
@@ -95,6 +104,7 @@ int listensock6(int port)
 	return(-1);
     }
     fcntl(fd, F_SETFD, FD_CLOEXEC);
+    holisten(fd);
     return(fd);
 }
 
@@ -140,7 +150,7 @@ static int initreq(struct conn *conn, struct hthead *req)
     salen = sizeof(sa);
     if(!getsockname(tcp->fd, (struct sockaddr *)&sa, &salen))
 	headappheader(req, "X-Ash-Server-Address", formathaddress((struct sockaddr *)&sa, sizeof(sa)));
-    headappheader(req, "X-Ash-Server-Port", sprintf3("%i", tcp->port->sport));
+    headappheader(req, "X-Ash-Server-Port", sprintf3("%i", tcp->sport));
     headappheader(req, "X-Ash-Protocol", "http");
     return(0);
 }
@@ -149,7 +159,9 @@ void servetcp(struct muth *muth, va_list args)
 {
     vavar(int, fd);
     vavar(struct sockaddr_storage, name);
-    vavar(struct tcpport *, stcp);
+    vavar(int, sport);
+    vavar(char *, pre);
+    vavar(size_t, prelen);
     struct bufio *in;
     struct conn conn;
     struct tcpconn tcp;
@@ -157,14 +169,44 @@ void servetcp(struct muth *muth, va_list args)
     memset(&conn, 0, sizeof(conn));
     memset(&tcp, 0, sizeof(tcp));
     in = mtbioopen(fd, 1, 60, "r+", NULL);
+    /* Data already read by an old process in a handoff. */
+    if(prelen > 0)
+	bufcat(in->rbuf, pre, prelen);
     conn.pdata = &tcp;
     conn.initreq = initreq;
+    conn.handoff = 1;
     tcp.fd = fd;
     tcp.name = name;
-    tcp.port = stcp;
+    tcp.sport = sport;
     serve(in, fd, &conn);
 }
 
+/* Starts serving a connection handed off from an old process. */
+void adopttcp(int fd, char *pre, size_t prelen)
+{
+    struct sockaddr_storage name, sname;
+    socklen_t namelen;
+    int sport;
+    
+    namelen = sizeof(name);
+    if(getpeername(fd, (struct sockaddr *)&name, &namelen)) {
+	close(fd);
+	return;
+    }
+    namelen = sizeof(sname);
+    if(getsockname(fd, (struct sockaddr *)&sname, &namelen)) {
+	close(fd);
+	return;
+    }
+    if(sname.ss_family == AF_INET)
+	sport = ntohs(((struct sockaddr_in *)&sname)->sin_port);
+    else if(sname.ss_family == AF_INET6)
+	sport = ntohs(((struct sockaddr_in6 *)&sname)->sin6_port);
+    else
+	sport = 0;
+    mustart(servetcp, fd, name, sport, pre, prelen);
+}
+
 static void listenloop(struct muth *muth, va_list args)
 {
     vavar(struct tcpport *, tcp);
@@ -188,7 +230,7 @@ static void listenloop(struct muth *muth, va_list args)
 		flog(LOG_ERR, "accept: %s", strerror(errno));
 		goto out;
 	    }
-	    mustart(servetcp, ns, name, tcp);
+	    mustart(servetcp, ns, name, tcp->sport, (char *)NULL, (size_t)0);
 	    if(++n >= 100)
 		break;
 	}
@@ -40,6 +40,7 @@
 #include <resp.h>
 #include <mt.h>
 #include <mtio.h>
+#include <stats.h>
 
 #ifdef HAVE_XATTR
 #include <sys/xattr.h>
@@ -48,6 +49,9 @@
 #include "compress.h"
 
 static magic_t cookie;
+static struct statcnt *st_reqs, *st_bytes, *st_notmod;
+static struct stathist *st_open;
+static struct muth *statmuth;
 
 static char *attrmimetype(char *file)
 {
@@ -136,6 +140,7 @@ static off_t passdata(FILE *in, FILE *out, off_t max)
 	if(fwrite(buf, 1, read, out) != read)
 	    return(-1);
 	total += read;
+	statinc(st_bytes, read);
     }
     return(total);
 }
@@ -230,7 +235,9 @@ static void serve(struct muth *muth, va_list args)
     char *file, *contype, *hdr;
     const char *enctype;
     struct stat sb;
+    uintmax_t t;
     
+    statinc(st_reqs, 1);
     sfile = NULL;
     contype = NULL;
     out = mtstdopen(fd, 1, 60, "r+", NULL);
@@ -245,7 +252,10 @@ static void serve(struct muth *muth, va_list args)
 	goto out;
     }
     hdr = getheader(req, "X-Ash-Compress") ? getheader(req, "Accept-Encoding") : "";
-    if(((sfd = ccopen(file, &sb, hdr, &enctype)) < 0) || ((sfile = fdopen(sfd, "r")) == NULL)) {
+    t = statnow();
+    sfd = ccopen(file, &sb, hdr, &enctype);
+    stathadd(st_open, statnow() - t);
+    if((sfd < 0) || ((sfile = fdopen(sfd, "r")) == NULL)) {
 	if(sfd >= 0)
 	    close(sfd);
 	flog(LOG_ERR, "psendfile: could not open input file %s: %s", file, strerror(errno));
@@ -266,8 +276,10 @@ static void serve(struct muth *muth, va_list args)
 	contype = sstrdup(hdr);
     contype = ckctype(contype);
     
-    if(checkcache(req, out, file, &sb))
+    if(checkcache(req, out, file, &sb)) {
+	statinc(st_notmod, 1);
 	goto out;
+    }
 
     if((hdr = getheader(req, "Range")) != NULL)
 	sendrange(req, out, sfile, &sb, contype, enctype, hdr, ishead);
@@ -298,6 +310,8 @@ static void listenloop(struct muth *muth, va_list args)
 	}
 	mustart(serve, req, fd);
     }
+    if(statmuth != NULL)
+	resume(statmuth, 0);
 }
 
 static void sigterm(int sig)
@@ -327,6 +341,11 @@ int main(int argc, char **argv)
     }
     cookie = magic_open(MAGIC_MIME_TYPE | MAGIC_SYMLINK);
     magic_load(cookie, NULL);
+    st_reqs = statcnt("requests");
+    st_bytes = statcnt("bytes");
+    st_notmod = statcnt("notmodified");
+    st_open = stathist("open");
+    statmuth = mtstatserve(statinit("psendfile"));
     mustart(listenloop, 0);
     signal(SIGINT, sigterm);
     signal(SIGTERM, sigterm);
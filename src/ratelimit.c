@@ -0,0 +1,217 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <req.h>
+#include <mt.h>
+#include <mtio.h>
+
+#include "htparser.h"
+#include "bucket.h"
+
+/*
+ * This is the token-bucket logic of ratequeue(1), moved into
+ * htparser so that throttled clients can be rejected before their
+ * requests are ever passed to the root handler. Requests waiting on
+ * the brim are kept as blocked connection coroutines rather than as
+ * queued requests. Only the first of them waits for the bucket to
+ * drain, for as long as it takes for one request's worth of level,
+ * and hands over to the next once it has been let through.
+ */
+
+struct lbucket {
+    struct bucket bk;
+    typedbuf(struct muth *) brim;
+};
+
+struct config {
+    double size, rate, retain, warnrate;
+    int brimsize;
+};
+
+static int enabled = 0;
+static double now;
+static struct config cf = {
+    .size = 100, .rate = 10, .warnrate = 60,
+    .retain = 10, .brimsize = 10,
+};
+
+static void freebucket(struct lbucket *lb)
+{
+    buffree(lb->brim);
+    bkfree(&lb->bk);
+}
+
+static void updbtime(struct lbucket *lb)
+{
+    struct bucket *bk = &lb->bk;
+    double tm, tm2;
+    
+    tm = (bk->level == 0) ? (bk->etime + cf.retain) : (bk->last + (bk->level / cf.rate) + cf.retain);
+    if((bk->blocked > 0) && ((tm2 = bk->wtime + cf.warnrate) > tm))
+	tm = tm2;
+    /* Waiting connections tick the bucket themselves, but it must
+     * not be expired under them. */
+    if((lb->brim.d > 0) && (tm < now + 1))
+	tm = now + 1;
+    bksettime(bk, tm);
+}
+
+static void tickbucket(struct lbucket *lb)
+{
+    struct bucket *bk = &lb->bk;
+    
+    bkdrain(bk, now, cf.rate);
+    if((bk->blocked > 0) && (now - bk->wtime >= cf.warnrate)) {
+	flog(LOG_NOTICE, "htparser: blocked %i requests from %s", bk->blocked, formatsrc(&bk->id));
+	bk->blocked = 0;
+	bk->wtime = now;
+    }
+}
+
+static void checkbtime(struct lbucket *lb)
+{
+    tickbucket(lb);
+    if((lb->bk.level == 0) && (now >= lb->bk.etime + cf.retain) && (lb->bk.blocked <= 0) && (lb->brim.d == 0)) {
+	freebucket(lb);
+	return;
+    }
+    updbtime(lb);
+}
+
+/*
+ * Returns zero if the request may be passed on, possibly after
+ * having waited for the bucket to drain, or non-zero if the client
+ * should be throttled.
+ */
+int ratelimit(struct hthead *req)
+{
+    struct source src;
+    struct bucket *bk;
+    struct lbucket *lb;
+    double wait;
+    
+    if(!enabled)
+	return(0);
+    now = bktime();
+    while((bk = bkexpired(now)) != NULL)
+	checkbtime((struct lbucket *)bk);
+    if(reqsource(req, &src))
+	return(0);
+    lb = (struct lbucket *)(bk = bkget(&src, sizeof(*lb), now));
+    tickbucket(lb);
+    if((bk->level < cf.size) && (lb->brim.d == 0)) {
+	bk->level += 1;
+    } else if(lb->brim.d < cf.brimsize) {
+	bufadd(lb->brim, current);
+	/* Wait to be resumed by the one ahead when it leaves. */
+	while(lb->brim.b[0] != current)
+	    block(-1, 0, 0);
+	while(bk->level >= cf.size) {
+	    updbtime(lb);
+	    if((wait = (bk->level - cf.size) / cf.rate) < 0)
+		wait = 0;
+	    block2(-1, 0, wait + 0.001);
+	    now = bktime();
+	    tickbucket(lb);
+	}
+	bufdel(lb->brim, 0);
+	bk->level += 1;
+	if(lb->brim.d > 0)
+	    resume(lb->brim.b[0], 0);
+    } else {
+	if(bk->blocked < 0) {
+	    flog(LOG_NOTICE, "htparser: blocking requests from %s", formatsrc(&bk->id));
+	    bk->blocked = 0;
+	    bk->wtime = now;
+	}
+	bk->blocked++;
+	updbtime(lb);
+	return(-1);
+    }
+    updbtime(lb);
+    return(0);
+}
+
+static int parsefloat(const char *str, double *dst)
+{
+    double buf;
+    char *p;
+    
+    buf = strtod(str, &p);
+    if((p == str) || *p)
+	return(-1);
+    *dst = buf;
+    return(0);
+}
+
+void handleratelimit(char *spec)
+{
+    char *p, *p2, *n;
+    double val;
+    
+    for(p = spec; p != NULL; p = n) {
+	if((n = strchr(p, ',')) != NULL)
+	    *(n++) = 0;
+	if(!strcmp(p, "help")) {
+	    printf("rate-limit parameters:\n");
+	    printf("\tsize=REQUESTS   [100]\n");
+	    printf("\t\tThe number of requests a client may burst.\n");
+	    printf("\trate=REQUESTS   [10]\n");
+	    printf("\t\tThe number of requests per second that a client's\n");
+	    printf("\t\tbucket drains by.\n");
+	    printf("\tbrim=REQUESTS   [10]\n");
+	    printf("\t\tThe number of requests beyond the bucket size\n");
+	    printf("\t\tthat are delayed rather than rejected.\n");
+	    printf("\tretain=SECONDS  [10]\n");
+	    printf("\t\tHow long an empty bucket is remembered.\n");
+	    exit(0);
+	}
+	if(((p2 = strchr(p, '=')) == NULL) || parsefloat(p2 + 1, &val) || (val < 0)) {
+	    flog(LOG_ERR, "htparser: missing or invalid rate-limit value for `%s'", p);
+	    exit(1);
+	}
+	*(p2++) = 0;
+	if(!strcmp(p, "size")) {
+	    cf.size = val;
+	} else if(!strcmp(p, "rate")) {
+	    if(val == 0) {
+		flog(LOG_ERR, "htparser: rate-limit rate must be non-zero");
+		exit(1);
+	    }
+	    cf.rate = val;
+	} else if(!strcmp(p, "brim")) {
+	    cf.brimsize = val;
+	} else if(!strcmp(p, "retain")) {
+	    cf.retain = val;
+	} else {
+	    flog(LOG_ERR, "htparser: unknown rate-limit parameter `%s'", p);
+	    exit(1);
+	}
+    }
+    enabled = 1;
+}
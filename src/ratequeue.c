@@ -23,11 +23,14 @@
 #include <string.h>
 #include <time.h>
 #include <signal.h>
-#include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -38,30 +41,48 @@
 #include <resp.h>
 #include <proc.h>
 #include <cf.h>
+#include <stats.h>
 
-#define SBUCKETS 7
+#include "bucket.h"
 
-struct source {
-    int type;
-    char data[16];
-    unsigned int len, hash;
-};
+#define SHMMAGIC 0x52714231
+#define SHMWAYS 8
 
 struct waiting {
     struct hthead *req;
     int fd;
+    uintmax_t qtime;
 };
 
-struct bucket {
-    struct source id;
-    double level, last, etime, wtime;
+struct qbucket {
+    struct bucket bk;
     typedbuf(struct waiting) brim;
-    int thpos, blocked;
 };
 
-struct btime {
-    struct bucket *bk;
-    double tm;
+/*
+ * When several ratequeue processes are to enforce a common limit,
+ * the bucket levels are kept in a table in a shared file mapping
+ * instead. The table is set-associative, with a spinlock per set;
+ * when a set is full, its least recently used entry is replaced.
+ * Waiting requests and blocking statistics are still kept per
+ * process, in the ordinary local buckets.
+ */
+struct shmslot {
+    struct source id;
+    int inuse;
+    double level, last, etime;
+    uint64_t atime;
+};
+
+struct shmset {
+    int lock;
+    struct shmslot slots[SHMWAYS];
+};
+
+struct shmtable {
+    uint32_t magic, nsets;
+    uint64_t clock, used, evicted;
+    struct shmset sets[];
 };
 
 struct config {
@@ -69,10 +90,6 @@ struct config {
     int brimsize;
 };
 
-static struct bucket *sbuckets[1 << SBUCKETS];
-static struct bucket **buckets = sbuckets;
-static int hashlen = SBUCKETS, nbuckets = 0;
-static typedbuf(struct btime) timeheap;
 static int child, reload;
 static double now;
 static const struct config defcfg = {
@@ -80,258 +97,201 @@ static const struct config defcfg = {
     .retain = 10, .brimsize = 10,
 };
 static struct config cf;
+static struct shmtable *shm = NULL;
+static struct statcnt *st_reqs, *st_queued, *st_rejected;
+static struct stathist *st_wait;
 
-static double rtime(void)
+static void freebucket(struct qbucket *qb)
 {
-    static int init = 0;
-    static struct timespec or;
-    struct timespec ts;
+    int i;
     
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    if(!init) {
-	or = ts;
-	init = 1;
+    for(i = 0; i < qb->brim.d; i++) {
+	freehthead(qb->brim.b[i].req);
+	close(qb->brim.b[i].fd);
     }
-    return((ts.tv_sec - or.tv_sec) + ((ts.tv_nsec - or.tv_nsec) / 1000000000.0));
+    buffree(qb->brim);
+    bkfree(&qb->bk);
 }
 
-static struct source reqsource(struct hthead *req)
+static void updbtime(struct qbucket *qb)
 {
-    int i;
-    char *sa;
-    struct in_addr a4;
-    struct in6_addr a6;
-    struct source ret;
+    struct bucket *bk = &qb->bk;
+    double tm, tm2;
     
-    ret = (struct source){};
-    if((sa = getheader(req, "X-Ash-Address")) != NULL) {
-	if(inet_pton(AF_INET, sa, &a4) == 1) {
-	    ret.type = AF_INET;
-	    memcpy(ret.data, &a4, ret.len = sizeof(a4));
-	} else if(inet_pton(AF_INET6, sa, &a6) == 1) {
-	    ret.type = AF_INET6;
-	    memcpy(ret.data, &a6, ret.len = sizeof(a6));
-	}
-    }
-    for(i = 0, ret.hash = ret.type; i < ret.len; i++)
-	ret.hash = (ret.hash * 31) + ret.data[i];
-    return(ret);
+    tm = (bk->level == 0) ? (bk->etime + cf.retain) : (bk->last + (bk->level / cf.rate) + cf.retain);
+    if((bk->blocked > 0) && ((tm2 = bk->wtime + cf.warnrate) > tm))
+	tm = tm2;
+    
+    if((qb->brim.d > 0) && ((tm2 = bk->last + ((bk->level - cf.size) / cf.rate)) < tm))
+	tm = tm2;
+    if((bk->blocked > 0) && ((tm2 = bk->wtime + cf.warnrate) < tm))
+	tm = tm2;
+    bksettime(bk, tm);
 }
 
-static int srccmp(const struct source *a, const struct source *b)
+static void shmlock(int *lock)
 {
-    int c;
-    
-    if((c = a->len - b->len) != 0)
-	return(c);
-    if((c = a->type - b->type) != 0)
-	return(c);
-    return(memcmp(a->data, b->data, a->len));
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+	sched_yield();
 }
 
-static const char *formatsrc(const struct source *src)
+static void shmunlock(int *lock)
 {
-    static char buf[128];
-    struct in_addr a4;
-    struct in6_addr a6;
-    
-    switch(src->type) {
-    case AF_INET:
-	memcpy(&a4, src->data, sizeof(a4));
-	if(!inet_ntop(AF_INET, &a4, buf, sizeof(buf)))
-	    return("<invalid ipv4>");
-	return(buf);
-    case AF_INET6:
-	memcpy(&a6, src->data, sizeof(a6));
-	if(!inet_ntop(AF_INET6, &a6, buf, sizeof(buf)))
-	    return("<invalid ipv6>");
-	return(buf);
-    default:
-	return("<invalid source record>");
-    }
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
 
-static void rehash(int nlen)
+/*
+ * Drains the shared bucket for bk and takes up to n requests' worth
+ * of level from it, returning the number actually taken. The shared
+ * state is mirrored into bk, so that its timeouts are computed as
+ * usual.
+ */
+static int shmtake(struct bucket *bk, int n)
 {
-    unsigned int i, o, n, m, pl, nl;
-    struct bucket **new, **old;
+    struct shmset *set;
+    struct shmslot *sl, *vic;
+    double delta, ll;
+    int i, got;
     
-    old = buckets;
-    if(nlen <= SBUCKETS) {
-	nlen = SBUCKETS;
-	new = sbuckets;
-    } else {
-	new = smalloc(sizeof(*new) * (1 << nlen));
+    set = &shm->sets[bk->id.hash & (shm->nsets - 1)];
+    shmlock(&set->lock);
+    sl = vic = NULL;
+    for(i = 0; i < SHMWAYS; i++) {
+	if(!set->slots[i].inuse) {
+	    if((vic == NULL) || vic->inuse)
+		vic = &set->slots[i];
+	} else if(!srccmp(&set->slots[i].id, &bk->id)) {
+	    sl = &set->slots[i];
+	    break;
+	} else if((vic == NULL) || (vic->inuse && (set->slots[i].atime < vic->atime))) {
+	    vic = &set->slots[i];
+	}
     }
-    if(nlen == hashlen)
-	return;
-    memset(new, 0, sizeof(*new) * (1 << nlen));
-    assert(old != new);
-    pl = 1 << hashlen; nl = 1 << nlen; m = nl - 1;
-    for(i = 0; i < pl; i++) {
-	if(!old[i])
-	    continue;
-	for(o = old[i]->id.hash & m, n = 0; n < nl; o = (o + 1) & m, n++) {
-	    if(!new[o]) {
-		new[o] = old[i];
-		break;
-	    }
+    if(sl == NULL) {
+	sl = vic;
+	if(sl->inuse)
+	    __atomic_add_fetch(&shm->evicted, 1, __ATOMIC_RELAXED);
+	else
+	    __atomic_add_fetch(&shm->used, 1, __ATOMIC_RELAXED);
+	memcpy(&sl->id, &bk->id, sizeof(bk->id));
+	sl->inuse = 1;
+	sl->level = 0;
+	sl->last = sl->etime = now;
+    }
+    sl->atime = __atomic_add_fetch(&shm->clock, 1, __ATOMIC_RELAXED);
+    if((delta = now - sl->last) > 0) {
+	sl->last = now;
+	ll = sl->level;
+	if((sl->level -= delta * cf.rate) < 0) {
+	    if(ll > 0)
+		sl->etime = now + (sl->level / cf.rate);
+	    sl->level = 0;
 	}
     }
-    if(old != sbuckets)
-	free(old);
-    buckets = new;
-    hashlen = nlen;
+    for(got = 0; (got < n) && (sl->level < cf.size); got++)
+	sl->level += 1;
+    bk->level = sl->level;
+    bk->etime = sl->etime;
+    bk->last = now;
+    shmunlock(&set->lock);
+    return(got);
 }
 
-static struct bucket *hashget(const struct source *src)
+static struct shmtable *shmopen(char *path, int nslots)
 {
-    unsigned int i, n, N, m;
-    struct bucket *bk;
+    int fd, nsets;
+    struct stat sb;
+    size_t sz;
+    struct shmtable *ret;
     
-    m = (N = (1 << hashlen)) - 1;
-    for(i = src->hash & m, n = 0; n < N; i = (i + 1) & m, n++) {
-	bk = buckets[i];
-	if(bk && !srccmp(&bk->id, src))
-	    return(bk);
+    ret = NULL;
+    if((fd = open(path, O_RDWR | ((nslots > 0) ? O_CREAT : 0), 0600)) < 0) {
+	flog(LOG_ERR, "ratequeue: %s: %s", path, strerror(errno));
+	return(NULL);
     }
-    for(i = src->hash & m; buckets[i]; i = (i + 1) & m);
-    buckets[i] = bk = szmalloc(sizeof(*bk));
-    memcpy(&bk->id, src, sizeof(*src));
-    bk->last = bk->etime = now;
-    bk->thpos = -1;
-    bk->blocked = -1;
-    if(++nbuckets > (1 << (hashlen - 1)))
-	rehash(hashlen + 1);
-    return(bk);
-}
-
-static void hashdel(struct bucket *bk)
-{
-    unsigned int i, o, p, n, N, m;
-    struct bucket *sb;
-    
-    m = (N = (1 << hashlen)) - 1;
-    for(i = bk->id.hash & m, n = 0; n < N; i = (i + 1) & m, n++) {
-	assert((sb = buckets[i]) != NULL);
-	if(!srccmp(&sb->id, &bk->id))
-	    break;
+    flock(fd, LOCK_EX);
+    if(fstat(fd, &sb)) {
+	flog(LOG_ERR, "ratequeue: %s: %s", path, strerror(errno));
+	goto out;
     }
-    assert(sb == bk);
-    buckets[i] = NULL;
-    for(o = (i + 1) & m; buckets[o] != NULL; o = (o + 1) & m) {
-	sb = buckets[o];
-	p = (sb->id.hash - i) & m;
-	if((p == 0) || (p > ((o - i) & m))) {
-	    buckets[i] = sb;
-	    buckets[o] = NULL;
-	    i = o;
+    if(sb.st_size == 0) {
+	for(nsets = 1; nsets * SHMWAYS < nslots; nsets <<= 1);
+	sz = sizeof(*ret) + (sizeof(*ret->sets) * nsets);
+	if(ftruncate(fd, sz)) {
+	    flog(LOG_ERR, "ratequeue: %s: %s", path, strerror(errno));
+	    goto out;
 	}
+    } else {
+	nsets = 0;
+	sz = sb.st_size;
     }
-    if(--nbuckets <= (1 << (hashlen - 3)))
-	rehash(hashlen - 1);
-}
-
-static void thraise(struct btime bt, int n)
-{
-    int p;
-    
-    while(n > 0) {
-	p = (n - 1) >> 1;
-	if(timeheap.b[p].tm <= bt.tm)
-	    break;
-	(timeheap.b[n] = timeheap.b[p]).bk->thpos = n;
-	n = p;
+    if(sz < sizeof(*ret)) {
+	flog(LOG_ERR, "ratequeue: %s: not a bucket table", path);
+	goto out;
     }
-    (timeheap.b[n] = bt).bk->thpos = n;
-}
-
-static void thlower(struct btime bt, int n)
-{
-    int c1, c2, c;
-    
-    while(1) {
-	c2 = (c1 = (n << 1) + 1) + 1;
-	if(c1 >= timeheap.d)
-	    break;
-	c = ((c2 < timeheap.d) && (timeheap.b[c2].tm < timeheap.b[c1].tm)) ? c2 : c1;
-	if(timeheap.b[c].tm > bt.tm)
-	    break;
-	(timeheap.b[n] = timeheap.b[c]).bk->thpos = n;
-	n = c;
+    if((ret = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	flog(LOG_ERR, "ratequeue: %s: %s", path, strerror(errno));
+	ret = NULL;
+	goto out;
     }
-    (timeheap.b[n] = bt).bk->thpos = n;
-}
-
-static void thadjust(struct btime bt, int n)
-{
-    if((n > 0) && (timeheap.b[(n - 1) >> 1].tm > bt.tm))
-	thraise(bt, n);
-    else
-	thlower(bt, n);
+    if(nsets > 0) {
+	ret->nsets = nsets;
+	ret->magic = SHMMAGIC;
+    }
+    if((ret->magic != SHMMAGIC) || (sizeof(*ret) + (sizeof(*ret->sets) * ret->nsets) != sz)) {
+	flog(LOG_ERR, "ratequeue: %s: not a bucket table", path);
+	munmap(ret, sz);
+	ret = NULL;
+	goto out;
+    }
+    
+out:
+    flock(fd, LOCK_UN);
+    close(fd);
+    return(ret);
 }
 
-static void freebucket(struct bucket *bk)
+static void shmstats(char *path)
 {
-    int i, n;
-    struct btime r;
+    struct shmtable *tab;
+    unsigned long nslots;
     
-    hashdel(bk);
-    if((n = bk->thpos) >= 0) {
-	r = timeheap.b[--timeheap.d];
-	if(n < timeheap.d)
-	    thadjust(r, n);
-    }
-    for(i = 0; i < bk->brim.d; i++) {
-	freehthead(bk->brim.b[i].req);
-	close(bk->brim.b[i].fd);
-    }
-    buffree(bk->brim);
-    free(bk);
+    if((tab = shmopen(path, 0)) == NULL)
+	exit(1);
+    nslots = (unsigned long)tab->nsets * SHMWAYS;
+    printf("sources: %ju\n", (uintmax_t)__atomic_load_n(&tab->used, __ATOMIC_RELAXED));
+    printf("slots: %lu\n", nslots);
+    printf("occupancy: %.1f%%\n", (__atomic_load_n(&tab->used, __ATOMIC_RELAXED) * 100.0) / nslots);
+    printf("evictions: %ju\n", (uintmax_t)__atomic_load_n(&tab->evicted, __ATOMIC_RELAXED));
 }
 
-static void updbtime(struct bucket *bk)
+static int takelevel(struct bucket *bk, int n)
 {
-    double tm, tm2;
+    int got;
     
-    tm = (bk->level == 0) ? (bk->etime + cf.retain) : (bk->last + (bk->level / cf.rate) + cf.retain);
-    if((bk->blocked > 0) && ((tm2 = bk->wtime + cf.warnrate) > tm))
-	tm = tm2;
-    
-    if((bk->brim.d > 0) && ((tm2 = bk->last + ((bk->level - cf.size) / cf.rate)) < tm))
-	tm = tm2;
-    if((bk->blocked > 0) && ((tm2 = bk->wtime + cf.warnrate) < tm))
-	tm = tm2;
-    
-    if(bk->thpos < 0) {
-	sizebuf(timeheap, ++timeheap.d);
-	thraise((struct btime){bk, tm}, timeheap.d - 1);
-    } else {
-	thadjust((struct btime){bk, tm}, bk->thpos);
-    }
+    if(shm != NULL)
+	return(shmtake(bk, n));
+    for(got = 0; (got < n) && (bk->level < cf.size); got++)
+	bk->level += 1;
+    return(got);
 }
 
-static void tickbucket(struct bucket *bk)
+static void tickbucket(struct qbucket *qb)
 {
-    double delta, ll;
+    struct bucket *bk = &qb->bk;
+    int n;
     
-    delta = now - bk->last;
-    bk->last = now;
-    ll = bk->level;
-    if((bk->level -= delta * cf.rate) < 0) {
-	if(ll > 0)
-	    bk->etime = now + (bk->level / cf.rate);
-	bk->level = 0;
-    }
-    while((bk->brim.d > 0) && (bk->level < cf.size)) {
-	if(sendreq(child, bk->brim.b[0].req, bk->brim.b[0].fd)) {
+    if(shm == NULL)
+	bkdrain(bk, now, cf.rate);
+    for(n = takelevel(bk, qb->brim.d); n > 0; n--) {
+	if(sendreq(child, qb->brim.b[0].req, qb->brim.b[0].fd)) {
 	    flog(LOG_ERR, "ratequeue: could not pass request to child: %s", strerror(errno));
 	    exit(1);
 	}
-	freehthead(bk->brim.b[0].req);
-	close(bk->brim.b[0].fd);
-	bufdel(bk->brim, 0);
-	bk->level += 1;
+	stathadd(st_wait, statnow() - qb->brim.b[0].qtime);
+	freehthead(qb->brim.b[0].req);
+	close(qb->brim.b[0].fd);
+	bufdel(qb->brim, 0);
     }
     if((bk->blocked > 0) && (now - bk->wtime >= cf.warnrate)) {
 	flog(LOG_NOTICE, "ratequeue: blocked %i requests from %s", bk->blocked, formatsrc(&bk->id));
@@ -340,35 +300,37 @@ static void tickbucket(struct bucket *bk)
     }
 }
 
-static void checkbtime(struct bucket *bk)
+static void checkbtime(struct qbucket *qb)
 {
-    tickbucket(bk);
-    if((bk->level == 0) && (now >= bk->etime + cf.retain) && (bk->blocked <= 0)) {
-	freebucket(bk);
+    tickbucket(qb);
+    if((qb->bk.level == 0) && (now >= qb->bk.etime + cf.retain) && (qb->bk.blocked <= 0)) {
+	freebucket(qb);
 	return;
     }
-    updbtime(bk);
+    updbtime(qb);
 }
 
 static void serve(struct hthead *req, int fd)
 {
     struct source src;
+    struct qbucket *qb;
     struct bucket *bk;
     
-    now = rtime();
-    src = reqsource(req);
-    bk = hashget(&src);
-    tickbucket(bk);
-    if(bk->level < cf.size) {
-	bk->level += 1;
+    now = bktime();
+    statinc(st_reqs, 1);
+    reqsource(req, &src);
+    qb = (struct qbucket *)(bk = bkget(&src, sizeof(*qb), now));
+    tickbucket(qb);
+    if((qb->brim.d == 0) && takelevel(bk, 1)) {
 	if(sendreq(child, req, fd)) {
 	    flog(LOG_ERR, "ratequeue: could not pass request to child: %s", strerror(errno));
 	    exit(1);
 	}
 	freehthead(req);
 	close(fd);
-    } else if(bk->brim.d < cf.brimsize) {
-	bufadd(bk->brim, ((struct waiting){.req = req, .fd = fd}));
+    } else if(qb->brim.d < cf.brimsize) {
+	bufadd(qb->brim, ((struct waiting){.req = req, .fd = fd, .qtime = statnow()}));
+	statinc(st_queued, 1);
     } else {
 	if(bk->blocked < 0) {
 	    flog(LOG_NOTICE, "ratequeue: blocking requests from %s", formatsrc(&bk->id));
@@ -376,11 +338,12 @@ static void serve(struct hthead *req, int fd)
 	    bk->wtime = now;
 	}
 	simpleerror(fd, 429, "Too many requests", "Your client is being throttled for issuing too frequent requests.");
+	statinc(st_rejected, 1);
 	freehthead(req);
 	close(fd);
 	bk->blocked++;
     }
-    updbtime(bk);
+    updbtime(qb);
 }
 
 static int parseint(const char *str, int *dst)
@@ -457,22 +420,26 @@ static void huphandler(int sig)
 
 static void usage(FILE *out)
 {
-    fprintf(out, "usage: ratequeue [-h] [-s BUCKET-SIZE] [-r RATE] [-b BRIM-SIZE] PROGRAM [ARGS...]\n");
+    fprintf(out, "usage: ratequeue [-h] [-s BUCKET-SIZE] [-r RATE] [-b BRIM-SIZE] [-m TABLE [-n SLOTS]] PROGRAM [ARGS...]\n");
+    fprintf(out, "       ratequeue -S TABLE\n");
 }
 
 int main(int argc, char **argv)
 {
     int c, rv;
-    int fd;
-    struct hthead *req;
-    struct pollfd pfd;
+    int i, n, nslots, sfd;
+    int fds[REQBATCH];
+    struct hthead *reqs[REQBATCH];
+    struct pollfd pfd[2];
     double timeout;
-    char *cfname;
+    struct bucket *bk;
+    char *cfname, *shmname;
     struct config cfbuf;
     
     cf = defcfg;
-    cfname = NULL;
-    while((c = getopt(argc, argv, "+hc:s:r:b:")) >= 0) {
+    cfname = shmname = NULL;
+    nslots = 65536;
+    while((c = getopt(argc, argv, "+hc:s:r:b:m:n:S:")) >= 0) {
 	switch(c) {
 	case 'h':
 	    usage(stdout);
@@ -489,6 +456,15 @@ int main(int argc, char **argv)
 	case 'b':
 	    parseint(optarg, &cf.brimsize);
 	    break;
+	case 'm':
+	    shmname = optarg;
+	    break;
+	case 'n':
+	    parseint(optarg, &nslots);
+	    break;
+	case 'S':
+	    shmstats(optarg);
+	    return(0);
 	}
     }
     if(argc - optind < 1) {
@@ -500,11 +476,20 @@ int main(int argc, char **argv)
 	    return(1);
 	cf = cfbuf;
     }
+    if(shmname) {
+	if((shm = shmopen(shmname, nslots)) == NULL)
+	    return(1);
+    }
     if((child = stdmkchild(argv + optind, NULL, NULL)) < 0) {
 	flog(LOG_ERR, "ratequeue: could not fork child: %s", strerror(errno));
 	return(1);
     }
     sigaction(SIGHUP, &(struct sigaction){.sa_handler = huphandler}, NULL);
+    st_reqs = statcnt("requests");
+    st_queued = statcnt("queued");
+    st_rejected = statcnt("rejected");
+    st_wait = stathist("wait");
+    sfd = statinit("ratequeue");
     while(1) {
 	if(reload) {
 	    if(cfname) {
@@ -513,27 +498,31 @@ int main(int argc, char **argv)
 	    }
 	    reload = 0;
 	}
-	now = rtime();
-	pfd = (struct pollfd){.fd = 0, .events = POLLIN};
-	timeout = (timeheap.d > 0) ? timeheap.b[0].tm : -1;
-	if((rv = poll(&pfd, 1, (timeout < 0) ? -1 : (int)((timeout + 0.1 - now) * 1000))) < 0) {
+	now = bktime();
+	pfd[0] = (struct pollfd){.fd = 0, .events = POLLIN};
+	pfd[1] = (struct pollfd){.fd = sfd, .events = POLLIN};
+	timeout = bknext();
+	if((rv = poll(pfd, 2, (timeout < 0) ? -1 : (int)((timeout + 0.1 - now) * 1000))) < 0) {
 	    if(errno != EINTR) {
 		flog(LOG_ERR, "ratequeue: error in poll: %s", strerror(errno));
 		exit(1);
 	    }
 	}
-	if(pfd.revents) {
-	    if((fd = recvreq(0, &req)) < 0) {
+	if(pfd[1].revents)
+	    statserve(sfd);
+	if(pfd[0].revents) {
+	    if((n = recvreqs(0, reqs, fds, REQBATCH, RECVREQ_LAZY)) < 0) {
 		if(errno == EINTR)
 		    continue;
 		if(errno != 0)
 		    flog(LOG_ERR, "recvreq: %s", strerror(errno));
 		break;
 	    }
-	    serve(req, fd);
+	    for(i = 0; i < n; i++)
+		serve(reqs[i], fds[i]);
 	}
-	while((timeheap.d > 0) && ((now = rtime()) >= timeheap.b[0].tm))
-	    checkbtime(timeheap.b[0].bk);
+	while((bk = bkexpired(now = bktime())) != NULL)
+	    checkbtime((struct qbucket *)bk);
     }
     return(0);
 }
@@ -324,6 +324,11 @@ static int setcreds(gnutls_session_t sess)
     return(0);
 }
 
+static gnutls_datum_t alpnprotos[] = {
+    {(unsigned char *)"h2", 2},
+    {(unsigned char *)"http/1.1", 8},
+};
+
 static void servessl(struct muth *muth, va_list args)
 {
     vavar(int, fd);
@@ -332,6 +337,7 @@ static void servessl(struct muth *muth, va_list args)
     struct conn conn;
     struct sslconn ssl;
     gnutls_session_t sess;
+    gnutls_datum_t proto;
     int ret;
 
     numconn++;
@@ -345,6 +351,7 @@ static void servessl(struct muth *muth, va_list args)
     gnutls_session_set_ptr(sess, pd);
     gnutls_handshake_set_post_client_hello_function(sess, setcreds);
     gnutls_transport_set_ptr(sess, (gnutls_transport_ptr_t)(intptr_t)fd);
+    gnutls_alpn_set_protocols(sess, alpnprotos, 2, 0);
     while((ret = gnutls_handshake(sess)) != 0) {
 	if((ret != GNUTLS_E_INTERRUPTED) && (ret != GNUTLS_E_AGAIN))
 	    goto out;
@@ -360,7 +367,10 @@ static void servessl(struct muth *muth, va_list args)
     ssl.name = name;
     ssl.sess = sess;
     bufinit(ssl.in);
-    serve(bioopen(&ssl, &iofuns), fd, &conn);
+    if(!gnutls_alpn_get_selected_protocol(sess, &proto) && (proto.size == 2) && !memcmp(proto.data, "h2", 2))
+	serveh2(bioopen(&ssl, &iofuns), fd, &conn, H2PREFACE);
+    else
+	serve(bioopen(&ssl, &iofuns), fd, &conn);
     while((ret = gnutls_bye(sess, GNUTLS_SHUT_RDWR)) != 0) {
 	if((ret != GNUTLS_E_INTERRUPTED) && (ret != GNUTLS_E_AGAIN))
 	    goto out;
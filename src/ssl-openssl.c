@@ -77,7 +77,7 @@ static ssize_t sslread(void *cookie, void *buf, size_t len)
     off = 0;
     while(off < len) {
 	nb = ((len - off) > INT_MAX) ? INT_MAX : (len - off);
-	if((ret = SSL_read(sdat->ssl, buf, nb)) <= 0) {
+	if((ret = SSL_read(sdat->ssl, (char *)buf + off, nb)) <= 0) {
 	    if(off > 0)
 		return(off);
 	    err = SSL_get_error(sdat->ssl, ret);
@@ -109,7 +109,7 @@ static ssize_t sslwrite(void *cookie, const void *buf, size_t len)
     off = 0;
     while(off < len) {
 	nb = ((len - off) > INT_MAX) ? INT_MAX : (len - off);
-	if((ret = SSL_write(sdat->ssl, buf, nb)) <= 0) {
+	if((ret = SSL_write(sdat->ssl, (char *)buf + off, nb)) <= 0) {
 	    if(off > 0)
 		return(off);
 	    err = SSL_get_error(sdat->ssl, ret);
@@ -160,6 +160,15 @@ static int initreq(struct conn *conn, struct hthead *req)
     return(0);
 }
 
+static const unsigned char alpnprotos[] = "\x02h2\x08http/1.1";
+
+static int selectalpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *uudata)
+{
+    if(SSL_select_next_proto((unsigned char **)out, outlen, alpnprotos, sizeof(alpnprotos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+	return(SSL_TLSEXT_ERR_NOACK);
+    return(SSL_TLSEXT_ERR_OK);
+}
+
 static void servessl(struct muth *muth, va_list args)
 {
     vavar(int, fd);
@@ -169,6 +178,8 @@ static void servessl(struct muth *muth, va_list args)
     SSL *ssl;
     struct conn conn;
     struct sslconn sdat;
+    const unsigned char *proto;
+    unsigned int protolen;
     
     fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
     ssl = SSL_new(pd->ctx);
@@ -186,7 +197,11 @@ static void servessl(struct muth *muth, va_list args)
     sdat.ssl = ssl;
     sdat.name = (struct sockaddr *)&name;
     sdat.namelen = sizeof(name);
-    serve(bioopen(&sdat, &iofuns), fd, &conn);
+    SSL_get0_alpn_selected(ssl, &proto, &protolen);
+    if((protolen == 2) && !memcmp(proto, "h2", 2))
+	serveh2(bioopen(&sdat, &iofuns), fd, &conn, H2PREFACE);
+    else
+	serve(bioopen(&sdat, &iofuns), fd, &conn);
     while((ret = SSL_shutdown(ssl)) < 0) {
 	if(tlsblock(fd, SSL_get_error(ssl, ret), 60))
 	    goto out;
@@ -242,6 +257,7 @@ void handleossl(int argc, char **argp, char **argv)
 	flog(LOG_ERR, "ssl: could not create context: %s", ERR_error_string(ERR_get_error(), NULL));
 	exit(1);
     }
+    SSL_CTX_set_alpn_select_cb(ctx, selectalpn, NULL);
     port = 443;
     for(i = 0; i < argc; i++) {
 	if(!strcmp(argp[i], "help")) {
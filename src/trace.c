@@ -0,0 +1,184 @@
+/*
+    ashd - A Sane HTTP Daemon
+    Copyright (C) 2008  Fredrik Tolf <fredrik@dolda2000.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <utils.h>
+#include <log.h>
+#include <req.h>
+#include <mt.h>
+#include <mtio.h>
+#include <stats.h>
+
+#include "htparser.h"
+
+/*
+ * htparser's end of request tracing (see the X-Ash-Trace comment in
+ * lib/req.c). Handlers report each hop they add on a datagram
+ * socket, whose sending end they inherit. Since every report
+ * contains the trace as it looked when it was made, only the latest
+ * one for each request needs to be kept, and since a report is
+ * queued before the handler making it can start responding, all of
+ * them are in by the time the response is complete.
+ */
+
+struct trace {
+    struct trace *next, *prev;
+    char *id, *hops;
+    uintmax_t head;
+};
+
+static FILE *sink = NULL;
+static int rfd = -1, wfd = -1;
+static uintmax_t seq = 0;
+static struct trace *active = NULL;
+
+static void gotreport(char *buf)
+{
+    struct trace *tr;
+    char *p;
+    
+    if((p = strchr(buf, ' ')) == NULL)
+	return;
+    *p = 0;
+    for(tr = active; tr != NULL; tr = tr->next) {
+	if(!strcmp(tr->id, buf)) {
+	    free(tr->hops);
+	    tr->hops = sstrdup(p + 1);
+	    break;
+	}
+    }
+}
+
+static void drain(void)
+{
+    char buf[4096];
+    ssize_t ret;
+    
+    while((ret = recv(rfd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+	buf[ret] = 0;
+	gotreport(buf);
+    }
+}
+
+static void tracewatch(struct muth *muth, va_list args)
+{
+    while(block(rfd, EV_READ, 0) > 0)
+	drain();
+}
+
+int traceinit(char *path)
+{
+    int fds[2];
+    
+    if((sink = fopen(path, "a")) == NULL) {
+	flog(LOG_ERR, "htparser: could not open trace file %s: %s", path, strerror(errno));
+	return(-1);
+    }
+    fcntl(fileno(sink), F_SETFD, FD_CLOEXEC);
+    if(socketpair(PF_UNIX, SOCK_DGRAM, 0, fds)) {
+	flog(LOG_ERR, "htparser: could not create trace socket: %s", strerror(errno));
+	fclose(sink);
+	sink = NULL;
+	return(-1);
+    }
+    rfd = fds[0];
+    wfd = fds[1];
+    fcntl(rfd, F_SETFD, FD_CLOEXEC);
+    return(0);
+}
+
+/* Called in the root handler's process before it is executed. */
+void tracechild(void)
+{
+    if(wfd >= 0)
+	putenv(sprintf2("ASHD_TRACEFD=%i", wfd));
+    else
+	unsetenv("ASHD_TRACEFD");
+}
+
+struct muth *tracestart(void)
+{
+    if(rfd < 0)
+	return(NULL);
+    return(mustart(tracewatch));
+}
+
+/*
+ * Starts tracing a request, if tracing is enabled. START is when
+ * htparser began receiving it.
+ */
+struct trace *tracereq(struct hthead *req, uintmax_t start)
+{
+    struct trace *tr;
+    
+    if(sink == NULL)
+	return(NULL);
+    omalloc(tr);
+    tr->id = sprintf2("%x.%jx", (unsigned int)getpid(), ++seq);
+    tr->hops = sprintf2("htparser/%i<%ju", (int)getpid(), start);
+    headappheader(req, "X-Ash-Trace", sprintf3("%s %s", tr->id, tr->hops));
+    tr->next = active;
+    if(active != NULL)
+	active->prev = tr;
+    active = tr;
+    return(tr);
+}
+
+void tracehead(struct trace *tr)
+{
+    if(tr != NULL)
+	tr->head = statnow();
+}
+
+/*
+ * Writes out a finished trace as `ID METHOD URL HOP... CODE@HEAD
+ * DONE', where CODE is `-' if no response was received.
+ */
+void tracedone(struct trace *tr, struct hthead *req, struct hthead *resp)
+{
+    if(tr == NULL)
+	return;
+    drain();
+    fprintf(sink, "%s %s %s %s ", tr->id, req->method, req->url, tr->hops);
+    if(resp != NULL)
+	fprintf(sink, "%i@%ju", resp->code, tr->head);
+    else
+	fprintf(sink, "-");
+    fprintf(sink, " %ju\n", statnow());
+    fflush(sink);
+    if(tr->next)
+	tr->next->prev = tr->prev;
+    if(tr->prev)
+	tr->prev->next = tr->next;
+    if(tr == active)
+	active = tr->next;
+    free(tr->id);
+    free(tr->hops);
+    free(tr);
+}
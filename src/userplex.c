@@ -22,6 +22,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <assert.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <pwd.h>
@@ -34,11 +37,38 @@
 #include <log.h>
 #include <req.h>
 #include <resp.h>
+#include <mt.h>
+#include <mtio.h>
+
+/*
+ * Users are kept in an open-addressed hash table by name, along with
+ * the result of looking them up, so that requests for users that do
+ * not exist can be rejected without asking NSS again. Since NSS
+ * lookups may block for arbitrarily long (think LDAP), they are done
+ * by a separate resolver process, and requests for a user that is
+ * being looked up are queued on it in the meantime, so that users
+ * whose handlers are already running are served regardless.
+ */
+
+#define SUSERS 7
+#define MAXNAME 256
+
+enum {
+    U_UNKNOWN, U_RESOLVING, U_VALID, U_INVALID,
+};
+
+struct waiting {
+    struct hthead *req;
+    int fd;
+};
 
 struct user {
-    struct user *next, *prev;
     char *name;
-    int fd;
+    unsigned int hash;
+    int state, keep, fd;
+    struct passwd pwd;
+    time_t expire, lastuse;
+    typedbuf(struct waiting) wait;
 };
 
 static int ignore = 0;
@@ -47,7 +77,124 @@ static char *dirname = NULL;
 static char **childspec;
 static uid_t minuid = 0;
 static int usesyslog = 0;
-static struct user *users = NULL;
+static time_t cachetime = 60, idletime = 0;
+static int rsk = -1;
+static struct user *susers[1 << SUSERS];
+static struct user **users = susers;
+static int hashlen = SUSERS, nusers = 0;
+
+static unsigned int namehash(char *name)
+{
+    unsigned int hash;
+    
+    for(hash = 0; *name; name++)
+	hash = (hash * 31) + (unsigned char)*name;
+    return(hash);
+}
+
+static void rehash(int nlen)
+{
+    unsigned int i, o, n, m, pl, nl;
+    struct user **new, **old;
+    
+    old = users;
+    if(nlen <= SUSERS) {
+	nlen = SUSERS;
+	new = susers;
+    } else {
+	new = smalloc(sizeof(*new) * (1 << nlen));
+    }
+    if(nlen == hashlen)
+	return;
+    memset(new, 0, sizeof(*new) * (1 << nlen));
+    assert(old != new);
+    pl = 1 << hashlen; nl = 1 << nlen; m = nl - 1;
+    for(i = 0; i < pl; i++) {
+	if(!old[i])
+	    continue;
+	for(o = old[i]->hash & m, n = 0; n < nl; o = (o + 1) & m, n++) {
+	    if(!new[o]) {
+		new[o] = old[i];
+		break;
+	    }
+	}
+    }
+    if(old != susers)
+	free(old);
+    users = new;
+    hashlen = nlen;
+}
+
+static struct user *finduser(char *name)
+{
+    unsigned int i, n, N, m, hash;
+    struct user *usr;
+    
+    hash = namehash(name);
+    m = (N = (1 << hashlen)) - 1;
+    for(i = hash & m, n = 0; (n < N) && ((usr = users[i]) != NULL); i = (i + 1) & m, n++) {
+	if((usr->hash == hash) && !strcmp(usr->name, name))
+	    return(usr);
+    }
+    return(NULL);
+}
+
+static struct user *adduser(char *name)
+{
+    unsigned int i, m;
+    struct user *usr;
+    
+    omalloc(usr);
+    usr->name = sstrdup(name);
+    usr->hash = namehash(name);
+    usr->fd = -1;
+    m = (1 << hashlen) - 1;
+    for(i = usr->hash & m; users[i]; i = (i + 1) & m);
+    users[i] = usr;
+    if(++nusers > (1 << (hashlen - 1)))
+	rehash(hashlen + 1);
+    return(usr);
+}
+
+static void freepwd(struct passwd *pwd)
+{
+    free(pwd->pw_name);
+    free(pwd->pw_dir);
+    free(pwd->pw_shell);
+    memset(pwd, 0, sizeof(*pwd));
+}
+
+static void deluser(struct user *usr)
+{
+    unsigned int i, o, p, n, N, m;
+    struct user *su;
+    
+    m = (N = (1 << hashlen)) - 1;
+    for(i = usr->hash & m, n = 0; n < N; i = (i + 1) & m, n++) {
+	assert((su = users[i]) != NULL);
+	if(su == usr)
+	    break;
+    }
+    assert(su == usr);
+    users[i] = NULL;
+    for(o = (i + 1) & m; users[o] != NULL; o = (o + 1) & m) {
+	su = users[o];
+	p = (su->hash - i) & m;
+	if((p == 0) || (p > ((o - i) & m))) {
+	    users[i] = su;
+	    users[o] = NULL;
+	    i = o;
+	}
+    }
+    if(--nusers <= (1 << (hashlen - 3)))
+	rehash(hashlen - 1);
+    if(usr->fd >= 0)
+	close(usr->fd);
+    freepwd(&usr->pwd);
+    buffree(usr->wait);
+    free(usr->name);
+    free(usr);
+}
 
 static void login(struct passwd *pwd)
 {
@@ -98,37 +245,35 @@ static void login(struct passwd *pwd)
     }
 }
 
-static void discardreq(int fromfd)
+static void failreq(int code, char *msg, char *text)
 {
     struct hthead *req;
     int fd;
     
-    if((fd = recvreq(fromfd, &req)) >= 0) {
+    if((fd = recvreq(0, &req)) >= 0) {
+	simpleerror(fd, code, msg, text);
 	freehthead(req);
 	close(fd);
     }
 }
 
-static void execchild(struct passwd *pwd, struct hthead *forreq, int reqfd)
+static void execchild(struct passwd *pwd)
 {
     if(!ignore)
 	execl(".ashd/handler", ".ashd/handler", NULL);
     if(dirname != NULL) {
 	if(access(dirname, X_OK | R_OK)) {
-	    discardreq(0);
-	    simpleerror(reqfd, 404, "Not Found", "No such resource could be found.");
+	    failreq(404, "Not Found", "No such resource could be found.");
 	    return;
 	}
     }
     execvp(childspec[0], childspec);
-    discardreq(0);
     flog(LOG_ERR, "could not start request handler for user `%s': %s", pwd->pw_name, strerror(errno));
-    simpleerror(reqfd, 500, "User Error", "Could not start any request handler for that user.");
+    failreq(500, "User Error", "Could not start any request handler for that user.");
 }
 
-static int forkchild(char *usrnm, struct hthead *forreq, int reqfd)
+static int forkchild(struct user *usr)
 {
-    struct passwd *pwd;
     pid_t pid;
     int fd[2];
     
@@ -137,18 +282,17 @@ static int forkchild(char *usrnm, struct hthead *forreq, int reqfd)
      * that. I might return to it at some later time. */
     if(socketpair(PF_UNIX, SOCK_SEQPACKET, 0, fd))
 	return(-1);
-    if((pwd = getpwnam(usrnm)) == NULL) {
-	flog(LOG_ERR, "already discovered user `%s' has disappeared", usrnm);
+    if((pid = fork()) < 0) {
+	close(fd[0]);
+	close(fd[1]);
 	return(-1);
     }
-    if((pid = fork()) < 0)
-	return(-1);
     if(pid == 0) {
 	dup2(fd[0], 0);
 	close(fd[0]);
 	close(fd[1]);
-	login(pwd);
-	execchild(pwd, forreq, reqfd);
+	login(&usr->pwd);
+	execchild(&usr->pwd);
 	exit(127);
     }
     close(fd[0]);
@@ -160,14 +304,15 @@ static void serve2(struct user *usr, struct hthead *req, int fd)
 {
     int serr;
     
+    usr->lastuse = time(NULL);
     if(usr->fd < 0)
-	usr->fd = forkchild(usr->name, req, fd);
+	usr->fd = forkchild(usr);
     if(sendreq2(usr->fd, req, fd, MSG_NOSIGNAL | MSG_DONTWAIT)) {
 	serr = errno;
 	if((serr == EPIPE) || (serr == ECONNRESET)) {
 	    /* Assume that the child has crashed and restart it. */
 	    close(usr->fd);
-	    usr->fd = forkchild(usr->name, req, fd);
+	    usr->fd = forkchild(usr);
 	    if(!sendreq2(usr->fd, req, fd, MSG_NOSIGNAL | MSG_DONTWAIT))
 		return;
 	}
@@ -179,53 +324,265 @@ static void serve2(struct user *usr, struct hthead *req, int fd)
     }
 }
 
-static void initnew(struct hthead *req, int fd, char *usrnm)
+/* Runs in the resolver process. */
+static int lookup(char *usrnm, struct passwd **ret)
 {
-    struct user *usr;
     struct passwd *pwd;
     struct group *grp;
-    int i, valid;
-
-    pwd = getpwnam(usrnm);
-    if(pwd == NULL) {
-	simpleerror(fd, 404, "Not Found", "No such resource could be found.");
-	return;
-    }
-    if(pwd->pw_uid < minuid) {
-	simpleerror(fd, 404, "Not Found", "No such resource could be found.");
-	return;
-    }
+    int i;
+    
+    if(((pwd = getpwnam(usrnm)) == NULL) || (pwd->pw_uid < minuid))
+	return('N');
     if(mgroup) {
 	if((grp = getgrnam(mgroup)) == NULL) {
 	    flog(LOG_ERR, "unknown group %s specified to userplex", mgroup);
-	    simpleerror(fd, 500, "Configuration Error", "The server has been erroneously configured.");
-	    return;
+	    return('E');
 	}
-	valid = 0;
-	if(grp->gr_gid == pwd->pw_gid) {
-	    valid = 1;
-	} else {
+	if(grp->gr_gid != pwd->pw_gid) {
 	    for(i = 0; grp->gr_mem[i] != NULL; i++) {
-		if(!strcmp(grp->gr_mem[i], usrnm)) {
-		    valid = 1;
+		if(!strcmp(grp->gr_mem[i], usrnm))
 		    break;
-		}
 	    }
+	    if(grp->gr_mem[i] == NULL)
+		return('N');
 	}
-	if(!valid) {
-	    simpleerror(fd, 404, "Not Found", "No such resource could be found.");
-	    return;
+    }
+    *ret = pwd;
+    return('Y');
+}
+
+/*
+ * The resolver answers each user name it is sent with a status
+ * character (Y for a valid user, N for an invalid one, or E if the
+ * configuration is in error), followed by the NUL-terminated name
+ * and, for valid users, their UID, GID, home directory and shell.
+ */
+static void resolver(int sk)
+{
+    char buf[MAXNAME + 1];
+    struct charbuf rep;
+    struct passwd *pwd;
+    ssize_t ret;
+    int st;
+    
+    while((ret = recv(sk, buf, sizeof(buf) - 1, 0)) > 0) {
+	buf[ret] = 0;
+	bufinit(rep);
+	bufadd(rep, st = lookup(buf, &pwd));
+	bufcatstr2(rep, buf);
+	if(st == 'Y') {
+	    bufcatstr2(rep, sprintf3("%ju", (uintmax_t)pwd->pw_uid));
+	    bufcatstr2(rep, sprintf3("%ju", (uintmax_t)pwd->pw_gid));
+	    bufcatstr2(rep, pwd->pw_dir);
+	    bufcatstr2(rep, pwd->pw_shell);
+	}
+	send(sk, rep.b, rep.d, MSG_NOSIGNAL);
+	buffree(rep);
+    }
+}
+
+static void startresolver(void)
+{
+    int sk[2], i, max;
+    pid_t pid;
+    
+    if(socketpair(PF_UNIX, SOCK_SEQPACKET, 0, sk)) {
+	flog(LOG_ERR, "userplex: could not create resolver socket: %s", strerror(errno));
+	exit(1);
+    }
+    if((pid = fork()) < 0) {
+	flog(LOG_ERR, "userplex: could not fork resolver: %s", strerror(errno));
+	exit(1);
+    }
+    if(pid == 0) {
+	/* Keep no request or handler sockets open. */
+	max = sysconf(_SC_OPEN_MAX);
+	for(i = 0; i < max; i++) {
+	    if((i != sk[1]) && (i != 2))
+		close(i);
+	}
+	resolver(sk[1]);
+	exit(0);
+    }
+    close(sk[1]);
+    fcntl(sk[0], F_SETFD, FD_CLOEXEC);
+    rsk = sk[0];
+}
+
+static int resolve(struct user *usr)
+{
+    if(send(rsk, usr->name, strlen(usr->name), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+	return(-1);
+    usr->state = U_RESOLVING;
+    return(0);
+}
+
+static void flushwait(struct user *usr, int st)
+{
+    struct waiting *w;
+    int i;
+    
+    for(i = 0; i < usr->wait.d; i++) {
+	w = &usr->wait.b[i];
+	if(usr->state == U_VALID)
+	    serve2(usr, w->req, w->fd);
+	else if(st == 'E')
+	    simpleerror(w->fd, 500, "Configuration Error", "The server has been erroneously configured.");
+	else
+	    simpleerror(w->fd, 404, "Not Found", "No such resource could be found.");
+	freehthead(w->req);
+	close(w->fd);
+    }
+    usr->wait.d = 0;
+}
+
+static int parseid(char *str, unsigned long *ret)
+{
+    char *p;
+    
+    if((*str < '0') || (*str > '9'))
+	return(-1);
+    errno = 0;
+    *ret = strtoul(str, &p, 10);
+    if(*p || (errno != 0))
+	return(-1);
+    return(0);
+}
+
+static void gotreply(char *buf, size_t len)
+{
+    struct user *usr;
+    char *p, *e, *f[5];
+    unsigned long uid, gid;
+    int st, i;
+    
+    st = buf[0];
+    e = buf + len;
+    for(p = buf + 1, i = 0; (i < 5) && (p < e); p += strlen(p) + 1)
+	f[i++] = p;
+    if((i < 1) || ((usr = finduser(f[0])) == NULL) || (usr->state != U_RESOLVING))
+	return;
+    usr->expire = time(NULL) + cachetime;
+    if((st == 'Y') && ((i < 5) || parseid(f[1], &uid) || parseid(f[2], &gid) ||
+		       ((uid_t)uid != uid) || ((gid_t)gid != gid))) {
+	flog(LOG_ERR, "userplex: malformed resolver reply for `%s'", usr->name);
+	st = 'E';
+    }
+    if(st == 'Y') {
+	freepwd(&usr->pwd);
+	usr->pwd.pw_name = sstrdup(usr->name);
+	usr->pwd.pw_uid = uid;
+	usr->pwd.pw_gid = gid;
+	usr->pwd.pw_dir = sstrdup(f[3]);
+	usr->pwd.pw_shell = sstrdup(f[4]);
+	usr->state = U_VALID;
+	if(usr->keep && (usr->fd < 0))
+	    usr->fd = forkchild(usr);
+    } else {
+	if(st != 'N')
+	    usr->expire = 0;
+	usr->state = U_INVALID;
+	if(usr->keep)
+	    flog(LOG_WARNING, "userplex: cannot start handler for invalid user `%s'", usr->name);
+    }
+    flushwait(usr, st);
+}
+
+/* Receives a reply of whatever size, growing BUF to fit it. */
+static ssize_t recvreply(struct charbuf *buf)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t ret;
+    
+    while(1) {
+	iov = (struct iovec){.iov_base = buf->b, .iov_len = buf->s};
+	msg = (struct msghdr){.msg_iov = &iov, .msg_iovlen = 1};
+	if((ret = recvmsg(rsk, &msg, MSG_PEEK | MSG_DONTWAIT)) <= 0)
+	    return(ret);
+	if(!(msg.msg_flags & MSG_TRUNC))
+	    return(recv(rsk, buf->b, buf->s, MSG_DONTWAIT));
+	sizebuf(*buf, buf->s * 2);
+    }
+}
+
+static void rsloop(struct muth *muth, va_list args)
+{
+    struct charbuf buf;
+    ssize_t ret;
+    int i;
+    
+    bufinit(buf);
+    sizebuf(buf, 4096);
+    while(1) {
+	block(rsk, EV_READ, 0);
+	while((ret = recvreply(&buf)) > 0)
+	    gotreply(buf.b, ret);
+	if((ret < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+	    continue;
+	flog(LOG_ERR, "userplex: resolver exited unexpectedly, restarting it");
+	close(rsk);
+	for(i = 0; i < (1 << hashlen); i++) {
+	    if((users[i] != NULL) && (users[i]->state == U_RESOLVING)) {
+		users[i]->state = U_UNKNOWN;
+		flushwait(users[i], 'E');
+	    }
+	}
+	startresolver();
+    }
+}
+
+/*
+ * Closes the sockets of handlers that have been idle for longer than
+ * the idle timeout, which makes them exit, and forgets users whose
+ * cached lookups have expired and who have no handler running.
+ */
+static void reaper(struct muth *muth, va_list args)
+{
+    typedbuf(struct user *) dead;
+    struct user *usr;
+    time_t now;
+    int i;
+    
+    bufinit(dead);
+    while(1) {
+	block(-1, 0, 10);
+	now = time(NULL);
+	for(i = 0; i < (1 << hashlen); i++) {
+	    if(((usr = users[i]) == NULL) || usr->keep)
+		continue;
+	    if((idletime > 0) && (usr->fd >= 0) && (now - usr->lastuse >= idletime)) {
+		close(usr->fd);
+		usr->fd = -1;
+	    }
+	    if((usr->fd < 0) && (usr->state != U_RESOLVING) && (now >= usr->expire))
+		bufadd(dead, usr);
+	}
+	for(i = 0; i < dead.d; i++)
+	    deluser(dead.b[i]);
+	dead.d = 0;
+    }
+}
+
+static void prestart(struct muth *muth, va_list args)
+{
+    vavar(char **, names);
+    vavar(int, n);
+    struct user *usr;
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if((usr = finduser(names[i])) == NULL)
+	    usr = adduser(names[i]);
+	usr->keep = 1;
+	while((usr->state != U_RESOLVING) && resolve(usr)) {
+	    if(errno != EAGAIN) {
+		flog(LOG_ERR, "userplex: could not look up user `%s': %s", usr->name, strerror(errno));
+		break;
+	    }
+	    block(rsk, EV_WRITE, 0);
 	}
     }
-    omalloc(usr);
-    usr->name = sstrdup(usrnm);
-    usr->fd = -1;
-    usr->next = users;
-    usr->prev = NULL;
-    if(users != NULL)
-	users->prev = usr;
-    users = usr;
-    serve2(usr, req, fd);
 }
 
 static void serve(struct hthead *req, int fd)
@@ -238,21 +595,59 @@ static void serve(struct hthead *req, int fd)
 	    stdredir(req, fd, 301, sprintf3("%s/", req->url));
 	else
 	    simpleerror(fd, 404, "Not Found", "No such resource could be found.");
-	return;
+	goto out;
     }
     *(p++) = 0;
     usrnm = sstrdup(req->rest);
     replrest(req, p);
-    for(usr = users; usr != NULL; usr = usr->next) {
-	if(!strcmp(usr->name, usrnm)) {
-	    serve2(usr, req, fd);
+    if(!*usrnm || (strlen(usrnm) > MAXNAME)) {
+	simpleerror(fd, 404, "Not Found", "No such resource could be found.");
+	free(usrnm);
+	goto out;
+    }
+    if((usr = finduser(usrnm)) == NULL)
+	usr = adduser(usrnm);
+    free(usrnm);
+    if((usr->state != U_RESOLVING) && (usr->fd < 0) && (time(NULL) >= usr->expire)) {
+	if(resolve(usr)) {
+	    flog(LOG_WARNING, "userplex: could not look up user `%s': %s", usr->name, strerror(errno));
+	    simpleerror(fd, 503, "Service Unavailable", "The server is too busy to handle that request right now.");
 	    goto out;
 	}
     }
-    initnew(req, fd, usrnm);
+    if(usr->state == U_RESOLVING) {
+	bufadd(usr->wait, ((struct waiting){.req = req, .fd = fd}));
+	return;
+    }
+    if(usr->state == U_VALID)
+	serve2(usr, req, fd);
+    else
+	simpleerror(fd, 404, "Not Found", "No such resource could be found.");
     
 out:
-    free(usrnm);
+    freehthead(req);
+    close(fd);
+}
+
+static void listenloop(struct muth *muth, va_list args)
+{
+    struct hthead *reqs[REQBATCH];
+    int fds[REQBATCH];
+    int i, n;
+    
+    while(1) {
+	block(0, EV_READ, 0);
+	if((n = recvreqs(0, reqs, fds, REQBATCH, 0)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno != 0)
+		flog(LOG_ERR, "recvreq: %s", strerror(errno));
+	    break;
+	}
+	for(i = 0; i < n; i++)
+	    serve(reqs[i], fds[i]);
+    }
+    exitioloop(1);
 }
 
 static void sighandler(int sig)
@@ -261,17 +656,16 @@ static void sighandler(int sig)
 
 static void usage(FILE *out)
 {
-    fprintf(out, "usage: userplex [-hIs] [-g GROUP] [-m MIN-UID] [-d PUB-DIR] [PROGRAM ARGS...]\n");
+    fprintf(out, "usage: userplex [-hIs] [-g GROUP] [-m MIN-UID] [-d PUB-DIR] [-c CACHE-TIME] [-t IDLE-TIME] [-p USER]... [PROGRAM ARGS...]\n");
 }
 
 int main(int argc, char **argv)
 {
-    struct hthead *req;
     int c;
-    int fd;
-    struct charvbuf csbuf;
+    struct charvbuf csbuf, pre;
     
-    while((c = getopt(argc, argv, "+hIsg:m:d:")) >= 0) {
+    bufinit(pre);
+    while((c = getopt(argc, argv, "+hIsg:m:d:c:t:p:")) >= 0) {
 	switch(c) {
 	case 'I':
 	    ignore = 1;
@@ -291,6 +685,19 @@ int main(int argc, char **argv)
 	case 'd':
 	    dirname = optarg;
 	    break;
+	case 'c':
+	    cachetime = atoi(optarg);
+	    break;
+	case 't':
+	    idletime = atoi(optarg);
+	    break;
+	case 'p':
+	    if(!*optarg || (strlen(optarg) > MAXNAME)) {
+		fprintf(stderr, "userplex: invalid user name: %s\n", optarg);
+		exit(1);
+	    }
+	    bufadd(pre, optarg);
+	    break;
 	case 'h':
 	    usage(stdout);
 	    exit(0);
@@ -312,15 +719,12 @@ int main(int argc, char **argv)
     }
     signal(SIGCHLD, SIG_IGN);
     signal(SIGPIPE, sighandler);
-    while(1) {
-	if((fd = recvreq(0, &req)) < 0) {
-	    if(errno != 0)
-		flog(LOG_ERR, "recvreq: %s", strerror(errno));
-	    break;
-	}
-	serve(req, fd);
-	freehthead(req);
-	close(fd);
-    }
+    startresolver();
+    mustart(rsloop);
+    mustart(reaper);
+    if(pre.d > 0)
+	mustart(prestart, pre.b, (int)pre.d);
+    mustart(listenloop);
+    ioloop();
     return(0);
 }